@@ -4,19 +4,37 @@ module Main where
 
 import qualified CWriter
 import qualified Cmm
-import Control.Monad ((>=>))
+import Control.Concurrent (forkIO)
+import Control.Concurrent.MVar (newEmptyMVar, putMVar, takeMVar)
+import Control.Exception (SomeException, evaluate, throwIO, try)
+import Control.Monad (foldM, forM, forM_, unless, when, (>=>))
+import qualified Data.ByteString as ByteString
 import Data.Char (toLower)
+import Data.List (isPrefixOf, partition, stripPrefix)
 import Data.Maybe (listToMaybe)
+import Data.Text (Text)
+import qualified Data.Text as Text
+import Data.Text.Encoding (decodeUtf8With, encodeUtf8)
+import Data.Text.Encoding.Error (lenientDecode)
+import GHC.Clock (getMonotonicTime)
 import qualified Lexer
+import qualified Optimizer
 import Ourlude
 import qualified Parser
 import qualified STG
 import qualified Simplifier
+import qualified Strictness
+import System.Directory (createDirectoryIfMissing, doesFileExist)
 import System.Environment (getArgs)
 import System.Exit (exitFailure)
+import System.FilePath (dropExtension, takeDirectory, (</>))
+import System.IO (IOMode (..), hPutStrLn, stderr, withBinaryFile)
+import System.Process (callProcess)
 import Text.Pretty.Simple (pPrint, pPrintString)
+import Text.Printf (printf)
 import qualified Typer
 import Types (Scheme)
+import qualified Usage
 
 -- An error that occurrs in a stage, including its name and what went wrong
 data StagedError = StagedError String String
@@ -59,7 +77,37 @@ printStage (Stage name r) a = case r a of
     putStrLn (name ++ ":")
     pPrint b
 
-lexerStage :: Stage String [Lexer.Token]
+-- Force the entire output of a stage, by showing it
+--
+-- The extra argument keeps the compiler from sharing one result between calls.
+forceShow :: Show b => Int -> b -> Int
+forceShow n b = n + length (show b)
+{-# NOINLINE forceShow #-}
+
+-- Execute a stage on its own, printing how long it took to stderr
+--
+-- Most stages produce their output lazily, so we force all of it by showing it.
+-- Showing it again, once it's been evaluated, tells us how long showing takes,
+-- which we don't count as part of the stage.
+timeStage :: Show b => Stage a b -> a -> IO b
+timeStage (Stage name r) a = do
+  start <- getMonotonicTime
+  b <- case r a of
+    Left err -> do
+      printStagedError err
+      exitFailure
+    Right b -> b <$ evaluate (forceShow 0 b)
+  forced <- getMonotonicTime
+  _ <- evaluate (forceShow 1 b)
+  shown <- getMonotonicTime
+  reportTime name (max 0 ((forced - start) - (shown - forced)))
+  return b
+
+-- Print out how long some stage took to stderr
+reportTime :: String -> Double -> IO ()
+reportTime name seconds = hPutStrLn stderr (printf "%-12s %10.6fs" name seconds)
+
+lexerStage :: Stage Text [Lexer.Token]
 lexerStage = makeStage "Lexer" Lexer.lexer
 
 parserStage :: Stage [Lexer.Token] Parser.AST
@@ -74,74 +122,258 @@ typerStage = makeStage "Typer" Typer.typer
 stgStage :: Stage (Simplifier.AST Scheme) STG.STG
 stgStage = makeStage "STG" STG.stg
 
+optimizerStage :: Optimizer.OptLevel -> Stage STG.STG STG.STG
+optimizerStage level = makeStage "Optimizer" (Optimizer.optimize level >>> Right @())
+
+strictnessStage :: Stage STG.STG STG.STG
+strictnessStage = makeStage "Strictness" (Strictness.strictness >>> Right @())
+
+usageStage :: Stage STG.STG STG.STG
+usageStage = makeStage "Usage" (Usage.usage >>> Right @())
+
 cmmStage :: Stage STG.STG Cmm.Cmm
 cmmStage = makeStage "Cmm" (Cmm.cmm >>> Right @())
 
-writeCStage :: Stage Cmm.Cmm String
-writeCStage = makeStage "Output C" (CWriter.writeC >>> Right @())
+-- The options we can pass through flags, instead of positional arguments
+data Options = Options
+  { -- How much effort to put into optimizing the STG
+    optLevel :: Optimizer.OptLevel,
+    -- The C compiler to run over the output of the compile stage, if any
+    cCompiler :: Maybe String,
+    -- The directory containing the runtime, and maybe a prebuilt library for it
+    runtimeDir :: FilePath,
+    -- Extra flags to pass to the C compiler
+    cFlags :: [String],
+    -- Whether or not to report how long each stage of compilation takes
+    timings :: Bool,
+    -- How many translation units to split the top level functions between
+    --
+    -- With a single unit, everything gets written to the output file.
+    units :: Int
+  }
+
+-- The options we use when no flags are given
+defaultOptions :: Options
+defaultOptions = Options Optimizer.O1 Nothing "." [] False 1
+
+-- Run some actions at the same time, waiting for all of them to finish
+concurrently :: [IO a] -> IO [a]
+concurrently actions = do
+  results <-
+    forM actions <| \action -> do
+      result <- newEmptyMVar
+      _ <- forkIO (try @SomeException action >>= putMVar result)
+      return result
+  forM results (takeMVar >=> either throwIO return)
+
+-- Write a file, unless it already has exactly the contents we want
+--
+-- Leaving the files that didn't change alone means that their objects can be reused.
+writeIfChanged :: FilePath -> ByteString.ByteString -> IO ()
+writeIfChanged path contents = do
+  exists <- doesFileExist path
+  same <- if exists then (== contents) <$> ByteString.readFile path else return False
+  unless same <| ByteString.writeFile path contents
+
+-- The name of the executable we produce from some C file
+executableFor :: FilePath -> FilePath
+executableFor path = if dropExtension path == path then path <> ".out" else dropExtension path
+
+-- The flags we always pass to the C compiler
+compileFlags :: Options -> [String]
+compileFlags options = ["-std=c99", "-O2", "-I" <> runtimeDir options] <> cFlags options
+
+-- Compile the C we've generated into an executable, next to that file
+--
+-- We link against the prebuilt runtime library if there is one, and
+-- otherwise compile the runtime along with the program.
+compileC :: Options -> String -> FilePath -> IO ()
+compileC options compiler path = do
+  let dir = runtimeDir options
+      library = dir </> "libhihrt.a"
+  prebuilt <- doesFileExist library
+  let runtime = if prebuilt then library else dir </> "runtime.c"
+      args = compileFlags options <> [path, runtime, "-o", executableFor path]
+  callProcess compiler args
+
+-- Compile the translation units we've generated, and link them into an executable
+--
+-- Units get compiled in parallel, into objects in a cache next to the output. Each
+-- object is named after the hash of its source, the runtime header, and the command
+-- compiling it, so units that haven't changed since the last time, as well as the
+-- runtime, reuse the object they had then.
+compileUnits :: Options -> String -> FilePath -> [FilePath] -> IO ()
+compileUnits options compiler path sources = do
+  let dir = runtimeDir options
+      library = dir </> "libhihrt.a"
+      cache = takeDirectory path </> ".hih-cache"
+      flags = compileFlags options
+  prebuilt <- doesFileExist library
+  header <- ByteString.readFile (dir </> "runtime.h")
+  createDirectoryIfMissing True cache
+  let command = encodeUtf8 (Text.pack (unwords (compiler : flags)))
+      compileObject source = do
+        contents <- ByteString.readFile source
+        let key = CWriter.fingerprintOf (ByteString.intercalate (ByteString.singleton 0) [command, header, contents])
+            object = cache </> printf "%016x.o" key
+        cached <- doesFileExist object
+        unless cached <| callProcess compiler (flags <> ["-c", source, "-o", object])
+        return object
+      allSources = if prebuilt then sources else sources <> [dir </> "runtime.c"]
+  objects <- concurrently (map compileObject allSources)
+  let libraries = [library | prebuilt]
+  callProcess compiler (cFlags options <> objects <> libraries <> ["-o", executableFor path])
 
 -- Read out which stages to execute based on a string
-readStage :: String -> Maybe String -> Maybe (String -> IO ())
-readStage "lex" _ =
+readStage :: Options -> String -> Maybe String -> Maybe (Text -> IO ())
+readStage _ "lex" _ =
   lexerStage |> printStage |> Just
-readStage "parse" _ =
+readStage _ "parse" _ =
   lexerStage >-> parserStage |> printStage |> Just
-readStage "simplify" _ =
+readStage _ "simplify" _ =
   lexerStage >-> parserStage >-> simplifierStage |> printStage |> Just
-readStage "type" _ =
+readStage _ "type" _ =
+  lexerStage
+    >-> parserStage
+    >-> simplifierStage
+    >-> typerStage
+    |> printStage
+    |> Just
+readStage options "stg" _ =
   lexerStage
     >-> parserStage
     >-> simplifierStage
     >-> typerStage
+    >-> stgStage
+    >-> optimizerStage (optLevel options)
     |> printStage
     |> Just
-readStage "stg" _ =
+readStage options "strictness" _ =
   lexerStage
     >-> parserStage
     >-> simplifierStage
     >-> typerStage
     >-> stgStage
+    >-> optimizerStage (optLevel options)
+    >-> strictnessStage
     |> printStage
     |> Just
-readStage "cmm" _ =
+readStage options "usage" _ =
   lexerStage
     >-> parserStage
     >-> simplifierStage
     >-> typerStage
     >-> stgStage
+    >-> optimizerStage (optLevel options)
+    >-> strictnessStage
+    >-> usageStage
+    |> printStage
+    |> Just
+readStage options "cmm" _ =
+  lexerStage
+    >-> parserStage
+    >-> simplifierStage
+    >-> typerStage
+    >-> stgStage
+    >-> optimizerStage (optLevel options)
+    >-> strictnessStage
+    >-> usageStage
     >-> cmmStage
     |> printStage
     |> Just
-readStage "compile" (Just outputFile) =
+readStage options "compile" (Just outputFile) =
   lexerStage
     >-> parserStage
     >-> simplifierStage
     >-> typerStage
     >-> stgStage
+    >-> optimizerStage (optLevel options)
+    >-> strictnessStage
+    >-> usageStage
     >-> cmmStage
-    >-> writeCStage
     |> outputStage
     |> Just
   where
-    outputStage (Stage _ r) a = case r a of
-      Left err -> printStagedError err
-      Right output -> writeFile outputFile output
-readStage _ _ = Nothing
+    outputStage (Stage _ r) a
+      | timings options = timedCompile a >>= writeOutput
+      | otherwise = case r a of
+        Left err -> printStagedError err
+        Right cmm -> writeOutput cmm
+
+    -- With timings, we run each stage on its own, instead of all at once
+    timedCompile =
+      timeStage lexerStage
+        >=> timeStage parserStage
+        >=> timeStage simplifierStage
+        >=> timeStage typerStage
+        >=> timeStage stgStage
+        >=> timeStage (optimizerStage (optLevel options))
+        >=> timeStage strictnessStage
+        >=> timeStage usageStage
+        >=> timeStage cmmStage
+
+    -- With a single unit, the C gets written straight to the file, as it gets generated
+    writeOutput cmm = do
+      start <- getMonotonicTime
+      sources <-
+        if units options == 1
+          then [outputFile] <$ withBinaryFile outputFile WriteMode (`CWriter.hPutC` cmm)
+          else writeUnits cmm
+      done <- getMonotonicTime
+      when (timings options) <| reportTime "Output C" (done - start)
+      forM_ (cCompiler options) <| \compiler -> case sources of
+        [single] -> compileC options compiler single
+        _ -> compileUnits options compiler outputFile sources
+
+    -- The output file gets the main unit, and the others go next to it, numbered
+    writeUnits cmm = do
+      let (mainUnit, functionUnits) = CWriter.splitC (units options) cmm
+          paths = map (\i -> dropExtension outputFile <> "_" <> show i <> ".c") [1 .. length functionUnits]
+      _ <- concurrently (zipWith writeIfChanged paths functionUnits)
+      writeIfChanged outputFile mainUnit
+      return (outputFile : paths)
+readStage _ _ _ = Nothing
 
 -- The arguments we'll need for our program
-data Args = Args FilePath (String -> IO ())
+data Args = Args FilePath (Text -> IO ())
+
+-- Read out the options from the flags we've been given
+--
+-- We optimize with -O1 by default, and the last level given wins.
+readOptions :: [String] -> Maybe Options
+readOptions = foldM readFlag defaultOptions
+  where
+    levels = [("-O0", Optimizer.O0), ("-O1", Optimizer.O1), ("-O2", Optimizer.O2)]
+
+    readFlag options flag = case flag of
+      "--cc" -> Just options {cCompiler = Just "cc"}
+      "--timings" -> Just options {timings = True}
+      _
+        | Just level <- lookup flag levels -> Just options {optLevel = level}
+        | Just count <- stripPrefix "--units=" flag,
+          [(n, "")] <- reads count,
+          n > 0 ->
+          Just options {units = n}
+        | Just compiler <- stripPrefix "--cc=" flag -> Just options {cCompiler = Just compiler}
+        | Just dir <- stripPrefix "--runtime=" flag -> Just options {runtimeDir = dir}
+        | Just flags <- stripPrefix "--cflags=" flag -> Just options {cFlags = cFlags options <> words flags}
+        | otherwise -> Nothing
 
 parseArgs :: [String] -> Maybe Args
-parseArgs (stageName : file : rest) = do
-  let outputFile = listToMaybe rest
-  stage <- readStage (map toLower stageName) outputFile
-  return (Args file stage)
-parseArgs _ = Nothing
+parseArgs args = do
+  let (flags, positional) = partition (isPrefixOf "-") args
+  options <- readOptions flags
+  case positional of
+    stageName : file : rest -> do
+      let outputFile = listToMaybe rest
+      stage <- readStage options (map toLower stageName) outputFile
+      return (Args file stage)
+    _ -> Nothing
 
 process :: Args -> IO ()
 process (Args path stage) = do
-  content <- readFile path
-  stage content
+  content <- ByteString.readFile path
+  stage (decodeUtf8With lenientDecode content)
 
 main :: IO ()
 main = do
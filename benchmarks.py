@@ -0,0 +1,211 @@
+'''
+This file runs all of the benchmarks in the directory `benchmarks`
+
+Each benchmark gets compiled with `--timings`, so that we can see how long
+each stage of the compiler takes, and then built with optimizations, and
+run a few times, keeping the fastest run. The runtime reports the rest of
+what we measure, through `+RTS -s --machine-readable`.
+
+The results can be saved as a baseline, with `--save-baseline`, and later runs
+get compared against that baseline, failing if anything got much worse.
+'''
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+ROOT = 'benchmarks'
+BASELINE = os.path.join(ROOT, 'baseline.json')
+
+# The statistics from the runtime we keep track of
+STATS = ['bytes_allocated', 'max_residency', 'minor_collections', 'major_collections']
+
+# How much worse than the baseline a measurement can get, before we count it as a regression
+THRESHOLDS = {
+    'seconds': 0.10,
+    'compile_seconds': 0.25,
+    'bytes_allocated': 0.02,
+    'max_residency': 0.05,
+    'minor_collections': 0.05,
+    'major_collections': 0.05,
+}
+
+
+def get_expected(file_name):
+    '''
+    Return the expected output for a given file.
+    '''
+    expected = []
+    with open(file_name) as fp:
+        for line in fp:
+            match = re.search(r'--.*OUT\((.*)\)', line)
+            if match:
+                expected.append(match.group(1))
+    return '\n'.join(expected)
+
+
+def build_compiler():
+    '''
+    Build the compiler once, returning the path to its executable.
+
+    Going through `cabal run` for every benchmark would count its startup
+    as part of the compile time.
+    '''
+    subprocess.run("cabal build -v0 haskell-in-haskell", shell=True, check=True)
+    return subprocess.check_output("cabal list-bin haskell-in-haskell", shell=True).decode('utf-8').strip()
+
+
+def parse_timings(err):
+    '''
+    Parse the time each stage took, as printed by `--timings`.
+    '''
+    timings = {}
+    for line in err.splitlines():
+        match = re.match(r'(.*?)\s+([0-9.]+)s$', line)
+        if match:
+            timings[match.group(1)] = float(match.group(2))
+    return timings
+
+
+def run_benchmark(compiler, file_name, runs):
+    '''
+    Compile, build, and run a single benchmark, returning its measurements.
+    '''
+    with tempfile.TemporaryDirectory() as tmp:
+        output = os.path.join(tmp, 'out.c')
+        executable = os.path.join(tmp, 'a.out')
+        stats = os.path.join(tmp, 'stats.json')
+        compiled = subprocess.run([compiler, 'compile', '-O2', '--timings', file_name, output],
+                                  stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out = compiled.stdout.decode('utf-8')
+        if compiled.returncode != 0 or 'Error' in out:
+            raise Exception(out + compiled.stderr.decode('utf-8'))
+        stages = parse_timings(compiled.stderr.decode('utf-8'))
+        subprocess.run(['gcc', '-std=c99', '-O2', '-I.', output, 'runtime.c', '-o', executable],
+                       check=True, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+
+        best = None
+        for _ in range(runs):
+            start = time.monotonic()
+            actual = subprocess.check_output([executable, '+RTS', f'-s{stats}', '--machine-readable', '-RTS'])
+            seconds = time.monotonic() - start
+            if best is None or seconds < best:
+                best = seconds
+        with open(stats) as fp:
+            reported = json.load(fp)
+
+    result = {
+        'output': actual.decode('utf-8').strip(),
+        'seconds': best,
+        'compile_seconds': sum(stages.values()),
+        'stages': stages,
+    }
+    for stat in STATS:
+        result[stat] = reported[stat]
+    return result
+
+
+def file_names():
+    '''
+    Yield all of the file names we need to run a benchmark on
+    '''
+    for file_name in os.listdir(ROOT):
+        if file_name.endswith('.hs'):
+            yield os.path.join(ROOT, file_name)
+
+
+def regressions(result, baseline):
+    '''
+    Yield a description of every measurement that got worse than the baseline allows.
+    '''
+    for key, threshold in THRESHOLDS.items():
+        old = baseline.get(key)
+        new = result[key]
+        if old is None:
+            continue
+        # Counts going from nothing to a small amount aren't worth failing over
+        if new > old * (1 + threshold) and new - old > 1e-3:
+            yield f'{key}: {old} -> {new} (+{100 * (new - old) / max(old, 1e-9):.1f}%)'
+
+
+def print_result(name, result):
+    '''
+    Print the measurements for a benchmark, including the time of each stage
+    '''
+    print(f'  {"run":<18} {result["seconds"]:10.4f}s')
+    print(f'  {"compile":<18} {result["compile_seconds"]:10.4f}s')
+    for stage, seconds in result['stages'].items():
+        print(f'    {stage:<16} {seconds:10.4f}s')
+    for stat in STATS:
+        print(f'  {stat:<18} {result[stat]:>10}')
+
+
+def main():
+    '''
+    The main function for our script.
+
+    This will find all of the benchmarks, and then run them, in parallel
+    if asked to, checking their output, and comparing the measurements
+    against the baseline.
+    '''
+    parser = argparse.ArgumentParser(description='Run the benchmarks in ' + ROOT)
+    parser.add_argument('--jobs', type=int, default=1, help='how many benchmarks to run at once')
+    parser.add_argument('--runs', type=int, default=3, help='how many times to run each benchmark')
+    parser.add_argument('--baseline', default=BASELINE, help='the file to compare against')
+    parser.add_argument('--save-baseline', action='store_true', help='save these results as the new baseline')
+    args = parser.parse_args()
+
+    compiler = build_compiler()
+    names = sorted(list(file_names()))
+    with ThreadPoolExecutor(max_workers=args.jobs) as executor:
+        futures = {name: executor.submit(run_benchmark, compiler, name, args.runs) for name in names}
+
+    baseline = {}
+    if os.path.exists(args.baseline) and not args.save_baseline:
+        with open(args.baseline) as fp:
+            baseline = json.load(fp)
+
+    failed = False
+    results = {}
+    for name in names:
+        try:
+            result = futures[name].result()
+        except BaseException as err:
+            print(f'{name}: FAIL')
+            print('Exception:')
+            print(err)
+            failed = True
+            continue
+        expected = get_expected(name).strip()
+        if result['output'] != expected:
+            print(f'\033[1m{name}\033[0m:\t\033[1m\033[31mFAIL\033[0m')
+            print(f'Expected:\033[1m\n{expected}\n\033[0m\nBut Found:\033[1m\n{result["output"]}\n\033[0m')
+            failed = True
+            continue
+        worse = list(regressions(result, baseline.get(name, {})))
+        if worse:
+            print(f'\033[1m{name}\033[0m:\t\033[1m\033[31mREGRESSED\033[0m')
+            for line in worse:
+                print(f'  {line}')
+            failed = True
+        else:
+            print(f'\033[1m{name}\033[0m:\t\033[1m\033[32mPASS\033[0m')
+        print_result(name, result)
+        del result['output']
+        results[name] = result
+
+    if args.save_baseline:
+        with open(args.baseline, 'w') as fp:
+            json.dump(results, fp, indent=2, sort_keys=True)
+            fp.write('\n')
+        print(f'Saved baseline to {args.baseline}')
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,25 @@
+data List a = Cons a (List a) | Nil
+
+tail :: List a -> List a
+tail Nil = Nil
+tail (Cons _ rest) = rest
+
+at :: Int -> List a -> a
+at 0 (Cons x _) = x
+at n (Cons _ xs) = at (n - 1) xs
+
+modulus :: Int -> Int
+modulus x = x - x / 1000000007 * 1000000007
+
+fibs :: List Int
+fibs = Cons 0 (Cons 1 (add fibs (tail fibs)))
+  where
+    add :: List Int -> List Int -> List Int
+    add (Cons a as) (Cons b bs) = Cons (modulus (a + b)) (add as bs)
+
+sumFibs :: Int -> Int -> Int
+sumFibs n acc = if n < 0 then acc else sumFibs (n - 1) (modulus (acc + at n fibs))
+
+-- OUT(594598519)
+main :: Int
+main = sumFibs 3000 0
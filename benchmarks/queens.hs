@@ -0,0 +1,16 @@
+data List a = Cons a (List a) | Nil
+
+safe :: Int -> Int -> List Int -> Bool
+safe _ _ Nil = True
+safe q d (Cons x xs) = q /= x && q /= x + d && q /= x - d && safe q (d + 1) xs
+
+place :: Int -> Int -> List Int -> Int
+place _ 0 _ = 1
+place n k qs = try n k qs 1
+
+try :: Int -> Int -> List Int -> Int -> Int
+try n k qs q = if q > n then 0 else (if safe q 1 qs then place n (k - 1) (Cons q qs) else 0) + try n k qs (q + 1)
+
+-- OUT(724)
+main :: Int
+main = place 10 10 Nil
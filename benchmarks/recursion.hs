@@ -0,0 +1,15 @@
+data List a = Cons a (List a) | Nil
+
+sumTo :: Int -> Int
+sumTo n = if n == 0 then 0 else n + sumTo (n - 1)
+
+upTo :: Int -> Int -> List Int
+upTo n m = if n > m then Nil else Cons n (upTo (n + 1) m)
+
+length :: List a -> Int
+length Nil = 0
+length (Cons _ xs) = 1 + length xs
+
+-- OUT(500001500000)
+main :: Int
+main = sumTo 1000000 + length (upTo 1 1000000)
@@ -0,0 +1,32 @@
+digit :: Int -> String
+digit 0 = "0"
+digit 1 = "1"
+digit 2 = "2"
+digit 3 = "3"
+digit 4 = "4"
+digit 5 = "5"
+digit 6 = "6"
+digit 7 = "7"
+digit 8 = "8"
+digit _ = "9"
+
+showInt :: Int -> String
+showInt n = if n < 10 then digit n else showInt (n / 10) ++ digit (n - n / 10 * 10)
+
+marker :: String -> Int
+marker s = case s of
+  "1,1" -> 1
+  "12,144" -> 1
+  "100,10000" -> 1
+  _ -> 0
+
+render :: Int -> String
+render i = showInt i ++ "," ++ showInt (i * i)
+
+markers :: Int -> Int -> Int
+markers 0 acc = acc
+markers i acc = markers (i - 1) (acc + marker (render i))
+
+-- OUT(3 markers in 200000,40000000000)
+main :: String
+main = showInt (markers 200000 0) ++ " markers in " ++ render 200000
@@ -0,0 +1,27 @@
+data Tree = Leaf | Node Tree Int Tree
+
+insert :: Int -> Tree -> Tree
+insert x Leaf = Node Leaf x Leaf
+insert x (Node l y r) = if x < y then Node (insert x l) y r else if x > y then Node l y (insert x r) else Node l y r
+
+member :: Int -> Tree -> Bool
+member _ Leaf = False
+member x (Node l y r) = if x < y then member x l else if x > y then member x r else True
+
+next :: Int -> Int
+next x = (x * 1103515245 + 12345) - (x * 1103515245 + 12345) / 2147483648 * 2147483648
+
+key :: Int -> Int
+key seed = seed - seed / 1000000 * 1000000
+
+build :: Int -> Int -> Tree -> Tree
+build 0 _ t = t
+build n seed t = build (n - 1) (next seed) (insert (key seed) t)
+
+count :: Int -> Int -> Tree -> Int -> Int
+count 0 _ _ acc = acc
+count n seed t acc = count (n - 1) (next seed) t (if member (key seed) t then acc + 1 else acc)
+
+-- OUT(35960)
+main :: Int
+main = count 200000 7 (build 200000 42 Leaf) 0
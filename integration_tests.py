@@ -1,13 +1,22 @@
 '''
 This file runs all of the integration tests in the directory `integration_tests`
 '''
+import json
 import os
 import re
 import subprocess
+import tempfile
 
 ROOT = 'integration_tests'
 OUTPUT = '.output.c'
 
+# The tests that also get run with a CAF image, saved by one run, and loaded by the next
+CAF_IMAGE_TESTS = ['0032.hs']
+
+# Runtime options making the garbage collector run often, with small CAF values
+# getting compacted partway through the program
+SMALL_HEAP = ['-A64k', '-H128k']
+
 
 def get_expected(file_name):
     '''
@@ -29,7 +38,7 @@ def gen_executable(file_name):
     out = subprocess.check_output(f"cabal run haskell-in-haskell -- compile {file_name} .output.c", shell=True).decode('utf-8')
     if 'Error' in out:
         raise Exception('\n'.join(out.split('\n')[1:]))
-    subprocess.run("gcc -std=c99 -fsanitize=address -fsanitize=undefined .output.c", shell=True, check=True, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    subprocess.run("gcc -std=c99 -fsanitize=address -fsanitize=undefined -I. .output.c runtime.c", shell=True, check=True, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
 
 
 
@@ -41,6 +50,69 @@ def get_output(file_name):
     return subprocess.check_output("./a.out", shell=True).decode('utf-8')
 
 
+def run_with_stats(options):
+    '''
+    Run the executable we've generated with some runtime options, returning
+    its output, and the statistics it reports.
+    '''
+    with tempfile.TemporaryDirectory() as tmp:
+        stats = os.path.join(tmp, 'stats.json')
+        out = subprocess.check_output(['./a.out', '+RTS', *options, f'-s{stats}', '--machine-readable', '-RTS'])
+        with open(stats) as fp:
+            return out.decode('utf-8').strip(), json.load(fp)
+
+
+def check_caf_image(file_name):
+    '''
+    Check that the CAFs of a program get saved to an image, and loaded from it,
+    and that images that are broken, or come from another program, get ignored.
+
+    This assumes that the executable for the file has just been generated.
+    Returns a list of the problems found.
+    '''
+    problems = []
+    expected = get_expected(file_name).strip()
+    with tempfile.TemporaryDirectory() as tmp:
+        image = os.path.join(tmp, 'cafs.img')
+        option = f'--caf-image={image}'
+        _, fresh = run_with_stats(SMALL_HEAP)
+
+        first, saved = run_with_stats([*SMALL_HEAP, option])
+        if first != expected:
+            problems.append(f'saving the image printed {first}')
+        if saved['compact_bytes'] == 0:
+            problems.append('nothing got compacted while saving the image')
+        if not os.path.exists(image):
+            problems.append('no image got saved')
+            return problems
+
+        second, loaded = run_with_stats([*SMALL_HEAP, option])
+        if second != first:
+            problems.append(f'loading the image printed {second}, instead of {first}')
+        if loaded['compact_bytes'] == 0:
+            problems.append('nothing got compacted after loading the image')
+        if loaded['bytes_allocated'] >= fresh['bytes_allocated']:
+            problems.append('loading the image didn\'t save any work')
+
+        with open(image, 'rb') as fp:
+            contents = fp.read()
+        broken = {
+            'truncated': contents[:len(contents) // 2],
+            'empty': b'',
+            # The fingerprint comes right after the magic number
+            'stale': contents[:8] + bytes(b ^ 0xff for b in contents[8:16]) + contents[16:],
+        }
+        for kind, data in broken.items():
+            with open(image, 'wb') as fp:
+                fp.write(data)
+            out, ignored = run_with_stats([*SMALL_HEAP, option])
+            if out != expected:
+                problems.append(f'loading a {kind} image printed {out}')
+            if ignored['bytes_allocated'] != fresh['bytes_allocated']:
+                problems.append(f'a {kind} image didn\'t get ignored')
+    return problems
+
+
 def file_names():
     '''
     Yield all of the file names we need to run an integration test on
@@ -67,8 +139,19 @@ def main():
             print('Exception:')
             print(err)
             continue
-        if expected == actual:
+        problems = []
+        if expected == actual and os.path.basename(name) in CAF_IMAGE_TESTS:
+            try:
+                problems = check_caf_image(name)
+            except BaseException as err:
+                problems = [str(err)]
+        if expected == actual and not problems:
             print(f'\033[1m{name}\033[0m:\t\033[1m\033[32mPASS\033[0m')
+        elif problems:
+            print(f'\033[1m{name}\033[0m:\t\033[1m\033[31mFAIL\033[0m')
+            print('With a CAF image:\033[1m')
+            print('\n'.join(problems))
+            print('\033[0m')
         else:
             print(f'\033[1m{name}\033[0m:\t\033[1m\033[31mFAIL\033[0m')
             print('Expected:\033[1m')
@@ -0,0 +1,10 @@
+step :: Int -> Int
+step n = n * 3 - n / 2 + (-1)
+
+kernel :: Int -> Int -> Int
+kernel 0 acc = acc
+kernel n acc = if n /= 5 then kernel (n - 1) (acc + step n) else kernel (n - 1) acc
+
+-- OUT(118)
+main :: Int
+main = kernel 10 0
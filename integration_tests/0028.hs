@@ -0,0 +1,34 @@
+data List a = Cons a (List a) | Nil
+
+data Pair a b = Pair a b
+
+split :: List Int -> Pair (List Int) (List Int)
+split Nil = Pair Nil Nil
+split (Cons x xs) = if x / 2 * 2 == x then Pair (Cons x evens) odds else Pair evens (Cons x odds)
+  where
+    rest = split xs
+
+    evens = case rest of
+      Pair es _ -> es
+
+    odds = case rest of
+      Pair _ os -> os
+
+upTo :: Int -> Int -> List Int
+upTo n m = if n > m then Nil else Cons n (upTo (n + 1) m)
+
+sum :: List Int -> Int
+sum Nil = 0
+sum (Cons x xs) = x + sum xs
+
+length :: List a -> Int
+length Nil = 0
+length (Cons _ xs) = 1 + length xs
+
+halves :: Pair (List Int) (List Int)
+halves = split (upTo 1 20000)
+
+-- OUT(100020000)
+main :: Int
+main = case halves of
+  Pair evens odds -> sum evens + length odds
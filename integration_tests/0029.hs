@@ -0,0 +1,23 @@
+data List a = Cons a (List a) | Nil
+
+fib :: Int -> Int
+fib n = if n < 2 then 1 else par x (seq y (x + y))
+  where
+    x = fib (n - 1)
+    y = fib (n - 2)
+
+lengths :: List (List Int) -> List Int
+lengths Nil = Nil
+lengths (Cons xs rest) = seq (length xs) (Cons (length xs) (lengths rest))
+
+length :: List a -> Int
+length Nil = 0
+length (Cons _ xs) = 1 + length xs
+
+sum :: List Int -> Int
+sum Nil = 0
+sum (Cons x xs) = x + sum xs
+
+-- OUT(10950)
+main :: Int
+main = seq sum (fib 20 + sum (lengths (Cons (Cons 1 Nil) (Cons (Cons 2 (Cons 3 (Cons 4 Nil))) Nil))))
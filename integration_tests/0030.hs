@@ -0,0 +1,9 @@
+greet :: String -> String
+greet "日本" = "こんにちは"
+greet "ab" = "a??b"
+greet "é" = "??="
+greet _ = "\?"
+
+-- OUT(こんにちは a??b ??= \?)
+main :: String
+main = greet "日本" ++ " " ++ greet "ab" ++ " " ++ greet "é" ++ " " ++ greet "e"
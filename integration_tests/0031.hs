@@ -0,0 +1,6 @@
+apply :: (Int -> Int) -> Int -> Int
+apply seq x = seq x
+
+-- OUT(5)
+main :: Int
+main = let par = 2 in seq par (apply (\seq -> seq + par) 3)
@@ -0,0 +1,22 @@
+data List a = Cons a (List a) | Nil
+
+range :: Int -> Int -> List Int
+range a b = if a > b then Nil else Cons a (range (a + 1) b)
+
+map :: (a -> b) -> List a -> List b
+map _ Nil = Nil
+map f (Cons x xs) = Cons (f x) (map f xs)
+
+sum :: List Int -> Int
+sum Nil = 0
+sum (Cons x xs) = x + sum xs
+
+squares :: List Int
+squares = map (\x -> x * x) (range 1 2000)
+
+total :: Int
+total = sum squares
+
+-- OUT(5334665333000)
+main :: Int
+main = sum (map (\x -> total - x) squares)
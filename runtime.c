@@ -1,44 +1,33 @@
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+// We need this for `mmap` and friends, since we compile as C99
+#define _DEFAULT_SOURCE
+
+#include "runtime.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef THREADED
+#include <pthread.h>
+#include <sched.h>
+/// Each thread gets its own copy of variables marked with this
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+void output_flush();
 
 /// exit the program, displaying an error message
 void panic(const char *message) {
+  // Whatever the program printed before failing should still show up
+  output_flush();
   fputs("PANIC:", stderr);
   fputs(message, stderr);
   exit(-1);
 }
 
-#ifdef DEBUG
-#define DEBUG_PRINT(...)                                                       \
-  do {                                                                         \
-    fprintf(stderr, __VA_ARGS__);                                              \
-  } while (0)
-#else
-#define DEBUG_PRINT(...)                                                       \
-  do {                                                                         \
-  } while (0)
-#endif
-
-/// A code label takes no arguments, and returns the next function.
-///
-/// We have to return a void*, because we can't easily have a recursive
-/// type here. But, this is basically always an `EntryFunction*`.
-typedef void *(*CodeLabel)(void);
-
-/// An evac function takes the current location of a closure,
-/// and returns the new location after moving that closure (if necessary).
-typedef uint8_t *(*EvacFunction)(uint8_t *);
-
-/// An InfoTable contains the information about the functions of a closure
-typedef struct InfoTable {
-  /// The function we can call to enter the closure
-  CodeLabel entry;
-  /// The evacuation function we call to collect this closure
-  EvacFunction evac;
-} InfoTable;
-
 /// For static objects, evacuating them should return their current location
 uint8_t *static_evac(uint8_t *base) {
   return base;
@@ -46,7 +35,7 @@ uint8_t *static_evac(uint8_t *base) {
 
 /// It's useful for to have a null table to use that's valid for the GC,
 /// but can't be entered
-InfoTable table_for_null = {NULL, &static_evac};
+InfoTable table_for_null = {NULL, &static_evac, NULL};
 static InfoTable *table_pointer_for_null = &table_for_null;
 
 /// For closures that have already been evacuated
@@ -57,79 +46,73 @@ uint8_t *already_evac(uint8_t *base) {
 }
 
 /// A table we can share between closures that are already evacuated
-InfoTable table_for_already_evac = {NULL, &already_evac};
-/// A pointer to the above table
-static InfoTable *table_pointer_for_already_evac = &table_for_already_evac;
+InfoTable table_for_already_evac = {NULL, &already_evac, NULL};
 
 uint8_t *string_evac(uint8_t *);
+uint8_t *string_scavenge(uint8_t *);
 
 /// The Infotable we use for strings
 ///
+/// A string closure contains its length, as a `size_t`, followed by
+/// that many bytes of character data, with no NUL terminator.
+///
 /// The entry should never be called, so we provide a panicking function
-InfoTable table_for_string = {NULL, &string_evac};
-static InfoTable *table_pointer_for_string = &table_for_string;
+InfoTable table_for_string = {NULL, &string_evac, &string_scavenge
+                              PROFILE_NAME("(string)")};
 
 /// The InfoTable we use for string literals
-InfoTable table_for_string_literal = {NULL, &static_evac};
+///
+/// These have the same layout as other strings.
+InfoTable table_for_string_literal = {NULL, &static_evac, NULL};
 
-typedef struct CAFCell {
-  InfoTable *table;
-  uint8_t *closure;
-  struct CAFCell *next;
-} CAFCell;
+uint8_t *rope_evac(uint8_t *);
+uint8_t *rope_scavenge(uint8_t *);
+
+/// The InfoTable we use for the concatenation of two strings
+///
+/// A rope contains its total length, as a `size_t`, followed by pointers
+/// to the left and right strings. Once a rope gets flattened, the left
+/// pointer holds the flattened string instead, and the right pointer is NULL.
+///
+/// Everywhere a string is expected, a rope can be used instead.
+InfoTable table_for_rope = {NULL, &rope_evac, &rope_scavenge
+                            PROFILE_NAME("(rope)")};
 
 CAFCell *g_CAFListHead = NULL;
 CAFCell **g_CAFListLast = &g_CAFListHead;
 
-/// Represents the argument stack
+#ifdef THREADED
+/// The capability of the current thread
 ///
-/// Each argument represents the location in memory where the closure
-/// for that argument is stored. You can sort of think of this as InfoTable**.
-typedef struct StackA {
-  /// The top of the argument stack.
-  ///
-  /// The stack grows upward, with the current pointer always
-  /// pointing at valid memory, but containing no "live" value.
-  uint8_t **top;
-  /// The base pointer of the argument stack.
-  ///
-  /// This is used to adjust the bottom of the stack, to implement updates
-  uint8_t **base;
-  /// A pointer to all of the data
-  ///
-  /// We keep this around so that we can free the stack on program exit
-  uint8_t **data;
-} StackA;
-
+/// This holds the registers and stacks of that thread.
+__thread Capability *g_Capability = NULL;
+#else
 /// The "A" or argument stack
-StackA g_SA = {NULL, NULL, NULL};
-
-/// Represents an item on the secondary stack.
-///
-/// This is either a 64 bit integer, or a function
-/// pointer for a continuation.
-typedef union StackBItem {
-  int64_t as_int;
-  CodeLabel as_code;
-  uint8_t *as_closure;
-  union StackBItem *as_sb_base;
-  uint8_t **as_sa_base;
-} StackBItem;
-
-/// Represents the secondary stack.
-///
-/// This contains various things: ints, and continuations.
-typedef struct StackB {
-  StackBItem *top;
-  StackBItem *base;
-  StackBItem *data;
-} StackB;
+StackA g_SA = {NULL, NULL, NULL, 0, 0};
 
 /// The secondary stack
-StackB g_SB = {NULL, NULL, NULL};
+StackB g_SB = {NULL, NULL, NULL, 0, 0};
+#endif
 
+// With GLOBAL_REGISTERS, these are declared as machine registers in the header
+#if !defined(GLOBAL_REGISTERS) && !defined(THREADED)
+/// The register holding the location of the current closure
+uint8_t *g_NodeRegister = NULL;
+/// The top of the argument stack.
+///
+/// The stack grows upward, with the current pointer always
+/// pointing at valid memory, but containing no "live" value.
+uint8_t **g_SATop = NULL;
+/// The top of the secondary stack
+StackBItem *g_SBTop = NULL;
+/// The part of the nursery we're currently writing to
+///
+/// This takes the place of the cursor of the nursery itself.
+uint8_t *g_HeapCursor = NULL;
 /// The register holding integer returns
 int64_t g_IntRegister = 0xBAD;
+#endif
+#ifndef THREADED
 /// The register holding string values
 ///
 /// This is **not** a pointer to the character data, but rather,
@@ -139,309 +122,2384 @@ uint8_t *g_StringRegister = NULL;
 uint16_t g_TagRegister = 0xBAD;
 /// The register holding the number of constructor args returned
 int64_t g_ConstructorArgCountRegister = 0xBAD;
-/// The register holding the location of the current closure
-uint8_t *g_NodeRegister = NULL;
 /// The register holding a constructor closure to update
 uint8_t *g_ConstrUpdateRegister = NULL;
+/// The register holding the kind of value we're returning
+///
+/// Only continuations that can get any kind of value look at this.
+uint8_t g_ReturnKindRegister = RETURN_INT;
+
+/// The pointer arguments passed to the fast entry of a global function
+///
+/// Calls that know exactly which function they're calling, and with how
+/// many arguments, skip the stack, and the check for partial applications.
+uint8_t *g_ArgRegisters[ARG_REGISTER_COUNT];
+/// How many of the argument registers hold live pointers
+///
+/// These are roots for the garbage collector, until the function we're
+/// calling moves them into its own variables.
+size_t g_ArgRegisterCount = 0;
+/// The int arguments passed to the fast entry of a worker function
+int64_t g_IntArgRegisters[ARG_REGISTER_COUNT];
+#endif
 
 /// A data structure representing our global Heap of memory
+///
+/// Each heap reserves a large range of address space up front, and then
+/// commits actual memory inside of that range as it needs to grow. This
+/// means that growing a heap never needs to move it.
 typedef struct Heap {
   /// The data contained in this heap
   uint8_t *data;
   /// The part of the data we're currently writing to
+  ///
+  /// The nursery uses `g_HeapCursor` instead, so that it can live
+  /// in a register. With THREADED, each capability allocates into its own
+  /// block of the nursery, and this is the end of the blocks handed out.
   uint8_t *cursor;
   /// The total capacity of the data, in bytes
+  ///
+  /// This is how much we allow ourselves to use before collecting garbage.
   size_t capacity;
+  /// The number of bytes at the start of the data that we can actually use
+  size_t committed;
+  /// The number of bytes of address space we've reserved for this heap
+  size_t reserved;
 } Heap;
 
 /// "The Heap", as a global variable.
 ///
+/// This is the nursery, where all new closures get allocated. It has a fixed
+/// size, and gets emptied out on every collection, by moving all the
+/// closures that survive into the old generation.
+///
 /// This is static, since we always use it through functions provided
 /// in this runtime file.
-static Heap g_Heap = {NULL, NULL, 0};
+static Heap g_Heap = {NULL, NULL, 0, 0, 0};
+
+#ifndef THREADED
+/// The end of the capacity of the nursery
+///
+/// This always needs to be kept in sync with `g_Heap`.
+uint8_t *g_HeapLimit = NULL;
+#endif
+
+/// The old generation, containing every closure that survived a collection.
+///
+/// This only gets collected once it can no longer hold the contents of
+/// the nursery.
+static Heap g_OldHeap = {NULL, NULL, 0, 0, 0};
+
+/// The other semispace of the old generation
+///
+/// A major collection moves the old generation into this space, and then
+/// the two spaces swap roles, so that we can reuse the same memory.
+static Heap g_OldHeapSpare = {NULL, NULL, 0, 0, 0};
+
+/// The heap that closures get moved into while collecting garbage
+static Heap *g_ToSpace = NULL;
+
+/// The old generation we're moving away from, during a major collection
+///
+/// During a minor collection, this is empty.
+static Heap g_CollectedOldHeap = {NULL, NULL, 0, 0, 0};
+
+/// The options controlling how the runtime behaves
+///
+/// These can be changed with `+RTS ... -RTS` on the command line,
+/// or with the `HIH_RTS` environment variable.
+typedef struct RTSConfig {
+  /// The initial capacity of the old generation, in bytes (`-H`)
+  size_t initial_heap_size;
+  /// The largest size the old generation can grow to, in bytes (`-M`)
+  ///
+  /// This is also the amount of address space each heap reserves.
+  size_t max_heap_size;
+  /// The size of the nursery, in bytes (`-A`)
+  size_t nursery_size;
+  /// The largest size each stack can grow to, in bytes (`-K`)
+  size_t stack_size;
+  /// How much room the old generation leaves after a major collection (`-F`)
+  ///
+  /// This is a multiple of the amount of live data.
+  double heap_growth;
+  /// Whether or not to report statistics when the program exits (`-s`)
+  int report_stats;
+  /// Whether or not to report statistics as JSON (`--machine-readable`)
+  int machine_readable;
+  /// Where to write the statistics, or NULL for stderr (`-s<file>`)
+  char *stats_file;
+  /// Whether or not to write out each line as soon as it's printed (`--unbuffered`)
+  int unbuffered_output;
+  /// Where to keep the values of CAFs between runs, or NULL (`--caf-image=`)
+  char *caf_image;
+#ifdef THREADED
+  /// The number of capabilities running Haskell code (`-N`)
+  ///
+  /// This is 0 until `setup` has looked at the options.
+  size_t capabilities;
+  /// The number of threads collecting garbage together (`-qn`)
+  ///
+  /// This is 0 until `setup` has looked at the options, and then defaults
+  /// to the number of capabilities.
+  size_t gc_threads;
+#endif
+#ifdef TICKY
+  /// Whether or not to write a report of the ticky counters (`-r`)
+  int ticky;
+  /// Where to write that report, or NULL for `<program>.ticky` (`-r<file>`)
+  char *ticky_file;
+#endif
+#ifdef PROFILING
+  /// Whether or not to write a report of allocations per closure (`-p`)
+  int profile;
+  /// Whether or not to take a heap census at every collection (`-h`)
+  int heap_profile;
+#endif
+} RTSConfig;
 
-/// Get a current cursor, where writes to the Heap will happen
-uint8_t *heap_cursor() {
-  return g_Heap.cursor;
+/// The configuration of the runtime, filled in by `setup`
+static RTSConfig g_Config = {
+    1 << 9, (size_t)1 << 32, 1 << 18, 1 << 26, 3, 0, 0, NULL, 0, NULL};
+
+/// Statistics about the memory behavior of a program
+typedef struct Stats {
+  /// The number of bytes allocated in the nursery
+  ///
+  /// We count this at every collection, and when the program exits,
+  /// by looking at how far the nursery has been filled.
+  size_t bytes_allocated;
+  /// The number of bytes moved by the garbage collector
+  size_t bytes_copied;
+  /// The most data we've seen in the old generation after a collection
+  size_t max_residency;
+  /// The number of collections of just the nursery
+  size_t minor_collections;
+  /// The number of collections of the whole heap
+  size_t major_collections;
+  /// The time the program started, in seconds
+  double start_time;
+  /// The total time spent collecting garbage, in seconds
+  double gc_time;
+} Stats;
+
+/// The statistics for the program we're currently running
+static Stats g_Stats = {0, 0, 0, 0, 0, 0, 0};
+
+/// Get the current time, in seconds
+double current_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-void heap_write(void *data, size_t bytes) {
-  memcpy(g_Heap.cursor, data, bytes);
-  g_Heap.cursor += bytes;
+#if defined(PROFILING) || defined(TICKY)
+/// The name of the program we're running, used to name profiling reports
+static const char *g_ProgramName = "hih";
+
+/// Open a profiling report for the program, with a given extension
+FILE *open_profile_file(const char *extension) {
+  const char *base = strrchr(g_ProgramName, '/');
+  base = base == NULL ? g_ProgramName : base + 1;
+  char *path = malloc(strlen(base) + strlen(extension) + 1);
+  if (path == NULL) {
+    panic("Failed to allocate profile path");
+  }
+  strcpy(path, base);
+  strcat(path, extension);
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "failed to open profile: %s\n", path);
+  }
+  free(path);
+  return out;
 }
 
-/// Write a pointer into the heap
-void heap_write_ptr(uint8_t *ptr) {
-  heap_write(&ptr, sizeof(uint8_t *));
+#endif
+
+#ifdef TICKY
+/// The counters of the functions that have been entered at least once
+static TickyCounter *g_TickyCounters = NULL;
+
+/// The number of counters in that list
+static size_t g_TickyCounterCount = 0;
+
+void ticky_register(TickyCounter *counter) {
+  counter->registered = 1;
+  counter->next = g_TickyCounters;
+  g_TickyCounters = counter;
+  ++g_TickyCounterCount;
 }
 
-/// Write an info table pointer into the heap
-void heap_write_info_table(InfoTable *ptr) {
-  heap_write(&ptr, sizeof(InfoTable *));
+/// Order counters by how often their function was entered, most often first
+int compare_ticky_counters(const void *a, const void *b) {
+  const TickyCounter *c1 = *(TickyCounter *const *)a;
+  const TickyCounter *c2 = *(TickyCounter *const *)b;
+  if (c1->entries != c2->entries) {
+    return c1->entries < c2->entries ? 1 : -1;
+  }
+  return strcmp(c1->name, c2->name);
 }
 
-/// Write an integer into the heap
-void heap_write_int(int64_t x) {
-  heap_write(&x, sizeof(int64_t));
+/// Write out the counters of each function, if requested
+///
+/// Along with the name of each binding, we write out the name of its C
+/// function, which is what tools like `perf` will call it.
+void ticky_report() {
+  if (!g_Config.ticky) {
+    return;
+  }
+  FILE *out;
+  if (g_Config.ticky_file != NULL) {
+    out = fopen(g_Config.ticky_file, "w");
+    if (out == NULL) {
+      fprintf(stderr, "failed to open ticky report: %s\n",
+              g_Config.ticky_file);
+    }
+  } else {
+    out = open_profile_file(".ticky");
+  }
+  if (out == NULL) {
+    return;
+  }
+  TickyCounter **counters =
+      malloc((g_TickyCounterCount + 1) * sizeof(TickyCounter *));
+  if (counters == NULL) {
+    panic("Failed to allocate ticky report");
+  }
+  size_t count = 0;
+  size_t total = 0;
+  for (TickyCounter *c = g_TickyCounters; c != NULL; c = c->next) {
+    counters[count++] = c;
+    total += c->entries;
+  }
+  qsort(counters, count, sizeof(TickyCounter *), &compare_ticky_counters);
+
+  fprintf(out, "%s: %zu entries\n\n", g_ProgramName, total);
+  fprintf(out, "%14s %7s %12s %12s %14s  %-40s %s\n", "entries", "%enter",
+          "updates", "paps", "bytes", "closure", "symbol");
+  for (size_t i = 0; i < count; ++i) {
+    TickyCounter *c = counters[i];
+    double percent = total == 0 ? 0 : 100.0 * c->entries / total;
+    fprintf(out, "%14zu %6.1f%% %12zu %12zu %14zu  %-40s %s\n", c->entries,
+            percent, c->update_frames, c->partial_applications,
+            c->bytes_allocated, c->name, c->symbol);
+  }
+  free(counters);
+  fclose(out);
 }
+#endif
 
-/// Write a short unsigned integer into the heap
-void heap_write_uint16(uint16_t x) {
-  heap_write(&x, sizeof(uint16_t));
+#ifdef PROFILING
+/// The tables we've seen closures for, linked through `next_profiled`
+static InfoTable *g_ProfiledTables = NULL;
+
+/// The number of tables in the profiled list
+static size_t g_ProfiledTableCount = 0;
+
+/// The file we write heap census samples to, if we're taking them
+static FILE *g_HeapProfile = NULL;
+
+/// Make sure that a table will show up in our profiling reports
+void profile_register(InfoTable *table) {
+  if (table->profiled) {
+    return;
+  }
+  table->profiled = 1;
+  table->next_profiled = g_ProfiledTables;
+  g_ProfiledTables = table;
+  ++g_ProfiledTableCount;
 }
 
-/// Read a ptr from a chunk of data
-uint8_t *read_ptr(uint8_t *data) {
-  uint8_t *ret;
-  memcpy(&ret, data, sizeof(uint8_t *));
-  return ret;
+void profile_alloc(InfoTable *table, size_t bytes) {
+  profile_register(table);
+  ++table->allocations;
+  table->bytes_allocated += bytes;
 }
 
-/// Read a 64 bit integer from a chunk of data
-int64_t read_int(uint8_t *data) {
-  int64_t ret;
-  memcpy(&ret, data, sizeof(int64_t));
-  return ret;
+/// A census is only accurate during a major collection, since that's
+/// the only time when every live closure gets scanned.
+void profile_live(InfoTable *table, size_t bytes) {
+  if (g_CollectedOldHeap.data == NULL) {
+    return;
+  }
+  profile_register(table);
+  table->live_bytes += bytes;
 }
 
-/// Read a pointer to an info table from a chunk of data
-InfoTable *read_info_table(uint8_t *data) {
-  InfoTable *ret;
-  memcpy(&ret, data, sizeof(InfoTable *));
-  return ret;
+/// Start a new heap census, forgetting the results of the last one
+void census_begin() {
+  for (InfoTable *t = g_ProfiledTables; t != NULL; t = t->next_profiled) {
+    t->live_bytes = 0;
+  }
 }
 
-static double HEAP_GROWTH = 3;
+/// Finish a heap census, writing out a sample if we're taking them
+void census_end() {
+  double time = current_time() - g_Stats.start_time;
+  if (g_HeapProfile != NULL) {
+    fprintf(g_HeapProfile, "BEGIN_SAMPLE %.6f\n", time);
+  }
+  for (InfoTable *t = g_ProfiledTables; t != NULL; t = t->next_profiled) {
+    if (t->live_bytes > t->max_live_bytes) {
+      t->max_live_bytes = t->live_bytes;
+    }
+    if (g_HeapProfile != NULL && t->live_bytes > 0) {
+      fprintf(g_HeapProfile, "%s\t%zu\n", t->name, t->live_bytes);
+    }
+  }
+  if (g_HeapProfile != NULL) {
+    fprintf(g_HeapProfile, "END_SAMPLE %.6f\n", time);
+  }
+}
 
-/// Collect a single root
-void collect_root(uint8_t **root) {
-  *root = read_info_table(*root)->evac(*root);
+/// Start writing the heap profile, if it was requested
+void heap_profile_begin() {
+  if (!g_Config.heap_profile) {
+    return;
+  }
+  g_HeapProfile = open_profile_file(".hp");
+  if (g_HeapProfile == NULL) {
+    return;
+  }
+  fprintf(g_HeapProfile, "JOB \"%s\"\n", g_ProgramName);
+  fprintf(g_HeapProfile, "SAMPLE_UNIT \"seconds\"\n");
+  fprintf(g_HeapProfile, "VALUE_UNIT \"bytes\"\n");
+  fprintf(g_HeapProfile, "BEGIN_SAMPLE 0.000000\nEND_SAMPLE 0.000000\n");
 }
 
+/// Finish the heap profile, with an empty closing sample
+void heap_profile_end() {
+  if (g_HeapProfile == NULL) {
+    return;
+  }
+  double time = current_time() - g_Stats.start_time;
+  fprintf(g_HeapProfile, "BEGIN_SAMPLE %.6f\nEND_SAMPLE %.6f\n", time, time);
+  fclose(g_HeapProfile);
+  g_HeapProfile = NULL;
+}
 
-/// Grow the heap, removing useless objects
-void collect_garbage(size_t extra_required) {
-  Heap old = g_Heap;
+/// Order tables by how many bytes they've allocated, largest first
+int compare_profiled_tables(const void *a, const void *b) {
+  const InfoTable *t1 = *(InfoTable *const *)a;
+  const InfoTable *t2 = *(InfoTable *const *)b;
+  if (t1->bytes_allocated != t2->bytes_allocated) {
+    return t1->bytes_allocated < t2->bytes_allocated ? 1 : -1;
+  }
+  return strcmp(t1->name, t2->name);
+}
 
-  size_t new_capacity = HEAP_GROWTH * old.capacity;
-  size_t required_capacity = old.cursor - old.data + extra_required;
-  if (new_capacity < required_capacity) {
-    new_capacity = required_capacity;
+/// Write out the allocations made for each closure, if requested
+void profile_report() {
+  if (!g_Config.profile) {
+    return;
+  }
+  FILE *out = open_profile_file(".prof");
+  if (out == NULL) {
+    return;
   }
+  InfoTable **tables = malloc((g_ProfiledTableCount + 1) * sizeof(InfoTable *));
+  if (tables == NULL) {
+    panic("Failed to allocate profile report");
+  }
+  size_t count = 0;
+  size_t total = 0;
+  for (InfoTable *t = g_ProfiledTables; t != NULL; t = t->next_profiled) {
+    tables[count++] = t;
+    total += t->bytes_allocated;
+  }
+  qsort(tables, count, sizeof(InfoTable *), &compare_profiled_tables);
+
+  fprintf(out, "%s: %zu bytes allocated\n\n", g_ProgramName, total);
+  fprintf(out, "%-40s %12s %14s %7s %14s %14s\n", "closure", "allocs",
+          "bytes", "%alloc", "live bytes", "max live");
+  for (size_t i = 0; i < count; ++i) {
+    InfoTable *t = tables[i];
+    double percent = total == 0 ? 0 : 100.0 * t->bytes_allocated / total;
+    fprintf(out, "%-40s %12zu %14zu %6.1f%% %14zu %14zu\n", t->name,
+            t->allocations, t->bytes_allocated, percent, t->live_bytes,
+            t->max_live_bytes);
+  }
+  free(tables);
+  fclose(out);
+}
+#endif
+
+/// The amount of memory each stack starts out with, in bytes
+static const size_t BASE_STACK_SIZE = 1 << 13;
+
+/// Round a size up to a multiple of the page size
+size_t round_to_page(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
 
-  g_Heap.data = malloc(new_capacity * sizeof(uint8_t));
-  if (g_Heap.data == NULL) {
-    panic("Failed to allocate new heap during garbage collection");
+/// Reserve a range of address space, without using any memory yet
+///
+/// This returns NULL if we couldn't reserve the space.
+uint8_t *reserve_memory(size_t size) {
+  void *data = mmap(NULL, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return data == MAP_FAILED ? NULL : data;
+}
+
+/// Grow the usable part of some reserved memory to hold at least `size` bytes
+///
+/// This returns the new number of usable bytes, or 0 if the memory
+/// can't hold `size` bytes.
+size_t commit_memory(uint8_t *data, size_t committed, size_t reserved,
+                     size_t size) {
+  if (size > reserved) {
+    return 0;
   }
-  g_Heap.cursor = g_Heap.data;
-  g_Heap.capacity = new_capacity;
+  // Committing in big steps avoids having to do this often
+  if (size < 2 * committed) {
+    size = 2 * committed;
+  }
+  size = round_to_page(size);
+  if (size > reserved) {
+    size = reserved;
+  }
+  if (mprotect(data + committed, size - committed, PROT_READ | PROT_WRITE) !=
+      0) {
+    return 0;
+  }
+  return size;
+}
 
-  if (g_StringRegister != NULL) {
-    collect_root(&g_StringRegister);
+/// Reserve the address space for a heap, without using any memory yet
+void heap_map(Heap *heap, size_t reserved) {
+  reserved = round_to_page(reserved);
+  uint8_t *data = reserve_memory(reserved);
+  if (data == NULL) {
+    panic("Failed to reserve space for the Heap");
   }
-  if (g_NodeRegister != NULL) {
-    collect_root(&g_NodeRegister);
+  heap->data = data;
+  heap->cursor = heap->data;
+  heap->capacity = 0;
+  heap->committed = 0;
+  heap->reserved = reserved;
+}
+
+/// Make sure that at least the first `size` bytes of a heap can be used
+void heap_commit(Heap *heap, size_t size) {
+  if (size <= heap->committed) {
+    return;
   }
-  if (g_ConstrUpdateRegister != NULL) {
-    collect_root(&g_ConstrUpdateRegister);
+  size = commit_memory(heap->data, heap->committed, heap->reserved, size);
+  if (size == 0) {
+    panic("Heap exhausted, try raising the maximum heap size");
   }
+  heap->committed = size;
+}
 
-  for (uint8_t **p = g_SA.data; p < g_SA.top; ++p) {
-    collect_root(p);
+/// Give back the memory used by a heap, past the first `size` bytes
+void heap_decommit(Heap *heap, size_t size) {
+  size = round_to_page(size);
+  if (size >= heap->committed) {
+    return;
   }
-  for (CAFCell *p = g_CAFListHead; p != NULL; p = p->next) {
-    collect_root(&p->closure);
+  uint8_t *start = heap->data + size;
+  size_t length = heap->committed - size;
+  madvise(start, length, MADV_DONTNEED);
+  mprotect(start, length, PROT_NONE);
+  heap->committed = size;
+}
+
+/// Set the capacity of a heap, committing enough memory to hold it
+void heap_set_capacity(Heap *heap, size_t capacity) {
+  if (capacity > heap->reserved) {
+    panic("Heap exhausted, try raising the maximum heap size");
   }
-  // Collect all the closures in the update frames
-  for (StackBItem *base = g_SB.base; base != g_SB.data;
-       base = base[0].as_sb_base) {
-    collect_root(&base[2].as_closure);
+  heap_commit(heap, capacity);
+  heap->capacity = capacity;
+}
+
+/// Reserve the memory for a stack, returning its start
+///
+/// One extra page is reserved past the end of the stack, and never made
+/// usable, so that a stray write past the end faults instead of corrupting
+/// whatever lies next to it.
+uint8_t *stack_map(size_t *reserved, size_t *committed) {
+  *reserved = round_to_page(g_Config.stack_size);
+  uint8_t *data = reserve_memory(*reserved + round_to_page(1));
+  if (data == NULL) {
+    panic("Failed to reserve space for the Stacks");
   }
-  // At this point, all references into the old heap are eliminated
-  free(old.data);
+  size_t initial = BASE_STACK_SIZE;
+  if (initial > *reserved) {
+    initial = *reserved;
+  }
+  *committed = commit_memory(data, 0, *reserved, initial);
+  if (*committed == 0) {
+    panic("Failed to initialize the Stacks");
+  }
+  return data;
+}
 
-  // To avoid exponential growth unnecessarily, we restrict
-  // the actual capacity available, hiding some of the unused data
-  size_t necessary_size = g_Heap.cursor - g_Heap.data;
-  size_t comfortable_size = HEAP_GROWTH * necessary_size;
-  if (comfortable_size < g_Heap.capacity) {
-    g_Heap.capacity = comfortable_size;
+/// Grow the memory of a stack, so that it can hold `required` bytes
+size_t stack_grow(uint8_t *data, size_t committed, size_t reserved,
+                  size_t required) {
+  size_t size = commit_memory(data, committed, reserved, required);
+  if (size == 0) {
+    panic("Stack overflow, try raising the maximum stack size");
+  }
+  return size;
+}
+
+/// Make sure that we can push a given number of items on each stack
+///
+/// The generated code does this once at the start of each function, for
+/// all of the items it might push.
+void stack_reserve(size_t a_items, size_t b_items) {
+  size_t sa_depth = (g_SATop - g_SA.data) + a_items;
+  if (sa_depth > g_SA.max_depth) {
+    g_SA.max_depth = sa_depth;
+  }
+  size_t sb_depth = (g_SBTop - g_SB.data) + b_items;
+  if (sb_depth > g_SB.max_depth) {
+    g_SB.max_depth = sb_depth;
+  }
+  if (g_SATop + a_items > g_SA.limit) {
+    uint8_t *data = (uint8_t *)g_SA.data;
+    size_t committed = (uint8_t *)g_SA.limit - data;
+    size_t required = (uint8_t *)(g_SATop + a_items) - data;
+    size_t size = stack_grow(data, committed, g_SA.reserved, required);
+    g_SA.limit = (uint8_t **)(data + size);
+  }
+  if (g_SBTop + b_items > g_SB.limit) {
+    uint8_t *data = (uint8_t *)g_SB.data;
+    size_t committed = (uint8_t *)g_SB.limit - data;
+    size_t required = (uint8_t *)(g_SBTop + b_items) - data;
+    size_t size = stack_grow(data, committed, g_SB.reserved, required);
+    g_SB.limit = (StackBItem *)(data + size);
   }
-  DEBUG_PRINT("GC Done. 0x%05X ↓ 0x%05X ↑ 0x%05X\n", old.capacity,
-              necessary_size, g_Heap.capacity);
 }
 
-/// Reserve a certain amount of bytes in the Heap
+/// Check whether or not a closure lives in some heap
+int heap_contains(Heap *heap, uint8_t *closure) {
+  return closure >= heap->data && closure < heap->cursor;
+}
+
+/// Get the end of the part of the nursery that's been allocated into
+///
+/// With THREADED, this includes the parts of each block that haven't been
+/// used yet, since only the capability owning a block knows how far it got.
+uint8_t *nursery_end() {
+#ifdef THREADED
+  return __atomic_load_n(&g_Heap.cursor, __ATOMIC_RELAXED);
+#else
+  return g_HeapCursor;
+#endif
+}
+
+/// Check whether or not a closure lives in the nursery
+int nursery_contains(uint8_t *closure) {
+  return closure >= g_Heap.data && closure < nursery_end();
+}
+
+#ifdef THREADED
+/// The size of the blocks of g_ToSpace each thread collecting garbage copies into
+#define GC_BLOCK_SIZE ((size_t)1 << 15)
+
+/// A range of closures that have been moved, but not scavenged yet
+typedef struct GCWork {
+  uint8_t *start;
+  uint8_t *end;
+} GCWork;
+
+/// The state each thread collecting garbage in parallel keeps to itself
+typedef struct GCThread {
+  /// Where the next closure we move goes, in our block of g_ToSpace
+  uint8_t *cursor;
+  /// The end of our block
+  uint8_t *limit;
+  /// The first closure in our block that nobody has started scavenging
+  uint8_t *pending;
+  /// The number of bytes we've moved during this collection
+  size_t bytes_copied;
+  /// The thread this runs on, unless it's the one that started the collection
+  pthread_t thread;
+} GCThread;
+
+/// Every thread that can collect garbage, with the one starting a collection first
+static GCThread *g_GCThreads = NULL;
+
+/// The number of threads collecting garbage together
+static size_t g_GCThreadCount = 1;
+
+/// The state of the current thread, while it's collecting garbage in parallel
 ///
-/// The point of this function is to trigger garbage collection, growing
-/// the Heap, if necessary.
+/// This is NULL whenever a collection only uses one thread.
+static THREAD_LOCAL GCThread *g_GCThread = NULL;
+
+/// The table a closure has while some thread is busy moving it
 ///
-/// No bounds checking of the Heap is done otherwise.
-void heap_reserve(size_t amount) {
-  // We'd need to write beyond the capacity of our buffer
-  if (g_Heap.cursor + amount > g_Heap.data + g_Heap.capacity) {
-    collect_garbage(amount);
+/// Nothing ever gets to enter, move, or scavenge a closure with this table,
+/// since other threads wait for it to get replaced.
+static InfoTable table_for_evacuating = {NULL, NULL, NULL};
+
+/// The table the closure the current thread is moving had before that
+static THREAD_LOCAL InfoTable *g_EvacuatingTable = NULL;
+
+/// The lock protecting the shared state of a parallel collection
+static pthread_mutex_t g_GCLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// The ranges of closures any thread can scavenge
+static GCWork *g_GCWork = NULL;
+static size_t g_GCWorkCount = 0;
+static size_t g_GCWorkCapacity = 0;
+
+/// Signalled whenever there's more work, or every thread has run out of it
+static pthread_cond_t g_GCWorkCond = PTHREAD_COND_INITIALIZER;
+
+/// The number of threads waiting for more work
+static size_t g_GCIdle = 0;
+
+/// Offer a range of closures for any thread to scavenge
+void gc_push_work(uint8_t *start, uint8_t *end) {
+  pthread_mutex_lock(&g_GCLock);
+  if (g_GCWorkCount >= g_GCWorkCapacity) {
+    size_t capacity = 2 * g_GCWorkCapacity + 16;
+    GCWork *work = realloc(g_GCWork, capacity * sizeof(GCWork));
+    if (work == NULL) {
+      panic("Failed to grow the work of the garbage collector");
+    }
+    g_GCWork = work;
+    g_GCWorkCapacity = capacity;
   }
+  g_GCWork[g_GCWorkCount].start = start;
+  g_GCWork[g_GCWorkCount].end = end;
+  ++g_GCWorkCount;
+  pthread_cond_signal(&g_GCWorkCond);
+  pthread_mutex_unlock(&g_GCLock);
 }
 
-void *black_hole_entry() {
-  fputs("infinite loop detected\n", stderr);
-  return NULL;
+/// Take a range of closures to scavenge, waiting for one if there are none
+///
+/// This returns 0 once every thread is waiting, since nobody can
+/// make any more work at that point.
+int gc_take_work(GCWork *work) {
+  pthread_mutex_lock(&g_GCLock);
+  if (g_GCWorkCount == 0) {
+    __atomic_add_fetch(&g_GCIdle, 1, __ATOMIC_RELAXED);
+    while (g_GCWorkCount == 0 && g_GCIdle < g_GCThreadCount) {
+      pthread_cond_wait(&g_GCWorkCond, &g_GCLock);
+    }
+    if (g_GCWorkCount == 0) {
+      pthread_cond_broadcast(&g_GCWorkCond);
+      pthread_mutex_unlock(&g_GCLock);
+      return 0;
+    }
+    __atomic_sub_fetch(&g_GCIdle, 1, __ATOMIC_RELAXED);
+  }
+  --g_GCWorkCount;
+  *work = g_GCWork[g_GCWorkCount];
+  pthread_mutex_unlock(&g_GCLock);
+  return 1;
 }
 
-uint8_t *black_hole_evac(uint8_t *base) {
-  uint8_t *new_base = heap_cursor();
-  heap_write(base, sizeof(InfoTable *) + sizeof(uint8_t *));
-  memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable*));
-  memcpy(base + sizeof(InfoTable *), &new_base, sizeof(uint8_t *));
+/// Give the current thread a new block of g_ToSpace, with room for `required` bytes
+///
+/// Whatever we haven't scavenged in the old block is left for any thread to do.
+void gc_block_refill(GCThread *self, size_t required) {
+  if (self->pending < self->cursor) {
+    gc_push_work(self->pending, self->cursor);
+  }
+  size_t size = required > GC_BLOCK_SIZE ? required : GC_BLOCK_SIZE;
+  pthread_mutex_lock(&g_GCLock);
+  uint8_t *start = g_ToSpace->cursor;
+  g_ToSpace->cursor += size;
+  heap_commit(g_ToSpace, g_ToSpace->cursor - g_ToSpace->data);
+  pthread_mutex_unlock(&g_GCLock);
+  self->cursor = start;
+  self->pending = start;
+  self->limit = start + size;
+}
+#endif
+
+/// Move the contents of a closure into the heap we're collecting into
+///
+/// This doesn't touch the old closure, which still needs to be forwarded.
+uint8_t *gc_move(uint8_t *base, size_t size) {
+#ifdef THREADED
+  GCThread *self = g_GCThread;
+  if (self != NULL) {
+    if (self->cursor + size > self->limit) {
+      gc_block_refill(self, size);
+    }
+    uint8_t *new_base = self->cursor;
+    self->cursor += size;
+    self->bytes_copied += size;
+    memcpy(new_base, base, size);
+    // The old closure lost its table when we claimed it
+    write_info_table(new_base, g_EvacuatingTable);
+    return new_base;
+  }
+#endif
+  size_t used = g_ToSpace->cursor - g_ToSpace->data;
+  if (used + size > g_ToSpace->committed) {
+    heap_commit(g_ToSpace, used + size);
+  }
+  g_Stats.bytes_copied += size;
+  uint8_t *new_base = g_ToSpace->cursor;
+  memcpy(new_base, base, size);
+  g_ToSpace->cursor += size;
   return new_base;
 }
 
-InfoTable table_for_black_hole = {&black_hole_entry, &black_hole_evac};
+/// Make a closure that's been moved point to wherever it's gone
+///
+/// The old closure needs to have space for at least one pointer.
+void gc_forward(uint8_t *base, uint8_t *new_base) {
+  write_ptr(base + sizeof(InfoTable *), new_base);
+#ifdef THREADED
+  __atomic_store_n((InfoTable **)base, &table_for_already_evac,
+                   __ATOMIC_RELEASE);
+#else
+  write_info_table(base, &table_for_already_evac);
+#endif
+}
 
-/// Concat two strings together, returning the location of the new string
+/// Move a closure into the heap we're collecting into
 ///
-/// This might trigger garbage collection. In practice, we only ever do
-/// this right before jumping to a continuation, so this is ok.
-uint8_t *string_concat(uint8_t *s1, uint8_t *s2) {
-  uint8_t *data1 = s1 + sizeof(InfoTable *);
-  uint8_t *data2 = s2 + sizeof(InfoTable *);
-  size_t len1 = strlen((char *)data1);
-  size_t len2 = strlen((char *)data2);
-
-  size_t required = sizeof(InfoTable *) + len1 + len2 + 1;
-  size_t min_size = sizeof(InfoTable *) + sizeof(uint8_t *);
-  size_t extra = 0;
-  // We need to make sure that the string has enough space for a relocation
-  if (required < min_size) {
-    extra = min_size - required;
-    required += extra;
-  }
-  if (g_Heap.cursor + required > g_Heap.data + g_Heap.capacity) {
-    // Push the two strings on the stack, so they're roots for the GC
-    g_SA.top[0] = s1;
-    g_SA.top[1] = s2;
-    g_SA.top += 2;
-
-    collect_garbage(required);
-
-    data2 = g_SA.top[-1] + sizeof(InfoTable *);
-    data1 = g_SA.top[-2] + sizeof(InfoTable *);
-    g_SA.top -= 2;
-  }
-
-  uint8_t *ret = g_Heap.cursor;
-
-  memcpy(g_Heap.cursor, &table_pointer_for_string, sizeof(InfoTable *));
-  g_Heap.cursor += sizeof(InfoTable *);
-  memcpy(g_Heap.cursor, data1, len1);
-  g_Heap.cursor += len1;
-  memcpy(g_Heap.cursor, data2, len2 + 1);
-  g_Heap.cursor += len2 + 1;
-  g_Heap.cursor += extra;
+/// The old closure gets replaced with an indirection to the new one,
+/// which means that it needs to have space for at least one pointer.
+uint8_t *gc_copy(uint8_t *base, size_t size) {
+  uint8_t *new_base = gc_move(base, size);
+  gc_forward(base, new_base);
+  return new_base;
+}
 
-  return ret;
+/// The remembered set, containing the old closures that might point
+/// to closures in the nursery.
+///
+/// These are the extra roots we need to look at in a minor collection.
+typedef struct RememberedSet {
+  uint8_t **data;
+  size_t count;
+  size_t capacity;
+} RememberedSet;
+
+#ifdef THREADED
+/// The most sparks each capability can hold on to at once
+///
+/// Like GHC, we drop the sparks that don't fit, instead of growing the pool,
+/// since a capability with this many sparks has plenty of work to hand out.
+#define SPARK_POOL_SIZE 4096
+
+/// The sparks a capability has created, waiting to be evaluated
+///
+/// This is a Chase-Lev deque, following the memory orders of Lê et al.:
+/// the capability owning the pool pushes and pops sparks at the bottom,
+/// and other capabilities steal them from the top.
+typedef struct SparkPool {
+  int64_t top;
+  int64_t bottom;
+  uint8_t *sparks[SPARK_POOL_SIZE];
+} SparkPool;
+
+/// A thread running Haskell code, along with everything it keeps to itself
+typedef struct Worker {
+  /// The registers and stacks of this worker
+  ///
+  /// This comes first, so that the current capability is also the current worker.
+  Capability capability;
+  /// The old closures this worker has made point into the nursery
+  RememberedSet remembered;
+  /// The sparks this worker has created
+  SparkPool sparks;
+  /// The bytes left at the end of the blocks of the nursery this worker is done with
+  size_t nursery_wasted;
+  /// The number of sparks added to the pool
+  size_t sparks_created;
+  /// The number of sparks this worker has evaluated
+  size_t sparks_converted;
+  /// The number of sparks dropped, because the pool was full
+  size_t sparks_overflowed;
+  /// The number of sparks dropped, because they were already evaluated
+  size_t sparks_fizzled;
+  /// Whether or not the spark we're running has finished without an error
+  int spark_finished;
+  /// The thread running this worker, unless it's the main thread
+  pthread_t thread;
+} Worker;
+
+/// The workers, with the one for the main thread first
+static Worker *g_Workers = NULL;
+
+/// The number of workers, which is the number of capabilities
+static size_t g_WorkerCount = 0;
+
+/// Get the worker running on the current thread
+Worker *current_worker() {
+  return (Worker *)g_Capability;
 }
+#else
+static RememberedSet g_RememberedSet = {NULL, 0, 0};
+#endif
 
-/// The evacuation function for strings
-uint8_t *string_evac(uint8_t *base) {
-  uint8_t *new_base = heap_cursor();
-  size_t bytes = strlen((char *)(base + sizeof(InfoTable *))) + 1;
-  heap_write(base, sizeof(InfoTable *) + bytes);
-  // We need to make sure we also have enough space for the relocation
-  if (bytes < sizeof(uint8_t *)) {
-    g_Heap.cursor += sizeof(uint8_t *) - bytes;
-  }
-  memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable *));
-  memcpy(base + sizeof(InfoTable *), &new_base, sizeof(uint8_t *));
-  return new_base;
+/// Get the remembered set the current capability adds to
+RememberedSet *current_remembered_set() {
+#ifdef THREADED
+  return &current_worker()->remembered;
+#else
+  return &g_RememberedSet;
+#endif
 }
 
-/// Save the current contents of the B stack
-void save_SB() {
-  g_SB.top[0].as_sb_base = g_SB.base;
-  g_SB.base = g_SB.top;
-  ++g_SB.top;
+/// Record that a closure has been modified to point to another closure
+///
+/// This needs to be called whenever we modify a closure that already
+/// exists, since that closure might be in the old generation, and now
+/// point to a closure in the nursery.
+void write_barrier(uint8_t *closure, uint8_t *pointee) {
+  if (!heap_contains(&g_OldHeap, closure) ||
+      !nursery_contains(untag(pointee))) {
+    return;
+  }
+  RememberedSet *set = current_remembered_set();
+  if (set->count >= set->capacity) {
+    size_t capacity = 2 * set->capacity + 16;
+    uint8_t **data = realloc(set->data, capacity * sizeof(uint8_t *));
+    if (data == NULL) {
+      panic("Failed to grow the remembered set");
+    }
+    set->data = data;
+    set->capacity = capacity;
+  }
+  set->data[set->count] = closure;
+  ++set->count;
 }
 
-/// Save the current contents of the A stack
-void save_SA() {
-  g_SB.top[0].as_sa_base = g_SA.base;
-  g_SA.base = g_SA.top;
-  ++g_SB.top;
+/// Publish the new table of a closure we've just updated
+///
+/// With THREADED, everything written to the closure before this becomes
+/// visible to any capability reading the new table.
+void publish_info_table(uint8_t *closure, InfoTable *table) {
+#ifdef THREADED
+  __atomic_store_n((InfoTable **)closure, table, __ATOMIC_RELEASE);
+#else
+  write_info_table(closure, table);
+#endif
 }
 
-/// The entry function for partial applications.
-void *partial_application_entry() {
-  DEBUG_PRINT("%s\n", __func__);
-  uint8_t *cursor = g_NodeRegister + sizeof(InfoTable *);
+/// Update a closure to become an indirection to another one
+void update_with_indirection(uint8_t *closure, uint8_t *target) {
+  write_ptr(closure + sizeof(InfoTable *), target);
+  publish_info_table(closure, &table_for_indirection);
+  write_barrier(closure, target);
+}
 
-  CodeLabel ret;
-  memcpy(&ret, cursor, sizeof(CodeLabel));
-  cursor += sizeof(CodeLabel);
+/// Check whether or not a closure is part of the heap we're currently collecting
+int gc_collecting(uint8_t *base) {
+  return nursery_contains(base) || heap_contains(&g_CollectedOldHeap, base);
+}
 
-  uint16_t b_items;
-  memcpy(&b_items, cursor, sizeof(uint16_t));
-  cursor += sizeof(uint16_t);
-  uint16_t a_items;
-  memcpy(&a_items, cursor, sizeof(uint16_t));
-  cursor += sizeof(uint16_t);
+#ifdef THREADED
+/// Move a closure, after making sure that no other thread is moving it
+///
+/// We claim the closure by replacing its table, so that nobody else can
+/// move it, or see it halfway through being forwarded. Whoever loses waits
+/// for the closure to be forwarded, and then uses where it went.
+uint8_t *evacuate_claimed(uint8_t *base) {
+  InfoTable *table = read_info_table(base);
+  for (;;) {
+    if (table == &table_for_already_evac) {
+      return already_evac(base);
+    }
+    if (table != &table_for_evacuating &&
+        __atomic_compare_exchange_n((InfoTable **)base, &table,
+                                    &table_for_evacuating, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    table = read_info_table(base);
+  }
+  // Moving an indirection moves whatever it points to, claiming that too
+  InfoTable *outer = g_EvacuatingTable;
+  g_EvacuatingTable = table;
+  uint8_t *new_closure = table->evac(base);
+  g_EvacuatingTable = outer;
+  // Some closures, like flattened ropes, don't get forwarded, and stay as they were
+  if (read_info_table(base) == &table_for_evacuating) {
+    publish_info_table(base, table);
+  }
+  return new_closure;
+}
+#endif
 
-  // Push saved stack arguments
-  size_t b_size = b_items * sizeof(StackBItem);
-  memcpy(g_SB.top, cursor, b_size);
-  g_SB.top += b_items;
-  cursor += b_size;
-  size_t a_size = a_items * sizeof(uint8_t *);
-  memcpy(g_SA.top, cursor, a_size);
-  g_SA.top += a_items;
+/// Move a closure, if it's part of the heap we're currently collecting
+///
+/// Tagged pointers only ever point to constructors, whose evacuation
+/// function returns a pointer with the same tag.
+uint8_t *evacuate(uint8_t *closure) {
+  uint8_t *base = untag(closure);
+  if (!gc_collecting(base)) {
+    return closure;
+  }
+#ifdef THREADED
+  if (g_GCThread != NULL) {
+    return evacuate_claimed(base);
+  }
+#endif
+  return read_info_table(base)->evac(base);
+}
 
-  // Jump to saved function
-  return ret;
+/// Collect a single root
+void collect_root(uint8_t **root) {
+  *root = evacuate(*root);
 }
 
-/// THe evacuation function for a partial application
-uint8_t *partial_application_evac(uint8_t *base) {
+/// How many selector thunks deep we can look through, before giving up
+///
+/// Each selector thunk whose field is another selector thunk needs
+/// another level of recursion, so we need to stop somewhere.
+#define SELECTOR_DEPTH_MAX 16
+
+static THREAD_LOCAL size_t g_SelectorDepth = 0;
+
+/// The evacuation function for thunks selecting a field of a constructor
+///
+/// These thunks contain just the closure they select from. If that
+/// closure has already been evaluated to a constructor with the right tag,
+/// we can replace the thunk with the field it selects, instead of copying it,
+/// and the rest of the constructor might no longer be alive.
+uint8_t *selector_evac(uint8_t *base, uint16_t tag, size_t field) {
+  size_t size = sizeof(InfoTable *) + sizeof(uint8_t *);
+  if (g_SelectorDepth >= SELECTOR_DEPTH_MAX) {
+    return gc_copy(base, size);
+  }
+  uint8_t *selectee = untag(read_ptr(base + sizeof(InfoTable *)));
+  InfoTable *table = read_info_table(selectee);
+  // Indirections can be looked through, whether they come from updates,
+  // or from having already been moved during this collection
+  while (table == &table_for_indirection || table == &table_for_already_evac) {
+    selectee = untag(read_ptr(selectee + sizeof(InfoTable *)));
+    table = read_info_table(selectee);
+  }
+  if (table != &table_for_with_constructor &&
+      table != &table_for_shared_constructor) {
+    return gc_copy(base, size);
+  }
+  uint16_t selectee_tag;
+  memcpy(&selectee_tag, selectee + sizeof(InfoTable *), sizeof(uint16_t));
+  uint16_t items;
+  memcpy(&items, selectee + sizeof(InfoTable *) + sizeof(uint16_t),
+         sizeof(uint16_t));
+  if (selectee_tag != tag || field >= items) {
+    return gc_copy(base, size);
+  }
+
+  uint8_t *value =
+      read_ptr(selectee + CONSTRUCTOR_HEADER_SIZE + field * sizeof(uint8_t *));
+#ifdef THREADED
+  if (g_GCThread != NULL) {
+    // Another thread might have claimed and forwarded the selectee while we
+    // were reading it, overwriting its header, so we only trust what we read
+    // if it's still the same constructor afterwards
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n((InfoTable **)selectee, __ATOMIC_ACQUIRE) != table) {
+      return gc_copy(base, size);
+    }
+    // Moving the field ourselves could mean waiting on another thread that's
+    // waiting on this thunk, so in parallel, we only use fields already moved
+    if (gc_collecting(untag(value)) &&
+        read_info_table(value) != &table_for_already_evac) {
+      return gc_copy(base, size);
+    }
+  }
+#endif
+  ++g_SelectorDepth;
+  uint8_t *new_value = evacuate(value);
+  --g_SelectorDepth;
+  // Everything else pointing to the thunk now gets the field instead
+  gc_forward(base, new_value);
+  return new_value;
+}
+
+/// The number of items in each update frame on the B stack
+///
+/// These are the saved B and A stack bases, the closure to update,
+/// and the continuation doing the update.
+#define UPDATE_FRAME_SIZE 4
+
+/// Collapse update frames sitting directly on top of each other
+///
+/// This happens whenever a thunk evaluates to another thunk, which
+/// builds up a chain of frames that all end up being updated with
+/// the same value. We keep the bottom frame of the chain, and make it
+/// update the topmost closure instead, with the closures of the other
+/// frames becoming indirections to that one.
+///
+/// The code for the other closures is long done, which is why we can
+/// overwrite them. The topmost closure might still be running though.
+///
+/// Evaluation frames look like update frames, but don't update anything,
+/// so they're left alone.
+void squeeze_update_frames() {
+  if (g_SB.base == g_SB.data) {
+    return;
+  }
+  // First, we go down the chain of frames, merging frames into the one
+  // below them, and linking each frame to the one above it instead, so that
+  // we can move everything down later. Removed frames lose their code.
+  StackBItem *above = NULL;
+  // The A stack base the current frame started
+  uint8_t **sa_base = g_SA.base;
+  StackBItem *frame = g_SB.base;
+  while (frame != g_SB.data) {
+    StackBItem *below = frame[0].as_sb_base;
+    uint8_t **saved_sa_base = frame[1].as_sa_base;
+    // A frame can only be merged if nothing was pushed between the two
+    // frames, on either stack.
+    if (below != g_SB.data && below + UPDATE_FRAME_SIZE == frame &&
+        sa_base == saved_sa_base &&
+        below[3].as_code == &update_constructor &&
+        frame[3].as_code == &update_constructor &&
+        below[2].as_closure != frame[2].as_closure) {
+      uint8_t *updatee = frame[2].as_closure;
+      update_with_indirection(below[2].as_closure, updatee);
+      below[2].as_closure = updatee;
+      frame[3].as_code = NULL;
+    }
+    frame[0].as_sb_base = above;
+    above = frame;
+    sa_base = saved_sa_base;
+    frame = below;
+  }
+
+  // Then we go back up, sliding the stack over the removed frames, and
+  // restoring the links between the frames we keep.
+  StackBItem *dest = above;
+  StackBItem *kept = g_SB.data;
+  for (frame = above; frame != NULL;) {
+    StackBItem *next = frame[0].as_sb_base;
+    StackBItem *end = next != NULL ? next : g_SBTop;
+    StackBItem *src = frame;
+    if (frame[3].as_code == NULL) {
+      src += UPDATE_FRAME_SIZE;
+    } else {
+      frame[0].as_sb_base = kept;
+      kept = dest;
+    }
+    size_t count = end - src;
+    memmove(dest, src, count * sizeof(StackBItem));
+    dest += count;
+    frame = next;
+  }
+  g_SB.base = kept;
+  g_SBTop = dest;
+}
+
+/// Move the closures the current capability points to into g_ToSpace
+void collect_capability_roots() {
+  if (g_StringRegister != NULL) {
+    collect_root(&g_StringRegister);
+  }
+  if (g_NodeRegister != NULL) {
+    // The node register always holds an untagged pointer
+    g_NodeRegister = untag(evacuate(g_NodeRegister));
+  }
+  if (g_ConstrUpdateRegister != NULL) {
+    collect_root(&g_ConstrUpdateRegister);
+  }
+  for (size_t i = 0; i < g_ArgRegisterCount; ++i) {
+    collect_root(&g_ArgRegisters[i]);
+  }
+
+  for (uint8_t **p = g_SA.data; p < g_SATop; ++p) {
+    collect_root(p);
+  }
+  // Collect all the closures in the update frames, which have been squeezed
+  for (StackBItem *base = g_SB.base; base != g_SB.data;
+       base = base[0].as_sb_base) {
+    collect_root(&base[2].as_closure);
+  }
+}
+
+/// Collect the old closures in a remembered set, which might point into the nursery
+void collect_remembered_set(RememberedSet *set) {
+  for (size_t i = 0; i < set->count; ++i) {
+    uint8_t *closure = set->data[i];
+    read_info_table(closure)->scavenge(closure);
+  }
+  set->count = 0;
+}
+
+/// Forget about all of the old closures pointing into the nursery
+void forget_remembered_sets() {
+#ifdef THREADED
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    g_Workers[i].remembered.count = 0;
+  }
+#else
+  g_RememberedSet.count = 0;
+#endif
+}
+
+#ifdef THREADED
+/// Collect the roots of a worker, including the sparks in its pool
+void collect_worker_roots(Worker *worker) {
+  g_Capability = &worker->capability;
+  collect_capability_roots();
+  SparkPool *pool = &worker->sparks;
+  for (int64_t j = pool->top; j < pool->bottom; ++j) {
+    collect_root(&pool->sparks[j % SPARK_POOL_SIZE]);
+  }
+}
+
+/// The next group of roots for a thread collecting in parallel to take
+///
+/// There's one group for each worker, then the CAFs, and then the
+/// remembered set of each worker.
+static size_t g_GCRootGroup = 0;
+
+/// Collect one group of roots, as numbered by `g_GCRootGroup`
+void collect_root_group(size_t group) {
+  if (group < g_WorkerCount) {
+    collect_worker_roots(&g_Workers[group]);
+  } else if (group == g_WorkerCount) {
+    for (CAFCell *p = g_CAFListHead; p != NULL; p = p->next) {
+      collect_root(&p->closure);
+    }
+  } else {
+    collect_remembered_set(&g_Workers[group - g_WorkerCount - 1].remembered);
+  }
+}
+
+/// The smallest range of closures we share, instead of scavenging ourselves
+#define GC_SHARE_SIZE ((size_t)1 << 12)
+
+/// Do our part of a parallel collection
+///
+/// Each thread takes groups of roots until there are none left. After that,
+/// we scavenge whatever we've moved, and help out with the closures others
+/// have moved, until everyone runs out of work.
+void gc_thread_work(GCThread *self) {
+  g_GCThread = self;
+  size_t groups = 2 * g_WorkerCount + 1;
+  for (;;) {
+    size_t group = __atomic_fetch_add(&g_GCRootGroup, 1, __ATOMIC_RELAXED);
+    if (group >= groups) {
+      break;
+    }
+    collect_root_group(group);
+  }
+  for (;;) {
+    if (self->pending < self->cursor) {
+      uint8_t *scan = self->pending;
+      uint8_t *end = self->cursor;
+      self->pending = end;
+      // If other threads are waiting, they can take this instead
+      if (end - scan >= GC_SHARE_SIZE &&
+          __atomic_load_n(&g_GCIdle, __ATOMIC_RELAXED) > 0) {
+        gc_push_work(scan, end);
+        continue;
+      }
+      while (scan < end) {
+        scan = read_info_table(scan)->scavenge(scan);
+      }
+      continue;
+    }
+    GCWork work;
+    if (!gc_take_work(&work)) {
+      break;
+    }
+    for (uint8_t *scan = work.start; scan < work.end;) {
+      scan = read_info_table(scan)->scavenge(scan);
+    }
+  }
+  g_GCThread = NULL;
+}
+
+/// Signalled when a parallel collection starts
+static pthread_cond_t g_GCStartCond = PTHREAD_COND_INITIALIZER;
+
+/// Signalled when a thread is done with its part of a parallel collection
+static pthread_cond_t g_GCDoneCond = PTHREAD_COND_INITIALIZER;
+
+/// The number of parallel collections started so far
+static size_t g_GCGeneration = 0;
+
+/// The number of threads done with the current parallel collection
+static size_t g_GCFinished = 0;
+
+/// The main loop of the threads that only help out with collections
+void *gc_thread_main(void *argument) {
+  GCThread *self = argument;
+  size_t generation = 0;
+  pthread_mutex_lock(&g_GCLock);
+  for (;;) {
+    while (g_GCGeneration == generation) {
+      pthread_cond_wait(&g_GCStartCond, &g_GCLock);
+    }
+    generation = g_GCGeneration;
+    pthread_mutex_unlock(&g_GCLock);
+    gc_thread_work(self);
+    pthread_mutex_lock(&g_GCLock);
+    ++g_GCFinished;
+    pthread_cond_broadcast(&g_GCDoneCond);
+  }
+  return NULL;
+}
+
+/// Move all of the closures reachable from our roots, using every GC thread
+///
+/// The closures end up in blocks of g_ToSpace, with some unused space left
+/// at the end of each block, so g_ToSpace can no longer be walked from start
+/// to end. Since g_ToSpace gets scavenged as closures are moved, nothing needs to.
+void collect_roots_in_parallel() {
+  Capability *current = g_Capability;
+  for (size_t i = 0; i < g_GCThreadCount; ++i) {
+    GCThread *thread = &g_GCThreads[i];
+    thread->cursor = NULL;
+    thread->limit = NULL;
+    thread->pending = NULL;
+    thread->bytes_copied = 0;
+  }
+  g_GCRootGroup = 0;
+  g_GCIdle = 0;
+  g_GCWorkCount = 0;
+  pthread_mutex_lock(&g_GCLock);
+  ++g_GCGeneration;
+  g_GCFinished = 0;
+  pthread_cond_broadcast(&g_GCStartCond);
+  pthread_mutex_unlock(&g_GCLock);
+
+  gc_thread_work(&g_GCThreads[0]);
+
+  pthread_mutex_lock(&g_GCLock);
+  while (g_GCFinished < g_GCThreadCount - 1) {
+    pthread_cond_wait(&g_GCDoneCond, &g_GCLock);
+  }
+  pthread_mutex_unlock(&g_GCLock);
+  g_Capability = current;
+
+  for (size_t i = 0; i < g_GCThreadCount; ++i) {
+    GCThread *thread = &g_GCThreads[i];
+    g_Stats.bytes_copied += thread->bytes_copied;
+    // The end of the last block handed out can be given back
+    if (thread->limit == g_ToSpace->cursor) {
+      g_ToSpace->cursor = thread->cursor;
+    }
+  }
+}
+#endif
+
+/// Move all of the closures reachable from our roots into g_ToSpace
+void collect_roots() {
+#ifdef THREADED
+  // Squeezing the stacks can add to the remembered sets, so we do this
+  // before any of them get collected
+  Capability *current = g_Capability;
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    g_Capability = &g_Workers[i].capability;
+    squeeze_update_frames();
+  }
+  g_Capability = current;
+  if (g_GCThreadCount > 1) {
+    collect_roots_in_parallel();
+    return;
+  }
+#else
+  squeeze_update_frames();
+#endif
+  uint8_t *scan = g_ToSpace->cursor;
+
+#ifdef THREADED
+  // Every capability has its own roots, including the sparks in its pool
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    collect_worker_roots(&g_Workers[i]);
+  }
+  g_Capability = current;
+#else
+  collect_capability_roots();
+#endif
+  for (CAFCell *p = g_CAFListHead; p != NULL; p = p->next) {
+    collect_root(&p->closure);
+  }
+  // Old closures that might point into the nursery act as roots too.
+  // During a major collection, the remembered sets are empty, since
+  // we'll end up seeing all of these closures anyways.
+#ifdef THREADED
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    collect_remembered_set(&g_Workers[i].remembered);
+  }
+#else
+  collect_remembered_set(&g_RememberedSet);
+#endif
+
+  // The roots have been moved, but the closures we've moved still point
+  // into the old heap. We walk over the new heap, scavenging each closure,
+  // which might move even more closures to the end of the new heap.
+  // Once our scan catches up with the end of the heap, we're done.
+  while (scan < g_ToSpace->cursor) {
+    InfoTable *table = read_info_table(scan);
+    uint8_t *next = table->scavenge(scan);
+    PROFILE_LIVE(table, next - scan);
+    scan = next;
+  }
+}
+
+void compact_cafs();
+
+/// Collect the entire heap, moving the old generation into the spare area
+///
+/// This needs to leave enough room in the old generation to be able
+/// to promote an entire nursery afterwards.
+void major_collection() {
+  size_t nursery_size = g_Heap.capacity;
+#ifdef DEBUG
+  size_t used = (g_OldHeap.cursor - g_OldHeap.data) +
+                (nursery_end() - g_Heap.data);
+#endif
+
+#ifdef PROFILING
+  census_begin();
+#endif
+  // The closures left behind by compacting get forwarded, like the others
+  compact_cafs();
+  g_CollectedOldHeap = g_OldHeap;
+  g_OldHeapSpare.cursor = g_OldHeapSpare.data;
+  // Everything gets moved, so there's no need to track old closures
+  forget_remembered_sets();
+  g_ToSpace = &g_OldHeapSpare;
+  collect_roots();
+
+  // At this point, all references into the old heap are eliminated,
+  // so we can swap the two spaces.
+  Heap old = g_OldHeap;
+  g_OldHeap = g_OldHeapSpare;
+  g_OldHeapSpare = old;
+  g_CollectedOldHeap.data = NULL;
+  g_CollectedOldHeap.cursor = NULL;
+#ifdef PROFILING
+  census_end();
+#endif
+
+  // To avoid exponential growth unnecessarily, we restrict
+  // the actual capacity available, hiding some of the unused data
+  size_t necessary_size = g_OldHeap.cursor - g_OldHeap.data;
+  size_t comfortable_size = g_Config.heap_growth * necessary_size;
+  if (comfortable_size < necessary_size + nursery_size) {
+    comfortable_size = necessary_size + nursery_size;
+  }
+  if (comfortable_size < g_Config.initial_heap_size) {
+    comfortable_size = g_Config.initial_heap_size;
+  }
+  if (comfortable_size > g_OldHeap.reserved) {
+    comfortable_size = g_OldHeap.reserved;
+  }
+  heap_set_capacity(&g_OldHeap, comfortable_size);
+  // The spare space will need to hold at most this much during the
+  // next major collection, so we can give the rest of its memory back.
+  heap_decommit(&g_OldHeapSpare, comfortable_size + nursery_size);
+  DEBUG_PRINT("Major GC Done. 0x%05zX ↓ 0x%05zX ↑ 0x%05zX\n", used,
+              necessary_size, g_OldHeap.capacity);
+}
+
+/// Collect the nursery, moving everything that's still alive into the
+/// old generation
+void minor_collection() {
+#ifdef DEBUG
+  size_t used = nursery_end() - g_Heap.data;
+  uint8_t *start = g_OldHeap.cursor;
+#endif
+  g_ToSpace = &g_OldHeap;
+  collect_roots();
+  DEBUG_PRINT("Minor GC Done. 0x%05zX ↓ 0x%05zX\n", used,
+              (size_t)(g_OldHeap.cursor - start));
+}
+
+#ifdef THREADED
+/// The lock protecting the state of the scheduler
+static pthread_mutex_t g_SchedulerLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Signalled whenever a capability stops running Haskell code, and
+/// whenever a collection finishes
+static pthread_cond_t g_SchedulerCond = PTHREAD_COND_INITIALIZER;
+
+/// The number of capabilities currently running Haskell code
+static size_t g_RunningCount = 0;
+
+/// Whether or not some capability is waiting to collect garbage
+///
+/// Every other capability stops at its next safe point, until that's done.
+static int g_GCRequested = 0;
+
+/// Wait for the collection another capability asked for to finish
+///
+/// This needs to be called with the scheduler lock held.
+void wait_for_collection() {
+  --g_RunningCount;
+  pthread_cond_broadcast(&g_SchedulerCond);
+  while (g_GCRequested) {
+    pthread_cond_wait(&g_SchedulerCond, &g_SchedulerLock);
+  }
+  ++g_RunningCount;
+}
+
+/// Stop running Haskell code on this thread for a while
+///
+/// Collections can happen without us until we acquire a capability again.
+void capability_release() {
+  pthread_mutex_lock(&g_SchedulerLock);
+  --g_RunningCount;
+  pthread_cond_broadcast(&g_SchedulerCond);
+  pthread_mutex_unlock(&g_SchedulerLock);
+}
+
+/// Start running Haskell code again, once no one is collecting garbage
+void capability_acquire() {
+  pthread_mutex_lock(&g_SchedulerLock);
+  while (g_GCRequested) {
+    pthread_cond_wait(&g_SchedulerCond, &g_SchedulerLock);
+  }
+  ++g_RunningCount;
+  pthread_mutex_unlock(&g_SchedulerLock);
+}
+
+/// Stop here if another capability is waiting to collect garbage
+///
+/// Anything we still need has to be reachable from our registers or
+/// stacks, since the collection can move it.
+void gc_safe_point() {
+  if (!__atomic_load_n(&g_GCRequested, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  pthread_mutex_lock(&g_SchedulerLock);
+  if (g_GCRequested) {
+    wait_for_collection();
+  }
+  pthread_mutex_unlock(&g_SchedulerLock);
+}
+
+/// Stop every other capability at a safe point, so that we can collect garbage
+///
+/// If another capability asked to collect first, we wait for it to be done
+/// instead, and return 0.
+int stop_the_world() {
+  pthread_mutex_lock(&g_SchedulerLock);
+  if (g_GCRequested) {
+    wait_for_collection();
+    pthread_mutex_unlock(&g_SchedulerLock);
+    return 0;
+  }
+  __atomic_store_n(&g_GCRequested, 1, __ATOMIC_RELEASE);
+  while (g_RunningCount > 1) {
+    pthread_cond_wait(&g_SchedulerCond, &g_SchedulerLock);
+  }
+  pthread_mutex_unlock(&g_SchedulerLock);
+  return 1;
+}
+
+/// Let the other capabilities continue, after we've collected garbage
+void start_the_world() {
+  pthread_mutex_lock(&g_SchedulerLock);
+  __atomic_store_n(&g_GCRequested, 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&g_SchedulerCond);
+  pthread_mutex_unlock(&g_SchedulerLock);
+}
+
+/// The size of the blocks of the nursery each capability allocates into
+#define ALLOCATION_BLOCK_SIZE ((size_t)1 << 15)
+
+/// Hand the current capability a new block of the nursery to allocate into
+///
+/// The block has room for at least `required` bytes, unless the nursery
+/// is full, in which case we return 0.
+int allocation_block_refill(size_t required) {
+  required = align_size(required);
+  size_t size = required > ALLOCATION_BLOCK_SIZE ? required : ALLOCATION_BLOCK_SIZE;
+  uint8_t *end = g_Heap.data + g_Heap.capacity;
+  uint8_t *start = __atomic_load_n(&g_Heap.cursor, __ATOMIC_RELAXED);
+  uint8_t *block_end;
+  do {
+    size_t left = end - start;
+    if (left < required) {
+      return 0;
+    }
+    block_end = left < size ? end : start + size;
+  } while (!__atomic_compare_exchange_n(&g_Heap.cursor, &start, block_end, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  current_worker()->nursery_wasted += g_HeapLimit - g_HeapCursor;
+  g_HeapCursor = start;
+  g_HeapLimit = block_end;
+  return 1;
+}
+#endif
+
+/// The number of bytes allocated in the nursery since the last collection
+///
+/// With THREADED, the other capabilities can't be running when this is called.
+size_t nursery_allocated() {
+  size_t used = nursery_end() - g_Heap.data;
+#ifdef THREADED
+  // The parts of the blocks that didn't get used don't count
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    Worker *worker = &g_Workers[i];
+    Capability *capability = &worker->capability;
+    used -= worker->nursery_wasted +
+            (capability->heap_limit - capability->heap_cursor);
+  }
+#endif
+  return used;
+}
+
+/// Empty out the nursery, removing useless objects
+///
+/// After this function returns, the nursery has enough space to hold
+/// `extra_required` bytes.
+void collect_garbage(size_t extra_required) {
+#ifdef THREADED
+  // Usually, we just need another block of the nursery. Otherwise, whoever
+  // gets to stop the world first collects garbage, and everyone else tries
+  // again once that's done.
+  do {
+    gc_safe_point();
+    if (allocation_block_refill(extra_required)) {
+      return;
+    }
+  } while (!stop_the_world());
+#endif
+  double start_time = current_time();
+  // In the worst case, everything in the nursery survives, and we need
+  // to be able to hold all of that in the old generation
+  size_t nursery_used = nursery_end() - g_Heap.data;
+  g_Stats.bytes_allocated += nursery_allocated();
+  size_t old_free = g_OldHeap.data + g_OldHeap.capacity - g_OldHeap.cursor;
+  int major = old_free < nursery_used;
+#ifdef PROFILING
+  // Each census needs a major collection, to see every live closure
+  major = major || g_Config.heap_profile;
+#endif
+  if (major) {
+    major_collection();
+    ++g_Stats.major_collections;
+  } else {
+    minor_collection();
+    ++g_Stats.minor_collections;
+  }
+  g_ToSpace = NULL;
+#ifdef THREADED
+  g_Heap.cursor = g_Heap.data;
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    Capability *capability = &g_Workers[i].capability;
+    capability->heap_cursor = g_Heap.data;
+    capability->heap_limit = g_Heap.data;
+    g_Workers[i].nursery_wasted = 0;
+  }
+#else
+  g_HeapCursor = g_Heap.data;
+#endif
+
+  size_t residency = g_OldHeap.cursor - g_OldHeap.data;
+  if (residency > g_Stats.max_residency) {
+    g_Stats.max_residency = residency;
+  }
+
+  // Some allocations are too large to fit in the nursery, so we grow it.
+  // We can do this without moving anything, since the nursery is empty.
+  // Once that allocation is gone, we shrink the nursery back down.
+  size_t nursery_size = g_Config.nursery_size;
+#ifdef THREADED
+  // Each capability gets its share of the nursery
+  nursery_size *= g_WorkerCount;
+#endif
+  if (extra_required > nursery_size) {
+    nursery_size = extra_required;
+  }
+  heap_set_capacity(&g_Heap, nursery_size);
+  heap_decommit(&g_Heap, nursery_size);
+#ifdef THREADED
+  allocation_block_refill(extra_required);
+#else
+  g_HeapLimit = g_Heap.data + g_Heap.capacity;
+#endif
+  g_Stats.gc_time += current_time() - start_time;
+#ifdef THREADED
+  start_the_world();
+#endif
+}
+
+#ifdef THREADED
+/// Check if we're the ones evaluating a closure, because it has one of our update frames
+int black_hole_owned(uint8_t *closure) {
+  for (StackBItem *base = g_SB.base; base != g_SB.data;
+       base = base[0].as_sb_base) {
+    if (base[2].as_closure == closure) {
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif
+
+void *black_hole_entry() {
+#ifdef THREADED
+  // Unless we're evaluating this closure ourselves, another capability
+  // is, and we wait for it to be updated with its value
+  if (!black_hole_owned(g_NodeRegister)) {
+    while (read_info_table(g_NodeRegister) == &table_for_black_hole) {
+      gc_safe_point();
+      sched_yield();
+    }
+    JUMP(read_info_table(g_NodeRegister)->entry);
+  }
+#endif
+  fputs("infinite loop detected\n", stderr);
+  return NULL;
+}
+
+uint8_t *black_hole_evac(uint8_t *base) {
+  return gc_copy(base, sizeof(InfoTable *) + sizeof(uint8_t *));
+}
+
+/// A black hole only contains padding, so there's nothing to collect
+uint8_t *black_hole_scavenge(uint8_t *base) {
+  return base + sizeof(InfoTable *) + sizeof(uint8_t *);
+}
+
+InfoTable table_for_black_hole = {&black_hole_entry, &black_hole_evac,
+                                  &black_hole_scavenge
+                                  PROFILE_NAME("(black_hole)")};
+
+/// Strings shorter than this get copied when concatenated, instead of
+/// creating a rope
+static const size_t SMALL_STRING_SIZE = 64;
+
+/// The size of the header for a string: its table, and its length
+static const size_t STRING_HEADER_SIZE = sizeof(InfoTable *) + sizeof(size_t);
+
+/// The size of a rope closure: its table, length, and two children
+static const size_t ROPE_SIZE =
+    sizeof(InfoTable *) + sizeof(size_t) + 2 * sizeof(uint8_t *);
+
+/// The size of a flat string with a certain number of characters
+size_t string_size(size_t length) {
+  return align_size(STRING_HEADER_SIZE + length);
+}
+
+/// Get the number of characters in a string, or a rope
+size_t string_length(uint8_t *s) {
+  size_t length;
+  memcpy(&length, s + sizeof(InfoTable *), sizeof(size_t));
+  return length;
+}
+
+/// Get the character data of a string, which can't be a rope
+uint8_t *string_data(uint8_t *s) {
+  return s + STRING_HEADER_SIZE;
+}
+
+/// Get the left child of a rope
+uint8_t *rope_left(uint8_t *rope) {
+  return read_ptr(rope + STRING_HEADER_SIZE);
+}
+
+/// Get the right child of a rope, which is NULL if it's been flattened
+uint8_t *rope_right(uint8_t *rope) {
+  return read_ptr(rope + STRING_HEADER_SIZE + sizeof(uint8_t *));
+}
+
+/// Check if a string is an unflattened rope, looking past flattened ones
+///
+/// This returns the string to use in place of the argument.
+uint8_t *string_resolve(uint8_t *s, int *is_rope) {
+  *is_rope = 0;
+  if (read_info_table(s) != &table_for_rope) {
+    return s;
+  }
+  if (rope_right(s) == NULL) {
+    return rope_left(s);
+  }
+  *is_rope = 1;
+  return s;
+}
+
+/// Make sure the nursery has room for a string allocation
+///
+/// The strings passed in are kept alive, and possibly moved, by this.
+void string_reserve(size_t required, uint8_t **s1, uint8_t **s2) {
+  if (g_HeapCursor + required <= g_HeapLimit) {
+    return;
+  }
+  // Push the two strings on the stack, so they're roots for the GC
+  stack_reserve(2, 0);
+  g_SATop[0] = *s1;
+  g_SATop[1] = s2 == NULL ? NULL : *s2;
+  g_SATop += 2;
+
+  collect_garbage(required);
+
+  g_SATop -= 2;
+  *s1 = g_SATop[0];
+  if (s2 != NULL) {
+    *s2 = g_SATop[1];
+  }
+}
+
+/// Allocate a new string, with space for a certain number of characters
+///
+/// The nursery needs to have room for this already.
+uint8_t *string_allocate(size_t length) {
+  uint8_t *ret = g_HeapCursor;
+  PROFILE_ALLOC(&table_for_string, string_size(length));
+  write_info_table(ret, &table_for_string);
+  memcpy(ret + sizeof(InfoTable *), &length, sizeof(size_t));
+  g_HeapCursor += string_size(length);
+  return ret;
+}
+
+/// The stack of strings we use while walking over a rope
+///
+/// Ropes can be very deep, so we avoid recursion, and keep this around
+/// between walks, to avoid allocating it every time.
+static THREAD_LOCAL uint8_t **g_RopeStack = NULL;
+static THREAD_LOCAL size_t g_RopeStackCapacity = 0;
+
+/// Push a string onto the stack used for walking ropes
+void rope_stack_push(size_t *count, uint8_t *s) {
+  if (*count >= g_RopeStackCapacity) {
+    size_t capacity = 2 * g_RopeStackCapacity + 16;
+    uint8_t **data = realloc(g_RopeStack, capacity * sizeof(uint8_t *));
+    if (data == NULL) {
+      panic("Failed to grow the rope stack");
+    }
+    g_RopeStack = data;
+    g_RopeStackCapacity = capacity;
+  }
+  g_RopeStack[*count] = s;
+  ++*count;
+}
+
+/// Copy the characters of a rope into a buffer large enough to hold them
+///
+/// We fill the buffer from the end, since ropes usually come from
+/// strings being appended on the right, making their left side deep.
+/// Visiting the right child first keeps the stack small in that case.
+void rope_copy(uint8_t *rope, uint8_t *buffer) {
+  uint8_t *end = buffer + string_length(rope);
+  size_t count = 0;
+  rope_stack_push(&count, rope);
+  while (count > 0) {
+    --count;
+    int is_rope;
+    uint8_t *s = string_resolve(g_RopeStack[count], &is_rope);
+    if (is_rope) {
+      rope_stack_push(&count, rope_left(s));
+      rope_stack_push(&count, rope_right(s));
+    } else {
+      size_t length = string_length(s);
+      end -= length;
+      memcpy(end, string_data(s), length);
+    }
+  }
+}
+
+/// Turn a string into a flat string, flattening it if it's a rope
+///
+/// When flattening a rope, we remember the result inside of the rope,
+/// so that it only ever gets flattened once. With THREADED, another
+/// capability might be walking the same rope, so we can't do that.
+///
+/// This might trigger garbage collection.
+uint8_t *string_flatten(uint8_t *s) {
+  int is_rope;
+  s = string_resolve(s, &is_rope);
+  if (!is_rope) {
+    return s;
+  }
+  size_t length = string_length(s);
+  string_reserve(string_size(length), &s, NULL);
+  uint8_t *ret = string_allocate(length);
+  rope_copy(s, string_data(ret));
+
+#ifndef THREADED
+  write_ptr(s + STRING_HEADER_SIZE, ret);
+  write_ptr(s + STRING_HEADER_SIZE + sizeof(uint8_t *), NULL);
+  write_barrier(s, ret);
+#endif
+  return ret;
+}
+
+/// Concat two strings together, returning the location of the new string
+///
+/// Small strings get copied, but larger ones just create a rope, which
+/// gets flattened once we need its characters.
+///
+/// This might trigger garbage collection. In practice, we only ever do
+/// this right before jumping to a continuation, so this is ok.
+uint8_t *string_concat(uint8_t *s1, uint8_t *s2) {
+  size_t len1 = string_length(s1);
+  size_t len2 = string_length(s2);
+  if (len1 == 0) {
+    return s2;
+  }
+  if (len2 == 0) {
+    return s1;
+  }
+
+  int rope1;
+  int rope2;
+  s1 = string_resolve(s1, &rope1);
+  s2 = string_resolve(s2, &rope2);
+  size_t length = len1 + len2;
+  if (length < SMALL_STRING_SIZE && !rope1 && !rope2) {
+    string_reserve(string_size(length), &s1, &s2);
+    uint8_t *ret = string_allocate(length);
+    memcpy(string_data(ret), string_data(s1), len1);
+    memcpy(string_data(ret) + len1, string_data(s2), len2);
+    return ret;
+  }
+
+  string_reserve(ROPE_SIZE, &s1, &s2);
+  uint8_t *ret = g_HeapCursor;
+  PROFILE_ALLOC(&table_for_rope, ROPE_SIZE);
+  write_info_table(ret, &table_for_rope);
+  memcpy(ret + sizeof(InfoTable *), &length, sizeof(size_t));
+  write_ptr(ret + STRING_HEADER_SIZE, s1);
+  write_ptr(ret + STRING_HEADER_SIZE + sizeof(uint8_t *), s2);
+  g_HeapCursor += ROPE_SIZE;
+  return ret;
+}
+
+size_t with_constructor_size(uint8_t *base, size_t *items_size);
+
+/// The compact region, holding the values of CAFs
+///
+/// Once a CAF has been fully evaluated, its value never changes, and stays
+/// alive until the program exits. Instead of copying that value on every
+/// major collection, we move it in here once. Closures in here only point
+/// to each other and to static closures, so the collector treats them as
+/// static too, never moving or scavenging them.
+static Heap g_Compact = {NULL, NULL, 0, 0, 0};
+
+/// Where each closure moved into the compact region went
+///
+/// This keeps the sharing inside of a value intact while we compact it.
+/// This is a hash table with open addressing, using NULL for empty slots,
+/// and its capacity is always a power of two.
+typedef struct CompactMap {
+  uint8_t **keys;
+  uint8_t **values;
+  size_t count;
+  size_t capacity;
+} CompactMap;
+
+static CompactMap g_CompactMap = {NULL, NULL, 0, 0};
+
+/// Find the slot holding some closure, or the empty slot where it would go
+size_t compact_map_slot(uint8_t *key) {
+  uint64_t hash = (uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ULL;
+  size_t mask = g_CompactMap.capacity - 1;
+  size_t slot = (hash >> 32) & mask;
+  while (g_CompactMap.keys[slot] != NULL && g_CompactMap.keys[slot] != key) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/// Find where a closure went in the compact region, or NULL if it hasn't moved
+uint8_t *compact_map_find(uint8_t *key) {
+  if (g_CompactMap.count == 0) {
+    return NULL;
+  }
+  return g_CompactMap.values[compact_map_slot(key)];
+}
+
+/// Remember where a closure went in the compact region
+void compact_map_insert(uint8_t *key, uint8_t *value) {
+  if (2 * (g_CompactMap.count + 1) > g_CompactMap.capacity) {
+    CompactMap old = g_CompactMap;
+    g_CompactMap.capacity = old.capacity == 0 ? 64 : 2 * old.capacity;
+    g_CompactMap.keys = calloc(g_CompactMap.capacity, sizeof(uint8_t *));
+    g_CompactMap.values = calloc(g_CompactMap.capacity, sizeof(uint8_t *));
+    if (g_CompactMap.keys == NULL || g_CompactMap.values == NULL) {
+      panic("Failed to grow the compact region's table");
+    }
+    for (size_t i = 0; i < old.capacity; ++i) {
+      if (old.keys[i] != NULL) {
+        size_t slot = compact_map_slot(old.keys[i]);
+        g_CompactMap.keys[slot] = old.keys[i];
+        g_CompactMap.values[slot] = old.values[i];
+      }
+    }
+    free(old.keys);
+    free(old.values);
+  }
+  size_t slot = compact_map_slot(key);
+  g_CompactMap.keys[slot] = key;
+  g_CompactMap.values[slot] = value;
+  ++g_CompactMap.count;
+}
+
+/// Forget about every closure we've moved
+///
+/// A large value leaves a large table behind, which we give back if the
+/// next values are small, so that clearing it doesn't get expensive.
+void compact_map_clear() {
+  if (g_CompactMap.count == 0) {
+    return;
+  }
+  if (g_CompactMap.capacity > 64 &&
+      8 * g_CompactMap.count < g_CompactMap.capacity) {
+    free(g_CompactMap.keys);
+    free(g_CompactMap.values);
+    g_CompactMap.keys = NULL;
+    g_CompactMap.values = NULL;
+    g_CompactMap.capacity = 0;
+  } else {
+    memset(g_CompactMap.keys, 0, g_CompactMap.capacity * sizeof(uint8_t *));
+    memset(g_CompactMap.values, 0,
+           g_CompactMap.capacity * sizeof(uint8_t *));
+  }
+  g_CompactMap.count = 0;
+}
+
+/// Make room for a closure at the end of the compact region
+uint8_t *compact_allocate(size_t size) {
+  size_t used = g_Compact.cursor - g_Compact.data;
+  heap_commit(&g_Compact, used + size);
+  uint8_t *ret = g_Compact.cursor;
+  g_Compact.cursor += size;
+  return ret;
+}
+
+/// Find the size of a closure in the compact region, and where its pointers are
+///
+/// Only ints, strings, and constructors ever end up in there.
+size_t compact_layout(uint8_t *base, uint8_t **fields, size_t *field_count) {
+  InfoTable *table = read_info_table(base);
+  *fields = base + sizeof(InfoTable *);
+  *field_count = 0;
+  if (table == &table_for_with_string) {
+    *field_count = 1;
+    return sizeof(InfoTable *) + sizeof(uint8_t *);
+  }
+  if (table == &table_for_string) {
+    return string_size(string_length(base));
+  }
+  if (table == &table_for_with_constructor) {
+    size_t items_size;
+    size_t size = with_constructor_size(base, &items_size);
+    *fields = base + size - items_size;
+    *field_count = items_size / sizeof(uint8_t *);
+    return size;
+  }
+  return sizeof(InfoTable *) + sizeof(int64_t);
+}
+
+/// Get the pointer to use for a closure in the compact region
+///
+/// Like the collector, we tag the pointers to constructors.
+uint8_t *compact_pointer(uint8_t *base) {
+  if (read_info_table(base) != &table_for_with_constructor) {
+    return base;
+  }
+  uint16_t tag;
+  memcpy(&tag, base + sizeof(InfoTable *), sizeof(uint16_t));
+  return tag_constructor(base, tag);
+}
+
+/// Copy the characters of a rope into the compact region
+///
+/// This is like `rope_copy`, except that some of the strings inside of the
+/// rope might have been moved into the compact region already, as part of
+/// a CAF we compacted earlier.
+void compact_rope_copy(uint8_t *rope, uint8_t *buffer) {
+  uint8_t *end = buffer + string_length(rope);
+  size_t count = 0;
+  rope_stack_push(&count, rope);
+  while (count > 0) {
+    --count;
+    uint8_t *s = g_RopeStack[count];
+    InfoTable *table = read_info_table(s);
+    if (table == &table_for_already_evac) {
+      rope_stack_push(&count, already_evac(s));
+    } else if (table == &table_for_rope && rope_right(s) == NULL) {
+      rope_stack_push(&count, rope_left(s));
+    } else if (table == &table_for_rope) {
+      rope_stack_push(&count, rope_left(s));
+      rope_stack_push(&count, rope_right(s));
+    } else {
+      size_t length = string_length(s);
+      end -= length;
+      memcpy(end, string_data(s), length);
+    }
+  }
+}
+
+/// Find the pointer to use for part of a value moved into the compact region
+///
+/// Closures in the heap get copied over, along with the indirections in
+/// front of them, and ropes get flattened, so that nothing in the compact
+/// region ever gets written to again. This returns NULL if the closure
+/// isn't fully evaluated yet.
+uint8_t *compact_closure(uint8_t *closure) {
+  for (;;) {
+    uint8_t *base = untag(closure);
+    // Static closures, and those already compacted, can be pointed to as is
+    if (!nursery_contains(base) && !heap_contains(&g_OldHeap, base)) {
+      return closure;
+    }
+    InfoTable *table = read_info_table(base);
+    if (table == &table_for_indirection || table == &table_for_already_evac) {
+      closure = read_ptr(base + sizeof(InfoTable *));
+      continue;
+    }
+    if (table == &table_for_rope && rope_right(base) == NULL) {
+      closure = rope_left(base);
+      continue;
+    }
+    uint8_t *copy = compact_map_find(base);
+    if (copy != NULL) {
+      return compact_pointer(copy);
+    }
+    if (table == &table_for_rope) {
+      size_t length = string_length(base);
+      copy = compact_allocate(string_size(length));
+      write_info_table(copy, &table_for_string);
+      memcpy(copy + sizeof(InfoTable *), &length, sizeof(size_t));
+      compact_rope_copy(base, string_data(copy));
+    } else if (table == &table_for_with_int ||
+               table == &table_for_with_string ||
+               table == &table_for_string ||
+               table == &table_for_with_constructor) {
+      uint8_t *fields;
+      size_t field_count;
+      size_t size = compact_layout(base, &fields, &field_count);
+      copy = compact_allocate(size);
+      memcpy(copy, base, size);
+    } else {
+      return NULL;
+    }
+    compact_map_insert(base, copy);
+    return compact_pointer(copy);
+  }
+}
+
+/// Move a fully evaluated value into the compact region, returning its new location
+///
+/// If some part of the value still needs to be evaluated, nothing moves,
+/// and this returns NULL. Otherwise, the old closures get forwarded to
+/// their copies, so this can only happen while collecting the old
+/// generation, or once the program is done running.
+uint8_t *compact(uint8_t *closure) {
+  uint8_t *start = g_Compact.cursor;
+  uint8_t *ret = compact_closure(closure);
+  // Like a collection, we scan over the closures we've copied, copying
+  // whatever they point to, until we catch up with the end of the region.
+  uint8_t *scan = start;
+  while (ret != NULL && scan < g_Compact.cursor) {
+    uint8_t *fields;
+    size_t field_count;
+    size_t size = compact_layout(scan, &fields, &field_count);
+    for (size_t i = 0; i < field_count; ++i) {
+      uint8_t *field = fields + i * sizeof(uint8_t *);
+      uint8_t *value = compact_closure(read_ptr(field));
+      if (value == NULL) {
+        ret = NULL;
+        break;
+      }
+      write_ptr(field, value);
+    }
+    scan += size;
+  }
+  if (ret == NULL) {
+    g_Compact.cursor = start;
+  } else {
+    for (size_t i = 0; i < g_CompactMap.capacity; ++i) {
+      if (g_CompactMap.keys[i] != NULL) {
+        gc_forward(g_CompactMap.keys[i],
+                   compact_pointer(g_CompactMap.values[i]));
+      }
+    }
+  }
+  compact_map_clear();
+  return ret;
+}
+
+/// Move the value of every CAF that's done evaluating into the compact region
+///
+/// The CAFs whose values aren't complete yet get another try the next time.
+void compact_cafs() {
+  for (CAFCell *p = g_CAFListHead; p != NULL; p = p->next) {
+    uint8_t *value = compact(p->closure);
+    if (value != NULL) {
+      p->closure = value;
+    }
+  }
+}
+
+/// Check if a flat string is equal to some literal characters
+int string_equals(uint8_t *s, const char *data, size_t length) {
+  return string_length(s) == length &&
+         memcmp(string_data(s), data, length) == 0;
+}
+
+/// The size of the buffer holding the output of the program
+#define OUTPUT_BUFFER_SIZE ((size_t)1 << 16)
+
+/// The output of the program, which hasn't been written out yet
+///
+/// Going through stdio for each value printed means parsing a format string,
+/// and taking a lock, every time, so we buffer the output ourselves instead.
+static char g_OutputBuffer[OUTPUT_BUFFER_SIZE];
+
+/// The number of bytes in the output buffer
+static size_t g_OutputLength = 0;
+
+#ifdef THREADED
+/// The lock protecting the output buffer
+///
+/// Only the main thread prints values, but a spark can still print an error.
+static pthread_mutex_t g_OutputLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/// Start writing to the output buffer
+void output_lock() {
+#ifdef THREADED
+  pthread_mutex_lock(&g_OutputLock);
+#endif
+}
+
+/// Finish writing to the output buffer
+void output_unlock() {
+#ifdef THREADED
+  pthread_mutex_unlock(&g_OutputLock);
+#endif
+}
+
+/// Write some bytes to stdout directly, retrying if only some of them get written
+void output_write_all(const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(STDOUT_FILENO, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // There's no one to complain to, if we can't write our output
+      return;
+    }
+    data += written;
+    length -= written;
+  }
+}
+
+/// Write out everything in the output buffer, which we've already locked
+void output_flush_locked() {
+  output_write_all(g_OutputBuffer, g_OutputLength);
+  g_OutputLength = 0;
+}
+
+/// Write out everything in the output buffer
+void output_flush() {
+  output_lock();
+  output_flush_locked();
+  output_unlock();
+}
+
+/// Add some bytes to the output
+///
+/// Writes too big to fit in the buffer skip it entirely.
+/// The output buffer needs to be locked while calling this.
+void output_write(const char *data, size_t length) {
+  if (g_OutputLength + length > OUTPUT_BUFFER_SIZE) {
+    output_flush_locked();
+    if (length > OUTPUT_BUFFER_SIZE) {
+      output_write_all(data, length);
+      return;
+    }
+  }
+  memcpy(g_OutputBuffer + g_OutputLength, data, length);
+  g_OutputLength += length;
+}
+
+/// Finish a line of output
+///
+/// In unbuffered mode, this is where the output actually gets written.
+void output_end_line() {
+  output_write("\n", 1);
+  if (g_Config.unbuffered_output) {
+    output_flush_locked();
+  }
+}
+
+/// Print out an int, in decimal, followed by a newline
+void print_int(int64_t x) {
+  // Enough for the 19 digits of the largest magnitude, and a sign
+  char digits[20];
+  char *start = digits + sizeof(digits);
+  // Negating the smallest int would overflow, but its magnitude fits here
+  uint64_t magnitude = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  do {
+    *--start = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (x < 0) {
+    *--start = '-';
+  }
+  output_lock();
+  output_write(start, digits + sizeof(digits) - start);
+  output_end_line();
+  output_unlock();
+}
+
+/// Print out some characters, followed by a newline
+void print_line(const char *line) {
+  output_lock();
+  output_write(line, strlen(line));
+  output_end_line();
+  output_unlock();
+}
+
+/// Print out a string, followed by a newline
+///
+/// This might trigger garbage collection, since ropes need to be flattened.
+void string_print(uint8_t *s) {
+  s = string_flatten(s);
+  output_lock();
+  output_write((const char *)string_data(s), string_length(s));
+  output_end_line();
+  output_unlock();
+}
+
+/// The evacuation function for strings
+uint8_t *string_evac(uint8_t *base) {
+  return gc_copy(base, string_size(string_length(base)));
+}
+
+/// Strings don't point to anything, so scavenging just skips over them
+uint8_t *string_scavenge(uint8_t *base) {
+  return base + string_size(string_length(base));
+}
+
+/// The evacuation function for ropes
+///
+/// A flattened rope can be replaced by its flattened string.
+uint8_t *rope_evac(uint8_t *base) {
+  if (rope_right(base) == NULL) {
+    return evacuate(rope_left(base));
+  }
+  return gc_copy(base, ROPE_SIZE);
+}
+
+/// The scavenge function for ropes, collecting both children
+uint8_t *rope_scavenge(uint8_t *base) {
+  uint8_t *cursor = base + STRING_HEADER_SIZE;
+  for (int i = 0; i < 2; ++i) {
+    uint8_t *root = read_ptr(cursor);
+    collect_root(&root);
+    memcpy(cursor, &root, sizeof(uint8_t *));
+    cursor += sizeof(uint8_t *);
+  }
+  return cursor;
+}
+
+/// Save the current contents of the B stack
+void save_SB() {
+  g_SBTop[0].as_sb_base = g_SB.base;
+  g_SB.base = g_SBTop;
+  ++g_SBTop;
+}
+
+/// Save the current contents of the A stack
+void save_SA() {
+  g_SBTop[0].as_sa_base = g_SA.base;
+  g_SA.base = g_SATop;
+  ++g_SBTop;
+}
+
+/// The size of the header for a partial application
+///
+/// This holds its table, the function to call, and the number of saved
+/// items on each stack, padded so that those items stay aligned.
+static const size_t PARTIAL_APPLICATION_HEADER_SIZE =
+    sizeof(InfoTable *) + sizeof(CodeLabel) + 2 * sizeof(uint16_t) +
+    sizeof(uint32_t);
+
+/// The entry function for partial applications.
+void *partial_application_entry(void) {
+  DEBUG_PRINT("%s\n", __func__);
+  uint8_t *cursor = g_NodeRegister + sizeof(InfoTable *);
+
+  CodeLabel ret;
+  memcpy(&ret, cursor, sizeof(CodeLabel));
+  cursor += sizeof(CodeLabel);
+
+  uint16_t b_items;
+  memcpy(&b_items, cursor, sizeof(uint16_t));
+  cursor += sizeof(uint16_t);
+  uint16_t a_items;
+  memcpy(&a_items, cursor, sizeof(uint16_t));
+  cursor = g_NodeRegister + PARTIAL_APPLICATION_HEADER_SIZE;
+
+  // Push saved stack arguments
+  stack_reserve(a_items, b_items);
+  size_t b_size = b_items * sizeof(StackBItem);
+  memcpy(g_SBTop, cursor, b_size);
+  g_SBTop += b_items;
+  cursor += b_size;
+  size_t a_size = a_items * sizeof(uint8_t *);
+  memcpy(g_SATop, cursor, a_size);
+  g_SATop += a_items;
+
+  // Jump to saved function
+  JUMP(ret);
+}
+
+/// Calculate the size of a partial application closure, and of its A items
+size_t partial_application_size(uint8_t *base, size_t *a_size) {
   uint8_t *items_base = base + sizeof(InfoTable *) + sizeof(CodeLabel);
 
-  // Get the number of items, in order to calculate size
   uint16_t b_items;
   memcpy(&b_items, items_base, sizeof(uint16_t));
   size_t b_size = b_items * sizeof(StackBItem);
   uint16_t a_items;
   memcpy(&a_items, items_base + sizeof(uint16_t), sizeof(uint16_t));
-  size_t a_size = a_items * sizeof(uint8_t *);
+  *a_size = a_items * sizeof(uint8_t *);
+
+  return PARTIAL_APPLICATION_HEADER_SIZE + b_size + *a_size;
+}
+
+/// THe evacuation function for a partial application
+uint8_t *partial_application_evac(uint8_t *base) {
+  size_t a_size;
+  return gc_copy(base, partial_application_size(base, &a_size));
+}
+
+/// The scavenge function for a partial application
+///
+/// The saved A items are pointers, which we need to collect.
+uint8_t *partial_application_scavenge(uint8_t *base) {
+  size_t a_size;
+  size_t total_size = partial_application_size(base, &a_size);
 
-  // Move over the closure
-  size_t total_size = sizeof(InfoTable *) + sizeof(CodeLabel) +
-                      2 * sizeof(uint16_t) + b_size + a_size;
-  uint8_t *new_base = heap_cursor();
-  heap_write(base, total_size);
-  // Replace the old closure with an evacuation indirection
-  memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable *));
-  memcpy(base + sizeof(InfoTable *), &new_base, sizeof(uint8_t *));
-
-  // Collect the roots recursively
-  for (uint8_t *cursor = new_base + total_size - a_size;
-       cursor < new_base + total_size; cursor += sizeof(uint8_t *)) {
-    uint8_t *root;
-    memcpy(&root, cursor, sizeof(uint8_t *));
+  uint8_t *end = base + total_size;
+  for (uint8_t *cursor = end - a_size; cursor < end;
+       cursor += sizeof(uint8_t *)) {
+    uint8_t *root = read_ptr(cursor);
     collect_root(&root);
     memcpy(cursor, &root, sizeof(uint8_t *));
   }
 
-  return new_base;
+  return end;
 }
 
 /// The table we use when creating a partial application closure
 InfoTable table_for_partial_application = {&partial_application_entry,
-                                           &partial_application_evac};
+                                           &partial_application_evac,
+                                           &partial_application_scavenge
+                                           PROFILE_NAME("(partial_application)")};
 
 /// The entry function for an indirection just enters the its pointee
-void *indirection_entry() {
+void *indirection_entry(void) {
   DEBUG_PRINT("%s\n", __func__);
-  g_NodeRegister = read_ptr(g_NodeRegister + sizeof(InfoTable *));
-  return read_info_table(g_NodeRegister)->entry;
+  // Indirections can point to tagged constructors
+  g_NodeRegister = untag(read_ptr(g_NodeRegister + sizeof(InfoTable *)));
+  JUMP(read_info_table(g_NodeRegister)->entry);
 }
 
 /// The evacuation function for an indirection.
@@ -450,137 +2508,234 @@ void *indirection_entry() {
 /// a new indirection in the heap.
 uint8_t *indirection_evac(uint8_t *base) {
   uint8_t *closure = read_ptr(base + sizeof(InfoTable *));
-  uint8_t *new_base = read_info_table(closure)->evac(closure);
-  memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable *));
-  memcpy(base + sizeof(InfoTable *), &new_base, sizeof(uint8_t *));
+  uint8_t *new_base = evacuate(closure);
+  gc_forward(base, new_base);
   return new_base;
 }
 
+/// The scavenge function for an indirection
+///
+/// Indirections never get moved, but an old closure can be updated to
+/// become an indirection, in which case we scavenge it as part of the
+/// remembered set.
+uint8_t *indirection_scavenge(uint8_t *base) {
+  uint8_t *cursor = base + sizeof(InfoTable *);
+  uint8_t *root = read_ptr(cursor);
+  collect_root(&root);
+  memcpy(cursor, &root, sizeof(uint8_t *));
+  return cursor + sizeof(uint8_t *);
+}
+
 /// The table we use for an indirection closure
-InfoTable table_for_indirection = {&indirection_entry, &indirection_evac};
+InfoTable table_for_indirection = {&indirection_entry, &indirection_evac,
+                                   &indirection_scavenge
+                                   PROFILE_NAME("(indirection)")};
 InfoTable *table_pointer_for_indirection = &table_for_indirection;
 
-InfoTable table_for_caf_cell = {&indirection_entry, &static_evac};
+InfoTable table_for_caf_cell = {&indirection_entry, &static_evac, NULL};
+
+#ifdef THREADED
+/// The lock making sure that only one capability starts evaluating each CAF
+static pthread_mutex_t g_CAFLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/// Start evaluating a CAF, by making its cell point to a new black hole
+///
+/// The CAF is still unevaluated if its cell points to `unevaluated`. Otherwise,
+/// another capability got to it first, and we return NULL, so that we can
+/// enter the cell again, and wait for that capability instead.
+uint8_t *claim_caf(CAFCell *cell, uint8_t *unevaluated, uint8_t *black_hole) {
+#ifdef THREADED
+  pthread_mutex_lock(&g_CAFLock);
+#endif
+  uint8_t *claimed = NULL;
+  if (cell->closure == unevaluated) {
+    write_info_table(black_hole, &table_for_black_hole);
+    // For padding purposes
+    write_ptr(black_hole + sizeof(InfoTable *), NULL);
+#ifdef THREADED
+    __atomic_store_n(&cell->closure, black_hole, __ATOMIC_RELEASE);
+#else
+    cell->closure = black_hole;
+#endif
+    *g_CAFListLast = cell;
+    g_CAFListLast = &cell->next;
+    claimed = black_hole;
+  }
+#ifdef THREADED
+  pthread_mutex_unlock(&g_CAFLock);
+#endif
+  return claimed;
+}
 
 /// The code that gets called when we hit an update frame when we're expecting
 /// a case continuation instead.
-void *update_constructor() {
+void *update_constructor(void) {
   // At this point, the topmost part of our update frame has been lobbed off,
   // now we need to chop off the rest, and also go to the "real" update
   // continuation
-  g_SB.top -= 4;
+  g_SBTop -= 4;
 
-  uint8_t *closure = g_SB.top[3].as_closure;
+  uint8_t *closure = g_SBTop[3].as_closure;
   // If we already have an updating thunk, just make us point to
   // to that one instead.
   if (g_ConstrUpdateRegister != NULL) {
-    memcpy(closure, &table_pointer_for_indirection, sizeof(InfoTable *));
-    memcpy(closure + sizeof(InfoTable *), &g_ConstrUpdateRegister,
-           sizeof(uint8_t *));
+    update_with_indirection(closure, g_ConstrUpdateRegister);
   } else {
     g_ConstrUpdateRegister = closure;
   }
-  g_SA.base = g_SB.top[2].as_sa_base;
-  g_SB.base = g_SB.top[1].as_sb_base;
-  return g_SB.top[0].as_code;
+  g_SA.base = g_SBTop[2].as_sa_base;
+  g_SB.base = g_SBTop[1].as_sb_base;
+  JUMP(g_SBTop[0].as_code);
+}
+
+/// The code that gets called when we return a value to an evaluation frame
+///
+/// These frames have the same layout as update frames, but there's nothing
+/// to update, so we just remove the frame, and keep returning.
+void *evaluation_frame(void) {
+  g_SBTop -= UPDATE_FRAME_SIZE;
+  g_SA.base = g_SBTop[2].as_sa_base;
+  g_SB.base = g_SBTop[1].as_sb_base;
+  JUMP(g_SBTop[0].as_code);
 }
 
-void *with_int_entry() {
+void *with_int_entry(void) {
   DEBUG_PRINT("%s\n", __func__);
   g_IntRegister = read_int(g_NodeRegister + sizeof(InfoTable *));
-  --g_SB.top;
-  return g_SB.top[0].as_code;
+  g_ReturnKindRegister = RETURN_INT;
+  --g_SBTop;
+  JUMP(g_SBTop[0].as_code);
 }
 
 uint8_t *with_int_evac(uint8_t *base) {
-  uint8_t *new_base = heap_cursor();
-  heap_write(base, sizeof(InfoTable *) + sizeof(int64_t));
+  return gc_copy(base, sizeof(InfoTable *) + sizeof(int64_t));
+}
 
-  memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable *));
-  memcpy(base + sizeof(InfoTable *), &new_base, sizeof(uint8_t *));
-  return new_base;
+uint8_t *with_int_scavenge(uint8_t *base) {
+  return base + sizeof(InfoTable *) + sizeof(int64_t);
 }
 
-InfoTable table_for_with_int = {&with_int_entry, &with_int_evac};
+InfoTable table_for_with_int = {&with_int_entry, &with_int_evac,
+                                &with_int_scavenge
+                                PROFILE_NAME("(with_int)")};
 
+InfoTable table_for_shared_int = {&with_int_entry, &static_evac, NULL};
+
+/// The preboxed ints between `SHARED_INT_MIN` and `SHARED_INT_MAX`
+///
+/// Small ints are very common, so instead of each thunk evaluating to one
+/// holding its own copy, they can all point to the same closure. This also
+/// means that the garbage collector can drop the thunk entirely, instead of
+/// having to copy it.
+SharedInt g_SharedInts[SHARED_INT_MAX - SHARED_INT_MIN + 1];
+
+/// Update a closure with an int
+///
+/// No write barrier is needed, since an int doesn't point anywhere,
+/// and the shared closures don't live in the nursery.
 void update_with_int() {
-  InfoTable *table = &table_for_with_int;
-  memcpy(g_ConstrUpdateRegister, &table, sizeof(InfoTable *));
-  memcpy(g_ConstrUpdateRegister + sizeof(InfoTable *), &g_IntRegister,
-         sizeof(int64_t));
+  if (g_IntRegister >= SHARED_INT_MIN && g_IntRegister <= SHARED_INT_MAX) {
+    update_with_indirection(g_ConstrUpdateRegister, shared_int(g_IntRegister));
+    return;
+  }
+  write_int(g_ConstrUpdateRegister + sizeof(InfoTable *), g_IntRegister);
+  publish_info_table(g_ConstrUpdateRegister, &table_for_with_int);
 }
 
-void *with_string_entry() {
+void *with_string_entry(void) {
   DEBUG_PRINT("%s\n", __func__);
   g_StringRegister = read_ptr(g_NodeRegister + sizeof(InfoTable *));
-  --g_SB.top;
-  return g_SB.top[0].as_code;
+  g_ReturnKindRegister = RETURN_STRING;
+  --g_SBTop;
+  JUMP(g_SBTop[0].as_code);
 }
 
 uint8_t *with_string_evac(uint8_t *base) {
-  uint8_t *new_base = heap_cursor();
-  heap_write(base, sizeof(InfoTable *) + sizeof(uint8_t *));
-
-  memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable *));
-  memcpy(base + sizeof(InfoTable *), &new_base, sizeof(uint8_t *));
+  return gc_copy(base, sizeof(InfoTable *) + sizeof(uint8_t *));
+}
 
-  uint8_t *cursor = new_base + sizeof(InfoTable *);
-  uint8_t *root;
-  memcpy(&root, cursor, sizeof(uint8_t *));
+uint8_t *with_string_scavenge(uint8_t *base) {
+  uint8_t *cursor = base + sizeof(InfoTable *);
+  uint8_t *root = read_ptr(cursor);
   collect_root(&root);
   memcpy(cursor, &root, sizeof(uint8_t *));
-
-  return new_base;
+  return cursor + sizeof(uint8_t *);
 }
 
-InfoTable table_for_with_string = {&with_string_entry, &with_string_evac};
+InfoTable table_for_with_string = {&with_string_entry, &with_string_evac,
+                                   &with_string_scavenge
+                                   PROFILE_NAME("(with_string)")};
 
 void update_with_string() {
-  InfoTable *table = &table_for_with_string;
-  memcpy(g_ConstrUpdateRegister, &table, sizeof(InfoTable *));
-  memcpy(g_ConstrUpdateRegister + sizeof(InfoTable *), &g_StringRegister,
-         sizeof(uint8_t *));
+  write_ptr(g_ConstrUpdateRegister + sizeof(InfoTable *), g_StringRegister);
+  publish_info_table(g_ConstrUpdateRegister, &table_for_with_string);
+  write_barrier(g_ConstrUpdateRegister, g_StringRegister);
 }
 
-void *with_constructor_entry() {
-  DEBUG_PRINT("%s\n", __func__);
-  uint8_t *cursor = g_NodeRegister + sizeof(InfoTable *);
-
-  memcpy(&g_TagRegister, cursor, sizeof(uint16_t));
-  cursor += sizeof(uint16_t);
+/// Push the items of a constructor closure, and set the constructor registers
+///
+/// This is how a constructor gets returned to a case continuation, which
+/// we can do directly, without entering the constructor, if we have
+/// a tagged pointer to it.
+void return_constructor(uint8_t *closure) {
+  uintptr_t tag = pointer_tag(closure);
+  uint8_t *base = untag(closure);
+  if (tag != 0 && tag != TAG_MASK) {
+    g_TagRegister = tag - 1;
+  } else {
+    memcpy(&g_TagRegister, base + sizeof(InfoTable *), sizeof(uint16_t));
+  }
 
   uint16_t items;
-  memcpy(&items, cursor, sizeof(uint16_t));
-  cursor += sizeof(uint16_t);
+  memcpy(&items, base + sizeof(InfoTable *) + sizeof(uint16_t),
+         sizeof(uint16_t));
   g_ConstructorArgCountRegister = items;
 
-  memcpy(g_SA.top, cursor, items * sizeof(uint8_t *));
-  g_SA.top += items;
+  stack_reserve(items, 0);
+  memcpy(g_SATop, base + CONSTRUCTOR_HEADER_SIZE, items * sizeof(uint8_t *));
+  g_SATop += items;
+}
 
-  --g_SB.top;
-  return g_SB.top[0].as_code;
+void *with_constructor_entry(void) {
+  DEBUG_PRINT("%s\n", __func__);
+  return_constructor(g_NodeRegister);
+  g_ReturnKindRegister = RETURN_CONSTRUCTOR;
+  --g_SBTop;
+  JUMP(g_SBTop[0].as_code);
 }
 
-uint8_t *with_constructor_evac(uint8_t *base) {
+/// Calculate the size of a constructor closure, and of its items
+size_t with_constructor_size(uint8_t *base, size_t *items_size) {
   uint8_t *items_base = base + sizeof(InfoTable *) + sizeof(uint16_t);
 
   uint16_t items;
   memcpy(&items, items_base, sizeof(uint16_t));
-  size_t items_size = items * sizeof(uint8_t *);
+  *items_size = items * sizeof(uint8_t *);
 
-  size_t total_size = sizeof(InfoTable *) + 2 * sizeof(uint16_t) + items_size;
+  return CONSTRUCTOR_HEADER_SIZE + *items_size;
+}
 
-  // Move over this closure
-  uint8_t *new_base = heap_cursor();
-  heap_write(base, total_size);
-  // Replace this closure with an evacuation indirection
-  memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable *));
-  memcpy(base + sizeof(InfoTable *), &new_base, sizeof(uint8_t *));
+/// The evacuation function for a constructor
+///
+/// Since we know that this closure is evaluated, we can return a tagged
+/// pointer to the new closure, even if the old pointer wasn't tagged.
+uint8_t *with_constructor_evac(uint8_t *base) {
+  size_t items_size;
+  uint8_t *new_base = gc_move(base, with_constructor_size(base, &items_size));
+  uint16_t tag;
+  memcpy(&tag, new_base + sizeof(InfoTable *), sizeof(uint16_t));
+  uint8_t *tagged = tag_constructor(new_base, tag);
+  // Later pointers to the old closure get the tagged pointer too
+  gc_forward(base, tagged);
+  return tagged;
+}
 
-  // Evacuate the roots recursively
-  uint8_t *cursor = new_base + sizeof(InfoTable *) + sizeof(uint16_t);
+uint8_t *with_constructor_scavenge(uint8_t *base) {
+  size_t items_size;
+  size_t total_size = with_constructor_size(base, &items_size);
 
-  uint8_t *end = new_base + total_size;
+  uint8_t *end = base + total_size;
   for (uint8_t *cursor = end - items_size; cursor < end;
        cursor += sizeof(uint8_t *)) {
     uint8_t *root = read_ptr(cursor);
@@ -588,29 +2743,96 @@ uint8_t *with_constructor_evac(uint8_t *base) {
     memcpy(cursor, &root, sizeof(uint8_t *));
   }
 
-  return new_base;
+  return end;
 }
 
 InfoTable table_for_with_constructor = {&with_constructor_entry,
-                                        &with_constructor_evac};
+                                        &with_constructor_evac,
+                                        &with_constructor_scavenge
+                                        PROFILE_NAME("(with_constructor)")};
 InfoTable *table_pointer_for_with_constructor = &table_for_with_constructor;
 
+/// Write the header of a constructor closure, returning a tagged pointer to it
+///
+/// The items of the constructor need to be written after this.
+uint8_t *write_constructor(uint8_t *base, uint16_t tag, uint16_t items) {
+  write_info_table(base, &table_for_with_constructor);
+  memcpy(base + sizeof(InfoTable *), &tag, sizeof(uint16_t));
+  memcpy(base + sizeof(InfoTable *) + sizeof(uint16_t), &items,
+         sizeof(uint16_t));
+  memset(base + sizeof(InfoTable *) + 2 * sizeof(uint16_t), 0,
+         sizeof(uint32_t));
+  return tag_constructor(base, tag);
+}
+
+InfoTable table_for_shared_constructor = {&with_constructor_entry,
+                                          &static_evac, NULL};
+
+/// A shared closure for each nullary constructor, like `True` or `Nothing`
+///
+/// Tags are only unique within a type, so one closure with a given tag
+/// can stand in for the nullary constructor of any type with that tag.
+SharedConstructor g_SharedConstructors[SHARED_CONSTRUCTOR_COUNT];
+
+/// Fill in the tables of shared closures
+void setup_shared_closures() {
+  for (int64_t i = SHARED_INT_MIN; i <= SHARED_INT_MAX; ++i) {
+    SharedInt *shared = &g_SharedInts[i - SHARED_INT_MIN];
+    shared->table = &table_for_shared_int;
+    shared->value = i;
+  }
+  for (uint16_t tag = 0; tag < SHARED_CONSTRUCTOR_COUNT; ++tag) {
+    SharedConstructor *shared = &g_SharedConstructors[tag];
+    shared->table = &table_for_shared_constructor;
+    shared->tag = tag;
+    shared->items = 0;
+    shared->padding = 0;
+  }
+}
+
+/// Update a closure with a constructor
+///
+/// The closure becomes an indirection holding a tagged pointer, so
+/// after the next collection, everything pointing to it will have that
+/// tagged pointer instead.
 void update_with_constructor() {
   uint16_t items = g_ConstructorArgCountRegister;
+  uint8_t *indirection;
+  if (items == 0 && g_TagRegister < SHARED_CONSTRUCTOR_COUNT) {
+    update_with_indirection(g_ConstrUpdateRegister,
+                            shared_constructor(g_TagRegister));
+    return;
+  }
+
   size_t items_size = items * sizeof(uint8_t *);
-  size_t required = sizeof(InfoTable *) + 2 * sizeof(uint16_t) + items_size;
+  size_t required = CONSTRUCTOR_HEADER_SIZE + items_size;
   heap_reserve(required);
 
-  uint8_t *indirection = heap_cursor();
-  heap_write_info_table(&table_for_with_constructor);
-  heap_write_uint16(g_TagRegister);
-  heap_write_uint16(items);
-  heap_write(g_SA.top - items, items_size);
+  uint8_t *base = heap_cursor();
+  PROFILE_ALLOC(&table_for_with_constructor, required);
+  indirection = write_constructor(base, g_TagRegister, items);
+  g_HeapCursor += CONSTRUCTOR_HEADER_SIZE;
+  heap_write(g_SATop - items, items_size);
+
+  update_with_indirection(g_ConstrUpdateRegister, indirection);
+}
 
-  memcpy(g_ConstrUpdateRegister, &table_pointer_for_indirection,
-         sizeof(InfoTable *));
-  memcpy(g_ConstrUpdateRegister + sizeof(InfoTable *), &indirection,
-         sizeof(uint8_t *));
+/// Update a closure with whatever kind of value we're returning
+///
+/// This is used by the continuations that can get any kind of value.
+/// Functions have already updated their closures with partial applications.
+void update_with_value() {
+  switch (g_ReturnKindRegister) {
+  case RETURN_INT:
+    update_with_int();
+    break;
+  case RETURN_STRING:
+    update_with_string();
+    break;
+  case RETURN_CONSTRUCTOR:
+    update_with_constructor();
+    break;
+  }
 }
 
 /// Check if we need to create an application update.
@@ -622,16 +2844,28 @@ void update_with_constructor() {
 CodeLabel check_application_update(int64_t arg_count, CodeLabel current) {
   // NOTE: Be very careful to not create any temporaries that might get
   // invalidated by garbage collection before calling `h_reserve`!
-  int64_t args = g_SA.top - g_SA.base;
+  int64_t args = g_SATop - g_SA.base;
   if (args >= arg_count) {
     return NULL;
   }
 
-  uint16_t b_items = g_SB.top - (g_SB.base + 4);
-  uint16_t a_items = g_SA.top - g_SA.base;
+  // An evaluation frame doesn't need to be updated, so we return the function
+  // straight to the continuation below it, without the arguments we got
+  if (g_SB.base[3].as_code != &update_constructor) {
+    g_SATop = g_SA.base;
+    g_SBTop = g_SB.base;
+    g_SA.base = g_SBTop[1].as_sa_base;
+    g_SB.base = g_SBTop[0].as_sb_base;
+    g_ReturnKindRegister = RETURN_FUNCTION;
+    --g_SBTop;
+    return g_SBTop[0].as_code;
+  }
+
+  uint16_t b_items = g_SBTop - (g_SB.base + 4);
+  uint16_t a_items = g_SATop - g_SA.base;
   size_t b_size = b_items * sizeof(StackBItem);
   size_t a_size = a_items * sizeof(uint8_t *);
-  size_t required = sizeof(InfoTable *) + sizeof(uint8_t *) + a_size + b_size;
+  size_t required = PARTIAL_APPLICATION_HEADER_SIZE + a_size + b_size;
   heap_reserve(required);
 
   // Pull out what we need from the update frame
@@ -643,21 +2877,23 @@ CodeLabel check_application_update(int64_t arg_count, CodeLabel current) {
   for (size_t i = 0; i < b_items; ++i) {
     g_SB.base[i] = g_SB.base[i + 4];
   }
-  g_SB.top -= 4;
+  g_SBTop -= 4;
 
   // Construct the new closure
   uint8_t *indirection = heap_cursor();
+  PROFILE_ALLOC(&table_for_partial_application, required);
   heap_write_info_table(&table_for_partial_application);
   heap_write(&current, sizeof(CodeLabel));
   heap_write_uint16(b_items);
   heap_write_uint16(a_items);
+  uint32_t padding = 0;
+  heap_write(&padding, sizeof(uint32_t));
   // NOTE: this works in my mental model of C, but I am not a lawyer
   // heap_write uses memcpy under the hood
   heap_write(g_SB.base, b_size);
   heap_write(g_SA.base, a_size);
 
-  memcpy(closure, &table_pointer_for_indirection, sizeof(InfoTable *));
-  memcpy(closure + sizeof(InfoTable *), &indirection, sizeof(uint8_t *));
+  update_with_indirection(closure, indirection);
 
   // Restoring old stack bases
   g_SA.base = saved_SA_base;
@@ -667,38 +2903,979 @@ CodeLabel check_application_update(int64_t arg_count, CodeLabel current) {
   return current;
 }
 
-/// The starting size for the Heap
-static const size_t BASE_HEAP_SIZE = 1 << 6;
-/// The starting size for each Stack
-static const size_t STACK_SIZE = 1 << 10;
+#ifdef THREADED
+/// Add a spark to the bottom of the pool of the current capability
+///
+/// This returns 0 if the pool is already full.
+int spark_pool_push(SparkPool *pool, uint8_t *closure) {
+  int64_t bottom = __atomic_load_n(&pool->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+  if (bottom - top >= SPARK_POOL_SIZE) {
+    return 0;
+  }
+  __atomic_store_n(&pool->sparks[bottom % SPARK_POOL_SIZE], closure,
+                   __ATOMIC_RELAXED);
+  // Whoever steals this spark needs to see the closure it points to
+  __atomic_store_n(&pool->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/// Take the spark at the bottom of the pool of the current capability
+///
+/// This returns NULL if the pool is empty, or another capability stole
+/// the last spark before we could get to it.
+uint8_t *spark_pool_pop(SparkPool *pool) {
+  int64_t bottom = __atomic_load_n(&pool->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&pool->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+  if (top > bottom) {
+    __atomic_store_n(&pool->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  uint8_t *closure =
+      __atomic_load_n(&pool->sparks[bottom % SPARK_POOL_SIZE], __ATOMIC_RELAXED);
+  if (top == bottom) {
+    // This is the last spark, so we race against anyone stealing it
+    if (!__atomic_compare_exchange_n(&pool->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      closure = NULL;
+    }
+    __atomic_store_n(&pool->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return closure;
+}
 
-/// Setup all the memory areas that we need
-void setup() {
-  g_Heap.data = malloc(BASE_HEAP_SIZE * sizeof(uint8_t *));
-  if (g_Heap.data == NULL) {
-    panic("Failed to initialize Heap");
+/// Take the spark at the top of the pool of another capability
+///
+/// This returns NULL if there's nothing to steal, or we lost a race.
+uint8_t *spark_pool_steal(SparkPool *pool) {
+  int64_t top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&pool->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return NULL;
   }
-  g_Heap.cursor = g_Heap.data;
-  g_Heap.capacity = BASE_HEAP_SIZE;
+  uint8_t *closure =
+      __atomic_load_n(&pool->sparks[top % SPARK_POOL_SIZE], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&pool->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return closure;
+}
+
+/// Check whether or not evaluating a spark would be useless
+///
+/// This is the case once the closure has a value, or some capability
+/// has already started evaluating it.
+int spark_fizzled(uint8_t *closure) {
+  for (;;) {
+    // Only constructors get tagged pointers
+    if (closure != untag(closure)) {
+      return 1;
+    }
+    InfoTable *table = read_info_table(closure);
+    if (table == &table_for_indirection || table == &table_for_caf_cell) {
+      closure = read_ptr(closure + sizeof(InfoTable *));
+      continue;
+    }
+    return table == &table_for_black_hole || table == &table_for_with_int ||
+           table == &table_for_shared_int || table == &table_for_with_string ||
+           table == &table_for_with_constructor ||
+           table == &table_for_shared_constructor ||
+           table == &table_for_partial_application ||
+           table == &table_for_string || table == &table_for_string_literal ||
+           table == &table_for_rope;
+  }
+}
+#endif
+
+/// Suggest that a closure could be evaluated in parallel
+///
+/// Without THREADED, there's no one else to evaluate it, so we do nothing.
+void spark(uint8_t *closure) {
+#ifdef THREADED
+  Worker *worker = current_worker();
+  if (spark_fizzled(closure)) {
+    ++worker->sparks_fizzled;
+  } else if (spark_pool_push(&worker->sparks, closure)) {
+    ++worker->sparks_created;
+  } else {
+    ++worker->sparks_overflowed;
+  }
+#else
+  (void)closure;
+#endif
+}
+
+#ifdef THREADED
+/// The continuation we return to once a spark has been evaluated
+///
+/// Since nothing looks at the value, we just update the closure, if needed,
+/// and leave the trampoline.
+void *spark_done(void) {
+  if (g_ConstrUpdateRegister != NULL) {
+    update_with_value();
+    g_ConstrUpdateRegister = NULL;
+  }
+  if (g_ReturnKindRegister == RETURN_CONSTRUCTOR) {
+    g_SATop -= g_ConstructorArgCountRegister;
+  }
+  current_worker()->spark_finished = 1;
+  return NULL;
+}
 
-  g_SA.data = malloc(STACK_SIZE * sizeof(InfoTable *));
-  if (g_SA.data == NULL) {
-    panic("Failed to initialize Argument Stack");
+/// Evaluate a spark on the current capability
+///
+/// If evaluating the spark runs into an error, the whole program stops,
+/// just like it would if the main thread had evaluated it.
+void run_spark(uint8_t *closure) {
+  Worker *worker = current_worker();
+  ++worker->sparks_converted;
+  worker->spark_finished = 0;
+  stack_reserve(0, 1 + UPDATE_FRAME_SIZE);
+  g_SBTop[0].as_code = &spark_done;
+  ++g_SBTop;
+  // The evaluation frame lets functions return to us without being applied
+  save_SB();
+  save_SA();
+  g_SBTop[0].as_closure = NULL;
+  g_SBTop[1].as_code = &evaluation_frame;
+  g_SBTop += 2;
+  g_NodeRegister = closure;
+  CodeLabel label = read_info_table(g_NodeRegister)->entry;
+  while (label != NULL) {
+    label = (CodeLabel)label();
+  }
+  if (!worker->spark_finished) {
+    cleanup();
+    exit(0);
   }
+  g_NodeRegister = NULL;
+  g_SATop = g_SA.data;
   g_SA.base = g_SA.data;
-  g_SA.top = g_SA.data;
+  g_SBTop = g_SB.data;
+  g_SB.base = g_SB.data;
+}
+
+/// Find a spark to evaluate, starting with the pool of the current capability
+///
+/// After that, we try to steal from each of the other capabilities in turn.
+uint8_t *find_spark() {
+  Worker *worker = current_worker();
+  uint8_t *closure = spark_pool_pop(&worker->sparks);
+  size_t index = worker - g_Workers;
+  for (size_t i = 1; closure == NULL && i < g_WorkerCount; ++i) {
+    closure = spark_pool_steal(&g_Workers[(index + i) % g_WorkerCount].sparks);
+  }
+  return closure;
+}
+
+/// The longest we wait before looking for sparks again, in nanoseconds
+#define MAX_IDLE_WAIT 1000000
+
+/// The main loop of the threads evaluating sparks
+///
+/// When there's nothing to do, we release our capability, so that collections
+/// can happen without us, and back off for longer and longer.
+void *worker_main(void *argument) {
+  g_Capability = argument;
+  Worker *worker = current_worker();
+  long wait = 1000;
+  capability_acquire();
+  for (;;) {
+    gc_safe_point();
+    uint8_t *closure = find_spark();
+    if (closure == NULL) {
+      capability_release();
+      struct timespec delay = {0, wait};
+      nanosleep(&delay, NULL);
+      wait = 2 * wait > MAX_IDLE_WAIT ? MAX_IDLE_WAIT : 2 * wait;
+      capability_acquire();
+      continue;
+    }
+    wait = 1000;
+    if (spark_fizzled(closure)) {
+      ++worker->sparks_fizzled;
+      continue;
+    }
+    run_spark(closure);
+  }
+  return NULL;
+}
+#endif
+
+/// Parse a size, like `64k`, `256m` or `1g`, returning 0 if it's invalid
+size_t parse_size(const char *input) {
+  char *end;
+  unsigned long long size = strtoull(input, &end, 10);
+  switch (*end) {
+  case 'g':
+  case 'G':
+    size <<= 10;
+    // fall through
+  case 'm':
+  case 'M':
+    size <<= 10;
+    // fall through
+  case 'k':
+  case 'K':
+    size <<= 10;
+    ++end;
+    break;
+  }
+  if (end == input || *end != '\0') {
+    return 0;
+  }
+  return size;
+}
+
+/// Apply a single runtime option, like `-H64m`, to our configuration
+void read_option(const char *option) {
+  size_t *size_option;
+  if (strcmp(option, "--machine-readable") == 0) {
+    g_Config.machine_readable = 1;
+    return;
+  }
+  if (strcmp(option, "--unbuffered") == 0) {
+    g_Config.unbuffered_output = 1;
+    return;
+  }
+  if (strncmp(option, "--caf-image=", 12) == 0 && option[12] != '\0') {
+    free(g_Config.caf_image);
+    g_Config.caf_image = malloc(strlen(option + 12) + 1);
+    if (g_Config.caf_image == NULL) {
+      panic("Failed to allocate runtime options");
+    }
+    strcpy(g_Config.caf_image, option + 12);
+    return;
+  }
+  if (option[0] != '-' || option[1] == '\0') {
+    goto invalid;
+  }
+  switch (option[1]) {
+  case 's':
+    g_Config.report_stats = 1;
+    free(g_Config.stats_file);
+    g_Config.stats_file = NULL;
+    if (option[2] != '\0') {
+      g_Config.stats_file = malloc(strlen(option + 2) + 1);
+      if (g_Config.stats_file == NULL) {
+        panic("Failed to allocate runtime options");
+      }
+      strcpy(g_Config.stats_file, option + 2);
+    }
+    return;
+  case 'H':
+    size_option = &g_Config.initial_heap_size;
+    break;
+  case 'M':
+    size_option = &g_Config.max_heap_size;
+    break;
+  case 'A':
+    size_option = &g_Config.nursery_size;
+    break;
+  case 'K':
+    size_option = &g_Config.stack_size;
+    break;
+  case 'F': {
+    char *end;
+    double factor = strtod(option + 2, &end);
+    if (end == option + 2 || *end != '\0' || !(factor >= 1)) {
+      goto invalid;
+    }
+    g_Config.heap_growth = factor;
+    return;
+  }
+#ifdef THREADED
+  case 'N': {
+    if (option[2] == '\0') {
+      long processors = sysconf(_SC_NPROCESSORS_ONLN);
+      g_Config.capabilities = processors > 0 ? processors : 1;
+      return;
+    }
+    char *end;
+    long capabilities = strtol(option + 2, &end, 10);
+    if (*end != '\0' || capabilities <= 0) {
+      goto invalid;
+    }
+    g_Config.capabilities = capabilities;
+    return;
+  }
+  case 'q': {
+    if (option[2] != 'n') {
+      goto invalid;
+    }
+    char *end;
+    long threads = strtol(option + 3, &end, 10);
+    if (end == option + 3 || *end != '\0' || threads <= 0) {
+      goto invalid;
+    }
+    g_Config.gc_threads = threads;
+    return;
+  }
+#endif
+#ifdef TICKY
+  case 'r':
+    g_Config.ticky = 1;
+    free(g_Config.ticky_file);
+    g_Config.ticky_file = NULL;
+    if (option[2] != '\0') {
+      g_Config.ticky_file = malloc(strlen(option + 2) + 1);
+      if (g_Config.ticky_file == NULL) {
+        panic("Failed to allocate runtime options");
+      }
+      strcpy(g_Config.ticky_file, option + 2);
+    }
+    return;
+#endif
+#ifdef PROFILING
+  case 'p':
+    g_Config.profile = 1;
+    return;
+  case 'h':
+    g_Config.heap_profile = 1;
+    return;
+#endif
+  default:
+    goto invalid;
+  }
+  size_t size = parse_size(option + 2);
+  if (size == 0) {
+    goto invalid;
+  }
+  *size_option = size;
+  return;
 
-  g_SB.data = malloc(STACK_SIZE * sizeof(StackBItem));
-  if (g_SB.data == NULL) {
-    panic("Failed to initialize Secondary Stack");
+invalid:
+  fprintf(stderr, "unknown runtime option: %s\n", option);
+  exit(-1);
+}
+
+/// Read the configuration of the runtime
+///
+/// The `HIH_RTS` environment variable contains a list of options,
+/// separated by spaces, e.g. `HIH_RTS="-H64m -M1g"`. After that,
+/// any options between `+RTS` and `-RTS` on the command line are applied.
+void read_config(int argc, char **argv) {
+  const char *options = getenv("HIH_RTS");
+  char buffer[256];
+  while (options != NULL && *options != '\0') {
+    size_t length = strcspn(options, " ");
+    if (length >= sizeof(buffer)) {
+      panic("runtime option is too long");
+    }
+    if (length > 0) {
+      memcpy(buffer, options, length);
+      buffer[length] = '\0';
+      read_option(buffer);
+    }
+    options += length;
+    options += strspn(options, " ");
+  }
+
+  int in_rts = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "+RTS") == 0) {
+      in_rts = 1;
+    } else if (strcmp(argv[i], "-RTS") == 0) {
+      in_rts = 0;
+    } else if (in_rts) {
+      read_option(argv[i]);
+    }
+  }
+
+  if (g_Config.initial_heap_size > g_Config.max_heap_size) {
+    g_Config.initial_heap_size = g_Config.max_heap_size;
   }
-  g_SB.top = g_SB.data;
+}
+
+/// Setup the stacks and registers of the current capability
+void capability_setup() {
+  size_t committed;
+  uint8_t *stack_data = stack_map(&g_SA.reserved, &committed);
+  g_SA.data = (uint8_t **)stack_data;
+  g_SA.limit = (uint8_t **)(stack_data + committed);
+  g_SA.base = g_SA.data;
+  g_SA.max_depth = 0;
+  g_SATop = g_SA.data;
+
+  stack_data = stack_map(&g_SB.reserved, &committed);
+  g_SB.data = (StackBItem *)stack_data;
+  g_SB.limit = (StackBItem *)(stack_data + committed);
+  g_SB.max_depth = 0;
+  g_SBTop = g_SB.data;
+
+  // Global register variables can't have initializers
+  g_NodeRegister = NULL;
+  g_IntRegister = 0xBAD;
   g_SB.base = g_SB.data;
 }
 
+/// Free the stacks of the current capability
+void capability_teardown() {
+  munmap(g_SA.data, g_SA.reserved + round_to_page(1));
+  munmap(g_SB.data, g_SB.reserved + round_to_page(1));
+}
+
+/// The tables of the closures that can live in the compact region
+///
+/// Images refer to these by their position in here.
+static InfoTable *const g_ImageTables[] = {
+    &table_for_with_int, &table_for_with_string, &table_for_string,
+    &table_for_with_constructor};
+
+#define IMAGE_TABLE_COUNT (sizeof(g_ImageTables) / sizeof(InfoTable *))
+
+/// The first 8 bytes of every image, which change along with its format
+#define IMAGE_MAGIC 0x3130464143484948ULL
+
+/// The kinds of pointers inside of an image, saying how to relocate them
+///
+/// Pointers are always aligned, so each relocation keeps the kind in the
+/// low bits of the offset of the pointer.
+enum ImagePointerKind {
+  /// An offset into the image itself
+  IMAGE_COMPACT,
+  /// An offset into `g_SharedInts`
+  IMAGE_SHARED_INT,
+  /// An offset into `g_SharedConstructors`
+  IMAGE_SHARED_CONSTRUCTOR,
+  /// A position in `g_ProgramStatics`, times the alignment, plus the tag
+  IMAGE_STATIC,
+  /// A position in `g_ImageTables`
+  IMAGE_TABLE
+};
+
+/// The start of an image file
+///
+/// This gets followed by the closures, then the relocations, then the roots.
+typedef struct ImageHeader {
+  uint64_t magic;
+  /// The fingerprint of the program that wrote this image
+  uint64_t fingerprint;
+  /// The number of bytes of closures
+  uint64_t size;
+  /// The number of pointers in the closures that need to be relocated
+  uint64_t relocations;
+  /// The number of CAFs whose values are in the image
+  uint64_t roots;
+} ImageHeader;
+
+/// A CAF whose value lives in an image
+typedef struct ImageRoot {
+  /// The position of the cell of the CAF in `g_ProgramStatics`
+  uint64_t cell;
+  /// The kind of pointer to its value
+  uint64_t kind;
+  /// The pointer to its value, before relocation
+  uint64_t value;
+} ImageRoot;
+
+/// A static closure, along with its position in `g_ProgramStatics`
+typedef struct ImageStatic {
+  uint8_t *closure;
+  size_t index;
+} ImageStatic;
+
+int image_static_compare(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((const ImageStatic *)a)->closure;
+  uintptr_t y = (uintptr_t)((const ImageStatic *)b)->closure;
+  return x < y ? -1 : x > y;
+}
+
+/// Find the position of a static closure, given the statics sorted by address
+///
+/// This returns 0 if it isn't one of the program's static closures.
+int image_find_static(ImageStatic *statics, uint8_t *closure, size_t *index) {
+  ImageStatic key = {closure, 0};
+  ImageStatic *found = bsearch(&key, statics, g_ProgramStaticCount,
+                               sizeof(ImageStatic), &image_static_compare);
+  if (found == NULL) {
+    return 0;
+  }
+  *index = found->index;
+  return 1;
+}
+
+/// Turn a pointer into the kind of pointer it is, and the value to store for it
+///
+/// This returns 0 if the pointer goes somewhere an image can't refer to.
+int image_encode(ImageStatic *statics, uint8_t *closure, uint64_t *kind,
+                 uint64_t *value) {
+  uint8_t *base = untag(closure);
+  uint8_t *ints = (uint8_t *)g_SharedInts;
+  uint8_t *constructors = (uint8_t *)g_SharedConstructors;
+  size_t index;
+  if (heap_contains(&g_Compact, base)) {
+    *kind = IMAGE_COMPACT;
+    *value = closure - g_Compact.data;
+  } else if (base >= ints && base < ints + sizeof(g_SharedInts)) {
+    *kind = IMAGE_SHARED_INT;
+    *value = closure - ints;
+  } else if (base >= constructors &&
+             base < constructors + sizeof(g_SharedConstructors)) {
+    *kind = IMAGE_SHARED_CONSTRUCTOR;
+    *value = closure - constructors;
+  } else if (image_find_static(statics, base, &index)) {
+    *kind = IMAGE_STATIC;
+    *value = index * CLOSURE_ALIGNMENT + pointer_tag(closure);
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+/// Turn a pointer stored in an image back into a real pointer
+///
+/// This returns 0 if the pointer doesn't go anywhere sensible.
+int image_decode(uint64_t kind, uint64_t value, size_t size,
+                 uint8_t **closure) {
+  switch (kind) {
+  case IMAGE_COMPACT:
+    if (value >= size) {
+      return 0;
+    }
+    *closure = g_Compact.data + value;
+    return 1;
+  case IMAGE_SHARED_INT:
+    if (value >= sizeof(g_SharedInts)) {
+      return 0;
+    }
+    *closure = (uint8_t *)g_SharedInts + value;
+    return 1;
+  case IMAGE_SHARED_CONSTRUCTOR:
+    if (value >= sizeof(g_SharedConstructors)) {
+      return 0;
+    }
+    *closure = (uint8_t *)g_SharedConstructors + value;
+    return 1;
+  case IMAGE_STATIC:
+    if (value / CLOSURE_ALIGNMENT >= g_ProgramStaticCount) {
+      return 0;
+    }
+    *closure =
+        g_ProgramStatics[value / CLOSURE_ALIGNMENT] + value % CLOSURE_ALIGNMENT;
+    return 1;
+  case IMAGE_TABLE:
+    if (value >= IMAGE_TABLE_COUNT) {
+      return 0;
+    }
+    *closure = (uint8_t *)g_ImageTables[value];
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/// Write the compact region out to an image, along with the CAFs it holds
+///
+/// Some CAFs have probably finished evaluating since the last major
+/// collection, so we try compacting them first. Nothing runs after this,
+/// so it's fine that this forwards the closures left behind in the heap.
+///
+/// The image gets written next to its final path, and then moved there,
+/// so that programs starting up in the meantime never see half of one.
+void caf_image_save(const char *path) {
+  compact_cafs();
+
+  size_t size = g_Compact.cursor - g_Compact.data;
+  size_t root_capacity = 0;
+  for (CAFCell *p = g_CAFListHead; p != NULL; p = p->next) {
+    ++root_capacity;
+  }
+  // Every closure starts with a table, so there are at most this many pointers
+  size_t relocation_capacity = size / sizeof(uint8_t *);
+  uint8_t *image = malloc(size + 1);
+  uint64_t *relocations = malloc((relocation_capacity + 1) * sizeof(uint64_t));
+  ImageRoot *roots = malloc((root_capacity + 1) * sizeof(ImageRoot));
+  ImageStatic *statics = malloc((g_ProgramStaticCount + 1) * sizeof(ImageStatic));
+  if (image == NULL || relocations == NULL || roots == NULL ||
+      statics == NULL) {
+    panic("Failed to allocate the CAF image");
+  }
+  for (size_t i = 0; i < g_ProgramStaticCount; ++i) {
+    statics[i].closure = g_ProgramStatics[i];
+    statics[i].index = i;
+  }
+  qsort(statics, g_ProgramStaticCount, sizeof(ImageStatic),
+        &image_static_compare);
+
+  memcpy(image, g_Compact.data, size);
+  size_t relocation_count = 0;
+  int ok = 1;
+  for (uint8_t *scan = g_Compact.data; ok && scan < g_Compact.cursor;) {
+    InfoTable *table = read_info_table(scan);
+    uint64_t index = 0;
+    while (g_ImageTables[index] != table) {
+      ++index;
+    }
+    size_t offset = scan - g_Compact.data;
+    memcpy(image + offset, &index, sizeof(uint64_t));
+    relocations[relocation_count++] = offset | IMAGE_TABLE;
+
+    uint8_t *fields;
+    size_t field_count;
+    size_t closure_size = compact_layout(scan, &fields, &field_count);
+    for (size_t i = 0; ok && i < field_count; ++i) {
+      uint8_t *field = fields + i * sizeof(uint8_t *);
+      uint64_t kind;
+      uint64_t value;
+      ok = image_encode(statics, read_ptr(field), &kind, &value);
+      offset = field - g_Compact.data;
+      memcpy(image + offset, &value, sizeof(uint64_t));
+      relocations[relocation_count++] = offset | kind;
+    }
+    scan += closure_size;
+  }
+
+  // CAFs whose values are still in the heap didn't finish evaluating, and
+  // for those whose value is static, there's nothing to save.
+  size_t root_count = 0;
+  for (CAFCell *p = g_CAFListHead; ok && p != NULL; p = p->next) {
+    ImageRoot *root = &roots[root_count];
+    size_t cell;
+    if (image_find_static(statics, (uint8_t *)p, &cell) &&
+        image_encode(statics, p->closure, &root->kind, &root->value) &&
+        root->kind != IMAGE_STATIC) {
+      root->cell = cell;
+      ++root_count;
+    }
+  }
+
+  char *temporary = malloc(strlen(path) + 5);
+  if (temporary == NULL) {
+    panic("Failed to allocate the CAF image");
+  }
+  strcpy(temporary, path);
+  strcat(temporary, ".tmp");
+  FILE *file = ok ? fopen(temporary, "wb") : NULL;
+  if (file != NULL) {
+    ImageHeader header = {IMAGE_MAGIC, g_ProgramFingerprint, size,
+                          relocation_count, root_count};
+    ok = fwrite(&header, sizeof(ImageHeader), 1, file) == 1 &&
+         fwrite(image, 1, size, file) == size &&
+         fwrite(relocations, sizeof(uint64_t), relocation_count, file) ==
+             relocation_count &&
+         fwrite(roots, sizeof(ImageRoot), root_count, file) == root_count;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok) {
+      remove(temporary);
+    }
+  }
+  if (!ok || file == NULL) {
+    fprintf(stderr, "failed to write CAF image: %s\n", path);
+  }
+  free(temporary);
+  free(statics);
+  free(roots);
+  free(relocations);
+  free(image);
+}
+
+/// Load the values of CAFs saved in an image by an earlier run
+///
+/// The image gets read straight into the compact region, and relocated
+/// there. If there's no image, or it came from a different program, we just
+/// start without it, evaluating each CAF as usual.
+void caf_image_load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return;
+  }
+  uint64_t *relocations = NULL;
+  ImageRoot *roots = NULL;
+  int ok = 0;
+
+  ImageHeader header;
+  if (fread(&header, sizeof(ImageHeader), 1, file) != 1 ||
+      header.magic != IMAGE_MAGIC ||
+      header.fingerprint != g_ProgramFingerprint ||
+      header.size > g_Compact.reserved ||
+      header.relocations > header.size / sizeof(uint8_t *) ||
+      header.roots > g_ProgramStaticCount) {
+    goto done;
+  }
+  size_t size = header.size;
+  heap_commit(&g_Compact, size);
+  relocations = malloc((header.relocations + 1) * sizeof(uint64_t));
+  roots = malloc((header.roots + 1) * sizeof(ImageRoot));
+  if (relocations == NULL || roots == NULL) {
+    panic("Failed to allocate the CAF image");
+  }
+  if (fread(g_Compact.data, 1, size, file) != size ||
+      fread(relocations, sizeof(uint64_t), header.relocations, file) !=
+          header.relocations ||
+      fread(roots, sizeof(ImageRoot), header.roots, file) != header.roots) {
+    goto done;
+  }
+
+  for (size_t i = 0; i < header.relocations; ++i) {
+    uint64_t offset = relocations[i] & ~(uint64_t)TAG_MASK;
+    uint64_t value;
+    uint8_t *closure;
+    if (offset + sizeof(uint64_t) > size) {
+      goto done;
+    }
+    memcpy(&value, g_Compact.data + offset, sizeof(uint64_t));
+    if (!image_decode(relocations[i] & TAG_MASK, value, size, &closure)) {
+      goto done;
+    }
+    write_ptr(g_Compact.data + offset, closure);
+  }
+  // Only once the whole image makes sense do we touch any CAFs
+  for (size_t i = 0; i < header.roots; ++i) {
+    uint8_t *closure;
+    if (roots[i].cell >= g_ProgramStaticCount ||
+        ((CAFCell *)g_ProgramStatics[roots[i].cell])->table !=
+            &table_for_caf_cell ||
+        roots[i].kind == IMAGE_TABLE ||
+        !image_decode(roots[i].kind, roots[i].value, size, &closure)) {
+      goto done;
+    }
+  }
+  ok = 1;
+  g_Compact.cursor = g_Compact.data + size;
+  for (size_t i = 0; i < header.roots; ++i) {
+    CAFCell *cell = (CAFCell *)g_ProgramStatics[roots[i].cell];
+    image_decode(roots[i].kind, roots[i].value, size, &cell->closure);
+    if (cell->next == NULL && g_CAFListLast != &cell->next) {
+      *g_CAFListLast = cell;
+      g_CAFListLast = &cell->next;
+    }
+  }
+
+done:
+  if (!ok) {
+    g_Compact.cursor = g_Compact.data;
+  }
+  free(roots);
+  free(relocations);
+  fclose(file);
+}
+
+/// Setup all the memory areas that we need
+void setup(int argc, char **argv) {
+  g_Stats.start_time = current_time();
+  read_config(argc, argv);
+#if defined(PROFILING) || defined(TICKY)
+  if (argc > 0) {
+    g_ProgramName = argv[0];
+  }
+#endif
+#ifdef PROFILING
+  heap_profile_begin();
+#endif
+
+#ifdef THREADED
+  if (g_Config.capabilities == 0) {
+    g_Config.capabilities = 1;
+  }
+  g_WorkerCount = g_Config.capabilities;
+  heap_map(&g_Heap, g_Config.max_heap_size);
+  // Each capability gets its share of the nursery
+  heap_set_capacity(&g_Heap, g_Config.nursery_size * g_WorkerCount);
+  g_Workers = calloc(g_WorkerCount, sizeof(Worker));
+  if (g_Workers == NULL) {
+    panic("Failed to allocate capabilities");
+  }
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    g_Capability = &g_Workers[i].capability;
+    capability_setup();
+    // The first allocation hands out a block of the nursery
+    g_HeapCursor = g_Heap.data;
+    g_HeapLimit = g_Heap.data;
+  }
+  g_Capability = &g_Workers[0].capability;
+  g_RunningCount = 1;
+  if (g_Config.gc_threads == 0) {
+    g_Config.gc_threads = g_Config.capabilities;
+  }
+  g_GCThreadCount = g_Config.gc_threads;
+  g_GCThreads = calloc(g_GCThreadCount, sizeof(GCThread));
+  if (g_GCThreads == NULL) {
+    panic("Failed to allocate the threads of the garbage collector");
+  }
+  for (size_t i = 1; i < g_GCThreadCount; ++i) {
+    if (pthread_create(&g_GCThreads[i].thread, NULL, &gc_thread_main,
+                       &g_GCThreads[i]) != 0) {
+      panic("Failed to start the threads of the garbage collector");
+    }
+  }
+#else
+  heap_map(&g_Heap, g_Config.max_heap_size);
+  g_HeapCursor = g_Heap.data;
+  heap_set_capacity(&g_Heap, g_Config.nursery_size);
+  g_HeapLimit = g_Heap.data + g_Heap.capacity;
+#endif
+
+  heap_map(&g_OldHeap, g_Config.max_heap_size);
+  heap_set_capacity(&g_OldHeap, g_Config.initial_heap_size);
+  heap_map(&g_OldHeapSpare, g_Config.max_heap_size);
+  heap_map(&g_Compact, g_Config.max_heap_size);
+
+#ifndef THREADED
+  capability_setup();
+#endif
+
+  setup_shared_closures();
+  if (g_Config.caf_image != NULL) {
+    caf_image_load(g_Config.caf_image);
+  }
+
+#ifdef THREADED
+  for (size_t i = 1; i < g_WorkerCount; ++i) {
+    if (pthread_create(&g_Workers[i].thread, NULL, &worker_main,
+                       &g_Workers[i].capability) != 0) {
+      panic("Failed to start the capabilities");
+    }
+  }
+#endif
+}
+
+/// Find the deepest each stack has been, over every capability
+void stack_max_depths(size_t *sa_depth, size_t *sb_depth) {
+#ifdef THREADED
+  *sa_depth = 0;
+  *sb_depth = 0;
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    Capability *capability = &g_Workers[i].capability;
+    if (capability->sa.max_depth > *sa_depth) {
+      *sa_depth = capability->sa.max_depth;
+    }
+    if (capability->sb.max_depth > *sb_depth) {
+      *sb_depth = capability->sb.max_depth;
+    }
+  }
+#else
+  *sa_depth = g_SA.max_depth;
+  *sb_depth = g_SB.max_depth;
+#endif
+}
+
+/// Write out the statistics we've gathered, in the format requested
+void report_stats() {
+  FILE *out = stderr;
+  if (g_Config.stats_file != NULL) {
+    out = fopen(g_Config.stats_file, "w");
+    if (out == NULL) {
+      fprintf(stderr, "failed to open stats file: %s\n", g_Config.stats_file);
+      return;
+    }
+  }
+  double total_time = current_time() - g_Stats.start_time;
+  double mutator_time = total_time - g_Stats.gc_time;
+  size_t compact_bytes = g_Compact.cursor - g_Compact.data;
+  size_t sa_depth;
+  size_t sb_depth;
+  stack_max_depths(&sa_depth, &sb_depth);
+#ifdef THREADED
+  size_t sparks_created = 0;
+  size_t sparks_converted = 0;
+  size_t sparks_overflowed = 0;
+  size_t sparks_fizzled = 0;
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    sparks_created += g_Workers[i].sparks_created;
+    sparks_converted += g_Workers[i].sparks_converted;
+    sparks_overflowed += g_Workers[i].sparks_overflowed;
+    sparks_fizzled += g_Workers[i].sparks_fizzled;
+  }
+#endif
+  if (g_Config.machine_readable) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"bytes_allocated\": %zu,\n", g_Stats.bytes_allocated);
+    fprintf(out, "  \"bytes_copied\": %zu,\n", g_Stats.bytes_copied);
+    fprintf(out, "  \"max_residency\": %zu,\n", g_Stats.max_residency);
+    fprintf(out, "  \"compact_bytes\": %zu,\n", compact_bytes);
+    fprintf(out, "  \"minor_collections\": %zu,\n",
+            g_Stats.minor_collections);
+    fprintf(out, "  \"major_collections\": %zu,\n",
+            g_Stats.major_collections);
+    fprintf(out, "  \"max_sa_depth\": %zu,\n", sa_depth);
+    fprintf(out, "  \"max_sb_depth\": %zu,\n", sb_depth);
+#ifdef THREADED
+    fprintf(out, "  \"sparks_created\": %zu,\n", sparks_created);
+    fprintf(out, "  \"sparks_converted\": %zu,\n", sparks_converted);
+    fprintf(out, "  \"sparks_overflowed\": %zu,\n",
+            sparks_overflowed);
+    fprintf(out, "  \"sparks_fizzled\": %zu,\n", sparks_fizzled);
+#endif
+    fprintf(out, "  \"mutator_seconds\": %.6f,\n", mutator_time);
+    fprintf(out, "  \"gc_seconds\": %.6f,\n", g_Stats.gc_time);
+    fprintf(out, "  \"total_seconds\": %.6f\n", total_time);
+    fprintf(out, "}\n");
+  } else {
+    fprintf(out, "%16zu bytes allocated in the heap\n",
+            g_Stats.bytes_allocated);
+    fprintf(out, "%16zu bytes copied during GC\n", g_Stats.bytes_copied);
+    fprintf(out, "%16zu bytes maximum residency\n", g_Stats.max_residency);
+    fprintf(out, "%16zu bytes in the compact region\n", compact_bytes);
+    fprintf(out, "%16zu minor collections\n", g_Stats.minor_collections);
+    fprintf(out, "%16zu major collections\n", g_Stats.major_collections);
+    fprintf(out, "%16zu items maximum argument stack depth\n", sa_depth);
+    fprintf(out, "%16zu items maximum secondary stack depth\n\n", sb_depth);
+#ifdef THREADED
+    fprintf(out, "  SPARKS: %zu (%zu converted, %zu overflowed, %zu fizzled)\n\n",
+            sparks_created, sparks_converted,
+            sparks_overflowed, sparks_fizzled);
+#endif
+    fprintf(out, "  MUT     time %10.3fs\n", mutator_time);
+    fprintf(out, "  GC      time %10.3fs\n", g_Stats.gc_time);
+    fprintf(out, "  Total   time %10.3fs\n", total_time);
+  }
+  if (out != stderr) {
+    fclose(out);
+  }
+}
+
 /// Cleanup all the memory areas that we've created
 void cleanup() {
-  free(g_Heap.data);
-  free(g_SA.data);
-  free(g_SB.data);
+#ifdef THREADED
+  // The other capabilities never get to run again
+  while (!stop_the_world()) {
+  }
+#endif
+  output_flush();
+  if (g_Config.caf_image != NULL) {
+    caf_image_save(g_Config.caf_image);
+  }
+  // Whatever is left in the nursery was allocated since the last collection
+  g_Stats.bytes_allocated += nursery_allocated();
+  if (g_Config.report_stats) {
+    report_stats();
+  }
+#ifdef PROFILING
+  heap_profile_end();
+  profile_report();
+#endif
+#ifdef TICKY
+  ticky_report();
+  free(g_Config.ticky_file);
+#endif
+  free(g_Config.stats_file);
+  free(g_Config.caf_image);
+  munmap(g_Heap.data, g_Heap.reserved);
+  munmap(g_OldHeap.data, g_OldHeap.reserved);
+  munmap(g_OldHeapSpare.data, g_OldHeapSpare.reserved);
+  munmap(g_Compact.data, g_Compact.reserved);
+  free(g_CompactMap.keys);
+  free(g_CompactMap.values);
+  free(g_RopeStack);
+#ifdef THREADED
+  // The threads of the garbage collector are waiting for a collection that
+  // never comes, so they never look at their work again
+  free(g_GCWork);
+  // The other threads are still parked, so their capabilities stay around
+  for (size_t i = 0; i < g_WorkerCount; ++i) {
+    free(g_Workers[i].remembered.data);
+    g_Workers[i].remembered.data = NULL;
+    g_Capability = &g_Workers[i].capability;
+    capability_teardown();
+  }
+#else
+  free(g_RememberedSet.data);
+  capability_teardown();
+#endif
 }
@@ -0,0 +1,631 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+// The interface between the runtime and the code the compiler generates.
+//
+// Everything a generated program uses lives here: the layout of closures,
+// the registers, and the small helpers that need to be inlined into every
+// function. The rest of the runtime is in `runtime.c`, which can be compiled
+// once, into `libhihrt`, and then linked with each program.
+// Both need to be compiled with the same `PROFILING`, `TICKY`, `GLOBAL_REGISTERS`,
+// `TAIL_CALLS`, and `THREADED` flags, since these change that interface.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// exit the program, displaying an error message
+void panic(const char *message);
+
+#ifdef DEBUG
+#define DEBUG_PRINT(...)                                                       \
+  do {                                                                         \
+    fprintf(stderr, __VA_ARGS__);                                              \
+  } while (0)
+#else
+#define DEBUG_PRINT(...)                                                       \
+  do {                                                                         \
+  } while (0)
+#endif
+
+/// A code label takes no arguments, and returns the next function.
+///
+/// We have to return a void*, because we can't easily have a recursive
+/// type here. But, this is basically always an `EntryFunction*`.
+typedef void *(*CodeLabel)(void);
+
+// Guaranteed tail calls need compiler support, so we only use them
+// if they've been asked for, and the compiler has them.
+#if defined(TAIL_CALLS) && defined(__has_attribute)
+#if __has_attribute(musttail)
+#define USE_TAIL_CALLS
+#endif
+#endif
+
+#if defined(TAIL_CALLS) && !defined(USE_TAIL_CALLS)
+#warning "musttail is not supported, falling back to the trampoline"
+#endif
+
+/// Continue execution with the next code label
+///
+/// Normally, this returns that label to the trampoline in `main`, which
+/// then calls it. When using tail calls, we call the label directly instead,
+/// which replaces the current function, without going back through `main`.
+/// A NULL label is always returned, which ends the program.
+#ifdef USE_TAIL_CALLS
+#define JUMP(label)                                                            \
+  do {                                                                         \
+    CodeLabel next_label = (CodeLabel)(label);                                 \
+    if (next_label == NULL) {                                                  \
+      return NULL;                                                             \
+    }                                                                          \
+    __attribute__((musttail)) return next_label();                             \
+  } while (0)
+#else
+#define JUMP(label) return (label)
+#endif
+
+/// An evac function takes the current location of a closure,
+/// and returns the new location after moving that closure (if necessary).
+///
+/// Evacuation only copies the closure itself: the pointers it contains
+/// are fixed up later, when the closure gets scavenged.
+typedef uint8_t *(*EvacFunction)(uint8_t *);
+
+/// A scavenge function takes the location of a closure in the new heap,
+/// and evacuates all of the closures it points to.
+///
+/// This returns the location just past the end of this closure, which
+/// lets us walk over the new heap closure by closure.
+typedef uint8_t *(*ScavengeFunction)(uint8_t *);
+
+/// An InfoTable contains the information about the functions of a closure
+typedef struct InfoTable {
+  /// The function we can call to enter the closure
+  CodeLabel entry;
+  /// The evacuation function we call to collect this closure
+  EvacFunction evac;
+  /// The function we call to collect the closures this one points to
+  ///
+  /// This is only used for closures that can end up in the new heap,
+  /// so static closures can leave it as NULL.
+  ScavengeFunction scavenge;
+#ifdef PROFILING
+  /// The name of the binding this closure comes from
+  const char *name;
+  /// The number of closures with this table we've allocated
+  size_t allocations;
+  /// The number of bytes allocated for closures with this table
+  size_t bytes_allocated;
+  /// The number of bytes live with this table, as of the last census
+  size_t live_bytes;
+  /// The most bytes we've seen live with this table, at any census
+  size_t max_live_bytes;
+  /// Whether or not this table is part of the list of profiled tables
+  int profiled;
+  /// The next table in the list of profiled tables
+  struct InfoTable *next_profiled;
+#endif
+} InfoTable;
+
+#ifdef PROFILING
+/// Provide the name of a table, in profiling builds
+#define PROFILE_NAME(name) , name
+/// Attribute an allocation of some number of bytes to a table
+#define PROFILE_ALLOC(table, bytes) profile_alloc(table, bytes)
+/// Count some bytes as live for a table, during a census
+#define PROFILE_LIVE(table, bytes) profile_live(table, bytes)
+void profile_alloc(InfoTable *table, size_t bytes);
+void profile_live(InfoTable *table, size_t bytes);
+#else
+#define PROFILE_NAME(name)
+#define PROFILE_ALLOC(table, bytes)
+#define PROFILE_LIVE(table, bytes)
+#endif
+
+#ifdef TICKY
+/// The ticky-ticky counters of a generated function
+///
+/// Each function, including each case continuation, has its own counters,
+/// which get reported in the order of how often they were entered.
+typedef struct TickyCounter {
+  /// The name of the binding the function comes from
+  const char *name;
+  /// The name of the C function, to line up with other profilers
+  const char *symbol;
+  /// The number of times the function was entered
+  size_t entries;
+  /// The number of update frames the function pushed
+  size_t update_frames;
+  /// The number of times the function was entered with too few arguments
+  size_t partial_applications;
+  /// The number of bytes the function allocated on the heap
+  size_t bytes_allocated;
+  /// Whether or not this counter is part of the list of counters
+  int registered;
+  /// The next counter in the list of counters
+  struct TickyCounter *next;
+} TickyCounter;
+
+void ticky_register(TickyCounter *counter);
+
+/// Declare the counters of a generated function
+#define TICKY_COUNTER(var, name, symbol)                                       \
+  TickyCounter var = {name, symbol, 0, 0, 0, 0, 0, NULL};
+/// Add to one of the counters of a generated function
+#define TICKY_ADD(var, field, amount)                                          \
+  do {                                                                         \
+    if (!(var).registered) {                                                   \
+      ticky_register(&(var));                                                  \
+    }                                                                          \
+    (var).field += (amount);                                                   \
+  } while (0)
+#define TICKY_ENTRY(var) TICKY_ADD(var, entries, 1)
+#define TICKY_UPDATE_FRAME(var) TICKY_ADD(var, update_frames, 1)
+#define TICKY_PARTIAL_APPLICATION(var) TICKY_ADD(var, partial_applications, 1)
+#define TICKY_ALLOC(var, bytes) TICKY_ADD(var, bytes_allocated, bytes)
+#else
+#define TICKY_COUNTER(var, name, symbol)
+#define TICKY_ENTRY(var)
+#define TICKY_UPDATE_FRAME(var)
+#define TICKY_PARTIAL_APPLICATION(var)
+#define TICKY_ALLOC(var, bytes)
+#endif
+
+/// For static objects, evacuating them should return their current location
+uint8_t *static_evac(uint8_t *base);
+
+/// The tables the runtime provides for its own closures
+extern InfoTable table_for_null;
+extern InfoTable table_for_string;
+extern InfoTable table_for_string_literal;
+extern InfoTable table_for_rope;
+extern InfoTable table_for_black_hole;
+extern InfoTable table_for_partial_application;
+extern InfoTable table_for_indirection;
+extern InfoTable *table_pointer_for_indirection;
+extern InfoTable table_for_caf_cell;
+extern InfoTable table_for_with_int;
+extern InfoTable table_for_shared_int;
+extern InfoTable table_for_with_string;
+extern InfoTable table_for_with_constructor;
+extern InfoTable *table_pointer_for_with_constructor;
+extern InfoTable table_for_shared_constructor;
+
+typedef struct CAFCell {
+  InfoTable *table;
+  uint8_t *closure;
+  struct CAFCell *next;
+} CAFCell;
+
+/// The list of CAFs, which are roots for the garbage collector
+extern CAFCell *g_CAFListHead;
+extern CAFCell **g_CAFListLast;
+
+/// A hash of the generated code, telling the CAF images of programs apart
+extern const uint64_t g_ProgramFingerprint;
+
+/// Every static closure in the program, including the cells of CAFs
+///
+/// A CAF image can't use their addresses, which change whenever the program
+/// gets rebuilt, so it refers to them by their position in here instead.
+extern uint8_t *g_ProgramStatics[];
+extern size_t g_ProgramStaticCount;
+
+/// Represents the argument stack
+///
+/// Each argument represents the location in memory where the closure
+/// for that argument is stored. You can sort of think of this as InfoTable**.
+///
+/// The top of this stack lives separately, in `g_SATop`.
+typedef struct StackA {
+  /// The base pointer of the argument stack.
+  ///
+  /// This is used to adjust the bottom of the stack, to implement updates
+  uint8_t **base;
+  /// A pointer to all of the data
+  ///
+  /// We keep this around so that we can free the stack on program exit
+  uint8_t **data;
+  /// The end of the memory we can currently use for this stack
+  uint8_t **limit;
+  /// The number of bytes of address space reserved for this stack
+  ///
+  /// The stack grows in place, so nothing on it ever needs to move.
+  size_t reserved;
+  /// The most items we've seen on this stack
+  size_t max_depth;
+} StackA;
+
+/// Represents an item on the secondary stack.
+///
+/// This is either a 64 bit integer, or a function
+/// pointer for a continuation.
+typedef union StackBItem {
+  int64_t as_int;
+  CodeLabel as_code;
+  uint8_t *as_closure;
+  union StackBItem *as_sb_base;
+  uint8_t **as_sa_base;
+} StackBItem;
+
+/// Represents the secondary stack.
+///
+/// This contains various things: ints, and continuations.
+///
+/// The top of this stack lives separately, in `g_SBTop`.
+typedef struct StackB {
+  StackBItem *base;
+  StackBItem *data;
+  /// The end of the memory we can currently use for this stack
+  StackBItem *limit;
+  /// The number of bytes of address space reserved for this stack
+  size_t reserved;
+  /// The most items we've seen on this stack
+  size_t max_depth;
+} StackB;
+
+/// The most arguments of each kind a fast entry can take in registers
+///
+/// This needs to match `argRegisterCount` in the compiler.
+#define ARG_REGISTER_COUNT 8
+
+/// The kinds of values we can return to a continuation
+///
+/// Most continuations know what they're getting, but the ones that can
+/// take any kind of value look at `g_ReturnKindRegister` to find out.
+enum { RETURN_INT, RETURN_STRING, RETURN_CONSTRUCTOR, RETURN_FUNCTION };
+
+#if defined(THREADED) && defined(GLOBAL_REGISTERS)
+#error "THREADED can't be combined with GLOBAL_REGISTERS"
+#endif
+#if defined(THREADED) && defined(PROFILING)
+#error "THREADED can't be combined with PROFILING"
+#endif
+#if defined(THREADED) && defined(TICKY)
+#error "THREADED can't be combined with TICKY"
+#endif
+
+// With GLOBAL_REGISTERS, the registers used on almost every transition
+// are pinned to callee-saved machine registers, using a GCC extension.
+// This lets them stay in registers across the trampoline, instead of being
+// loaded and stored through memory in every function. These have to come
+// before the functions using them, and can't have their address taken.
+#ifdef GLOBAL_REGISTERS
+#if !defined(__GNUC__) || defined(__clang__) || !defined(__x86_64__)
+#error "GLOBAL_REGISTERS is only supported with GCC on x86-64"
+#endif
+/// The register holding the location of the current closure
+register uint8_t *g_NodeRegister __asm__("rbx");
+/// The top of the argument stack
+register uint8_t **g_SATop __asm__("r12");
+/// The top of the secondary stack
+register StackBItem *g_SBTop __asm__("r13");
+/// The part of the nursery we're currently writing to
+register uint8_t *g_HeapCursor __asm__("r14");
+/// The register holding integer returns
+register int64_t g_IntRegister __asm__("r15");
+#elif defined(THREADED)
+/// Everything a capability needs to run Haskell code on its own
+///
+/// With THREADED, each thread running Haskell code has a capability, with its
+/// own registers, stacks, and block of the nursery to allocate into. The usual
+/// names for these all refer to the capability of the current thread.
+typedef struct Capability {
+  uint8_t *node;
+  uint8_t **sa_top;
+  StackBItem *sb_top;
+  uint8_t *heap_cursor;
+  uint8_t *heap_limit;
+  int64_t int_register;
+  uint8_t *string_register;
+  uint16_t tag;
+  int64_t constructor_arg_count;
+  uint8_t *constr_update;
+  uint8_t return_kind;
+  uint8_t *arg_registers[ARG_REGISTER_COUNT];
+  size_t arg_register_count;
+  int64_t int_arg_registers[ARG_REGISTER_COUNT];
+  StackA sa;
+  StackB sb;
+} Capability;
+
+/// The capability of the current thread
+extern __thread Capability *g_Capability;
+
+#define g_NodeRegister (g_Capability->node)
+#define g_SATop (g_Capability->sa_top)
+#define g_SBTop (g_Capability->sb_top)
+#define g_HeapCursor (g_Capability->heap_cursor)
+#define g_HeapLimit (g_Capability->heap_limit)
+#define g_IntRegister (g_Capability->int_register)
+#define g_StringRegister (g_Capability->string_register)
+#define g_TagRegister (g_Capability->tag)
+#define g_ConstructorArgCountRegister (g_Capability->constructor_arg_count)
+#define g_ConstrUpdateRegister (g_Capability->constr_update)
+#define g_ReturnKindRegister (g_Capability->return_kind)
+#define g_ArgRegisters (g_Capability->arg_registers)
+#define g_ArgRegisterCount (g_Capability->arg_register_count)
+#define g_IntArgRegisters (g_Capability->int_arg_registers)
+#define g_SA (g_Capability->sa)
+#define g_SB (g_Capability->sb)
+#else
+/// The register holding the location of the current closure
+extern uint8_t *g_NodeRegister;
+/// The top of the argument stack.
+///
+/// The stack grows upward, with the current pointer always
+/// pointing at valid memory, but containing no "live" value.
+extern uint8_t **g_SATop;
+/// The top of the secondary stack
+extern StackBItem *g_SBTop;
+/// The part of the nursery we're currently writing to
+///
+/// This takes the place of the cursor of the nursery itself.
+extern uint8_t *g_HeapCursor;
+/// The register holding integer returns
+extern int64_t g_IntRegister;
+#endif
+#ifndef THREADED
+/// The "A" or argument stack
+extern StackA g_SA;
+/// The secondary stack
+extern StackB g_SB;
+/// The register holding string values
+///
+/// This is **not** a pointer to the character data, but rather,
+/// the location in memory where this string closure resides.
+extern uint8_t *g_StringRegister;
+/// The register holding constructor tag returns
+extern uint16_t g_TagRegister;
+/// The register holding the number of constructor args returned
+extern int64_t g_ConstructorArgCountRegister;
+/// The register holding a constructor closure to update
+extern uint8_t *g_ConstrUpdateRegister;
+/// The register holding the kind of value we're returning
+extern uint8_t g_ReturnKindRegister;
+
+/// The pointer arguments passed to the fast entry of a global function
+extern uint8_t *g_ArgRegisters[ARG_REGISTER_COUNT];
+/// How many of the argument registers hold live pointers
+extern size_t g_ArgRegisterCount;
+/// The int arguments passed to the fast entry of a worker function
+extern int64_t g_IntArgRegisters[ARG_REGISTER_COUNT];
+
+/// The end of the part of the nursery we can allocate into
+///
+/// This lets the generated code check for space in the nursery
+/// without having to call into the runtime.
+extern uint8_t *g_HeapLimit;
+#endif
+
+/// Get a current cursor, where writes to the Heap will happen
+static inline uint8_t *heap_cursor() {
+  return g_HeapCursor;
+}
+
+static inline void heap_write(void *data, size_t bytes) {
+  memcpy(g_HeapCursor, data, bytes);
+  g_HeapCursor += bytes;
+}
+
+/// Write a pointer into the heap
+static inline void heap_write_ptr(uint8_t *ptr) {
+  heap_write(&ptr, sizeof(uint8_t *));
+}
+
+/// Write an info table pointer into the heap
+static inline void heap_write_info_table(InfoTable *ptr) {
+  heap_write(&ptr, sizeof(InfoTable *));
+}
+
+/// Write an integer into the heap
+static inline void heap_write_int(int64_t x) {
+  heap_write(&x, sizeof(int64_t));
+}
+
+/// Write a short unsigned integer into the heap
+static inline void heap_write_uint16(uint16_t x) {
+  heap_write(&x, sizeof(uint16_t));
+}
+
+/// Read a ptr from a chunk of data
+static inline uint8_t *read_ptr(uint8_t *data) {
+  uint8_t *ret;
+  memcpy(&ret, data, sizeof(uint8_t *));
+  return ret;
+}
+
+/// Read a 64 bit integer from a chunk of data
+static inline int64_t read_int(uint8_t *data) {
+  int64_t ret;
+  memcpy(&ret, data, sizeof(int64_t));
+  return ret;
+}
+
+/// Every closure starts at a multiple of this many bytes
+///
+/// This leaves the low bits of a pointer to a closure free, which we use
+/// to tag pointers to constructors that have already been evaluated.
+#define CLOSURE_ALIGNMENT 8
+
+/// The bits of a pointer holding its tag
+#define TAG_MASK ((uintptr_t)(CLOSURE_ALIGNMENT - 1))
+
+/// Round a size up, so that the next closure will be aligned
+static inline size_t align_size(size_t size) {
+  return (size + CLOSURE_ALIGNMENT - 1) & ~TAG_MASK;
+}
+
+/// Get the tag of a pointer to a closure
+///
+/// A tag of 0 means that we know nothing about the closure, and need to
+/// enter it. Otherwise, the closure is an evaluated constructor: tags
+/// up to 6 are stored as that tag plus one, with larger tags all sharing 7.
+static inline uintptr_t pointer_tag(uint8_t *closure) {
+  return (uintptr_t)closure & TAG_MASK;
+}
+
+/// Remove the tag from a pointer, so that we can look inside the closure
+static inline uint8_t *untag(uint8_t *closure) {
+  return (uint8_t *)((uintptr_t)closure & ~TAG_MASK);
+}
+
+/// Tag a pointer to an evaluated constructor with a certain tag
+static inline uint8_t *tag_constructor(uint8_t *closure, uint16_t tag) {
+  uintptr_t bits = tag < TAG_MASK - 1 ? tag + 1 : TAG_MASK;
+  return (uint8_t *)((uintptr_t)closure | bits);
+}
+
+/// Read a pointer to an info table from a chunk of data
+///
+/// The data can be a tagged pointer to a closure.
+static inline InfoTable *read_info_table(uint8_t *data) {
+#ifdef THREADED
+  // Another capability might have just updated this closure, and we need
+  // to see whatever it wrote before publishing the new table
+  return __atomic_load_n((InfoTable **)untag(data), __ATOMIC_ACQUIRE);
+#else
+  InfoTable *ret;
+  memcpy(&ret, untag(data), sizeof(InfoTable *));
+  return ret;
+#endif
+}
+
+/// Write a ptr into a chunk of data
+static inline void write_ptr(uint8_t *data, uint8_t *ptr) {
+  memcpy(data, &ptr, sizeof(uint8_t *));
+}
+
+/// Write a 64 bit integer into a chunk of data
+static inline void write_int(uint8_t *data, int64_t x) {
+  memcpy(data, &x, sizeof(int64_t));
+}
+
+/// Write a pointer to an info table into a chunk of data
+static inline void write_info_table(uint8_t *data, InfoTable *table) {
+  memcpy(data, &table, sizeof(InfoTable *));
+}
+
+/// Claim a thunk we're about to evaluate, turning it into a black hole
+///
+/// Only the threaded runtime needs to do this as soon as a thunk gets entered,
+/// since another capability might be entering it at the same time. This fails
+/// if the thunk no longer has its own table, because someone else got there first.
+static inline int claim_thunk(uint8_t *closure, InfoTable *table) {
+#ifdef THREADED
+  InfoTable *expected = table;
+  return __atomic_compare_exchange_n((InfoTable **)closure, &expected,
+                                     &table_for_black_hole, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#else
+  (void)closure;
+  (void)table;
+  return 1;
+#endif
+}
+
+
+void collect_garbage(size_t extra_required);
+
+/// Reserve a certain amount of bytes in the Heap
+///
+/// The point of this function is to trigger garbage collection, growing
+/// the Heap, if necessary.
+///
+/// No bounds checking of the Heap is done otherwise.
+static inline void heap_reserve(size_t amount) {
+  // We'd need to write beyond the capacity of our buffer
+  if (g_HeapCursor + amount > g_HeapLimit) {
+    collect_garbage(amount);
+  }
+}
+
+/// The smallest int we keep a shared, preboxed closure for
+#define SHARED_INT_MIN (-16)
+/// The largest int we keep a shared, preboxed closure for
+#define SHARED_INT_MAX 255
+
+/// A statically allocated closure holding an int
+///
+/// This has the same layout as a `with_int` closure, but lives outside
+/// of the heap, so it's never moved or collected.
+typedef struct SharedInt {
+  InfoTable *table;
+  int64_t value;
+} SharedInt;
+
+/// The preboxed ints between `SHARED_INT_MIN` and `SHARED_INT_MAX`
+extern SharedInt g_SharedInts[SHARED_INT_MAX - SHARED_INT_MIN + 1];
+
+/// Get a pointer to the shared closure for a small int
+static inline uint8_t *shared_int(int64_t value) {
+  return (uint8_t *)&g_SharedInts[value - SHARED_INT_MIN];
+}
+
+/// The size of the header of a constructor closure
+///
+/// This holds its table, tag, and number of items, padded so that the items
+/// stay aligned. This also leaves room for a forwarding pointer, even if
+/// there are no items.
+static const size_t CONSTRUCTOR_HEADER_SIZE =
+    sizeof(InfoTable *) + 2 * sizeof(uint16_t) + sizeof(uint32_t);
+
+/// How many constructor tags we keep a shared nullary closure for
+#define SHARED_CONSTRUCTOR_COUNT 256
+
+/// A statically allocated constructor closure without any items
+///
+/// This has the same layout as a `with_constructor` closure.
+typedef struct SharedConstructor {
+  InfoTable *table;
+  uint16_t tag;
+  uint16_t items;
+  uint32_t padding;
+} SharedConstructor;
+
+/// A shared closure for each nullary constructor, like `True` or `Nothing`
+extern SharedConstructor g_SharedConstructors[SHARED_CONSTRUCTOR_COUNT];
+
+/// Get a tagged pointer to the shared closure for a nullary constructor
+static inline uint8_t *shared_constructor(uint16_t tag) {
+  return tag_constructor((uint8_t *)&g_SharedConstructors[tag], tag);
+}
+
+// The rest of the runtime, which the generated code calls into
+
+uint8_t *gc_copy(uint8_t *base, size_t size);
+void write_barrier(uint8_t *closure, uint8_t *pointee);
+uint8_t *evacuate(uint8_t *closure);
+uint8_t *selector_evac(uint8_t *base, uint16_t tag, size_t field);
+void collect_root(uint8_t **root);
+void stack_reserve(size_t a_items, size_t b_items);
+
+size_t string_length(uint8_t *s);
+uint8_t *string_data(uint8_t *s);
+uint8_t *string_flatten(uint8_t *s);
+uint8_t *string_concat(uint8_t *s1, uint8_t *s2);
+int string_equals(uint8_t *s, const char *data, size_t length);
+void string_print(uint8_t *s);
+void print_int(int64_t x);
+void print_line(const char *line);
+
+void save_SB();
+void save_SA();
+void *update_constructor(void);
+void *evaluation_frame(void);
+void update_with_int();
+void update_with_string();
+void return_constructor(uint8_t *closure);
+uint8_t *write_constructor(uint8_t *base, uint16_t tag, uint16_t items);
+void update_with_constructor();
+void update_with_value();
+CodeLabel check_application_update(int64_t arg_count, CodeLabel current);
+uint8_t *claim_caf(CAFCell *cell, uint8_t *unevaluated, uint8_t *black_hole);
+void spark(uint8_t *closure);
+
+void setup(int argc, char **argv);
+void cleanup();
+
+#endif
@@ -2,19 +2,27 @@
 {-# LANGUAGE LambdaCase #-}
 {-# LANGUAGE RecordWildCards #-}
 
-module CWriter (writeC) where
+module CWriter (hPutC, splitC, fingerprintOf) where
 
 import Cmm hiding (cmm)
+import Control.Monad (foldM, foldM_, zipWithM)
 import Control.Monad.Reader
 import Control.Monad.Writer
+import Data.Bits (xor)
+import qualified Data.ByteString as ByteString
+import Data.ByteString.Builder (Builder)
+import qualified Data.ByteString.Builder as Builder
+import qualified Data.ByteString.Lazy as LazyByteString
 import Data.Foldable (Foldable (fold))
 import Data.IntMap (IntMap)
 import qualified Data.IntMap as IntMap
-import Data.List (intercalate)
+import Data.List (foldl', intercalate, tails)
 import qualified Data.Map as Map
 import Data.Maybe (fromMaybe)
 import qualified Data.Set as Set
+import Data.Word (Word64, Word8)
 import Ourlude
+import System.IO (Handle)
 import Text.Printf (printf)
 
 -- | The type we use to store global function information
@@ -42,6 +50,9 @@ cLocation (LocationTable mp) = \case
   -- Strings, on the other hand, do need to be explicitly located,
   -- so they need to have an entry here
   PrimIntLocation i -> Just (show i)
+  -- The shared closures are always there in the runtime
+  SharedInt i -> Just (printf "shared_int(%d)" i)
+  SharedConstructor tag -> Just (printf "shared_constructor(%d)" tag)
   other -> Map.lookup other mp
 
 singleLocation :: Location -> CCode -> LocationTable
@@ -52,8 +63,9 @@ manyLocations = Map.fromList >>> LocationTable
 
 -- | A type for CCode.
 --
--- We could use something more efficient than a string, but this is ok
--- for our explanation purposes
+-- Each fragment of code is a string, which is convenient to build up with printf.
+-- Whole lines get written out into a Builder instead, so that the output doesn't
+-- need to be kept around as a string.
 type CCode = String
 
 {- Common variable names -}
@@ -65,10 +77,23 @@ cafCellFor path = "caf_cell_for_" <> displayPath path
 allocationSizeVar :: CCode
 allocationSizeVar = "allocation_size"
 
+-- | A variable name for the part of the heap a body allocates into
+heapPointerVar :: CCode
+heapPointerVar = "hp"
+
+-- | The location a given number of words into the space a body allocates into
+heapAt :: Int -> CCode
+heapAt 0 = heapPointerVar
+heapAt n = printf "%s + %d * sizeof(uint8_t*)" heapPointerVar n
+
 -- | A variable name for the Nth argument passed to us
 argVar :: Index -> CCode
 argVar n = "arg_" <> show n
 
+-- | A variable name for the Nth int argument passed to us
+intArgVar :: Index -> CCode
+intArgVar n = "int_arg_" <> show n
+
 -- | A variable name for the Nth constructor argument passed to us
 constructorArgVar :: Index -> CCode
 constructorArgVar n = "constructor_arg_" <> show n
@@ -93,6 +118,14 @@ closurePointerTmp = "tmp_closure_ptr"
 allocatedVar :: Index -> CCode
 allocatedVar n = "allocated_" <> show n
 
+-- | A variable name for a constructor we've allocated
+constructedVar :: Index -> CCode
+constructedVar n = "constructed_" <> show n
+
+-- | A variable name for an int we've computed
+primTempVar :: Index -> CCode
+primTempVar n = "prim_temp_" <> show n
+
 -- | A variable name for the Nth buried pointer
 buriedPtrVar :: Index -> CCode
 buriedPtrVar n = "buried_ptr_" <> show n
@@ -105,15 +138,30 @@ buriedIntVar n = "buried_int_" <> show n
 buriedStringVar :: Index -> CCode
 buriedStringVar n = "buried_string_" <> show n
 
--- | A variable name for the nth string literal
-stringLiteralVar :: Index -> CCode
-stringLiteralVar n = "string_literal_" <> show n
+-- | A variable name for a string literal
+--
+-- This is named after the contents of the literal, instead of its position among the
+-- literals of the program, so that other literals coming and going don't rename it.
+stringLiteralVar :: String -> CCode
+stringLiteralVar = fingerprintOfString >>> printf "string_literal_%016x"
 
 -- | A variable name for the evac function given a bound argument shape
 evacArgInfoVar :: ArgInfo -> CCode
-evacArgInfoVar (ArgInfo 0 0 0) = "evac_empty"
-evacArgInfoVar ArgInfo {..} =
-  "evac"
+evacArgInfoVar = argInfoVar "evac"
+
+-- | A variable name for the scavenge function given a bound argument shape
+scavengeArgInfoVar :: ArgInfo -> CCode
+scavengeArgInfoVar = argInfoVar "scavenge"
+
+-- | A variable name for the evac function of thunks selecting a given field
+selectorEvacVar :: (Tag, Int) -> CCode
+selectorEvacVar (tag, field) = printf "selector_evac_%d_%d" tag field
+
+-- | A variable name for some GC function, given a bound argument shape
+argInfoVar :: CCode -> ArgInfo -> CCode
+argInfoVar prefix (ArgInfo 0 0 0) = prefix <> "_empty"
+argInfoVar prefix ArgInfo {..} =
+  prefix
     <> fold
       [ part "pointers" boundPointers,
         part "ints" boundInts,
@@ -123,6 +171,30 @@ evacArgInfoVar ArgInfo {..} =
     part _ 0 = ""
     part tag n = "_" <> show n <> "_" <> tag
 
+{- String Literals -}
+
+-- | The bytes of a string, encoded as UTF-8, which is how the runtime stores strings
+utf8Bytes :: String -> [Word8]
+utf8Bytes = Builder.stringUtf8 >>> Builder.toLazyByteString >>> LazyByteString.unpack
+
+-- | The number of bytes a string takes up in the runtime
+utf8Length :: String -> Int
+utf8Length = utf8Bytes >>> length
+
+-- | A C string literal containing exactly the bytes of a string
+--
+-- Haskell's `show` uses escapes that C doesn't have, or reads differently, so we
+-- write every byte that isn't printable ASCII as an octal escape instead, which
+-- always takes 3 digits. Question marks get escaped too, since C99 has trigraphs.
+cStringLiteral :: String -> CCode
+cStringLiteral s = "\"" <> foldMap escape (utf8Bytes s) <> "\""
+  where
+    escape :: Word8 -> CCode
+    escape b
+      | b == 34 || b == 92 = ['\\', toEnum (fromIntegral b)]
+      | b >= 32 && b < 127 && b /= 63 = [toEnum (fromIntegral b)]
+      | otherwise = printf "\\%03o" b
+
 {- Nested Identifiers -}
 
 -- | Represents a sequence of function names
@@ -159,6 +231,20 @@ displayPath (IdentPath names) =
           '_' -> "__"
           x -> pure x
 
+-- | Display a path as a readable name, for profiling reports
+--
+-- Unlike `displayPath`, this doesn't need to be a valid C identifier,
+-- so we can keep the original names around.
+displayName :: IdentPath -> String
+displayName (IdentPath names) =
+  names |> reverse |> map convertName |> intercalate "."
+  where
+    convertName :: FunctionName -> String
+    convertName = \case
+      PlainFunction name -> name
+      CaseFunction index -> "case_" ++ show index
+      Entry -> "entry"
+
 -- | Get the table name for some identifier path
 tableName :: IdentPath -> CCode
 tableName = displayPath >>> ("table_for_" <>)
@@ -167,6 +253,21 @@ tableName = displayPath >>> ("table_for_" <>)
 tablePtrName :: IdentPath -> CCode
 tablePtrName = displayPath >>> ("table_pointer_for_" <>)
 
+-- | Get the constant the runtime uses for some kind of return
+returnKindName :: ReturnKind -> CCode
+returnKindName = \case
+  IntReturn -> "RETURN_INT"
+  StringReturn -> "RETURN_STRING"
+  ConstructorReturn -> "RETURN_CONSTRUCTOR"
+
+-- | Get the name of the fast entry for some identifier path
+fastEntryName :: IdentPath -> CCode
+fastEntryName = displayPath >>> ("fast_entry_for_" <>)
+
+-- | Get the name of the ticky counters for some identifier path
+tickyName :: IdentPath -> CCode
+tickyName = displayPath >>> ("ticky_for_" <>)
+
 -- | The number of columns we're currently indented
 type Indent = Int
 
@@ -192,20 +293,22 @@ data Context = Context
     -- | A table for CCode to use different locations
     locationTable :: LocationTable,
     -- | A table mapping indexed sub functions to full identifier paths
-    subFunctionTable :: IntMap IdentPath
+    subFunctionTable :: IntMap IdentPath,
+    -- | Whether or not continuations need to be told what kind of value they get
+    returnKinds :: Bool
   }
   deriving (Show)
 
 -- | A context we can use at the start of our traversal
 startingContext :: Context
-startingContext = Context mempty 0 mempty mempty mempty mempty
+startingContext = Context mempty 0 mempty mempty mempty mempty False
 
 -- | A computational context we use when generating C code
-newtype CWriter a = CWriter (ReaderT Context (Writer CCode) a)
-  deriving (Functor, Applicative, Monad, MonadReader Context, MonadWriter CCode)
+newtype CWriter a = CWriter (ReaderT Context (Writer Builder) a)
+  deriving (Functor, Applicative, Monad, MonadReader Context, MonadWriter Builder)
 
 -- | Run a CWriter computation, using the starting context
-runCWriter :: CWriter a -> (a, CCode)
+runCWriter :: CWriter a -> (a, Builder)
 runCWriter (CWriter m) =
   runReaderT m startingContext |> runWriter
 
@@ -213,9 +316,9 @@ runCWriter (CWriter m) =
 writeLine :: CCode -> CWriter ()
 writeLine code = do
   amount <- asks currentIndent
-  tell (replicate amount ' ')
-  tell code
-  tell "\n"
+  tell (Builder.string7 (replicate amount ' '))
+  tell (Builder.stringUtf8 code)
+  tell (Builder.char7 '\n')
 
 -- | Write a comment line
 --
@@ -251,15 +354,16 @@ withGlobals globals =
     impliedLocations =
       globals |> IntMap.toList |> foldMap table
 
--- | Get the C function for some global
-getGlobalFunction :: Index -> CWriter CCode
-getGlobalFunction i = do
-  globals' <- asks globals
-  let path = IntMap.findWithDefault err i globals'
-  return (displayPath path)
+-- | Get the path for some global
+getGlobalPath :: Index -> CWriter IdentPath
+getGlobalPath i = asks (globals >>> IntMap.findWithDefault err i)
   where
     err = error ("Global Function " <> show i <> " does not exist")
 
+-- | Get the C function for some global
+getGlobalFunction :: Index -> CWriter CCode
+getGlobalFunction = getGlobalPath >>> fmap displayPath
+
 withCafs :: TopLevels -> CWriter a -> CWriter a
 withCafs cafs =
   local (\r -> r {cafs = cafs}) >>> withLocations impliedLocations
@@ -305,8 +409,8 @@ getCLocation location = do
   where
     err = error ("could not find C location for " ++ show location)
 
-getCafCell :: Index -> CWriter CCode
-getCafCell n = asks (cafs >>> IntMap.findWithDefault err n >>> cafCellFor)
+getCafPath :: Index -> CWriter IdentPath
+getCafPath n = asks (cafs >>> IntMap.findWithDefault err n)
   where
     err = error ("CAF " <> show n <> " has no cell associated with it")
 
@@ -331,37 +435,116 @@ gatherGlobals (Cmm functions entry) = gatherInFunctions (entry : functions)
         thoseMappings <- gatherInFunctions subFunctions
         return (thisMapping <> thoseMappings)
 
+-- | Apply the C operator for some builtin to two ints
+applyOperator :: Builtin2 -> CCode -> CCode -> CCode
+applyOperator b l1 l2 = case b of
+  Add2 -> printf "%s + %s" l1 l2
+  Sub2 -> printf "%s - %s" l1 l2
+  Mul2 -> printf "%s * %s" l1 l2
+  Div2 -> printf "%s / %s" l1 l2
+  Less2 -> printf "%s < %s" l1 l2
+  LessEqual2 -> printf "%s <= %s" l1 l2
+  Greater2 -> printf "%s > %s" l1 l2
+  GreaterEqual2 -> printf "%s >= %s" l1 l2
+  EqualTo2 -> printf "%s == %s" l1 l2
+  NotEqualTo2 -> printf "%s != %s" l1 l2
+  Concat2 -> error "concatenation doesn't produce an int"
+
+-- | Generate the C expression computing some int
+--
+-- Every operation gets parenthesized, so that we don't have to
+-- worry about the precedence of the operators in C.
+genPrimExpr :: PrimExpr -> CWriter CCode
+genPrimExpr = \case
+  PrimValue location -> getCLocation location
+  PrimApply2 b e1 e2 -> do
+    c1 <- genPrimExpr e1
+    c2 <- genPrimExpr e2
+    return (printf "(%s)" (applyOperator b c1 c2))
+  PrimNegate e -> printf "(- %s)" <$> genPrimExpr e
+
 -- | Generate the C code to handle the instructions in a body
 --
 -- This assumes that all the necessary locations have been supplied
 genInstructions :: Body -> CWriter ()
 genInstructions (Body _ _ []) = writeLine "return NULL;"
 genInstructions (Body _ _ [PopExcessConstructorArgs]) = writeLine "return NULL;"
-genInstructions (Body _ _ instrs) =
-  forM_ instrs <| \instr -> do
-    comment (show instr)
-    genInstr instr
+genInstructions (Body _ _ instrs) = do
+  claimHeapSpace
+  constructed <- declareAllocations
+  withLocations constructed <| foldM_ genWithOffset 0 (zip instrs (drop 1 (tails instrs)))
   where
+    -- The space for this body has already been reserved, so we can bump
+    -- the heap cursor once, and then write each field at a fixed offset.
+    claimHeapSpace = case sum (map allocatedWords instrs) of
+      0 -> return ()
+      count -> do
+        comment "claim the space reserved on the heap"
+        writeLine (printf "uint8_t* %s = g_HeapCursor;" heapPointerVar)
+        writeLine (printf "g_HeapCursor += %d * sizeof(uint8_t*);" count)
+
+    -- Allocated closures can point to each other, so we name all of them
+    -- before writing any of their fields.
+    declareAllocations = do
+      let offsets = scanl (+) 0 (map allocatedWords instrs)
+      fold <$> zipWithM declareAllocation offsets instrs
+
+    declareAllocation offset = \case
+      AllocTable index -> do
+        writeLine (printf "uint8_t* %s = %s;" (allocatedVar index) (heapAt offset))
+        return mempty
+      AllocConstructor index tag _ -> do
+        let var = constructedVar index
+        writeLine (printf "uint8_t* %s = tag_constructor(%s, %d);" var (heapAt offset) tag)
+        return (singleLocation (Constructed index) var)
+      ComputeInt (PrimTemp index) _ -> do
+        let var = primTempVar index
+        writeLine (printf "int64_t %s;" var)
+        return (singleLocation (PrimTemp index) var)
+      _ -> return mempty
+
+    genWithOffset offset (instr, rest) = do
+      comment (show instr)
+      genInstr offset instr
+      profileAllocation instr rest
+      return (offset + allocatedWords instr)
+
+    -- In profiling builds, we attribute each allocation to its table.
+    -- The fields of a closure always come right after its table.
+    profileAllocation instr rest = case instr of
+      AllocTable index -> do
+        table <- getTableName index
+        let fields = rest |> takeWhile isField |> length
+        writeLine (printf "PROFILE_ALLOC(&%s, sizeof(InfoTable*) + %d * sizeof(uint8_t*));" table fields)
+      AllocConstructor _ _ fields ->
+        writeLine (printf "PROFILE_ALLOC(&table_for_with_constructor, CONSTRUCTOR_HEADER_SIZE + %d * sizeof(uint8_t*));" fields)
+      CreateCAFClosure _ ->
+        writeLine "PROFILE_ALLOC(&table_for_black_hole, sizeof(InfoTable*) + sizeof(uint8_t*));"
+      _ -> return ()
+
+    -- Each of these fields takes up 8 bytes
+    isField = \case
+      AllocPointer _ -> True
+      AllocBlankPointer -> True
+      AllocInt _ -> True
+      AllocString _ -> True
+      _ -> False
+
+    -- The node register always holds an untagged pointer
+    genEnter l = do
+      writeLine (printf "g_NodeRegister = untag(%s);" l)
+      writeLine "JUMP(read_info_table(g_NodeRegister)->entry);"
+
     genB1 b l = case b of
-      PrintInt1 -> writeLine (printf "printf(\"%%ld\\n\", %s);" l)
-      PrintString1 ->
-        writeLine (printf "printf(\"%%s\\n\", (char*)(%s + sizeof(InfoTable*)));" l)
-      Negate1 -> writeLine (printf "g_IntRegister = -%s;" l)
+      PrintInt1 -> writeLine (printf "print_int(%s);" l)
+      PrintString1 -> writeLine (printf "string_print(%s);" l)
+      Negate1 -> writeLine (printf "g_IntRegister = - %s;" l)
 
     genB2 b l1 l2 = case b of
-      Add2 -> writeLine (printf "g_IntRegister = %s + %s;" l1 l2)
-      Sub2 -> writeLine (printf "g_IntRegister = %s - %s;" l1 l2)
-      Mul2 -> writeLine (printf "g_IntRegister = %s * %s;" l1 l2)
-      Div2 -> writeLine (printf "g_IntRegister = %s / %s;" l1 l2)
-      Less2 -> writeLine (printf "g_IntRegister = %s < %s;" l1 l2)
-      LessEqual2 -> writeLine (printf "g_IntRegister = %s <= %s;" l1 l2)
-      Greater2 -> writeLine (printf "g_IntRegister = %s > %s;" l1 l2)
-      GreaterEqual2 -> writeLine (printf "g_IntRegister = %s >= %s;" l1 l2)
-      EqualTo2 -> writeLine (printf "g_IntRegister = %s == %s;" l1 l2)
-      NotEqualTo2 -> writeLine (printf "g_IntRegister = %s /= %s;" l1 l2)
       Concat2 -> writeLine (printf "g_StringRegister = string_concat(%s, %s);" l1 l2)
+      _ -> writeLine (printf "g_IntRegister = %s;" (applyOperator b l1 l2))
 
-    genInstr = \case
+    genInstr offset = \case
       StoreInt location ->
         getCLocation location >>= \l ->
           writeLine (printf "g_IntRegister = %s;" l)
@@ -372,99 +555,210 @@ genInstructions (Body _ _ instrs) =
       StoreConstructorArgCount count ->
         writeLine (printf "g_ConstructorArgCountRegister = %d;" count)
       PopExcessConstructorArgs ->
-        writeLine "g_SA.top -= g_ConstructorArgCountRegister;"
+        writeLine "g_SATop -= g_ConstructorArgCountRegister;"
       Enter (Global i) ->
         getGlobalFunction i >>= \l ->
-          writeLine (printf "return &%s;" l)
+          writeLine (printf "JUMP(&%s);" l)
       Enter location ->
-        getCLocation location >>= \l -> do
-          writeLine (printf "g_NodeRegister = %s;" l)
-          writeLine (printf "return read_info_table(%s)->entry;" l)
-      EnterCaseContinuation -> do
-        writeLine "--g_SB.top;"
-        writeLine "return g_SB.top[0].as_code;"
+        getCLocation location >>= genEnter
+      EnterScrutinee (Global i) _ ->
+        getGlobalFunction i >>= \l ->
+          writeLine (printf "JUMP(&%s);" l)
+      EnterScrutinee location index -> do
+        l <- getCLocation location
+        function <- getSubFunction index
+        writeLine (printf "if (pointer_tag(%s) != 0) {" l)
+        indented <| do
+          writeLine (printf "return_constructor(%s);" l)
+          writeLine "--g_SBTop;"
+          writeLine (printf "JUMP(&%s);" function)
+        writeLine "}"
+        genEnter l
+      EnterFast i ptrs ints -> do
+        entry <- fastEntryName <$> getGlobalPath i
+        ptrs' <- mapM getCLocation ptrs
+        ints' <- mapM getCLocation ints
+        forM_ (zip [0 :: Int ..] ptrs') <| \(n, l) ->
+          writeLine (printf "g_ArgRegisters[%d] = %s;" n l)
+        forM_ (zip [0 :: Int ..] ints') <| \(n, l) ->
+          writeLine (printf "g_IntArgRegisters[%d] = %s;" n l)
+        writeLine (printf "g_ArgRegisterCount = %d;" (length ptrs))
+        writeLine (printf "JUMP(&%s);" entry)
+      EnterCaseContinuation kind -> do
+        tellKind <- asks returnKinds
+        when tellKind <| writeLine (printf "g_ReturnKindRegister = %s;" (returnKindName kind))
+        writeLine "--g_SBTop;"
+        writeLine "JUMP(g_SBTop[0].as_code);"
       Exit -> writeLine "return NULL;"
       Builtin2 b location1 location2 -> do
         l1 <- getCLocation location1
         l2 <- getCLocation location2
         genB2 b l1 l2
       Builtin1 b location -> getCLocation location >>= genB1 b
+      ComputeInt location expr -> do
+        l <- getCLocation location
+        e <- genPrimExpr expr
+        writeLine (printf "%s = %s;" l e)
       PushSA location ->
         getCLocation location >>= \l -> do
-          writeLine (printf "g_SA.top[0] = %s;" l)
-          writeLine "++g_SA.top;"
+          writeLine (printf "g_SATop[0] = %s;" l)
+          writeLine "++g_SATop;"
+      PushSB location ->
+        getCLocation location >>= \l -> do
+          writeLine (printf "g_SBTop[0].as_int = %s;" l)
+          writeLine "++g_SBTop;"
       PushConstructorArg location ->
         getCLocation location >>= \l -> do
-          writeLine (printf "g_SA.top[0] = %s;" l)
-          writeLine "++g_SA.top;"
+          writeLine (printf "g_SATop[0] = %s;" l)
+          writeLine "++g_SATop;"
       PushCaseContinuation index -> do
         function <- getSubFunction index
-        writeLine (printf "g_SB.top[0].as_code = &%s;" function)
-        writeLine "++g_SB.top;"
+        writeLine (printf "g_SBTop[0].as_code = &%s;" function)
+        writeLine "++g_SBTop;"
+      PushEvaluationFrame -> do
+        comment "pushing evaluation frame"
+        writeLine "save_SB();"
+        writeLine "save_SA();"
+        writeLine "g_SBTop[0].as_closure = NULL;"
+        writeLine "g_SBTop[1].as_code = &evaluation_frame;"
+        writeLine "g_SBTop += 2;"
+      SparkClosure location ->
+        getCLocation location >>= \l ->
+          writeLine (printf "spark(%s);" l)
       Bury location ->
         getCLocation location >>= \l -> do
-          writeLine (printf "g_SA.top[0] = %s;" l)
-          writeLine "++g_SA.top;"
+          writeLine (printf "g_SATop[0] = %s;" l)
+          writeLine "++g_SATop;"
       BuryInt location ->
         getCLocation location >>= \l -> do
-          writeLine (printf "g_SB.top[0].as_int = %s;" l)
-          writeLine "++g_SB.top;"
+          writeLine (printf "g_SBTop[0].as_int = %s;" l)
+          writeLine "++g_SBTop;"
       BuryString location ->
         getCLocation location >>= \l -> do
-          writeLine (printf "g_SA.top[0] = %s;" l)
-          writeLine "++g_SA.top;"
+          writeLine (printf "g_SATop[0] = %s;" l)
+          writeLine "++g_SATop;"
       AllocTable index -> do
-        let var = allocatedVar index
         table <- getTableName index
-        writeLine (printf "uint8_t* %s = heap_cursor();" var)
-        writeLine (printf "heap_write_info_table(&%s);" table)
+        writeLine (printf "write_info_table(%s, &%s);" (allocatedVar index) table)
+      AllocConstructor _ tag fields ->
+        writeLine (printf "write_constructor(%s, %d, %d);" (heapAt offset) tag fields)
       AllocPointer location ->
         getCLocation location >>= \l ->
-          writeLine (printf "heap_write_ptr(%s);" l)
+          writeLine (printf "write_ptr(%s, %s);" (heapAt offset) l)
       AllocBlankPointer -> do
-        writeLine (printf "heap_write_ptr(NULL);")
+        writeLine (printf "write_ptr(%s, NULL);" (heapAt offset))
       AllocInt location ->
         getCLocation location >>= \l ->
-          writeLine (printf "heap_write_int(%s);" l)
+          writeLine (printf "write_int(%s, %s);" (heapAt offset) l)
       AllocString location ->
         getCLocation location >>= \l ->
-          writeLine (printf "heap_write_ptr(%s);" l)
+          writeLine (printf "write_ptr(%s, %s);" (heapAt offset) l)
       PrintError s ->
-        writeLine (printf "puts(\"Error:\\n%s\");" s)
+        writeLine (printf "print_line(\"Error:\\n%s\");" s)
       PushUpdate -> do
         comment "pushing update frame"
+        ticky <- asks (currentFunction >>> tickyName)
+        writeLine (printf "TICKY_UPDATE_FRAME(%s);" ticky)
         writeLine "save_SB();"
         writeLine "save_SA();"
-        writeLine "g_SB.top[0].as_closure = g_NodeRegister;"
+        writeLine "g_SBTop[0].as_closure = g_NodeRegister;"
         -- If we encounter a case expression, it knows what to do here.
-        writeLine "g_SB.top[1].as_code = &update_constructor;"
-        writeLine "g_SB.top += 2;"
+        writeLine "g_SBTop[1].as_code = &update_constructor;"
+        writeLine "g_SBTop += 2;"
+      ClaimNode -> do
+        table <- asks (currentFunction >>> tableName)
+        writeLine (printf "if (!claim_thunk(g_NodeRegister, &%s)) {" table)
+        indented (writeLine "JUMP(read_info_table(g_NodeRegister)->entry);")
+        writeLine "}"
+      BlackHoleNode ->
+        writeLine "write_info_table(g_NodeRegister, &table_for_black_hole);"
       CreateCAFClosure index -> do
-        cell <- getCafCell index
-        writeLine (printf "*g_CAFListLast = &%s;" cell)
-        writeLine (printf "g_CAFListLast = &%s.next;" cell)
-        writeLine (printf "%s.closure = heap_cursor();" cell)
-        writeLine (printf "g_NodeRegister = %s.closure;" cell)
-        writeLine "heap_write_info_table(&table_for_black_hole);"
-        -- For padding purposes
-        writeLine "heap_write_ptr(NULL);"
-
-genNormalBody :: Int -> ArgInfo -> Body -> CWriter ()
-genNormalBody argCount bound body = do
+        path <- getCafPath index
+        let cell = cafCellFor path
+        -- The black hole gets padding written by the runtime
+        writeLine (printf "g_NodeRegister = claim_caf(&%s, (uint8_t*)&%s, %s);" cell (tablePtrName path) (heapAt offset))
+        -- If someone else started evaluating this CAF first, we wait for its value
+        writeLine "if (g_NodeRegister == NULL) {"
+        indented <| do
+          writeLine (printf "g_NodeRegister = (uint8_t*)&%s;" cell)
+          writeLine "JUMP(read_info_table(g_NodeRegister)->entry);"
+        writeLine "}"
+
+-- | The number of words an instruction writes to the heap
+allocatedWords :: Instruction -> Int
+allocatedWords = \case
+  AllocTable _ -> 1
+  -- The table, followed by the tag and field count
+  AllocConstructor {} -> 2
+  AllocPointer _ -> 1
+  AllocBlankPointer -> 1
+  AllocInt _ -> 1
+  AllocString _ -> 1
+  -- A black hole, along with padding
+  CreateCAFClosure _ -> 2
+  _ -> 0
+
+-- | Where the body of a function finds the arguments passed to it
+data ArgSource
+  = -- | The arguments are on the stacks, for calls through the normal entry
+    OnStacks
+  | -- | The arguments are in the argument registers, for calls through the fast entry
+    InRegisters
+
+genNormalBody :: ArgSource -> Int -> Int -> ArgInfo -> Body -> CWriter ()
+genNormalBody source argCount intArgCount bound body = do
   reserveBodySpace body
-  args <- if argCount <= 0 then return mempty else popArgs
+  reserveStackSpace body
+  -- The argument registers are roots until now, in case reserving space collected garbage
+  (args, intArgs) <- case source of
+    OnStacks -> (,) <$> whenAny argCount popArgs <*> whenAny intArgCount popIntArgs
+    InRegisters -> (,) <$> readArgs <*> whenAny intArgCount readIntArgs
   boundArgs <- popBound bound
-  withLocations (args <> boundArgs) (genInstructions body)
+  withLocations (args <> intArgs <> boundArgs) (genInstructions body)
   where
+    whenAny count m = if count <= 0 then return mempty else m
+
+    readArgs :: CWriter LocationTable
+    readArgs = do
+      comment "reading register arguments"
+      pairs <-
+        forM [0 .. argCount - 1] <| \n -> do
+          let var = argVar (n + 1)
+          writeLine (printf "uint8_t* %s = g_ArgRegisters[%d];" var n)
+          return (Arg n, var)
+      writeLine "g_ArgRegisterCount = 0;"
+      return (manyLocations pairs)
+
+    readIntArgs :: CWriter LocationTable
+    readIntArgs = do
+      comment "reading register int arguments"
+      pairs <-
+        forM [0 .. intArgCount - 1] <| \n -> do
+          let var = intArgVar (n + 1)
+          writeLine (printf "int64_t %s = g_IntArgRegisters[%d];" var n)
+          return (IntArg n, var)
+      return (manyLocations pairs)
+
     popArgs :: CWriter LocationTable
     popArgs = do
       comment "popping stack arguments"
       pairs <-
         forM [1 .. argCount] <| \n -> do
           let var = argVar n
-          writeLine (printf "uint8_t* %s = g_SA.top[-%d];" var n)
+          writeLine (printf "uint8_t* %s = g_SATop[-%d];" var n)
           return (Arg (n - 1), var)
-      writeLine (printf "g_SA.top -= %d;" argCount)
+      writeLine (printf "g_SATop -= %d;" argCount)
+      return (manyLocations pairs)
+
+    popIntArgs :: CWriter LocationTable
+    popIntArgs = do
+      comment "popping int arguments"
+      pairs <-
+        forM [1 .. intArgCount] <| \n -> do
+          let var = intArgVar n
+          writeLine (printf "int64_t %s = g_SBTop[-%d].as_int;" var n)
+          return (IntArg (n - 1), var)
+      writeLine (printf "g_SBTop -= %d;" intArgCount)
       return (manyLocations pairs)
 
     popBound :: ArgInfo -> CWriter LocationTable
@@ -517,16 +811,48 @@ reserveBodySpace (Body Allocation {..} _ _) = do
   addSize "pointer allocations" "sizeof(uint8_t*)" pointersAllocated
   addSize "int allocations" "sizeof(int64_t)" intsAllocated
   addSize "string allocations" "sizeof(uint8_t*)" stringsAllocated
-  writeLine (printf "heap_reserve(%s);\n" allocationSizeVar)
+  writeLine (printf "heap_reserve(%s);" allocationSizeVar)
+  ticky <- asks (currentFunction >>> tickyName)
+  writeLine (printf "TICKY_ALLOC(%s, %s);\n" ticky allocationSizeVar)
   where
     addSize _ _ 0 = return ()
     addSize cmt sizeof count = do
       comment cmt
       writeLine (printf "%s += %d * %s;" allocationSizeVar count sizeof)
 
+-- | Make sure that the stacks have room for everything a body pushes
+--
+-- Like with the heap, we do this once at the start of the body, instead
+-- of checking before every single push.
+reserveStackSpace :: Body -> CWriter ()
+reserveStackSpace (Body _ _ instrs) =
+  case (sum (map fst usages), sum (map snd usages)) of
+    (0, 0) -> return ()
+    (saItems, sbItems) -> do
+      comment "reserve enough space on the stacks"
+      writeLine (printf "stack_reserve(%d, %d);\n" saItems sbItems)
+  where
+    usages = map stackUsage instrs
+
+    stackUsage :: Instruction -> (Int, Int)
+    stackUsage = \case
+      PushSA _ -> (1, 0)
+      PushSB _ -> (0, 1)
+      PushConstructorArg _ -> (1, 0)
+      Bury _ -> (1, 0)
+      BuryString _ -> (1, 0)
+      BuryInt _ -> (0, 1)
+      PushCaseContinuation _ -> (0, 1)
+      -- An update frame takes up 4 items on the secondary stack
+      PushUpdate -> (0, 4)
+      -- As does an evaluation frame, which has the same layout
+      PushEvaluationFrame -> (0, 4)
+      _ -> (0, 0)
+
 genContinuationBody :: ArgInfo -> Body -> CWriter ()
 genContinuationBody buriedArgs body = do
   reserveBodySpace body
+  reserveStackSpace body
   args <- popConstructorArgs body
   buried <- popBuriedArgs buriedArgs
   withLocations (args <> buried) (genInstructions body)
@@ -538,9 +864,9 @@ genContinuationBody buriedArgs body = do
       pairs <-
         forM [1 .. count] <| \n -> do
           let var = constructorArgVar n
-          writeLine (printf "uint8_t* %s = g_SA.top[-%d];" var n)
+          writeLine (printf "uint8_t* %s = g_SATop[-%d];" var n)
           return (ConstructorArg (n - 1), var)
-      writeLine (printf "g_SA.top -= %d;" count)
+      writeLine (printf "g_SATop -= %d;" count)
       return (manyLocations pairs)
     popBuriedArgs :: ArgInfo -> CWriter LocationTable
     popBuriedArgs (ArgInfo 0 0 0) = return mempty
@@ -559,9 +885,9 @@ genContinuationBody buriedArgs body = do
           pairs <-
             forM [1 .. count] <| \n -> do
               let var = buriedPtrVar n
-              writeLine (printf "uint8_t* %s = g_SA.top[-%d];" var n)
+              writeLine (printf "uint8_t* %s = g_SATop[-%d];" var n)
               return (Buried (n - 1), var)
-          writeLine (printf "g_SA.top -= %d;" count)
+          writeLine (printf "g_SATop -= %d;" count)
           return (manyLocations pairs)
         popInts 0 = return mempty
         popInts count = do
@@ -569,9 +895,9 @@ genContinuationBody buriedArgs body = do
           pairs <-
             forM [1 .. count] <| \n -> do
               let var = buriedIntVar n
-              writeLine (printf "int64_t %s = g_SB.top[-%d].as_int;" var n)
+              writeLine (printf "int64_t %s = g_SBTop[-%d].as_int;" var n)
               return (BuriedInt (n - 1), var)
-          writeLine (printf "g_SB.top -= %d;" count)
+          writeLine (printf "g_SBTop -= %d;" count)
           return (manyLocations pairs)
         popStrings 0 = return mempty
         popStrings count = do
@@ -579,9 +905,9 @@ genContinuationBody buriedArgs body = do
           pairs <-
             forM [1 .. count] <| \n -> do
               let var = buriedStringVar n
-              writeLine (printf "uint8_t* %s = g_SA.top[-%d];" var n)
+              writeLine (printf "uint8_t* %s = g_SATop[-%d];" var n)
               return (BuriedString (n - 1), var)
-          writeLine (printf "g_SA.top -= %d;" count)
+          writeLine (printf "g_SATop -= %d;" count)
           return (manyLocations pairs)
 
 genCasePrelude :: CCode -> CWriter ()
@@ -612,26 +938,87 @@ genIntCases buriedArgs updateWith scrut cases default' = do
       indented (genContinuationBody buriedArgs body)
       writeLine "}"
 
+-- | Generate the branches of a case expression over strings
+--
+-- Instead of comparing the scrutinee with each literal in turn, we first
+-- switch on its length, and then on its first byte, if more than one literal
+-- is left. This leaves at most a handful of comparisons to find the matching
+-- branch, whose index we then switch on.
 genStringCases :: ArgInfo -> [(String, Body)] -> Body -> CWriter ()
 genStringCases buriedArgs cases default' = do
   genCasePrelude "update_with_string();"
-  writeLine "char* scrut = (char*)(g_StringRegister + sizeof(InfoTable*));"
-  forM_ (zip [0 ..] cases) genCase
-  genDefault default'
+  -- Everything live is on the stacks at this point, so we can flatten
+  -- the string, even though that might trigger garbage collection.
+  writeLine "g_StringRegister = string_flatten(g_StringRegister);"
+  writeLine "uint8_t* scrut = g_StringRegister;"
+  comment "find the branch matching the scrutinee"
+  writeLine "int branch = -1;"
+  writeLine "switch (string_length(scrut)) {"
+  indented <| forM_ (groupOn utf8Length indexedCases) genLengthCase
+  writeLine "}"
+  writeLine "switch (branch) {"
+  indented <| do
+    forM_ (zip [0 ..] cases) genCase
+    genDefault default'
+  writeLine "}"
   where
+    indexedCases :: [(Int, String)]
+    indexedCases = zip [0 ..] (map fst cases)
+
+    -- This keeps the literals in each group in their original order,
+    -- so that the first matching branch still wins.
+    groupOn :: (String -> Int) -> [(Int, String)] -> [(Int, [(Int, String)])]
+    groupOn key entries =
+      [(key s, [(i, s)]) | (i, s) <- entries]
+        |> Map.fromListWith (flip (<>))
+        |> Map.toList
+
+    firstByte :: String -> Int
+    firstByte s = case utf8Bytes s of
+      b : _ -> fromIntegral b
+      [] -> 0
+
+    genLengthCase :: (Int, [(Int, String)]) -> CWriter ()
+    genLengthCase (len, entries) = do
+      writeLine (printf "case %d:" len)
+      indented <| do
+        case entries of
+          [_] -> genMatches entries
+          _ | len == 0 -> genMatches entries
+          _ -> do
+            writeLine "switch (string_data(scrut)[0]) {"
+            indented <| forM_ (groupOn firstByte entries) genByteCase
+            writeLine "}"
+        writeLine "break;"
+
+    genByteCase :: (Int, [(Int, String)]) -> CWriter ()
+    genByteCase (byte, entries) = do
+      writeLine (printf "case %d:" byte)
+      indented <| do
+        genMatches entries
+        writeLine "break;"
+
+    genMatches :: [(Int, String)] -> CWriter ()
+    genMatches entries = do
+      forM_ (zip [0 :: Int ..] entries) <| \(j, (i, s)) -> do
+        let condType = if j == 0 then "if" else "} else if"
+        writeLine (printf "%s (string_equals(scrut, %s, %d)) {" condType (cStringLiteral s) (utf8Length s))
+        indented (writeLine (printf "branch = %d;" i))
+      writeLine "}"
+
     genCase :: (Int, (String, Body)) -> CWriter ()
-    genCase (i, (s, body)) = do
-      let condType = if i == 0 then "if" else "} else if"
-      writeLine (printf "%s (strcmp(%s, scrut) == 0) {" condType (show s))
+    genCase (i, (_, body)) = do
+      writeLine (printf "case %d: {" i)
       indented (genContinuationBody buriedArgs body)
+      writeLine "}"
 
     genDefault body = do
-      writeLine "} else {"
+      writeLine "default: {"
       indented (genContinuationBody buriedArgs body)
       writeLine "}"
 
-genFunctionBody :: Int -> ArgInfo -> FunctionBody -> CWriter ()
-genFunctionBody argCount boundArgs = \case
+genFunctionBody :: Int -> Int -> ArgInfo -> FunctionBody -> CWriter ()
+genFunctionBody argCount intArgCount boundArgs = \case
   IntCaseBody cases default' ->
     genIntCases boundArgs "update_with_int();" "g_IntRegister" cases default'
   TagCaseBody cases default' ->
@@ -644,7 +1031,29 @@ genFunctionBody argCount boundArgs = \case
           StringUpdate -> "update_with_string();"
     genCasePrelude updateWith
     genContinuationBody boundArgs body
-  NormalBody body -> genNormalBody argCount boundArgs body
+  PolyCaseBody body -> do
+    genCasePrelude "update_with_value();"
+    -- We don't look at the constructor we get, so we can get rid of its items
+    writeLine "if (g_ReturnKindRegister == RETURN_CONSTRUCTOR) {"
+    indented (writeLine "g_SATop -= g_ConstructorArgCountRegister;")
+    writeLine "}"
+    genContinuationBody boundArgs body
+  NormalBody body -> genNormalBody OnStacks argCount intArgCount boundArgs body
+
+-- | Move the arguments a function was called with from the stacks into the argument registers
+--
+-- The normal entry of a function with a fast entry does this once it's made sure
+-- that it has enough arguments, before jumping to the fast entry.
+genMoveArgs :: Int -> Int -> CWriter ()
+genMoveArgs argCount intArgCount = do
+  comment "moving stack arguments into registers"
+  forM_ [0 .. argCount - 1] <| \n ->
+    writeLine (printf "g_ArgRegisters[%d] = g_SATop[-%d];" n (n + 1))
+  unless (argCount == 0) <| writeLine (printf "g_SATop -= %d;" argCount)
+  forM_ [0 .. intArgCount - 1] <| \n ->
+    writeLine (printf "g_IntArgRegisters[%d] = g_SBTop[-%d].as_int;" n (n + 1))
+  unless (intArgCount == 0) <| writeLine (printf "g_SBTop -= %d;" intArgCount)
+  writeLine (printf "g_ArgRegisterCount = %d;" argCount)
 
 -- | Generate the C code for a function
 genFunction :: Function -> CWriter ()
@@ -655,11 +1064,16 @@ genFunction Function {..} =
     let current = displayPath currentPath
         currentTable = tableName currentPath
         currentPointer = tablePtrName currentPath
-        evac = case closureType of
-          DynamicClosure -> printf "&%s" (evacArgInfoVar boundArgs)
-          _ -> "&static_evac"
+        currentTicky = tickyName currentPath
+        (evac, scavenge) = case closureType of
+          DynamicClosure ->
+            let evacVar = maybe (evacArgInfoVar boundArgs) selectorEvacVar selector
+             in (printf "&%s" evacVar, printf "&%s" (scavengeArgInfoVar boundArgs))
+          _ -> ("&static_evac", "NULL")
     writeLine (printf "void* %s(void);" current)
-    writeLine (printf "InfoTable %s = { &%s, %s };" currentTable current evac)
+    when hasFastEntry <| writeLine (printf "void* %s(void);" (fastEntryName currentPath))
+    writeLine (printf "InfoTable %s = { &%s, %s, %s PROFILE_NAME(%s) };" currentTable current evac scavenge (show (displayName currentPath)))
+    writeLine (printf "TICKY_COUNTER(%s, %s, %s)" currentTicky (show (displayName currentPath)) (show current))
     -- If it this is a global, we need to create a place for the info table
     -- pointer to live
     case closureType of
@@ -675,33 +1089,60 @@ genFunction Function {..} =
     writeLine (printf "void* %s() {" current)
     indented <| do
       writeLine "DEBUG_PRINT(\"%s\\n\", __func__);"
+      -- Functions with a fast entry count their entries there instead
+      unless hasFastEntry <| writeLine (printf "TICKY_ENTRY(%s);" currentTicky)
       unless (argCount == 0) <| do
         case closureType of
           GlobalClosure _ ->
             writeLine (printf "g_NodeRegister = (uint8_t*)&%s;" currentPointer)
           _ -> return ()
-        writeLine (printf "check_application_update(%d, %s);" argCount current)
-      withSubFunctionTable subFunctions
-        <| withLocations maybeAllocatedClosures
-        <| genFunctionBody argCount boundArgs body
+        -- Without enough arguments, we get the next code to run instead
+        writeLine (printf "CodeLabel label = check_application_update(%d, %s);" argCount current)
+        writeLine "if (label != NULL) {"
+        indented <| do
+          -- These calls never reach the fast entry, so we count them here
+          when hasFastEntry <| writeLine (printf "TICKY_ENTRY(%s);" currentTicky)
+          writeLine (printf "TICKY_PARTIAL_APPLICATION(%s);" currentTicky)
+          writeLine "JUMP(label);"
+        writeLine "}"
+      if hasFastEntry
+        then do
+          genMoveArgs argCount intArgCount
+          writeLine (printf "JUMP(&%s);" (fastEntryName currentPath))
+        else inBody (genFunctionBody argCount intArgCount boundArgs body)
     writeLine "}"
+    when hasFastEntry <| do
+      writeLine (printf "void* %s() {" (fastEntryName currentPath))
+      indented <| do
+        writeLine "DEBUG_PRINT(\"%s\\n\", __func__);"
+        writeLine (printf "TICKY_ENTRY(%s);" currentTicky)
+        writeLine (printf "g_NodeRegister = (uint8_t*)&%s;" currentPointer)
+        case body of
+          NormalBody normal -> inBody (genNormalBody InRegisters argCount intArgCount boundArgs normal)
+          _ -> error ("the fast entry of " <> current <> " needs a normal body")
+      writeLine "}"
   where
+    inBody =
+      withSubFunctionTable subFunctions
+        <<< withLocations maybeAllocatedClosures
+
     -- The idea is that we'll initialize these variable on demand as we
     -- see actual alloc instructions, but we know what we're going to name that
     -- variable already.
     maybeAllocatedClosures =
       manyLocations [(Allocated n, allocatedVar n) | n <- zipWith const [0 ..] subFunctions]
 
--- | Gather all the literal strings used in our program
-gatherStrings :: Cmm -> Set.Set String
-gatherStrings (Cmm functions entry) =
-  foldMap inFunction (entry : functions)
+-- | Gather all the locations some functions, and their sub functions, use
+--
+-- Calling a global through its fast entry counts as using the location of that global.
+gatherLocations :: [Function] -> Set.Set Location
+gatherLocations = foldMap inFunction
   where
-    inFunction :: Function -> Set.Set String
+    inFunction :: Function -> Set.Set Location
     inFunction Function {..} =
       inFunctionBody body <> foldMap inFunction subFunctions
 
-    inFunctionBody :: FunctionBody -> Set.Set String
+    inFunctionBody :: FunctionBody -> Set.Set Location
     inFunctionBody = \case
       IntCaseBody branches default' ->
         foldMap inBody (default' : map snd branches)
@@ -710,51 +1151,77 @@ gatherStrings (Cmm functions entry) =
       TagCaseBody branches default' ->
         foldMap inBody (default' : map snd branches)
       ContinuationBody _ body -> inBody body
+      PolyCaseBody body -> inBody body
       NormalBody body -> inBody body
 
-    inBody :: Body -> Set.Set String
-    inBody (Body _ _ instrs) = foldMap inInstr instrs
+    inBody :: Body -> Set.Set Location
+    inBody (Body _ _ instrs) = foldMap (inInstr >>> Set.fromList) instrs
 
-    inInstr :: Instruction -> Set.Set String
+    inInstr :: Instruction -> [Location]
     inInstr = \case
-      StoreString loc -> inLocation loc
-      Builtin2 _ loc1 loc2 -> inLocation loc1 <> inLocation loc2
-      Builtin1 _ loc -> inLocation loc
-      BuryString loc -> inLocation loc
-      AllocString loc -> inLocation loc
-      -- Some of these contain locations, but shouldn't contain strings
-      _ -> mempty
-
-    inLocation :: Location -> Set.Set String
-    inLocation (PrimStringLocation s) = Set.singleton s
-    inLocation _ = mempty
+      StoreInt loc -> [loc]
+      StoreString loc -> [loc]
+      Enter loc -> [loc]
+      EnterScrutinee loc _ -> [loc]
+      EnterFast i ptrs ints -> Global i : ptrs <> ints
+      Builtin2 _ loc1 loc2 -> [loc1, loc2]
+      Builtin1 _ loc -> [loc]
+      ComputeInt loc e -> loc : inPrimExpr e
+      PushSA loc -> [loc]
+      PushSB loc -> [loc]
+      PushConstructorArg loc -> [loc]
+      SparkClosure loc -> [loc]
+      Bury loc -> [loc]
+      BuryInt loc -> [loc]
+      BuryString loc -> [loc]
+      AllocPointer loc -> [loc]
+      AllocInt loc -> [loc]
+      AllocString loc -> [loc]
+      CreateCAFClosure i -> [CAF i]
+      _ -> []
+
+    inPrimExpr :: PrimExpr -> [Location]
+    inPrimExpr = \case
+      PrimValue loc -> [loc]
+      PrimApply2 _ e1 e2 -> inPrimExpr e1 <> inPrimExpr e2
+      PrimNegate e -> inPrimExpr e
+
+-- | Gather all the literal strings used in some functions
+gatherStrings :: [Function] -> Set.Set String
+gatherStrings functions =
+  Set.fromList [s | PrimStringLocation s <- Set.toList (gatherLocations functions)]
+
+-- | Whether something gets defined in the translation unit we're writing, or only declared
+--
+-- Things declared in one unit get defined in another unit of the same program.
+data Linkage = Define | Declare deriving (Eq, Show)
 
 -- | Generate the static strings we need in our program
-genStaticStrings :: Set.Set String -> CWriter LocationTable
-genStaticStrings strings =
-  foldMapM (uncurry makeLocation) indexedStrings
+genStaticStrings :: Linkage -> Set.Set String -> CWriter LocationTable
+genStaticStrings linkage strings =
+  foldMapM makeLocation (Set.toList strings)
   where
-    indexedStrings :: [(Index, String)]
-    indexedStrings = strings |> Set.toList |> zip [0 ..]
-
-    makeLocation :: Index -> String -> CWriter LocationTable
-    makeLocation i s = do
-      let bytes = length s + 1
-          var = stringLiteralVar i
-      writeLine "struct {"
+    makeLocation :: String -> CWriter LocationTable
+    makeLocation s = do
+      let bytes = utf8Length s + 1
+          var = stringLiteralVar s
+      writeLine (if linkage == Define then "struct {" else "extern struct {")
       indented <| do
         writeLine "InfoTable* table;"
+        writeLine "size_t length;"
         writeLine (printf "char data[%d];" bytes)
-      writeLine (printf "} %s = { &table_for_string_literal, %s };" var (show s))
+      case linkage of
+        Define -> writeLine (printf "} %s = { &table_for_string_literal, %d, %s };" var (utf8Length s) (cStringLiteral s))
+        Declare -> writeLine (printf "} %s;" var)
       return (singleLocation (PrimStringLocation s) ("(uint8_t*)&" <> var))
 
--- | Gather all the bound argument shapes in our program
+-- | Gather all the bound argument shapes in some functions
 --
 -- This is nice so that we can have one garbage collection
 -- pattern for each of these.
-gatherBoundArgTypes :: Cmm -> Set.Set ArgInfo
-gatherBoundArgTypes (Cmm functions function) =
-  foldMap inFunction (function : functions)
+gatherBoundArgTypes :: [Function] -> Set.Set ArgInfo
+gatherBoundArgTypes =
+  foldMap inFunction
   where
     inFunction :: Function -> Set.Set ArgInfo
     inFunction Function {..} =
@@ -765,54 +1232,156 @@ gatherBoundArgTypes (Cmm functions function) =
           DynamicClosure -> Set.singleton boundArgs
           _ -> Set.empty
 
+-- | Gather all the fields selector thunks in some functions select
+gatherSelectors :: [Function] -> Set.Set (Tag, Int)
+gatherSelectors =
+  foldMap inFunction
+  where
+    inFunction :: Function -> Set.Set (Tag, Int)
+    inFunction Function {..} =
+      foldMap Set.singleton selector <> foldMap inFunction subFunctions
+
+-- | Check if the continuations of our program need to know what kind of value they get
+--
+-- Only the continuations for `seq`, and the sparks the runtime evaluates, can
+-- get any kind of value, so most programs don't need to say what they return.
+usesReturnKinds :: Cmm -> Bool
+usesReturnKinds (Cmm functions function) =
+  any inFunction (function : functions)
+  where
+    inFunction :: Function -> Bool
+    inFunction Function {..} =
+      inFunctionBody body || any inFunction subFunctions
+
+    inFunctionBody :: FunctionBody -> Bool
+    inFunctionBody = \case
+      IntCaseBody branches default' -> any inBody (default' : map snd branches)
+      StringCaseBody branches default' -> any inBody (default' : map snd branches)
+      TagCaseBody branches default' -> any inBody (default' : map snd branches)
+      ContinuationBody _ body -> inBody body
+      PolyCaseBody _ -> True
+      NormalBody body -> inBody body
+
+    inBody :: Body -> Bool
+    inBody (Body _ _ instrs) = any isSpark instrs
+
+    isSpark = \case
+      SparkClosure _ -> True
+      _ -> False
+
+-- | Generate the evacuation function for thunks selecting a certain field
+--
+-- The runtime does the actual work, we just need to say which field.
+genSelectorEvacFunction :: (Tag, Int) -> CWriter ()
+genSelectorEvacFunction sel@(tag, field) = do
+  writeLine (printf "uint8_t* %s(uint8_t* base) {" (selectorEvacVar sel))
+  indented <| writeLine (printf "return selector_evac(base, %d, %d);" tag field)
+  writeLine "}"
+  writeLine ""
+
 -- | Generate the evacuation function for a certain argument shape
+--
+-- This only moves the closure itself, the closures it points to
+-- are collected later, in the scavenge function.
 genEvacFunction :: ArgInfo -> CWriter ()
-genEvacFunction info@ArgInfo {..} = do
+genEvacFunction info = do
   let thisFunction = evacArgInfoVar info
   writeLine (printf "uint8_t* %s(uint8_t* base) {" thisFunction)
   indented <| do
     comment "relocating closure"
-    writeLine "size_t closure_size = sizeof(InfoTable*);"
-    case info of
-      ArgInfo 0 0 0 ->
-        writeLine "closure_size += sizeof(uint8_t*);"
-      _ -> do
-        writeLine
-          ( printf
-              "closure_size += %d * sizeof(uint8_t*);"
-              (boundPointers + boundStrings)
-          )
-        writeLine (printf "closure_size += %d * sizeof(int64_t);" boundInts)
-    writeLine "uint8_t* new_base = heap_cursor();"
-    writeLine "heap_write(base, closure_size);"
-    comment "replacing old closure with indirection"
-    writeLine "memcpy(base, &table_pointer_for_already_evac, sizeof(InfoTable*));"
-    writeLine "memcpy(base + sizeof(InfoTable*), &new_base, sizeof(uint8_t*));"
-    comment "evacuating roots recursively"
-    writeLine "uint8_t* cursor = new_base + sizeof(InfoTable*);"
-    writeLine "uint8_t* root;"
-    replicateM_ boundPointers <| do
-      writeLine "root = read_ptr(cursor);"
-      writeLine "collect_root(&root);"
-      writeLine "memcpy(cursor, &root, sizeof(uint8_t*));"
-      writeLine "cursor += sizeof(uint8_t*);"
-    unless (boundInts == 0)
-      <| writeLine (printf "cursor += %d * sizeof(int64_t);" boundInts)
-    replicateM_ boundStrings <| do
+    genClosureSize info
+    writeLine "return gc_copy(base, closure_size);"
+  writeLine "}"
+  writeLine ""
+
+-- | Generate the scavenge function for a certain argument shape
+--
+-- This takes a closure that has already been moved, and collects
+-- all of the pointers it contains, returning the end of the closure.
+genScavengeFunction :: ArgInfo -> CWriter ()
+genScavengeFunction info@ArgInfo {..} = do
+  let thisFunction = scavengeArgInfoVar info
+  writeLine (printf "uint8_t* %s(uint8_t* base) {" thisFunction)
+  indented <| do
+    genClosureSize info
+    unless (boundPointers == 0 && boundStrings == 0) <| do
+      comment "evacuating roots"
+      writeLine "uint8_t* cursor = base + sizeof(InfoTable*);"
+      writeLine "uint8_t* root;"
+      replicateM_ boundPointers collectCursor
+      unless (boundInts == 0)
+        <| writeLine (printf "cursor += %d * sizeof(int64_t);" boundInts)
+      replicateM_ boundStrings collectCursor
+    writeLine "return base + closure_size;"
+  writeLine "}"
+  writeLine ""
+  where
+    collectCursor = do
       writeLine "root = read_ptr(cursor);"
       writeLine "collect_root(&root);"
       writeLine "memcpy(cursor, &root, sizeof(uint8_t*));"
       writeLine "cursor += sizeof(uint8_t*);"
-    writeLine "return new_base;"
 
-  writeLine "}"
-  writeLine ""
+-- | Generate a `closure_size` variable, for a closure with a certain argument shape
+genClosureSize :: ArgInfo -> CWriter ()
+genClosureSize info@ArgInfo {..} = do
+  writeLine "size_t closure_size = sizeof(InfoTable*);"
+  case info of
+    ArgInfo 0 0 0 ->
+      writeLine "closure_size += sizeof(uint8_t*);"
+    _ -> do
+      writeLine
+        ( printf
+            "closure_size += %d * sizeof(uint8_t*);"
+            (boundPointers + boundStrings)
+        )
+      writeLine (printf "closure_size += %d * sizeof(int64_t);" boundInts)
+
+-- | Generate the table of every static closure in our program
+--
+-- CAF images saved by the runtime refer to static closures by their position
+-- in this table, since their addresses change whenever the program gets rebuilt.
+genProgramStatics :: Set.Set String -> CWriter ()
+genProgramStatics strings = do
+  globalPaths <- asks (globals >>> IntMap.elems)
+  cafPaths <- asks (cafs >>> IntMap.elems)
+  let literals = map stringLiteralVar (Set.toList strings)
+      statics = literals <> map tablePtrName (globalPaths <> cafPaths) <> map cafCellFor cafPaths
+      -- C doesn't allow empty arrays
+      entries = map ("(uint8_t*)&" <>) statics <> ["NULL"]
+  writeLine "uint8_t *g_ProgramStatics[] = {"
+  indented <| forM_ entries ((<> ",") >>> writeLine)
+  writeLine "};"
+  writeLine (printf "size_t g_ProgramStaticCount = %d;" (length statics))
+
+-- | The fingerprint of a program, before hashing any of its code
+emptyFingerprint :: Word64
+emptyFingerprint = 0xcbf29ce484222325
+
+-- | Add some more of the C code for a program to its fingerprint
+--
+-- We use FNV-1a, which is simple, and good enough to tell programs apart.
+-- Since it works a byte at a time, we can hash the code a chunk at a time.
+addToFingerprint :: Word64 -> ByteString.ByteString -> Word64
+addToFingerprint = ByteString.foldl' step
+  where
+    step :: Word64 -> Word8 -> Word64
+    step hash b = (hash `xor` fromIntegral b) * 0x100000001b3
 
+-- | Generate the line defining the fingerprint of a program
+genFingerprint :: Word64 -> Builder
+genFingerprint = printf "const uint64_t g_ProgramFingerprint = 0x%016xULL;\n" >>> Builder.string7
+
+-- | Generate the main function, running the program from its entry
+--
+-- With tail calls enabled, functions jump to each other directly, and
+-- only come back here once the program is done. We keep the trampoline
+-- around regardless, since it's the portable way of running the program.
 genMainFunction :: CWriter ()
 genMainFunction = do
-  writeLine "int main() {"
+  writeLine "int main(int argc, char **argv) {"
   indented <| do
-    writeLine "setup();"
+    writeLine "setup(argc, argv);"
     let entry = displayPath (IdentPath [Entry])
     writeLine (printf "CodeLabel label = &%s;" entry)
     writeLine "while (label != NULL) {"
@@ -822,25 +1391,156 @@ genMainFunction = do
     writeLine "return 0;"
   writeLine "}"
 
--- | Generate CCode for our Cmm IR
-genCmm :: Cmm -> CWriter ()
-genCmm cmm@(Cmm functions entry) = do
-  writeLine "#include \"runtime.c\"\n"
-  stringLocations <- genStaticStrings (gatherStrings cmm)
+-- | Gather the declarations for each global in our program, by the location used to refer to it
+gatherGlobalDeclarations :: Cmm -> CWriter (Map.Map Location [CCode])
+gatherGlobalDeclarations (Cmm functions entry) = foldMapM inFunction (entry : functions)
+  where
+    inFunction :: Function -> CWriter (Map.Map Location [CCode])
+    inFunction Function {..} =
+      insideFunction functionName <| do
+        currentPath <- asks currentFunction
+        let declareGlobal =
+              [printf "void* %s(void);" (displayPath currentPath)]
+                <> [printf "void* %s(void);" (fastEntryName currentPath) | hasFastEntry]
+                <> [printf "extern InfoTable* %s;" (tablePtrName currentPath)]
+            thisDeclaration = case closureType of
+              DynamicClosure -> mempty
+              GlobalClosure i -> Map.singleton (Global i) declareGlobal
+              CAFClosure i ->
+                Map.singleton (CAF i) (declareGlobal <> [printf "extern CAFCell %s;" (cafCellFor currentPath)])
+        (thisDeclaration <>) <$> foldMapM inFunction subFunctions
+
+-- | Generate declarations for the globals some functions use
+--
+-- Functions can refer to globals defined after them, or in another translation unit,
+-- so we declare them before any function. We only declare the globals that get used,
+-- in sorted order, so that the rest of the program can change without changing these.
+genGlobalDeclarations :: Cmm -> [Function] -> CWriter ()
+genGlobalDeclarations cmm used = do
+  declarations <- gatherGlobalDeclarations cmm
+  Map.restrictKeys declarations (gatherLocations used)
+    |> fold
+    |> Set.fromList
+    |> mapM_ writeLine
+
+-- | Generate declarations for the garbage collection functions some functions use
+--
+-- These get defined in the main unit, but the info tables in every unit use them.
+genCollectorDeclarations :: [Function] -> CWriter ()
+genCollectorDeclarations used = do
+  forM_ (gatherBoundArgTypes used) <| \info -> do
+    writeLine (printf "uint8_t* %s(uint8_t* base);" (evacArgInfoVar info))
+    writeLine (printf "uint8_t* %s(uint8_t* base);" (scavengeArgInfoVar info))
+  forM_ (gatherSelectors used) <| \sel ->
+    writeLine (printf "uint8_t* %s(uint8_t* base);" (selectorEvacVar sel))
+
+-- | Generate CCode for our Cmm IR, with only some of its top level functions
+--
+-- This is the main translation unit of a program, containing its entry point,
+-- and everything the runtime needs to find. The top level functions not
+-- included here need to be generated in the other units, with `genFunctionUnit`.
+genMainUnit :: Cmm -> [Function] -> CWriter ()
+genMainUnit cmm@(Cmm functions entry) included = do
+  writeLine "#include \"runtime.h\"\n"
+  -- The table of static closures refers to every global, and every literal
+  let everything = entry : functions
+  declarations <- gatherGlobalDeclarations cmm
+  fold declarations |> Set.fromList |> mapM_ writeLine
   writeLine ""
-  forM_ (gatherBoundArgTypes cmm) genEvacFunction
+  let strings = gatherStrings everything
+  stringLocations <- genStaticStrings Define strings
+  writeLine ""
+  forM_ (gatherBoundArgTypes everything) <| \info -> do
+    genEvacFunction info
+    genScavengeFunction info
+  forM_ (gatherSelectors everything) genSelectorEvacFunction
   writeLine ""
   withLocations stringLocations <| do
-    forM_ functions <| \f -> do
+    forM_ included <| \f -> do
       genFunction f
       writeLine ""
     genFunction entry
     writeLine ""
+    genProgramStatics strings
+    writeLine ""
     writeLine ""
     genMainFunction
 
--- | Convert our Cmm IR into actual C code
-writeC :: Cmm -> CCode
-writeC cmm =
+-- | Generate a translation unit containing some of the top level functions of a program
+--
+-- The unit only declares the things its own functions use, so that its code stays
+-- the same as long as those functions do, and it can be reused from a previous build.
+genFunctionUnit :: Cmm -> [Function] -> CWriter ()
+genFunctionUnit cmm included = do
+  writeLine "#include \"runtime.h\"\n"
+  genGlobalDeclarations cmm included
+  genCollectorDeclarations included
+  writeLine ""
+  stringLocations <- genStaticStrings Declare (gatherStrings included)
+  writeLine ""
+  withLocations stringLocations <| forM_ included <| \f -> do
+    genFunction f
+    writeLine ""
+
+-- | Run some generation of C code, in the context of the whole program
+inProgram :: Cmm -> CWriter () -> Builder
+inProgram cmm m =
   let ((globals, cafs), _) = runCWriter (gatherGlobals cmm)
-   in genCmm cmm |> withGlobals globals |> withCafs cafs |> runCWriter |> snd
+   in m
+        |> withGlobals globals
+        |> withCafs cafs
+        |> local (\r -> r {returnKinds = usesReturnKinds cmm})
+        |> runCWriter
+        |> snd
+
+-- | Convert our Cmm IR into actual C code, without the fingerprint at the end
+genCode :: Cmm -> Builder
+genCode cmm@(Cmm functions _) = inProgram cmm (genMainUnit cmm functions)
+
+-- | Convert our Cmm IR into C code, writing it out to a handle as it gets generated
+--
+-- The code never has to be in memory all at once. The fingerprint at the end
+-- hashes all of the code before it, so we hash each chunk as we write it.
+hPutC :: Handle -> Cmm -> IO ()
+hPutC h cmm = do
+  let chunks = Builder.toLazyByteString (genCode cmm) |> LazyByteString.toChunks
+      writeChunk fingerprint chunk = do
+        ByteString.hPut h chunk
+        return (addToFingerprint fingerprint chunk)
+  fingerprint <- foldM writeChunk emptyFingerprint chunks
+  Builder.hPutBuilder h (genFingerprint fingerprint)
+
+-- | Convert our Cmm IR into C code, split into a main unit, and some units with functions
+--
+-- Each top level function goes in the unit picked by hashing its name, so that
+-- it stays in the same unit as the rest of the program changes, and the units
+-- it doesn't affect stay the same. The fingerprint, in the main unit, hashes the
+-- code of every unit. The units don't depend on each other, so they can be
+-- evaluated in parallel.
+splitC :: Int -> Cmm -> (ByteString.ByteString, [ByteString.ByteString])
+splitC count cmm@(Cmm functions _) =
+  let unitFor f =
+        show (functionName f)
+          |> fingerprintOfString
+          |> (`mod` fromIntegral count)
+          |> fromIntegral
+      groups = [filter (unitFor >>> (== i)) functions | i <- [0 .. count - 1]]
+      strict = Builder.toLazyByteString >>> LazyByteString.toStrict
+      functionUnits = map (genFunctionUnit cmm >>> inProgram cmm >>> strict) groups
+      mainUnit = strict (inProgram cmm (genMainUnit cmm []))
+      fingerprint = foldl' addToFingerprint emptyFingerprint (functionUnits <> [mainUnit])
+   in (mainUnit <> strict (genFingerprint fingerprint), functionUnits)
+
+-- | Hash some bytes, in the same way as the fingerprint of a program
+--
+-- This is useful to tell apart different versions of the C code we generate.
+fingerprintOf :: ByteString.ByteString -> Word64
+fingerprintOf = addToFingerprint emptyFingerprint
+
+-- | Hash a string, encoded as UTF-8, in the same way as `fingerprintOf`
+fingerprintOfString :: String -> Word64
+fingerprintOfString =
+  Builder.stringUtf8
+    >>> Builder.toLazyByteString
+    >>> LazyByteString.toStrict
+    >>> fingerprintOf
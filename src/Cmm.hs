@@ -24,14 +24,17 @@ module Cmm
     Function (..),
     Location (..),
     DirectUpdateType (..),
+    ReturnKind (..),
     FunctionBody (..),
     Body (..),
     Instruction (..),
     ClosureType(..),
     Index,
+    Tag,
     Allocation (..),
     Builtin2 (..),
     Builtin1 (..),
+    PrimExpr (..),
     cmm,
   )
 where
@@ -51,7 +54,8 @@ import Control.Monad.State
     runState,
   )
 import qualified Data.Map.Strict as Map
-import Data.Maybe (fromMaybe, maybeToList)
+import Data.List (elemIndex, partition)
+import Data.Maybe (fromMaybe, isJust, isNothing, maybeToList)
 import Ourlude
 import STG
   ( Alts (..),
@@ -107,6 +111,10 @@ data Storage
     --
     -- Note that CAFs and Globals share indices
     CAFStorage Index
+  | -- | This variable is one of the closures the runtime shares
+    --
+    -- Like globals, these never need to be stored alongside a closure.
+    SharedStorage
   deriving (Eq, Show)
 
 -- | Represents what type of variable something will end up being
@@ -126,6 +134,8 @@ data VarType
 data Location
   = -- | This variable is the nth pointer arg passed to us on the stack
     Arg Index
+  | -- | This variable is the nth int arg passed to us on the secondary stack
+    IntArg Index
   | -- | This variable is the nth constructor argument passed to us
     ConstructorArg Index
   | -- | This variable is the nth pointer bound in this closure
@@ -138,11 +148,19 @@ data Location
     Global Index
   | -- | This variable is a top-level updateable value
     CAF Index
+  | -- | This variable is the runtime's preboxed closure for a small int
+    SharedInt Int
+  | -- | This variable is the runtime's shared closure for a nullary constructor
+    SharedConstructor Tag
   | -- | This variable is a closure we've allocated, with the index being the sub function index
     --
     -- This can be sparse, i.e. if we have 4 subfunctions, 2 of which are global, we might
     -- have index 1 and 3 as `Allocated`.
     Allocated Index
+  | -- | This variable is a constructor we've allocated directly
+    --
+    -- Unlike `Allocated`, the index is unique, and doesn't refer to a sub function.
+    Constructed Index
   | -- | This variable is the nth dead pointer
     --
     -- Buried locations come from the bound names used inside the branches of a
@@ -159,6 +177,11 @@ data Location
     IntRegister
   | -- | This variable will be stored in the string register
     StringRegister
+  | -- | This variable is the nth int we've computed in this function's body
+    --
+    -- Unlike the int register, each of these gets a C variable of its own, which
+    -- means that other builtins can't clobber them.
+    PrimTemp Index
   | -- | This variable is equal to this primitive int
     PrimIntLocation Int
   | -- | This variable is equal to this primitive string
@@ -173,12 +196,17 @@ locationType = \case
   Bound _ -> PointerVar
   Global _ -> PointerVar
   CAF _ -> PointerVar
+  SharedInt _ -> PointerVar
+  SharedConstructor _ -> PointerVar
   Allocated _ -> PointerVar
+  Constructed _ -> PointerVar
   Buried _ -> PointerVar
   CurrentNode -> PointerVar
+  IntArg _ -> IntVar
   BoundInt _ -> IntVar
   BuriedInt _ -> IntVar
   IntRegister -> IntVar
+  PrimTemp _ -> IntVar
   PrimIntLocation _ -> IntVar
   BoundString _ -> StringVar
   BuriedString _ -> StringVar
@@ -191,6 +219,16 @@ data DirectUpdateType
   | StringUpdate
   deriving (Show)
 
+-- | The kind of value we're returning to a case continuation
+--
+-- Most continuations know what kind of value they're getting, but the ones
+-- for `seq` can be handed any kind of value, and need to be told which.
+data ReturnKind
+  = IntReturn
+  | StringReturn
+  | ConstructorReturn
+  deriving (Show)
+
 -- | Represents a kind of builtin taking two arguments
 data Builtin2
   = -- | IntR <- a + b
@@ -227,6 +265,21 @@ data Builtin1
     Negate1
   deriving (Show)
 
+-- | Represents an arithmetic expression over unboxed ints
+--
+-- Chains of builtins on ints can be computed in one go, without
+-- passing any of the intermediate results through a register.
+data PrimExpr
+  = -- | The int stored in some location
+    PrimValue Location
+  | -- | Apply a builtin to the results of two expressions
+    --
+    -- This is never `Concat2`, since that doesn't produce an int.
+    PrimApply2 Builtin2 PrimExpr PrimExpr
+  | -- | Apply `Negate1` to the result of an expression
+    PrimNegate PrimExpr
+  deriving (Show)
+
 -- | Represents a single instruction in our IR
 --
 -- The idea is that each of these instructions is a little unit that makes
@@ -248,28 +301,54 @@ data Instruction
     -- For this to be valid, that location needs to actually contain *code*,
     -- of course. `BoundString` would not be a valid location here, for example.
     Enter Location
+  | -- | Enter the closure we're matching on in a case expression
+    --
+    -- The index is for the nth subfunction, containing the case function we've
+    -- just pushed. A tagged pointer means that the closure is a constructor we've
+    -- already evaluated, so we can return it to that function directly instead.
+    EnterScrutinee Location Index
+  | -- | Enter a global function through its fast entry
+    --
+    -- We know exactly how many arguments this function takes, so we pass them
+    -- in the argument registers, instead of on the stacks. This also means that the
+    -- function doesn't need to check whether or not it has enough arguments.
+    EnterFast Index [Location] [Location]
   | -- | We need to enter the code for the continuation at the top of the stack
     --
     -- In practice, this stack will contain the code for the branches
     -- of a case expression, and this instruction yields control to
     -- whatever branches need to match on the value we're producing.
-    EnterCaseContinuation
+    EnterCaseContinuation ReturnKind
   | -- | Print that an error happened
     PrintError String
   | -- | Apply a builtin expecting two locations
     Builtin2 Builtin2 Location Location
   | -- | Apply a builtin expecting a single location
     Builtin1 Builtin1 Location
+  | -- | Compute an int, storing it in some location
+    --
+    -- This location is either the int register, or a `PrimTemp`.
+    ComputeInt Location PrimExpr
   | -- | Exit the program
     Exit
   | -- | Push a pointer onto the argument stack
     PushSA Location
+  | -- | Push an int argument onto the secondary stack
+    PushSB Location
   | -- | Push a pointer onto the stack for constructor arguments
     PushConstructorArg Location
   | -- | Push a case continuation onto the stack
     --
     -- The index is for the nth subfunction containing the case function
     PushCaseContinuation Index
+  | -- | Push an evaluation frame onto the stack
+    --
+    -- This sits between a continuation that can take any kind of value and
+    -- the expression it evaluates. If that expression turns out to be a function,
+    -- this frame stops it from looking for arguments past the continuation.
+    PushEvaluationFrame
+  | -- | Offer the closure at some location to be evaluated in parallel
+    SparkClosure Location
   | -- | Bury a pointer used in a case expression
     Bury Location
   | -- | Bury an int used in a case expression
@@ -282,6 +361,13 @@ data Instruction
     -- this instruction appears, and lets us know which table we're referring to. This same
     -- index is also used to refer to whatever object this instruction allocates.
     AllocTable Index
+  | -- | Allocate the header for a constructor with a certain tag and number of fields
+    --
+    -- The index names the `Constructed` location this allocates. Instead of
+    -- having a table of their own, constructors use the runtime's shared layout,
+    -- which lets us tag the pointers we have to them. The fields follow as
+    -- pointer allocations, in reverse order, which is what the runtime expects.
+    AllocConstructor Index Tag Int
   | -- | Allocate a pointer on the heap
     AllocPointer Location
   | -- | Allocate blank space for a pointer
@@ -293,8 +379,18 @@ data Instruction
     AllocInt Location
   | -- | Allocate a string on the heap
     AllocString Location
+  | -- | Claim the current node, before pushing an update frame for it
+    --
+    -- In the threaded runtime, this black holes the thunk, and if another
+    -- capability got there first, we enter the node again, waiting for its value.
+    ClaimNode
   | -- | Push an update frame
     PushUpdate
+  | -- | Overwrite the table of the current node with a black hole
+    --
+    -- Selector thunks do this when entered, so that the garbage collector
+    -- doesn't replace them with their field while they're being updated.
+    BlackHoleNode
   | -- | Create the dynamic heap part of a CAF
     --
     -- We use the index to neatly indicate which CAF we need to update
@@ -370,6 +466,11 @@ data FunctionBody
     --
     -- This is kind of like a normal body, but bound arguments are buried instead.
     ContinuationBody DirectUpdateType Body
+  | -- | The body of a continuation ignoring whatever value it gets
+    --
+    -- The value can be of any kind, so this also needs to get rid of the items
+    -- of a constructor, and do whichever kind of update is pending.
+    PolyCaseBody Body
   | -- | Represents a normal function body
     NormalBody Body
   deriving (Show)
@@ -393,9 +494,12 @@ data Function = Function
     -- infrastructure in each case
     closureType :: ClosureType,
     -- | Information about the number of pointer arguments
-    --
-    -- Since primitives can't be passed to functions, this just the number of pointers
     argCount :: Int,
+    -- | The number of unboxed int arguments
+    --
+    -- Only workers created by strictness analysis take these, and
+    -- they're passed on the secondary stack, instead of with the pointers.
+    intArgCount :: Int,
     -- | Information about the number of bound arguments
     --
     -- This also tells us how to garbage collect the closure, along with the information
@@ -405,6 +509,16 @@ data Function = Function
     -- which aren't going to be collocated with the continuation, but passed
     -- on some stack instead.
     boundArgs :: ArgInfo,
+    -- | Whether or not this function has a fast entry
+    --
+    -- Calls to a global function passing exactly the arguments it expects
+    -- can skip straight to this entry, passing the arguments in registers.
+    hasFastEntry :: Bool,
+    -- | The constructor tag and field this thunk selects from its only free variable, if any
+    --
+    -- The garbage collector can replace these selector thunks with that field,
+    -- once the constructor they select from has been evaluated.
+    selector :: Maybe (Tag, Int),
     -- | The actual body of this function
     body :: FunctionBody,
     -- | The functions defined nested inside of this function
@@ -420,13 +534,15 @@ data Context = Context
   { -- | A map from names to their corresponding storages
     storages :: Map.Map ValName Storage,
     -- | A map from names to their corresponding locations
-    locations :: Map.Map ValName Location
+    locations :: Map.Map ValName Location,
+    -- | The number of pointer and int arguments each global with a fast entry takes
+    fastEntries :: Map.Map Index (Int, Int)
   }
   deriving (Show)
 
 -- | A default context to start with
 startingContext :: Context
-startingContext = Context mempty mempty
+startingContext = Context mempty mempty mempty
 
 -- | The state we need to keep track of in our context
 --
@@ -476,6 +592,26 @@ withLocations :: [(ValName, Location)] -> ContextM a -> ContextM a
 withLocations newLocations =
   local (\r -> r {locations = Map.fromList newLocations <> locations r})
 
+-- | Run a contextual computation knowing about the fast entries of some globals
+withFastEntries :: [(Index, (Int, Int))] -> ContextM a -> ContextM a
+withFastEntries newEntries =
+  local (\r -> r {fastEntries = Map.fromList newEntries <> fastEntries r})
+
+-- | The most arguments of each kind a fast entry can take in registers
+--
+-- This needs to match @ARG_REGISTER_COUNT@ in the runtime.
+argRegisterCount :: Int
+argRegisterCount = 8
+
+-- | The number of pointer and int arguments the fast entry of a global function takes
+--
+-- Only functions taking some arguments, but not too many, have a fast entry.
+fastArity :: LambdaForm -> Maybe (Int, Int)
+fastArity (LambdaForm _ _ args intArgs _)
+  | null args && null intArgs = Nothing
+  | length args > argRegisterCount || length intArgs > argRegisterCount = Nothing
+  | otherwise = Just (length args, length intArgs)
+
 -- | Run a contextual computation with a certain number of tables allocated
 addNSubFunctions :: Int -> ContextM ()
 addNSubFunctions more =
@@ -535,63 +671,73 @@ atomAsPointer = \case
       _ -> error (n <> " has location " <> show loc <> " which cannot hold a pointer")
   other -> error (show other <> " cannot be used as a pointer")
 
+-- | Cast an atom into a location we can pass as an argument to a function
+--
+-- This is either a pointer, or an unboxed int for the workers strictness analysis creates.
+atomAsArg :: Atom -> ContextM Location
+atomAsArg = \case
+  PrimitiveAtom (PrimInt i) -> return (PrimIntLocation i)
+  NameAtom n -> do
+    loc <- getLocation n
+    case locationType loc of
+      StringVar -> error (n <> " has location " <> show loc <> " which cannot be passed to a function")
+      _ -> return loc
+  other -> error (show other <> " cannot be passed to a function")
+
 -- | Generate the instructions for a builtin instruction
 genBuiltinInstructions :: Builtin -> [Atom] -> ContextM [Instruction]
-genBuiltinInstructions builtin args = case builtin of
-  Add -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 Add2 l1 l2, EnterCaseContinuation]
-  Sub -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 Sub2 l1 l2, EnterCaseContinuation]
-  Mul -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 Mul2 l1 l2, EnterCaseContinuation]
-  Div -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 Div2 l1 l2, EnterCaseContinuation]
-  Less -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 Less2 l1 l2, EnterCaseContinuation]
-  LessEqual -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 LessEqual2 l1 l2, EnterCaseContinuation]
-  Greater -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 Greater2 l1 l2, EnterCaseContinuation]
-  GreaterEqual -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 GreaterEqual2 l1 l2, EnterCaseContinuation]
-  EqualTo -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 EqualTo2 l1 l2, EnterCaseContinuation]
-  NotEqualTo -> do
-    (l1, l2) <- grab2 atomAsInt args
-    return [Builtin2 NotEqualTo2 l1 l2, EnterCaseContinuation]
-  Concat -> do
-    (l1, l2) <- grab2 atomAsString args
-    return [Builtin2 Concat2 l1 l2, EnterCaseContinuation]
-  Negate -> do
-    l <- grab1 atomAsInt args
-    return [Builtin1 Negate1 l, EnterCaseContinuation]
-  ExitWithInt -> do
-    l <- grab1 atomAsInt args
-    return [Builtin1 PrintInt1 l, Exit]
-  ExitWithString -> do
-    l <- grab1 atomAsString args
-    return [Builtin1 PrintString1 l, Exit]
+genBuiltinInstructions builtin args = case genPrimExpr builtin args of
+  Just compute -> do
+    expr <- compute
+    return [ComputeInt IntRegister expr, EnterCaseContinuation IntReturn]
+  Nothing -> case builtin of
+    Concat -> do
+      (l1, l2) <- grab2 builtin atomAsString args
+      return [Builtin2 Concat2 l1 l2, EnterCaseContinuation StringReturn]
+    ExitWithInt -> do
+      l <- grab1 builtin atomAsInt args
+      return [Builtin1 PrintInt1 l, Exit]
+    ExitWithString -> do
+      l <- grab1 builtin atomAsString args
+      return [Builtin1 PrintString1 l, Exit]
+    Spark -> do
+      l <- grab1 builtin atomAsPointer args
+      return [SparkClosure l, StoreInt (PrimIntLocation 1), EnterCaseContinuation IntReturn]
+    other -> error ("builtin " <> show other <> " has no instructions")
+
+-- | Generate the expression a builtin computes, if it just produces an int
+genPrimExpr :: Builtin -> [Atom] -> Maybe (ContextM PrimExpr)
+genPrimExpr builtin args = case builtin of
+  Add -> binary Add2
+  Sub -> binary Sub2
+  Mul -> binary Mul2
+  Div -> binary Div2
+  Less -> binary Less2
+  LessEqual -> binary LessEqual2
+  Greater -> binary Greater2
+  GreaterEqual -> binary GreaterEqual2
+  EqualTo -> binary EqualTo2
+  NotEqualTo -> binary NotEqualTo2
+  Negate -> Just (PrimNegate <$> grab1 builtin value args)
+  _ -> Nothing
   where
-    grab2 :: (Atom -> ContextM Location) -> [Atom] -> ContextM (Location, Location)
-    grab2 convert atoms =
-      forM atoms convert >>= \case
-        [l1, l2] -> return (l1, l2)
-        _ -> error ("expected 2 locations for builtin " ++ show builtin ++ ", found " ++ show (length atoms))
-
-    grab1 :: (Atom -> ContextM Location) -> [Atom] -> ContextM Location
-    grab1 convert atoms =
-      forM atoms convert >>= \case
-        [l] -> return l
-        _ -> error ("expected 1 location for builtin " <> show builtin ++ ", found " <> show (length atoms))
+    value = atomAsInt >>> fmap PrimValue
+
+    binary op = Just (uncurry (PrimApply2 op) <$> grab2 builtin value args)
+
+-- | Convert the two arguments passed to a builtin
+grab2 :: Builtin -> (Atom -> ContextM a) -> [Atom] -> ContextM (a, a)
+grab2 builtin convert atoms =
+  forM atoms convert >>= \case
+    [l1, l2] -> return (l1, l2)
+    _ -> error ("expected 2 locations for builtin " ++ show builtin ++ ", found " ++ show (length atoms))
+
+-- | Convert the single argument passed to a builtin
+grab1 :: Builtin -> (Atom -> ContextM a) -> [Atom] -> ContextM a
+grab1 builtin convert atoms =
+  forM atoms convert >>= \case
+    [l] -> return l
+    _ -> error ("expected 1 location for builtin " <> show builtin ++ ", found " <> show (length atoms))
 
 -- | Generate the function body that actually inspects values in the case branches
 genCaseFunction :: Int -> [ValName] -> Alts -> ContextM Function
@@ -605,6 +751,9 @@ genCaseFunction index bound alts =
     functionName = CaseFunction index
     closureType = DynamicClosure
     argCount = 0
+    intArgCount = 0
+    hasFastEntry = False
+    selector = Nothing
 
     getBuriedArgs :: ContextM (ArgInfo, [(ValName, Location)])
     getBuriedArgs = do
@@ -630,6 +779,9 @@ genCaseFunction index bound alts =
         handleBranches IntCaseBody (const genFunctionBody) branches defaultExpr
       StringAlts branches defaultExpr ->
         handleBranches StringCaseBody (const genFunctionBody) branches defaultExpr
+      PolyAlt expr -> do
+        (body, subFunctions) <- genFunctionBody expr
+        return (PolyCaseBody body, subFunctions)
       ConstrAlts branches defaultExpr ->
         handleBranches makeCaseBody genConstrCaseBody branches defaultExpr
         where
@@ -679,15 +831,45 @@ genCaseFunction index bound alts =
 genCaseExpr :: Expr -> [ValName] -> Alts -> ContextM (Body, [Function])
 genCaseExpr scrut [] (BindPrim box1 n1 (Box box2 (NameAtom n2)))
   | box1 == box2 && n1 == n2 = genFunctionBody scrut
+-- Ints computed by builtins can be stored in a temporary, instead of a case continuation
+genCaseExpr (Builtin b args) _ (BindPrim IntBox name expr)
+  | Just compute <- genPrimExpr b args = do
+    primExpr <- compute
+    index <- fresh
+    (body, subFunctions) <-
+      withStorages [(name, LocalStorage IntVar)]
+        <| withLocations [(name, PrimTemp index)]
+        <| genFunctionBody expr
+    let fused = fuseComputeInt index primExpr body
+        computed = Body mempty 0 [ComputeInt (PrimTemp index) primExpr] <> body
+    return (fromMaybe computed fused, subFunctions)
+-- Sparking a closure returns straight away, so we don't need a continuation
+genCaseExpr (Builtin Spark args) _ (BindPrim IntBox name expr) = do
+  l <- grab1 Spark atomAsPointer args
+  (body, subFunctions) <-
+    withStorages [(name, LocalStorage IntVar)]
+      <| withLocations [(name, PrimIntLocation 1)]
+      <| genFunctionBody expr
+  return (Body mempty 0 [SparkClosure l] <> body, subFunctions)
 genCaseExpr scrut bound alts = do
   index <- gets subFunctionsCreated
   caseFunction <- genCaseFunction index bound alts
   addNSubFunctions 1
-  (scrutBody, scrutFunctions) <- genFunctionBody scrut
+  (scrutBody, scrutFunctions) <- genScrutinee index scrut
   buryBound <- getBuryBound
-  let thisBody = Body mempty 0 (buryBound <> [PushCaseContinuation index])
+  let frame = case alts of
+        PolyAlt _ -> [PushEvaluationFrame]
+        _ -> []
+      thisBody = Body mempty 0 (buryBound <> [PushCaseContinuation index] <> frame)
   return (thisBody <> scrutBody, caseFunction : scrutFunctions)
   where
+    genScrutinee :: Index -> Expr -> ContextM (Body, [Function])
+    genScrutinee index = \case
+      Apply f [] | ConstrAlts _ _ <- alts -> do
+        fLoc <- getLocation f
+        return (Body mempty 0 [EnterScrutinee fLoc index], [])
+      other -> genFunctionBody other
+
     getBuryBound :: ContextM [Instruction]
     getBuryBound = do
       (ptrs, ints, strings) <- separateNames bound
@@ -704,18 +886,157 @@ genCaseExpr scrut bound alts = do
             IntVar -> [BuryInt loc]
             StringVar -> [BuryString loc]
 
+-- | Try and fuse the computation of some temporary into the start of a body
+--
+-- If the body immediately uses the temporary to compute another int, and never
+-- uses it again, then we can compute that int directly from the expression
+-- producing the temporary. Doing this throughout a chain of builtins means
+-- that something like @a + b * c@ becomes a single C expression.
+fuseComputeInt :: Index -> PrimExpr -> Body -> Maybe Body
+fuseComputeInt index primExpr = \case
+  Body alloc count (ComputeInt location expr : rest)
+    | primUses expr == 1 && all (instructionLocations >>> notElem temp) rest ->
+      Just (Body alloc count (ComputeInt location (replace expr) : rest))
+  _ -> Nothing
+  where
+    temp = PrimTemp index
+
+    primUses :: PrimExpr -> Int
+    primUses = \case
+      PrimValue l -> if l == temp then 1 else 0
+      PrimApply2 _ e1 e2 -> primUses e1 + primUses e2
+      PrimNegate e -> primUses e
+
+    replace :: PrimExpr -> PrimExpr
+    replace = \case
+      PrimValue l | l == temp -> primExpr
+      PrimApply2 op e1 e2 -> PrimApply2 op (replace e1) (replace e2)
+      PrimNegate e -> PrimNegate (replace e)
+      other -> other
+
+-- | The locations an instruction uses
+instructionLocations :: Instruction -> [Location]
+instructionLocations = \case
+  StoreInt l -> [l]
+  StoreString l -> [l]
+  Enter l -> [l]
+  EnterScrutinee l _ -> [l]
+  EnterFast _ ptrs ints -> ptrs <> ints
+  Builtin2 _ l1 l2 -> [l1, l2]
+  Builtin1 _ l -> [l]
+  ComputeInt l expr -> l : exprLocations expr
+  PushSA l -> [l]
+  PushSB l -> [l]
+  PushConstructorArg l -> [l]
+  Bury l -> [l]
+  BuryInt l -> [l]
+  BuryString l -> [l]
+  SparkClosure l -> [l]
+  AllocPointer l -> [l]
+  AllocInt l -> [l]
+  AllocString l -> [l]
+  _ -> []
+  where
+    exprLocations = \case
+      PrimValue l -> [l]
+      PrimApply2 _ e1 e2 -> exprLocations e1 <> exprLocations e2
+      PrimNegate e -> exprLocations e
+
+-- | The smallest int the runtime has a preboxed closure for
+--
+-- This needs to match @SHARED_INT_MIN@ in the runtime.
+sharedIntMin :: Int
+sharedIntMin = -16
+
+-- | The largest int the runtime has a preboxed closure for
+--
+-- This needs to match @SHARED_INT_MAX@ in the runtime.
+sharedIntMax :: Int
+sharedIntMax = 255
+
+-- | How many tags the runtime has nullary constructor closures for
+--
+-- This needs to match @SHARED_CONSTRUCTOR_COUNT@ in the runtime.
+sharedConstructorCount :: Int
+sharedConstructorCount = 256
+
+-- | Check if a lambda form can be replaced with one of the runtime's shared closures
+--
+-- Boxed literals and nullary constructors are very common, and don't depend
+-- on anything, so instead of giving each of them a static closure of its own,
+-- we can point them all at the same object.
+sharedLocation :: LambdaForm -> Maybe Location
+sharedLocation = \case
+  LambdaForm [] N [] [] (Box IntBox (PrimitiveAtom (PrimInt i)))
+    | i >= sharedIntMin && i <= sharedIntMax -> Just (SharedInt i)
+  LambdaForm [] N [] [] (Constructor tag [])
+    | tag < sharedConstructorCount -> Just (SharedConstructor tag)
+  _ -> Nothing
+
 -- | Generate the body we need for a let expression
+--
+-- Bindings that can use a shared closure don't generate anything, we just
+-- make a note of their location, and handle the rest normally.
 genLet :: [Binding] -> Expr -> ContextM (Body, [Function])
-genLet bindings expr = do
+genLet allBindings expr =
+  withStorages (map (fst >>> (,SharedStorage)) shared)
+    <| withLocations shared
+    <| genOwnedLet constructors bindings expr
+  where
+    sharedBinding (Binding name form) = (,) name <$> sharedLocation form
+
+    shared = foldMap (sharedBinding >>> maybeToList) allBindings
+
+    owned = filter (sharedBinding >>> isNothing) allBindings
+
+    constructorBinding (Binding name form) = (,) name <$> constructorFields form
+
+    constructors = foldMap (constructorBinding >>> maybeToList) owned
+
+    bindings = filter (constructorBinding >>> isNothing) owned
+
+-- | Check if a lambda form just builds a constructor, returning its tag and fields
+--
+-- We can allocate these directly, without generating any code for them.
+-- Constructors without any fields are static, so we leave them alone.
+constructorFields :: LambdaForm -> Maybe (Tag, [ValName])
+constructorFields = \case
+  LambdaForm (_ : _) N [] [] (Constructor tag atoms) -> (,) tag <$> traverse atomName atoms
+  _ -> Nothing
+  where
+    atomName (NameAtom n) = Just n
+    atomName _ = Nothing
+
+-- | Check if a lambda form is a thunk selecting a field of a variable, returning its tag and index
+--
+-- These come up in things like lazy pattern bindings, where each name is
+-- a thunk taking apart the same value, and that value stays alive as long
+-- as any one of them hasn't been evaluated.
+selectorField :: ValName -> LambdaForm -> Maybe (Tag, Int)
+selectorField x = \case
+  LambdaForm _ U [] [] (Case (Apply x' []) _ (ConstrAlts [((tag, names), Apply field [])] _))
+    | x == x' -> (,) tag <$> elemIndex field names
+  _ -> Nothing
+
+-- | Generate the body for a let expression, where each binding needs to be allocated
+--
+-- The constructors get allocated directly, and the other bindings need a closure.
+genOwnedLet :: [(ValName, (Tag, [ValName]))] -> [Binding] -> Expr -> ContextM (Body, [Function])
+genOwnedLet constructors bindings expr = do
+  constructed <- forM constructors (\c -> (,) <$> fresh <*> pure c)
+  let constructedStorages = [(name, LocalStorage PointerVar) | (name, _) <- constructors]
+      constructedLocations = [(name, Constructed i) | (i, (name, _)) <- constructed]
   bindingStorages <- getBindingStorages
-  withStorages bindingStorages <| do
+  let fast = [(index, arity) | ((_, GlobalStorage index), Binding _ form) <- zip bindingStorages bindings, Just arity <- [fastArity form]]
+  withStorages (constructedStorages <> bindingStorages) <| withFastEntries fast <| do
     let tableCount = bindingStorages |> filter (snd >>> (== LocalStorage PointerVar)) |> length
-    allocations <- getAllocations tableCount
+    allocations <- getAllocations (tableCount + length constructors)
     locations <- getLocations
-    withLocations locations <| do
+    withLocations (constructedLocations <> locations) <| do
       subFunctions <- genSubFunctions
       letInstrs <- genLetInstrs
-      let thisBody = Body allocations 0 letInstrs
+      constructorInstrs <- foldMapM allocateConstructor constructed
+      let thisBody = Body allocations 0 (letInstrs <> constructorInstrs)
       -- This needs to be done at least after letInstrs, since letInstrs needs
       -- to know the number of sub functions we had before
       addNSubFunctions (length subFunctions)
@@ -726,23 +1047,27 @@ genLet bindings expr = do
     getBindingStorages =
       forM bindings <| \(Binding name form) -> do
         storage <- case form of
-          LambdaForm [] N _ _ -> GlobalStorage <$> fresh
+          LambdaForm [] N _ _ _ -> GlobalStorage <$> fresh
           _ -> return (LocalStorage PointerVar)
         return (name, storage)
 
     getAllocations :: Int -> ContextM Allocation
     getAllocations tableCount = do
       formAllocations <- foldMapM (\(Binding _ form) -> formAllocation form) bindings
-      return (Allocation tableCount 0 0 0 <> formAllocations)
+      return (Allocation tableCount 0 0 0 <> formAllocations <> constructorAllocations)
       where
+        -- The tag and field count of a constructor take up one more word
+        constructorAllocations =
+          foldMap (\(_, (_, fields)) -> Allocation 0 (1 + length fields) 0 0) constructors
+
         formAllocation :: LambdaForm -> ContextM Allocation
-        formAllocation (LambdaForm [] _ _ _) =
+        formAllocation (LambdaForm [] _ _ _ _) =
           -- The blank pointer if we have no bound arguments
           --
           -- This condition becomes more complicated if we have integers
           -- that aren't at least the size of a pointer.
           return (Allocation 0 1 0 0)
-        formAllocation (LambdaForm bound _ _ _) = do
+        formAllocation (LambdaForm bound _ _ _ _) = do
           (boundPtrs, boundInts, boundStrings) <- separateNames bound
           return (Allocation 0 (length boundPtrs) (length boundInts) (length boundStrings))
 
@@ -766,7 +1091,7 @@ genLet bindings expr = do
       foldMapM (uncurry allocateBinding) (zip [start ..] bindings)
       where
         allocateBinding :: Int -> Binding -> ContextM [Instruction]
-        allocateBinding i (Binding name (LambdaForm bound _ _ _)) = do
+        allocateBinding i (Binding name (LambdaForm bound _ _ _ _)) = do
           storage <- getStorage name
           case storage of
             GlobalStorage _ -> return []
@@ -791,6 +1116,11 @@ genLet bindings expr = do
                   allocBlank = [AllocBlankPointer | null bound]
               return ([AllocTable i] <> allocBlank <> allocPtrs <> allocInts <> allocStrings)
 
+    allocateConstructor :: (Index, (ValName, (Tag, [ValName]))) -> ContextM [Instruction]
+    allocateConstructor (i, (_, (tag, fields))) = do
+      locations <- forM fields (NameAtom >>> atomAsPointer)
+      return (AllocConstructor i tag (length fields) : map AllocPointer (reverse locations))
+
 -- | Generate the function body for an expression, along with the necessary sub functions
 --
 -- These always return normal bodies, since the case based bodies are returned
@@ -809,36 +1139,47 @@ genFunctionBody = \case
     return
       <| justInstructions
         [ StoreInt (PrimIntLocation i),
-          EnterCaseContinuation
+          EnterCaseContinuation IntReturn
         ]
   Primitive (PrimString s) ->
-    let instrs = [StoreString (PrimStringLocation s), EnterCaseContinuation]
+    let instrs = [StoreString (PrimStringLocation s), EnterCaseContinuation StringReturn]
      in return (Body (Allocation 0 0 0 0) 0 instrs, [])
   Box IntBox atom -> do
     loc <- atomAsInt atom
     return
       <| justInstructions
         [ StoreInt loc,
-          EnterCaseContinuation
+          EnterCaseContinuation IntReturn
         ]
   Box StringBox atom -> do
     loc <- atomAsString atom
     return
       <| justInstructions
         [ StoreString loc,
-          EnterCaseContinuation
+          EnterCaseContinuation StringReturn
         ]
   Apply f args -> do
     fLoc <- getLocation f
-    argLocs <- mapM atomAsPointer args
-    let instrs = map PushSA (reverse argLocs) <> [Enter fLoc]
+    argLocs <- mapM atomAsArg args
+    -- Ints only get passed to workers, which take them after all the pointers
+    let (intLocs, ptrLocs) = partition (locationType >>> (== IntVar)) argLocs
+    fast <- case fLoc of
+      Global i -> asks (fastEntries >>> Map.lookup i)
+      _ -> return Nothing
+    let instrs = case (fLoc, fast) of
+          -- The extra arguments stay on the stack, for the function this call returns
+          (Global i, Just (ptrCount, intCount))
+            | length ptrLocs >= ptrCount && length intLocs == intCount ->
+              let (now, later) = splitAt ptrCount ptrLocs
+               in map PushSA (reverse later) <> [EnterFast i now intLocs]
+          _ -> map PushSA (reverse ptrLocs) <> map PushSB (reverse intLocs) <> [Enter fLoc]
     return (justInstructions instrs)
   Constructor tag args -> do
     argLocs <- mapM atomAsPointer args
     let instrs =
           [StoreTag tag, StoreConstructorArgCount (length args)]
             <> map PushConstructorArg (reverse argLocs)
-            <> [EnterCaseContinuation]
+            <> [EnterCaseContinuation ConstructorReturn]
     return (justInstructions instrs)
   Builtin b args -> do
     instrs <- genBuiltinInstructions b args
@@ -858,11 +1199,18 @@ separateNames bound = do
       filterM (getStorage >>> fmap (== LocalStorage storageType)) bound
 
 genLamdbdaForm :: FunctionName -> ClosureType -> LambdaForm -> ContextM Function
-genLamdbdaForm functionName closureType (LambdaForm bound u args expr) =
+genLamdbdaForm functionName closureType form@(LambdaForm bound u args intArgs expr) =
   withStorages argStorages <| withNewSubFunctionCount <| do
     let argCount = length args
+        intArgCount = length intArgs
+        hasFastEntry = case closureType of
+          GlobalClosure _ -> isJust (fastArity form)
+          _ -> False
     (boundPtrs, boundInts, boundStrings) <- separateNames bound
     let boundArgs = ArgInfo (length boundPtrs) (length boundInts) (length boundStrings)
+        selector = case (closureType, boundPtrs, boundArgs) of
+          (DynamicClosure, [x], ArgInfo 1 0 0) -> selectorField x form
+          _ -> Nothing
     myLocation <- getMyLocation functionName
     let locations =
           maybeToList myLocation
@@ -875,7 +1223,7 @@ genLamdbdaForm functionName closureType (LambdaForm bound u args expr) =
           (GlobalClosure _, _) -> mempty
           (CAFClosure i, _) -> Body (Allocation 1 1 0 0) 0 [CreateCAFClosure i, PushUpdate]
           (DynamicClosure, N) -> mempty
-          (DynamicClosure, U) -> Body mempty 0 [PushUpdate]
+          (DynamicClosure, U) -> Body mempty 0 ([ClaimNode] <> [BlackHoleNode | isJust selector] <> [PushUpdate])
         body = NormalBody (updateExtra <> normalBody)
     return Function {..}
   where
@@ -891,10 +1239,12 @@ genLamdbdaForm functionName closureType (LambdaForm bound u args expr) =
       _ -> return Nothing
 
     argStorages :: [(ValName, Storage)]
-    argStorages = zip args (repeat (LocalStorage PointerVar))
+    argStorages =
+      zip args (repeat (LocalStorage PointerVar))
+        <> zip intArgs (repeat (LocalStorage IntVar))
 
     argLocations :: [(ValName, Location)]
-    argLocations = zip args (map Arg [0 ..])
+    argLocations = zip args (map Arg [0 ..]) <> zip intArgs (map IntArg [0 ..])
 
     boundLocations :: (Int -> Location) -> [ValName] -> [(ValName, Location)]
     boundLocations f names = zip names (map f [0 ..])
@@ -913,14 +1263,15 @@ genCmm :: STG -> ContextM Cmm
 genCmm (STG bindings entryForm) = do
   entryIndex <- fresh
   topLevel <-
-    forM bindings <| \(Binding name (LambdaForm _ u _ _)) -> do
+    forM bindings <| \(Binding name (LambdaForm _ u _ _ _)) -> do
       index <- fresh
       case u of
         N -> return (name, GlobalStorage index, Global index)
         U -> return (name, CAFStorage index, CAF index)
   let topLevelStorages = map (\(name, storage, _) -> (name, storage)) topLevel
       topLevelLocations = map (\(name, _, location) -> (name, location)) topLevel
-  withStorages topLevelStorages <| withLocations topLevelLocations <| do
+      fast = [(index, arity) | ((_, GlobalStorage index, _), Binding _ form) <- zip topLevel bindings, Just arity <- [fastArity form]]
+  withStorages topLevelStorages <| withLocations topLevelLocations <| withFastEntries fast <| do
     entry <- genLamdbdaForm Entry (GlobalClosure entryIndex) entryForm
     topLevelFunctions <- forM bindings genBinding
     return (Cmm topLevelFunctions entry)
@@ -1,5 +1,4 @@
 {-# LANGUAGE LambdaCase #-}
-{-# LANGUAGE TupleSections #-}
 
 module Lexer (Token (..), lexer) where
 
@@ -9,6 +8,8 @@ import Control.Monad.State (State, gets, modify', runState)
 import Data.Char (isAlphaNum, isDigit, isLower, isSpace, isUpper)
 import Data.List (foldl', foldl1')
 import Data.Maybe (listToMaybe, maybeToList)
+import Data.Text (Text)
+import qualified Data.Text as Text
 import Ourlude
 
 -- Represents the kind of error that can occur
@@ -21,17 +22,43 @@ data LexerError
     UnmatchedLayout
   deriving (Eq, Show)
 
--- Create the right lex error when we encounter an unexpected string
-unexpected :: String -> LexerError
-unexpected [] = UnexpectedEOF
-unexpected (c : _) = Unexpected c
+-- Create the right lex error when we encounter an unexpected input
+unexpected :: Input -> LexerError
+unexpected input = case Text.uncons (remaining input) of
+  Nothing -> UnexpectedEOF
+  Just (c, _) -> Unexpected c
 
--- A Lexer takes an input string, and can consume part of that string to return a result, or fail
+-- The input we're lexing
+--
+-- Along with the text we have left, we keep track of how many characters we've
+-- consumed, so that we can compare how much two lexers matched without looking
+-- at the rest of the input, and the column we're at, for the layout rules.
+data Input = Input
+  { consumed :: !Int,
+    column :: !Int,
+    remaining :: !Text
+  }
+
+-- Advance past a single character, with some text remaining after it
+advanceChar :: Char -> Text -> Input -> Input
+advanceChar c rest (Input n col _) =
+  Input (n + 1) (if c == '\n' then 0 else col + 1) rest
+
+-- Advance past some text, with some text remaining after it
+advance :: Text -> Text -> Input -> Input
+advance matched rest (Input n col _) =
+  let col' =
+        if Text.any (== '\n') matched
+          then Text.length (Text.takeWhileEnd (/= '\n') matched)
+          else col + Text.length matched
+   in Input (n + Text.length matched) col' rest
+
+-- A Lexer takes some input, and can consume part of that input to return a result, or fail
 --
 -- Lexers are like parser combinators, except that they cannot do conditional decision making,
 -- or return multiple results. They always return the result that consumed more input,
 -- which corresponds to the "longest match" rule you want in a lexical analyzer
-newtype Lexer a = Lexer {runLexer :: String -> Either LexerError (a, String)}
+newtype Lexer a = Lexer {runLexer :: Input -> Either LexerError (a, Input)}
 
 -- We can map over the result of a lexer, without changing what strings are recognized
 instance Functor Lexer where
@@ -56,14 +83,48 @@ instance Alternative Lexer where
       (Left _, res) -> res
       -- Implement the longest match rule
       (a@(Right (_, restA)), b@(Right (_, restB))) ->
-        if length restA <= length restB then a else b
+        if consumed restA >= consumed restB then a else b
 
 -- A lexer that matches a single character matching a predicate
 satisfies :: (Char -> Bool) -> Lexer Char
 satisfies p =
-  Lexer <| \case
-    c : cs | p c -> Right (c, cs)
-    rest -> Left (unexpected rest)
+  Lexer <| \input -> case Text.uncons (remaining input) of
+    Just (c, cs) | p c -> Right (c, advanceChar c cs input)
+    _ -> Left (unexpected input)
+
+-- A lexer that matches as many characters matching a predicate as it can, maybe none
+--
+-- This matches the same thing as `many (satisfies p)`, but takes the whole run at once.
+spanning :: (Char -> Bool) -> Lexer Text
+spanning p =
+  Lexer <| \input ->
+    let (matched, rest) = Text.span p (remaining input)
+     in Right (matched, advance matched rest input)
+
+-- A lexer like `spanning`, but which needs to match at least one character
+spanning1 :: (Char -> Bool) -> Lexer Text
+spanning1 p =
+  Lexer <| \input -> case runLexer (spanning p) input of
+    Right (matched, _) | Text.null matched -> Left (unexpected input)
+    res -> res
+
+-- A lexer that consumes nothing, returning the column we're at
+currentColumn :: Lexer Int
+currentColumn = Lexer (\input -> Right (column input, input))
+
+-- Match a lexer as many times as possible, but at least once
+--
+-- This is like `some`, but runs in a loop, so that lexing a large file doesn't
+-- need a level of recursion for each of its tokens.
+repeatedly :: Lexer a -> Lexer [a]
+repeatedly (Lexer l) =
+  Lexer <| \input -> do
+    (a, rest) <- l input
+    return (go [a] rest)
+  where
+    go acc input = case l input of
+      Left _ -> (reverse acc, input)
+      Right (a, rest) -> go (a : acc) rest
 
 -- A lexer that matches a single character
 char :: Char -> Lexer Char
@@ -132,13 +193,13 @@ data Token
   deriving (Eq, Show)
 
 -- Lex out one of the tokens in our language
-token :: Lexer (Token, String)
+token :: Lexer Token
 token = keyword <|> operator <|> literal <|> name
   where
-    with :: Functor f => b -> f a -> f (b, a)
-    with b = fmap (b,)
+    with :: Functor f => b -> f a -> f b
+    with = (<$)
 
-    keyword :: Lexer (Token, String)
+    keyword :: Lexer Token
     keyword =
       oneOf
         [ Let `with` string "let",
@@ -154,7 +215,7 @@ token = keyword <|> operator <|> literal <|> name
           Underscore `with` string "_"
         ]
 
-    operator :: Lexer (Token, String)
+    operator :: Lexer Token
     operator =
       oneOf
         [ OpenParens `with` string "(",
@@ -184,54 +245,56 @@ token = keyword <|> operator <|> literal <|> name
           AmpersandAmpersand `with` string "&&"
         ]
 
-    literal :: Lexer (Token, String)
+    literal :: Lexer Token
     literal = intLit <|> stringLit <|> boolLit
       where
-        intLit :: Lexer (Token, String)
-        intLit = some (satisfies isDigit) |> fmap (\x -> (IntLit (read x), x))
+        intLit :: Lexer Token
+        intLit = spanning1 isDigit |> fmap (Text.unpack >>> read >>> IntLit)
 
-        stringLit :: Lexer (Token, String)
-        stringLit = char '"' *> (many (satisfies (/= '"')) <* char '"') |> fmap (\x -> (StringLit x, x))
+        stringLit :: Lexer Token
+        stringLit = char '"' *> (spanning (/= '"') <* char '"') |> fmap (Text.unpack >>> StringLit)
 
-        boolLit :: Lexer (Token, String)
+        boolLit :: Lexer Token
         boolLit = (BoolLit True `with` string "True") <|> (BoolLit False `with` string "False")
 
-    name :: Lexer (Token, String)
+    name :: Lexer Token
     name = primName <|> upperName <|> lowerName
       where
-        continuesName :: Lexer Char
-        continuesName = satisfies isAlphaNum <|> char '\''
+        continuesName :: Char -> Bool
+        continuesName c = isAlphaNum c || c == '\''
 
-        followedBy :: Lexer Char -> Lexer Char -> Lexer String
-        followedBy l1 l2 = liftA2 (:) l1 (many l2)
+        followedBy :: (Char -> Bool) -> (Char -> Bool) -> Lexer String
+        followedBy p1 p2 = liftA2 (:) (satisfies p1) (Text.unpack <$> spanning p2)
 
-        upperName :: Lexer (Token, String)
-        upperName = (satisfies isUpper `followedBy` continuesName) |> fmap (\x -> (UpperName x, x))
+        upperName :: Lexer Token
+        upperName = (isUpper `followedBy` continuesName) |> fmap UpperName
 
-        lowerName :: Lexer (Token, String)
-        lowerName = (satisfies isLower `followedBy` continuesName) |> fmap (\x -> (LowerName x, x))
+        lowerName :: Lexer Token
+        lowerName = (isLower `followedBy` continuesName) |> fmap LowerName
 
-        primName :: Lexer (Token, String)
+        primName :: Lexer Token
         primName =
           (IntTypeName `with` string "Int")
             <|> (StringTypeName `with` string "String")
             <|> (BoolTypeName `with` string "Bool")
 
--- A raw token is either a "real" token, or some whitespace that we actually want to ignore
+-- A raw token is either a "real" token, along with the column it starts at,
+-- or some whitespace that we actually want to ignore
 data RawToken
-  = Blankspace String
-  | Comment String
+  = Blankspace
+  | Comment
   | Newline
-  | NormalToken Token String
+  | NormalToken Token Int
 
 -- A Lexer for raw tokens
 rawLexer :: Lexer [RawToken]
-rawLexer = some (whitespace <|> comment <|> fmap (uncurry NormalToken) token)
+rawLexer = repeatedly (whitespace <|> comment <|> normalToken)
   where
     whitespace = blankspace <|> newline
-    blankspace = Blankspace <$> some (satisfies (\x -> isSpace x && x /= '\n'))
-    comment = Comment <$> (string "--" *> many (satisfies (/= '\n')))
+    blankspace = Blankspace <$ spanning1 (\x -> isSpace x && x /= '\n')
+    comment = Comment <$ (string "--" *> spanning (/= '\n'))
     newline = Newline <$ char '\n'
+    normalToken = flip NormalToken <$> currentColumn <*> token
 
 -- Represents a position some token can have in the middle of a line.
 --
@@ -241,19 +304,17 @@ data LinePosition = Start | Middle deriving (Eq, Show)
 -- Some type annotated with a position
 data Positioned a = Positioned a LinePosition Int deriving (Show)
 
-type PosState = (LinePosition, Int)
-
 -- Take tokens and whitespace, and return positioned tokens, with whitespace filtered out
 position :: [RawToken] -> [Positioned Token]
-position = foldl' go ((Start, 0), []) >>> snd >>> reverse
+position = foldl' go (Start, []) >>> snd >>> reverse
   where
-    eat :: PosState -> RawToken -> (PosState, Maybe (Positioned Token))
-    eat (pos, col) = \case
-      Newline -> ((Start, 0), Nothing)
-      Comment _ -> ((Start, 0), Nothing)
-      Blankspace s -> ((pos, col + length s), Nothing)
-      NormalToken t s -> ((Middle, col + length s), Just (Positioned t pos col))
-    go :: (PosState, [Positioned Token]) -> RawToken -> (PosState, [Positioned Token])
+    eat :: LinePosition -> RawToken -> (LinePosition, Maybe (Positioned Token))
+    eat pos = \case
+      Newline -> (Start, Nothing)
+      Comment -> (Start, Nothing)
+      Blankspace -> (pos, Nothing)
+      NormalToken t col -> (Middle, Just (Positioned t pos col))
+    go :: (LinePosition, [Positioned Token]) -> RawToken -> (LinePosition, [Positioned Token])
     go (p, acc) raw =
       let (p', produced) = eat p raw
        in (p', maybeToList produced <> acc)
@@ -387,7 +448,7 @@ layout inputs =
           popLayout
           closeImplicitLayouts
 
--- Lex a specific string, producing a list of tokens if no errors occurred.
-lexer :: String -> Either LexerError [Token]
+-- Lex some source code, producing a list of tokens if no errors occurred.
+lexer :: Text -> Either LexerError [Token]
 lexer input =
-  runLexer rawLexer input >>= (fst >>> position >>> layout)
+  runLexer rawLexer (Input 0 0 input) >>= (fst >>> position >>> layout)
@@ -0,0 +1,566 @@
+{-# LANGUAGE GeneralizedNewtypeDeriving #-}
+{-# LANGUAGE LambdaCase #-}
+{-# LANGUAGE TupleSections #-}
+
+-- | This module contains an optimizer, rewriting STG into simpler STG
+--
+-- Our translation into STG is very direct: every operator is a call to some builtin,
+-- every literal gets its own binding, and every result gets inspected again by whoever
+-- uses it. A lot of this work can be done ahead of time instead.
+--
+-- We inline small functions at the calls saturating them, substituting the arguments
+-- for the parameters. Once a function is inlined, we often end up matching on a constructor
+-- we just built, or on a value we've already matched on, and we can pick the right branch
+-- directly. Lets move as close to their only use as we can, thunks that just build a value
+-- become that value, and the bindings nobody uses anymore get dropped.
+module Optimizer (OptLevel (..), optimize) where
+
+import Control.Monad.Reader
+import Control.Monad.State
+import Data.List (find, nub)
+import qualified Data.Map.Strict as Map
+import Data.Maybe (fromMaybe, isJust, maybeToList)
+import qualified Data.Set as Set
+import Ourlude
+import STG
+
+-- | How much effort we put into optimizing a program
+data OptLevel = O0 | O1 | O2 deriving (Eq, Ord, Show)
+
+-- | The knobs each optimization level sets
+data Settings = Settings
+  { -- | The largest function body we're willing to copy into each call
+    inlineSize :: Int,
+    -- | How much code we're willing to duplicate when pushing a case into the branches of another
+    caseOfCaseBudget :: Int,
+    -- | How many times we run over the whole program
+    rounds :: Int
+  }
+
+settingsFor :: OptLevel -> Settings
+settingsFor = \case
+  O0 -> Settings 0 0 0
+  O1 -> Settings 12 0 2
+  O2 -> Settings 24 24 4
+
+{- Utilities -}
+
+bindingNames :: [Binding] -> [ValName]
+bindingNames = map (\(Binding name _) -> name)
+
+bindingForms :: [Binding] -> [LambdaForm]
+bindingForms = map (\(Binding _ form) -> form)
+
+-- | Iterate a function until we reach a fixed point
+fixpoint :: Eq a => (a -> a) -> a -> a
+fixpoint f a =
+  let a' = f a
+   in if a' == a then a else fixpoint f a'
+
+disjoint :: Ord a => Set.Set a -> Set.Set a -> Bool
+disjoint a b = Set.null (Set.intersection a b)
+
+-- | Each branch of some alternatives, along with the names that branch binds
+altBranches :: Alts -> [([ValName], Expr)]
+altBranches = \case
+  IntAlts branches def -> map (snd >>> ([],)) branches <> map ([],) (maybeToList def)
+  StringAlts branches def -> map (snd >>> ([],)) branches <> map ([],) (maybeToList def)
+  ConstrAlts branches def -> map (first snd) branches <> map ([],) (maybeToList def)
+  BindPrim _ n e -> [([n], e)]
+  Unbox _ n e -> [([n], e)]
+  PolyAlt e -> [([], e)]
+
+-- | Rewrite each branch of some alternatives, knowing the names that branch binds
+traverseAlts :: Applicative f => ([ValName] -> Expr -> f Expr) -> Alts -> f Alts
+traverseAlts f = \case
+  IntAlts branches def -> IntAlts <$> traverse (traverse (f [])) branches <*> traverse (f []) def
+  StringAlts branches def -> StringAlts <$> traverse (traverse (f [])) branches <*> traverse (f []) def
+  ConstrAlts branches def ->
+    ConstrAlts <$> traverse (\((tag, names), e) -> ((tag, names),) <$> f names e) branches <*> traverse (f []) def
+  BindPrim box n e -> BindPrim box n <$> f [n] e
+  Unbox box n e -> Unbox box n <$> f [n] e
+  PolyAlt e -> PolyAlt <$> f [] e
+
+-- | A rough measure of how much code an expression generates
+size :: Expr -> Int
+size = \case
+  Case scrut _ alts -> 1 + size scrut + altsSize alts
+  Let bindings e -> size e + sum [1 + size body | LambdaForm _ _ _ _ body <- bindingForms bindings]
+  _ -> 1
+
+altsSize :: Alts -> Int
+altsSize = altBranches >>> map (snd >>> size) >>> sum
+
+-- | Check if an expression is a value we can allocate directly
+isValue :: Expr -> Bool
+isValue = \case
+  Constructor _ _ -> True
+  Box _ _ -> True
+  _ -> False
+
+-- | The updateable flag a thunk with a given body needs
+--
+-- This mirrors what we decide when first generating STG, since optimizing a thunk
+-- can turn it into a value.
+updateable :: Updateable -> Expr -> Updateable
+updateable u = \case
+  Primitive _ -> N
+  Error _ -> N
+  e | isValue e -> N
+  _ -> u
+
+-- | The top level names each top level binding refers to
+references :: [Binding] -> ValName -> Set.Set ValName
+references bindings =
+  let edges = Map.fromList [(name, freeNames form) | Binding name form <- bindings]
+   in \name -> Map.findWithDefault mempty name edges
+
+-- | All the names we can reach, starting from some names, and following references
+reachableFrom :: (ValName -> Set.Set ValName) -> Set.Set ValName -> Set.Set ValName
+reachableFrom refs = fixpoint (\names -> names <> foldMap refs names)
+
+{- Known Values -}
+
+-- | What we know about the value some name holds
+data Known
+  = -- | The name holds this constructor, with these fields
+    KnownConstructor Tag [Atom]
+  | -- | The name holds this boxed primitive
+    KnownBox BoxType Atom
+
+knownAtoms :: Known -> [Atom]
+knownAtoms = \case
+  KnownConstructor _ atoms -> atoms
+  KnownBox _ atom -> [atom]
+
+-- | Figure out what value an expression produces, if we know
+knownValue :: Expr -> Maybe Known
+knownValue = \case
+  Constructor tag atoms -> Just (KnownConstructor tag atoms)
+  Box box atom -> Just (KnownBox box atom)
+  _ -> Nothing
+
+-- | The values we know some bindings hold
+knownBindings :: [Binding] -> [(ValName, Known)]
+knownBindings bindings =
+  [(name, value) | Binding name (LambdaForm _ _ [] [] e) <- bindings, Just value <- [knownValue e]]
+
+{- Optimizer Monad -}
+
+-- | The information we have access to while optimizing
+data Context = Context
+  { -- | The settings for the level we're optimizing at
+    settings :: Settings,
+    -- | The top level functions small enough to inline at each saturated call
+    inlineable :: Map.Map ValName ([ValName], Expr),
+    -- | What we know about the values some names hold
+    known :: Map.Map ValName Known,
+    -- | The names bound locally at this point, which might shadow top level names
+    locals :: Set.Set ValName
+  }
+
+-- | A context where we can generate fresh names, and know about our surroundings
+newtype OptimizerM a = OptimizerM (ReaderT Context (State Int) a)
+  deriving (Functor, Applicative, Monad, MonadReader Context, MonadState Int)
+
+runOptimizerM :: OptimizerM a -> Context -> a
+runOptimizerM (OptimizerM m) ctx = evalState (runReaderT m ctx) 0
+
+fresh :: OptimizerM ValName
+fresh = do
+  x <- get
+  put (x + 1)
+  return ("$o" <> show x)
+
+-- | Run a computation where some new names shadow what we knew about them
+--
+-- This also forgets the values mentioning these names, since they now refer to something else.
+binding :: [ValName] -> OptimizerM a -> OptimizerM a
+binding names =
+  local <| \ctx ->
+    ctx
+      { inlineable = Map.withoutKeys (inlineable ctx) shadowed,
+        known = Map.filter (knownAtoms >>> freeNames >>> disjoint shadowed) (Map.withoutKeys (known ctx) shadowed),
+        locals = shadowed <> locals ctx
+      }
+  where
+    shadowed = Set.fromList names
+
+-- | Run a computation knowing the values of some names
+knowing :: [(ValName, Known)] -> OptimizerM a -> OptimizerM a
+knowing values = local (\ctx -> ctx {known = Map.fromList values <> known ctx})
+
+{- Substitution -}
+
+-- | Move a substitution under a binder
+--
+-- The name stops being substituted, unless it would capture one of the names
+-- we're substituting in, in which case we rename it.
+underName :: Map.Map ValName Atom -> ValName -> OptimizerM (Map.Map ValName Atom, ValName)
+underName sub name
+  | Set.member name (freeNames (Map.elems sub)) = do
+    name' <- fresh
+    return (Map.insert name (NameAtom name') sub, name')
+  | otherwise = return (Map.delete name sub, name)
+
+under :: Map.Map ValName Atom -> [ValName] -> OptimizerM (Map.Map ValName Atom, [ValName])
+under sub = \case
+  [] -> return (sub, [])
+  name : names -> do
+    (sub', name') <- underName sub name
+    (sub'', names') <- under sub' names
+    return (sub'', name' : names')
+
+-- | Replace some names with atoms, without capturing any of the names we substitute in
+substitute :: Map.Map ValName Atom -> Expr -> OptimizerM Expr
+substitute sub e | Map.null sub = return e
+substitute sub e = case e of
+  Apply f atoms ->
+    return <| case Map.lookup f sub of
+      Just (NameAtom g) -> Apply g (map atom atoms)
+      Just (PrimitiveAtom p) -> Primitive p
+      Nothing -> Apply f (map atom atoms)
+  Constructor tag atoms -> return (Constructor tag (map atom atoms))
+  Builtin b atoms -> return (Builtin b (map atom atoms))
+  Box box a -> return (Box box (atom a))
+  Case scrut bound alts -> Case <$> substitute sub scrut <*> pure bound <*> substituteAlts sub alts
+  Let bindings body -> do
+    (sub', names) <- under sub (bindingNames bindings)
+    forms <- mapM (substituteForm sub') (bindingForms bindings)
+    Let (zipWith Binding names forms) <$> substitute sub' body
+  _ -> return e
+  where
+    atom (NameAtom n) = Map.findWithDefault (NameAtom n) n sub
+    atom a = a
+
+substituteForm :: Map.Map ValName Atom -> LambdaForm -> OptimizerM LambdaForm
+substituteForm sub (LambdaForm free u params intParams e) = do
+  (sub', params') <- under sub params
+  (sub'', intParams') <- under sub' intParams
+  LambdaForm free u params' intParams' <$> substitute sub'' e
+
+substituteAlts :: Map.Map ValName Atom -> Alts -> OptimizerM Alts
+substituteAlts sub = \case
+  IntAlts branches def -> IntAlts <$> traverse (traverse (substitute sub)) branches <*> traverse (substitute sub) def
+  StringAlts branches def -> StringAlts <$> traverse (traverse (substitute sub)) branches <*> traverse (substitute sub) def
+  ConstrAlts branches def -> ConstrAlts <$> traverse branch branches <*> traverse (substitute sub) def
+  BindPrim box n e -> do
+    (sub', n') <- underName sub n
+    BindPrim box n' <$> substitute sub' e
+  Unbox box n e -> do
+    (sub', n') <- underName sub n
+    Unbox box n' <$> substitute sub' e
+  PolyAlt e -> PolyAlt <$> substitute sub e
+  where
+    branch ((tag, names), e) = do
+      (sub', names') <- under sub names
+      ((tag, names'),) <$> substitute sub' e
+
+{- Optimizing Expressions -}
+
+optForm :: LambdaForm -> OptimizerM LambdaForm
+optForm (LambdaForm free u params intParams e) =
+  binding (params <> intParams) <| do
+    e' <- optExpr e
+    let u' = if null params then updateable u e' else u
+    return (LambdaForm free u' params intParams e')
+
+optExpr :: Expr -> OptimizerM Expr
+optExpr = \case
+  Apply f atoms -> optApply f atoms
+  Case scrut _ alts -> optExpr scrut >>= (`optCase` alts)
+  Let bindings e -> optLet bindings e
+  e -> return e
+
+-- | Optimize a function call, inlining the function if it's small enough
+--
+-- This is where beta reduction happens: the body of the function gets
+-- the arguments substituted for its parameters.
+optApply :: ValName -> [Atom] -> OptimizerM Expr
+optApply f atoms = do
+  found <- asks (inlineable >>> Map.lookup f)
+  shadowed <- asks locals
+  case found of
+    -- The names the function refers to need to mean the same thing where we call it
+    Just (params, body)
+      | length atoms >= length params,
+        disjoint shadowed (freeNames (LambdaForm [] N params [] body)) -> do
+        let (now, later) = splitAt (length params) atoms
+        body' <- substitute (Map.fromList (zip params now)) body
+        case (body', later) of
+          (_, []) -> optExpr body'
+          (Apply g atoms', _) -> optApply g (atoms' <> later)
+          _ -> return (Apply f atoms)
+    _ -> return (Apply f atoms)
+
+-- | Pick the branch a known value ends up in, if we can tell
+choose :: Known -> Alts -> Maybe (OptimizerM Expr)
+choose value alts = case (value, alts) of
+  (KnownConstructor tag atoms, ConstrAlts branches def) -> case find (fst >>> fst >>> (== tag)) branches of
+    Just ((_, names), e)
+      | length names == length atoms -> Just (substitute (Map.fromList (zip names atoms)) e)
+      | otherwise -> Nothing
+    Nothing -> Just (return (orIncomplete def))
+  (KnownBox IntBox (PrimitiveAtom (PrimInt i)), IntAlts branches def) ->
+    Just (return (fromMaybe (orIncomplete def) (lookup i branches)))
+  (KnownBox StringBox (PrimitiveAtom (PrimString s)), StringAlts branches def) ->
+    Just (return (fromMaybe (orIncomplete def) (lookup s branches)))
+  (KnownBox box atom, BindPrim box' n e) | box == box' -> Just (substitute (Map.singleton n atom) e)
+  (KnownBox box atom, Unbox box' n e) | box == box' -> Just (substitute (Map.singleton n atom) e)
+  -- Anything we know about has already been evaluated
+  (_, PolyAlt e) -> Just (return e)
+  _ -> Nothing
+  where
+    orIncomplete = fromMaybe (Error "Incomplete Case Expression")
+
+-- | The places an expression can end up returning from
+tails :: Expr -> [Expr]
+tails = \case
+  Case _ _ alts -> concatMap (snd >>> tails) (altBranches alts)
+  Let _ e -> tails e
+  e -> [e]
+
+-- | The names bound on the way to the tails of an expression
+tailBinders :: Expr -> Set.Set ValName
+tailBinders = \case
+  Case _ _ alts -> foldMap (\(names, e) -> Set.fromList names <> tailBinders e) (altBranches alts)
+  Let bindings e -> Set.fromList (bindingNames bindings) <> tailBinders e
+  _ -> mempty
+
+-- | Check whether pushing some alternatives into the tails of an expression is worth it
+--
+-- This is only the case when each tail produces a value we can match on directly.
+-- Tails producing different constructors pick different branches, but the others
+-- each need their own copy of the alternatives.
+worthPushing :: Int -> Expr -> Alts -> Bool
+worthPushing budget scrut alts =
+  all resolved leaves
+    && disjoint (tailBinders scrut) (freeNames alts)
+    && copies * altsSize alts <= budget
+  where
+    leaves = tails scrut
+    resolved = \case
+      Error _ -> True
+      e -> isJust (knownValue e)
+    values = length (filter isValue leaves)
+    tags = nub [tag | Constructor tag _ <- leaves]
+    copies = max 0 (values - max 1 (length tags))
+
+-- | Optimize a case expression, given its optimized scrutinee
+optCase :: Expr -> Alts -> OptimizerM Expr
+optCase scrut alts = do
+  found <- case scrut of
+    Apply x [] -> asks (known >>> Map.lookup x)
+    _ -> return (knownValue scrut)
+  budget <- asks (settings >>> caseOfCaseBudget)
+  case scrut of
+    Error s -> return (Error s)
+    _ | Just value <- found, Just chosen <- choose value alts -> chosen >>= optExpr
+    Let bindings e
+      | disjoint (Set.fromList (bindingNames bindings)) (freeNames alts) ->
+        Let bindings <$> binding (bindingNames bindings) (knowing (knownBindings bindings) (optCase e alts))
+    Case {}
+      | worthPushing budget scrut alts -> pushInto scrut
+    _ -> Case scrut [] <$> optAlts scrut alts
+  where
+    pushInto = \case
+      Case inner bound innerAlts -> Case inner bound <$> traverseAlts (\names e -> binding names (pushInto e)) innerAlts
+      Let bindings e -> Let bindings <$> binding (bindingNames bindings) (pushInto e)
+      leaf -> optCase leaf alts
+
+-- | Optimize the alternatives of a case, learning what each branch tells us about the scrutinee
+optAlts :: Expr -> Alts -> OptimizerM Alts
+optAlts scrut = \case
+  IntAlts branches def ->
+    IntAlts
+      <$> traverse (\(i, e) -> (i,) <$> learning [] (KnownBox IntBox (PrimitiveAtom (PrimInt i))) e) branches
+      <*> traverse optExpr def
+  StringAlts branches def ->
+    StringAlts
+      <$> traverse (\(s, e) -> (s,) <$> learning [] (KnownBox StringBox (PrimitiveAtom (PrimString s))) e) branches
+      <*> traverse optExpr def
+  BindPrim box n e -> BindPrim box n <$> learning [n] (KnownBox box (NameAtom n)) e
+  Unbox box n e -> Unbox box n <$> learning [n] (KnownBox box (NameAtom n)) e
+  PolyAlt e -> PolyAlt <$> optExpr e
+  ConstrAlts branches def ->
+    ConstrAlts
+      <$> traverse (\((tag, names), e) -> ((tag, names),) <$> learning names (KnownConstructor tag (map NameAtom names)) e) branches
+      <*> traverse optExpr def
+  where
+    -- A branch binding the name we matched on shadows it, so we don't learn anything
+    learning names value e = binding names <| case scrut of
+      Apply x [] | notElem x names -> knowing [(x, value)] (optExpr e)
+      _ -> optExpr e
+
+{- Let Floating -}
+
+optLet :: [Binding] -> Expr -> OptimizerM Expr
+optLet bindings e =
+  binding (bindingNames bindings) <| do
+    forms <- mapM optForm (bindingForms bindings)
+    let bindings' = zipWith Binding (bindingNames bindings) forms
+    e' <- knowing (knownBindings bindings') (optExpr e)
+    (bindings'', e'') <- removeAliases bindings' e'
+    floated <- concat <$> mapM floatOut bindings''
+    return (finishLet floated e'')
+
+-- | Replace the bindings that just evaluate another name with that name
+removeAliases :: [Binding] -> Expr -> OptimizerM ([Binding], Expr)
+removeAliases bindings e = case aliases of
+  [] -> return (bindings, e)
+  _ -> do
+    let sub = Map.fromList aliases
+        kept = filter (\(Binding name _) -> not (Map.member name sub)) bindings
+    forms <- mapM (substituteForm sub) (bindingForms kept)
+    e' <- substitute sub e
+    return (zipWith Binding (bindingNames kept) forms, e')
+  where
+    names = Set.fromList (bindingNames bindings)
+    aliases = [(name, NameAtom y) | Binding name (LambdaForm _ _ [] [] (Apply y [])) <- bindings, not (Set.member y names)]
+
+-- | Lift the bindings out of a thunk that just ends up building a value
+--
+-- The thunk then becomes that value, which we can allocate directly, instead
+-- of allocating the thunk, and then the value when it gets evaluated.
+floatOut :: Binding -> OptimizerM [Binding]
+floatOut = \case
+  Binding name (LambdaForm free _ [] [] (Let inner e))
+    | isValue e -> do
+      -- These names now live alongside others, so they need to be fresh
+      names <- mapM (const fresh) inner
+      let sub = Map.fromList (zip (bindingNames inner) (map NameAtom names))
+      forms <- mapM (substituteForm sub) (bindingForms inner)
+      e' <- substitute sub e
+      return (Binding name (LambdaForm free N [] [] e') : zipWith Binding names forms)
+  b -> return [b]
+
+-- | Count how many times a name gets mentioned in an expression
+uses :: ValName -> Expr -> Int
+uses name = go
+  where
+    go = \case
+      Apply f atoms -> count (NameAtom f : atoms)
+      Constructor _ atoms -> count atoms
+      Builtin _ atoms -> count atoms
+      Box _ atom -> count [atom]
+      Case scrut _ alts -> go scrut + sum [go e | (names, e) <- altBranches alts, notElem name names]
+      Let bindings e
+        | elem name (bindingNames bindings) -> 0
+        | otherwise -> go e + sum [go body | LambdaForm _ _ params intParams body <- bindingForms bindings, notElem name (params <> intParams)]
+      _ -> 0
+
+    count = filter (== NameAtom name) >>> length
+
+-- | Replace the single place where a thunk gets evaluated with its body
+--
+-- This only works if that place isn't inside of some other closure, since
+-- that closure might get entered many times, and if none of the names the
+-- body needs get shadowed on the way there.
+replaceUse :: ValName -> Expr -> Expr -> Maybe Expr
+replaceUse name thunk = go
+  where
+    blocked = Set.insert name (freeNames thunk)
+
+    mentions :: FreeNames a => a -> Bool
+    mentions = freeNames >>> Set.member name
+
+    go = \case
+      Apply f [] | f == name -> Just thunk
+      Case scrut bound alts
+        | mentions scrut -> (\scrut' -> Case scrut' bound alts) <$> go scrut
+        | otherwise -> Case scrut bound <$> traverseAlts branch alts
+      Let bindings e
+        | disjoint blocked (Set.fromList (bindingNames bindings)) && not (mentions (bindingForms bindings)) ->
+          Let bindings <$> go e
+      _ -> Nothing
+
+    branch names e
+      | elem name names || not (mentions e) = Just e
+      | disjoint blocked (Set.fromList names) = go e
+      | otherwise = Nothing
+
+-- | Move a binding into the only branch of a case that uses it
+--
+-- This way, we don't allocate it on the paths that don't need it.
+sinkInto :: Binding -> Expr -> Maybe Expr
+sinkInto b@(Binding name form) = \case
+  Case scrut bound alts
+    | not (Set.member name (freeNames scrut)),
+      [_] <- filter (uncurry needs) (altBranches alts) ->
+      Case scrut bound <$> traverseAlts place alts
+  _ -> Nothing
+  where
+    needed = Set.insert name (freeNames form)
+
+    needs names e = notElem name names && Set.member name (freeNames e)
+
+    place names e
+      | not (needs names e) = Just e
+      | disjoint needed (Set.fromList names) = Just (Let [b] e)
+      | otherwise = Nothing
+
+-- | Build a let expression, once its bindings and body have been optimized
+--
+-- We drop the bindings nobody uses, and move the others as close to their use as we can.
+finishLet :: [Binding] -> Expr -> Expr
+finishLet bindings e =
+  let live = reachableFrom (references bindings) (freeNames e)
+      used = filter (\(Binding name _) -> Set.member name live) bindings
+      (kept, e') = foldl (place used) ([], e) used
+   in flatten (reverse kept) e'
+  where
+    -- The other bindings in this group might need a binding to stay where it is
+    place used (kept, body) b@(Binding name form)
+      | Set.member name (freeNames [f | Binding n f <- used, n /= name]) = (b : kept, body)
+      | LambdaForm _ _ [] [] thunk <- form,
+        not (Set.member name (freeNames form)),
+        uses name body == 1,
+        Just body' <- replaceUse name thunk body =
+        (kept, body')
+      | Just body' <- sinkInto b body = (kept, body')
+      | otherwise = (b : kept, body)
+
+    -- Merging nested lets lets us allocate all of their closures at once
+    flatten [] body = body
+    flatten bs (Let inner body)
+      | disjoint (Set.fromList (bindingNames inner)) (Set.fromList (bindingNames bs) <> freeNames (bindingForms bs)) =
+        Let (bs <> inner) body
+    flatten bs body = Let bs body
+
+{- Top Level -}
+
+-- | The top level functions small enough to inline, that can't end up calling themselves
+inlineCandidates :: Settings -> [Binding] -> Map.Map ValName ([ValName], Expr)
+inlineCandidates s bindings =
+  Map.fromList
+    [ (name, (params, e))
+      | Binding name (LambdaForm _ N params [] e) <- bindings,
+        not (null params),
+        size e <= inlineSize s,
+        not (Set.member name (reachableFrom refs (refs name)))
+    ]
+  where
+    refs = references bindings
+
+-- | Optimize a program, putting in as much effort as a given level asks for
+optimize :: OptLevel -> STG -> STG
+optimize O0 program = program
+optimize level (STG bindings entry) =
+  runOptimizerM (go (rounds s) bindings entry) (Context s mempty mempty mempty)
+  where
+    s = settingsFor level
+
+    go :: Int -> [Binding] -> LambdaForm -> OptimizerM STG
+    go 0 bindings' entry' = return (finish bindings' entry')
+    go n bindings' entry' = do
+      let withTopLevel ctx = ctx {inlineable = inlineCandidates s bindings', known = Map.fromList (knownBindings bindings')}
+      (forms, entry'') <- local withTopLevel ((,) <$> mapM optForm (bindingForms bindings') <*> optForm entry')
+      let bindings'' = zipWith Binding (bindingNames bindings') forms
+          live = reachableFrom (references bindings'') (freeNames entry'')
+      go (n - 1) (filter (\(Binding name _) -> Set.member name live) bindings'') entry''
+
+    finish bindings' entry' =
+      let topLevel = Set.fromList (bindingNames bindings')
+       in STG
+            (map (\(Binding name form) -> Binding name (refreshForm topLevel form)) bindings')
+            (refreshForm topLevel entry')
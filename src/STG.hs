@@ -12,10 +12,12 @@ module STG
     ValName,
     LambdaForm (..),
     Expr (..),
+    FreeNames (..),
     Tag,
     Alts (..),
     Primitive (..),
     Updateable (..),
+    refreshForm,
     stg,
   )
 where
@@ -63,6 +65,8 @@ data Builtin
   | Concat
   | ExitWithInt
   | ExitWithString
+  | -- Offer a closure to be evaluated in parallel, returning a dummy int
+    Spark
   deriving (Eq, Show)
 
 -- Represents a unit of data simple enough to be passed directly
@@ -142,6 +146,10 @@ data Alts
   | -- Potential branches for constructor tags, introducing names,
     -- and then we end, as usual, with a default case
     ConstrAlts [((Tag, [ValName]), Expr)] (Maybe Expr)
+  | -- Evaluate the scrutinee, whatever kind of value it is, and then ignore it
+    --
+    -- This is only used to implement seq, which works for values of any type.
+    PolyAlt Expr
   deriving (Eq, Show)
 
 -- A flag telling us when a thunk is updateable
@@ -155,8 +163,12 @@ data Updateable = N | U deriving (Eq, Show)
 -- Represents a lambda expression
 --
 -- We first have a list of free variables occurring in the body,
--- the updateable flag, then the list of parameters, and then the body
-data LambdaForm = LambdaForm [ValName] Updateable [ValName] Expr deriving (Eq, Show)
+-- the updateable flag, then the list of parameters, and then the body.
+--
+-- Between the parameters and the body, we also have a list of parameters
+-- passed as unboxed ints. These only appear on the workers created by
+-- strictness analysis, and we only ever call these with all their arguments.
+data LambdaForm = LambdaForm [ValName] Updateable [ValName] [ValName] Expr deriving (Eq, Show)
 
 class FreeNames a where
   freeNames :: a -> Set.Set ValName
@@ -176,6 +188,7 @@ instance FreeNames Expr where
   freeNames (Apply name atoms) = Set.singleton name <> freeNames atoms
   freeNames (Constructor _ atoms) = freeNames atoms
   freeNames (Builtin _ atoms) = freeNames atoms
+  freeNames (Box _ atom) = freeNames atom
   freeNames (Case e _ alts) = freeNames e <> freeNames alts
   freeNames (Let bindings e) =
     let (names, insideBindings) = foldMap (\(Binding name e') -> (Set.singleton name, freeNames e')) bindings
@@ -190,9 +203,45 @@ instance FreeNames Alts where
      in freeNames e <> inAlts
   freeNames (BindPrim _ n e) = Set.delete n (freeNames e)
   freeNames (Unbox _ n e) = Set.delete n (freeNames e)
+  freeNames (PolyAlt e) = freeNames e
 
 instance FreeNames LambdaForm where
-  freeNames (LambdaForm _ _ names e) = Set.difference (freeNames e) (Set.fromList names)
+  freeNames (LambdaForm _ _ names intNames e) = Set.difference (freeNames e) (Set.fromList (names <> intNames))
+
+-- | Recompute the names each closure and case expression needs to capture
+--
+-- Passes rewriting STG move expressions around, so the names we originally computed
+-- are no longer accurate.
+refreshForm :: Set.Set ValName -> LambdaForm -> LambdaForm
+refreshForm topLevel (LambdaForm _ u params intParams e) =
+  let e' = refreshExpr topLevel e
+   in LambdaForm (captured topLevel (LambdaForm [] u params intParams e')) u params intParams e'
+
+refreshExpr :: Set.Set ValName -> Expr -> Expr
+refreshExpr topLevel = go
+  where
+    go = \case
+      Case scrut _ alts ->
+        let alts' = goAlts alts
+         in Case (go scrut) (captured topLevel alts') alts'
+      Let bindings e -> Let (map goBinding bindings) (go e)
+      e -> e
+
+    goAlts = \case
+      IntAlts branches def -> IntAlts (map (second go) branches) (fmap go def)
+      StringAlts branches def -> StringAlts (map (second go) branches) (fmap go def)
+      ConstrAlts branches def -> ConstrAlts (map (second go) branches) (fmap go def)
+      BindPrim box n e -> BindPrim box n (go e)
+      Unbox box n e -> Unbox box n (go e)
+      PolyAlt e -> PolyAlt (go e)
+
+    -- A closure can refer to itself without capturing anything
+    goBinding (Binding name form) =
+      let LambdaForm free u params intParams e = refreshForm topLevel form
+       in Binding name (LambdaForm (filter (/= name) free) u params intParams e)
+
+captured :: FreeNames a => Set.Set ValName -> a -> [ValName]
+captured topLevel a = Set.toList (Set.difference (freeNames a) topLevel)
 
 -- Represents a binding from a name to a lambda form
 --
@@ -248,9 +297,9 @@ getFreeNames a =
 
 makeLambdaForm :: [ValName] -> Expr -> STGM LambdaForm
 makeLambdaForm names expr = do
-  free <- getFreeNames (LambdaForm [] N names expr)
+  free <- getFreeNames (LambdaForm [] N names [] expr)
   let u = updateable names expr
-  return (LambdaForm free u names expr)
+  return (LambdaForm free u names [] expr)
   where
     updateable :: [ValName] -> Expr -> Updateable
     -- If we have arguments, then we can't be evaluated further
@@ -353,6 +402,8 @@ builtinName = \case
   S.Compose -> "$compose"
   S.Cash -> "$cash"
   S.Negate -> "$neg"
+  S.Seq -> "$seq"
+  S.Par -> "$par"
 
 -- Convert an expression into an STG expression
 convertExpr :: S.Expr Scheme -> STGM Expr
@@ -397,7 +448,7 @@ convertExpr =
       (bindings, atom) <- atomize lambda
       return (makeLet bindings (atomToExpr atom))
     handle S.ApplyExpr {} = error "Apply Expressions shouldn't appear here"
-    handle S.Builtin {} = error "Unary builtin operation"
+    handle (S.Builtin b) = return (Apply (builtinName b) [])
     handle (S.CaseExpr _ []) = return (Error "Empty Case Expression")
     handle (S.CaseExpr e branches) = convertExpr e >>= convertBranches branches
 
@@ -435,8 +486,8 @@ convertBranches branches scrut = case head branches of
     findPatterns conv = takeWhile (fst >>> (/= S.Wildcard)) >>> traverse (\(pat, e) -> liftA2 (,) (conv pat) (convertExpr e))
 
 removeBindingName :: ValName -> LambdaForm -> LambdaForm
-removeBindingName name (LambdaForm free u names expr) =
-  LambdaForm (filter (/= name) free) u names expr
+removeBindingName name (LambdaForm free u names intNames expr) =
+  LambdaForm (filter (/= name) free) u names intNames expr
 
 -- Convert an expression to a lambda form
 --
@@ -480,7 +531,7 @@ convertAST (AST _ defs) =
   where
     makeEntry boxType b n = do
       theCase <- makeCase (Apply n []) (Unbox boxType "#v" (Builtin b [NameAtom "#v"]))
-      return (LambdaForm [] N [] theCase)
+      return (LambdaForm [] N [] [] theCase)
 
     gatherBindings =
       defs |> convertValueDefinitions |> fmap (builtins ++)
@@ -522,6 +573,7 @@ builtins =
           []
           N
           ["$0", "$1"]
+          []
           ( Case
               (Apply "$0" [])
               ["$1"]
@@ -539,6 +591,7 @@ builtins =
           []
           N
           ["$0", "$1"]
+          []
           ( Case
               (Apply "$0" [])
               ["$1"]
@@ -556,28 +609,41 @@ builtins =
           []
           N
           ["$0", "$1", "$2"]
+          []
           ( Let
               [ Binding
                   "$3"
-                  ( LambdaForm ["$1", "$2"] U [] (Apply "$1" [NameAtom "$2"])
+                  ( LambdaForm ["$1", "$2"] U [] [] (Apply "$1" [NameAtom "$2"])
                   )
               ]
               (Apply "$0" [NameAtom "$3"])
           )
       ),
-    Binding "$cash" (LambdaForm [] N ["$0", "$1"] (Apply "$0" [NameAtom "$1"])),
+    Binding "$cash" (LambdaForm [] N ["$0", "$1"] [] (Apply "$0" [NameAtom "$1"])),
     Binding
       "$neg"
       ( LambdaForm
           []
           N
           ["$0"]
+          []
           ( Case
               (Apply "$0" [])
               []
               ( Unbox IntBox "#0" (makeIntBox (Builtin Negate [NameAtom "#0"]))
               )
           )
+      ),
+    Binding "$seq" (LambdaForm [] N ["$0", "$1"] [] (Case (Apply "$0" []) ["$1"] (PolyAlt (Apply "$1" [])))),
+    -- Sparking never fails, so the int it returns only makes sure the spark happens first
+    Binding
+      "$par"
+      ( LambdaForm
+          []
+          N
+          ["$0", "$1"]
+          []
+          (Case (Builtin Spark [NameAtom "$0"]) ["$1"] (BindPrim IntBox "#s" (Apply "$1" [])))
       )
   ]
   where
@@ -587,6 +653,7 @@ builtins =
         []
         N
         ["$0", "$1"]
+        []
         ( Case
             (Apply "$0" [])
             ["$1"]
@@ -161,6 +161,10 @@ data Builtin
   | And
   | Or
   | Negate
+  | -- | Evaluate the first argument, and then return the second
+    Seq
+  | -- | Maybe evaluate the first argument in parallel, and then return the second
+    Par
   deriving (Eq, Show)
 
 -- | Represents a kind of expression in our language
@@ -711,6 +715,20 @@ convertDefinitions = map pluckValueDefinition >>> catMaybes >>> convertValueDefi
     pluckValueDefinition (P.ValueDefinition v) = Just v
     pluckValueDefinition _ = Nothing
 
+-- | Replace the uses of the names for the builtins evaluating things early
+--
+-- Programs can bind `seq` and `par` themselves, so we only resolve them to the builtins
+-- after the patterns binding names have been compiled, and only where no binding shadows them.
+resolveBuiltinNames :: [ValueDefinition ()] -> [ValueDefinition ()]
+resolveBuiltinNames defs = map resolveDefinition defs
+  where
+    topLevel = map (\(ValueDefinition n _ _ _) -> n) defs
+
+    unbound = filter (fst >>> (`notElem` topLevel)) [("seq", Seq), ("par", Par)]
+
+    resolveDefinition (ValueDefinition n dec t e) =
+      ValueDefinition n dec t (foldr (\(name, b) -> substituteName name (Builtin b)) e unbound)
+
 simplifier :: P.AST -> Either SimplifierError (AST ())
 simplifier (P.AST defs) = do
   resolutionMap' <- gatherResolutions defs
@@ -719,4 +737,4 @@ simplifier (P.AST defs) = do
   let ctx = SimplifierContext resolutionMap' resolvedConstructors
   runSimplifier ctx <| do
     defs' <- convertDefinitions defs
-    return (AST resolvedConstructors defs')
+    return (AST resolvedConstructors (resolveBuiltinNames defs'))
@@ -0,0 +1,506 @@
+{-# LANGUAGE GeneralizedNewtypeDeriving #-}
+{-# LANGUAGE LambdaCase #-}
+{-# LANGUAGE TupleSections #-}
+
+-- | This module contains a strictness analysis over STG, and the transformations it enables
+--
+-- Whenever we pass an argument to a function that isn't already a name, we allocate
+-- a thunk for it. When the function is always going to evaluate that argument anyways,
+-- this is wasteful, and we might as well evaluate it before making the call.
+--
+-- For arguments that are ints, we can go further, and pass them unboxed. We do this by
+-- splitting a function into a worker, which takes these ints directly, and a wrapper, which
+-- evaluates them before calling the worker. The calls we know about go straight to
+-- the worker, and the wrapper serves every other use of the function.
+module Strictness (strictness) where
+
+import Control.Monad.Reader
+import Control.Monad.State
+import qualified Data.Map.Strict as Map
+import Data.Maybe (fromMaybe, maybeToList)
+import qualified Data.Set as Set
+import Ourlude
+import STG
+
+{- Analysis -}
+
+-- | Some information we have about each argument of certain functions
+type Signatures = Map.Map ValName [Bool]
+
+-- | The top level functions we analyze, along with their parameters and bodies
+type Functions = Map.Map ValName ([ValName], Expr)
+
+-- | Gather the top level functions in a program
+--
+-- These are the functions we can reference by name anywhere in the program,
+-- which means that we know how they'll get called.
+gatherFunctions :: [Binding] -> Functions
+gatherFunctions bindings =
+  Map.fromList [(name, (params, e)) | Binding name (LambdaForm _ N params [] e) <- bindings, not (null params)]
+
+-- | Remove the information about some names, since they're now shadowed
+without :: [ValName] -> Map.Map ValName a -> Map.Map ValName a
+without names mp = Map.withoutKeys mp (Set.fromList names)
+
+bindingNames :: [Binding] -> [ValName]
+bindingNames = map (\(Binding name _) -> name)
+
+-- | The names passed as arguments to a function at the positions a signature marks
+marked :: Signatures -> ValName -> [Atom] -> [ValName]
+marked sigs f atoms =
+  [n | (True, NameAtom n) <- zip (Map.findWithDefault [] f sigs) atoms]
+
+-- | Iterate a function until we reach a fixed point
+fixpoint :: Eq a => (a -> a) -> a -> a
+fixpoint f a =
+  let a' = f a
+   in if a' == a then a else fixpoint f a'
+
+-- | Represents the names an expression will definitely end up evaluating
+data Demand
+  = -- | The expression never returns, so it might as well evaluate everything
+    Diverges
+  | -- | The expression will evaluate at least these names
+    Evaluates (Set.Set ValName)
+  deriving (Eq, Show)
+
+-- | Combine two demands that both happen
+andThen :: Demand -> Demand -> Demand
+andThen (Evaluates a) (Evaluates b) = Evaluates (a <> b)
+andThen _ _ = Diverges
+
+-- | Combine two demands when only one of them will happen
+orElse :: Demand -> Demand -> Demand
+orElse Diverges d = d
+orElse d Diverges = d
+orElse (Evaluates a) (Evaluates b) = Evaluates (Set.intersection a b)
+
+-- | Forget about some names, once they're no longer in scope
+forget :: [ValName] -> Demand -> Demand
+forget _ Diverges = Diverges
+forget names (Evaluates a) = Evaluates (Set.difference a (Set.fromList names))
+
+isDemanded :: Demand -> ValName -> Bool
+isDemanded Diverges _ = True
+isDemanded (Evaluates a) name = Set.member name a
+
+-- | Figure out which names an expression always evaluates
+--
+-- The signatures tell us which arguments other functions evaluate, when we
+-- give them all of their arguments.
+demand :: Signatures -> Expr -> Demand
+demand sigs = \case
+  Error _ -> Diverges
+  Apply f atoms ->
+    let saturated = length atoms >= length (Map.findWithDefault [] f sigs)
+        strictArgs = if saturated then marked sigs f atoms else []
+     in Evaluates (Set.fromList (f : strictArgs))
+  Case scrut _ alts -> demand sigs scrut `andThen` altsDemand sigs alts
+  Let bindings e ->
+    let names = bindingNames bindings
+        sigs' = without names sigs
+        thunks = [(name, body) | Binding name (LambdaForm _ _ [] [] body) <- bindings]
+        -- Evaluating a thunk we've bound here evaluates whatever that thunk does
+        forceThunks d =
+          foldr andThen d [demand sigs' body | (name, body) <- thunks, isDemanded d name]
+     in forget names (fixpoint forceThunks (demand sigs' e))
+  _ -> Evaluates mempty
+
+altsDemand :: Signatures -> Alts -> Demand
+altsDemand sigs = \case
+  IntAlts branches def -> oneOf (map snd branches <> maybeToList def)
+  StringAlts branches def -> oneOf (map snd branches <> maybeToList def)
+  ConstrAlts branches def ->
+    let inBranch ((_, names), e) = forget names (demand (without names sigs) e)
+     in foldr orElse Diverges (map inBranch branches <> map (demand sigs) (maybeToList def))
+  BindPrim _ n e -> forget [n] (demand (without [n] sigs) e)
+  Unbox _ n e -> forget [n] (demand (without [n] sigs) e)
+  PolyAlt e -> demand sigs e
+  where
+    oneOf = map (demand sigs) >>> foldr orElse Diverges
+
+-- | Find out which arguments each function always evaluates
+--
+-- We start by assuming that every function evaluates all of its arguments, and then
+-- weaken this assumption until it stops changing. This lets us see through recursion,
+-- since a recursive call doesn't evaluate anything the call itself doesn't.
+strictSignatures :: Functions -> Signatures
+strictSignatures functions =
+  fixpoint (\sigs -> Map.map (signature sigs) functions) (Map.map (fst >>> map (const True)) functions)
+  where
+    signature sigs (params, e) =
+      let d = demand (without params sigs) e
+       in map (isDemanded d) params
+
+-- | Find the names an expression uses as ints
+--
+-- Since our programs are well typed, a name used like an int has to be one.
+intUses :: Signatures -> Expr -> Set.Set ValName
+intUses sigs = \case
+  Apply f atoms -> Set.fromList (marked sigs f atoms)
+  Case scrut _ alts ->
+    let scrutinized = case (scrut, alts) of
+          (Apply n [], IntAlts _ _) -> Set.singleton n
+          (Apply n [], Unbox IntBox _ _) -> Set.singleton n
+          _ -> mempty
+     in scrutinized <> intUses sigs scrut <> altsIntUses sigs alts
+  Let bindings e ->
+    let names = bindingNames bindings
+        sigs' = without names sigs
+        inBinding (Binding _ (LambdaForm _ _ params intParams body)) =
+          let bound = params <> intParams
+           in Set.difference (intUses (without bound sigs') body) (Set.fromList bound)
+     in Set.difference (foldMap inBinding bindings <> intUses sigs' e) (Set.fromList names)
+  _ -> mempty
+
+altsIntUses :: Signatures -> Alts -> Set.Set ValName
+altsIntUses sigs = \case
+  IntAlts branches def -> foldMap (intUses sigs) (map snd branches <> maybeToList def)
+  StringAlts branches def -> foldMap (intUses sigs) (map snd branches <> maybeToList def)
+  ConstrAlts branches def ->
+    let inBranch ((_, names), e) = Set.difference (intUses (without names sigs) e) (Set.fromList names)
+     in foldMap inBranch branches <> foldMap (intUses sigs) def
+  BindPrim _ n e -> Set.delete n (intUses (without [n] sigs) e)
+  Unbox _ n e -> Set.delete n (intUses (without [n] sigs) e)
+  PolyAlt e -> intUses sigs e
+
+-- | Find out which arguments of each function are ints
+--
+-- Unlike with strictness, we start by assuming that no argument is an int,
+-- and learn more about the arguments until nothing changes.
+intSignatures :: Functions -> Signatures
+intSignatures functions =
+  fixpoint (\sigs -> Map.map (signature sigs) functions) (Map.map (fst >>> map (const False)) functions)
+  where
+    signature sigs (params, e) =
+      let used = intUses (without params sigs) e
+       in map (`Set.member` used) params
+
+{- Transformation -}
+
+-- | The information we need to call the worker of some function
+data Worker = Worker
+  { -- | The name of the worker function
+    workerName :: ValName,
+    -- | Whether or not each argument of the original function gets passed unboxed
+    unboxedArgs :: [Bool]
+  }
+  deriving (Show)
+
+-- | Decide which functions should be split into a worker and a wrapper
+--
+-- This is worth it for any function evaluating one of its int arguments.
+findWorkers :: Functions -> Map.Map ValName Worker
+findWorkers functions =
+  Map.mapMaybeWithKey workerFor (Map.intersectionWith (zipWith (&&)) strict ints)
+  where
+    strict = strictSignatures functions
+    ints = intSignatures functions
+
+    workerFor name unboxedFlags
+      | or unboxedFlags = Just (Worker (name <> "$w") unboxedFlags)
+      | otherwise = Nothing
+
+-- | The context we use when rewriting expressions
+data Context = Context
+  { -- | The workers of the functions that have one
+    workers :: Map.Map ValName Worker,
+    -- | The parameters and bodies of the workers simple enough to inline
+    inlineable :: Map.Map ValName ([ValName], Expr),
+    -- | The names bound to boxed ints whose unboxed value we already know
+    unboxed :: Map.Map ValName Atom,
+    -- | The primitive names we've replaced with some other atom
+    renamed :: Map.Map ValName Atom
+  }
+
+-- | A computation where we can rewrite expressions, with a source of fresh names
+newtype StrictnessM a = StrictnessM (ReaderT Context (State Int) a)
+  deriving (Functor, Applicative, Monad, MonadReader Context, MonadState Int)
+
+runStrictnessM :: StrictnessM a -> Context -> a
+runStrictnessM (StrictnessM m) ctx =
+  m |> (`runReaderT` ctx) |> (`evalState` 0)
+
+-- | Create a fresh name for a primitive value
+freshPrim :: StrictnessM ValName
+freshPrim = do
+  x <- get
+  put (x + 1)
+  return ("#s" <> show x)
+
+-- | Run a computation where some new names shadow what we knew about them
+binding :: [ValName] -> StrictnessM a -> StrictnessM a
+binding names =
+  local <| \ctx ->
+    ctx
+      { workers = without names (workers ctx),
+        inlineable = without names (inlineable ctx),
+        unboxed = without names (unboxed ctx),
+        renamed = without names (renamed ctx)
+      }
+
+-- | Run a computation knowing the unboxed values of some boxed ints
+withUnboxed :: [(ValName, Atom)] -> StrictnessM a -> StrictnessM a
+withUnboxed known =
+  binding (map fst known)
+    >>> local (\ctx -> ctx {unboxed = Map.fromList known <> unboxed ctx})
+
+-- | Run a computation where a primitive name gets replaced with some atom
+renaming :: ValName -> Atom -> StrictnessM a -> StrictnessM a
+renaming name atom =
+  binding [name]
+    >>> local (\ctx -> ctx {renamed = Map.insert name atom (renamed ctx)})
+
+rewriteAtom :: Atom -> StrictnessM Atom
+rewriteAtom = \case
+  NameAtom n -> asks (renamed >>> Map.findWithDefault (NameAtom n) n)
+  atom -> return atom
+
+-- | Make a case expression, simplifying the scrutinee if we can
+makeCase :: Expr -> Alts -> Expr
+makeCase scrut alts = case (scrut, alts) of
+  -- There's no point in boxing up an int, only to unbox it right away
+  (Case inner [] (BindPrim IntBox n (Box IntBox (NameAtom n'))), _)
+    | n == n' -> makeCase inner alts
+  -- Comparisons produce a bool from an int, which we can match on directly
+  (Case inner [] (IntAlts [(0, Constructor 0 []), (1, Constructor 1 [])] Nothing), ConstrAlts branches def)
+    | all (fst >>> snd >>> null) branches ->
+      let pick tag = case lookup (tag, []) branches of
+            Just e -> e
+            Nothing -> fromMaybe (Error "Incomplete Case Expression") def
+       in Case inner [] (IntAlts [(0, pick 0), (1, pick 1)] Nothing)
+  _ -> Case scrut [] alts
+
+-- | Make a let expression, dropping the bindings we no longer use
+makeLet :: [Binding] -> Expr -> Expr
+makeLet bindings e = case filter (\(Binding name _) -> Set.member name live) bindings of
+  [] -> e
+  used -> Let used e
+  where
+    live = fixpoint reach (freeNames e)
+
+    reach names =
+      names <> foldMap (\(Binding name form) -> if Set.member name names then freeNames form else mempty) bindings
+
+-- | Find the worker we can call with these arguments, if any
+lookupWorker :: ValName -> [Atom] -> StrictnessM (Maybe Worker)
+lookupWorker f atoms = do
+  found <- asks (workers >>> Map.lookup f)
+  return <| case found of
+    Just worker | length atoms == length (unboxedArgs worker) -> Just worker
+    _ -> Nothing
+
+-- | Call the worker of some function, evaluating the arguments it takes unboxed
+--
+-- We can also pass in the bodies of thunks we would have allocated for some of
+-- these arguments, in which case we evaluate those bodies directly instead.
+callWorker :: Map.Map ValName Expr -> Worker -> [Atom] -> StrictnessM Expr
+callWorker thunks (Worker name unboxedFlags) = zip unboxedFlags >>> go [] []
+  where
+    go ptrs ints = \case
+      [] -> finish (reverse ptrs) (reverse ints)
+      (False, atom) : rest -> go (atom : ptrs) ints rest
+      (True, atom) : rest -> evaluate atom (\int -> go ptrs (int : ints) rest)
+
+    evaluate :: Atom -> (Atom -> StrictnessM Expr) -> StrictnessM Expr
+    evaluate atom withInt = case atom of
+      NameAtom n ->
+        asks (unboxed >>> Map.lookup n) >>= \case
+          Just int -> withInt int
+          Nothing -> case Map.findWithDefault (Apply n []) n thunks of
+            Box IntBox int -> withInt int
+            scrut -> do
+              v <- freshPrim
+              rest <- withInt (NameAtom v)
+              return (makeCase scrut (Unbox IntBox v rest))
+      _ -> withInt atom
+
+    finish ptrs ints =
+      asks (inlineable >>> Map.lookup name) >>= \case
+        Just (params, body) | null ptrs -> withUnboxed (zip params ints) (rewriteExpr body)
+        _ -> return (Apply name (ptrs <> ints))
+
+-- | Rewrite an expression to make use of the strictness information we have
+rewriteExpr :: Expr -> StrictnessM Expr
+rewriteExpr = \case
+  Apply f atoms ->
+    asks (unboxed >>> Map.lookup f) >>= \case
+      Just int | null atoms -> return (Box IntBox int)
+      _ -> do
+        atoms' <- mapM rewriteAtom atoms
+        lookupWorker f atoms' >>= \case
+          Just worker -> callWorker mempty worker atoms'
+          Nothing -> return (Apply f atoms')
+  Constructor tag atoms -> Constructor tag <$> mapM rewriteAtom atoms
+  Builtin b atoms -> Builtin b <$> mapM rewriteAtom atoms
+  Box box atom -> Box box <$> rewriteAtom atom
+  Case scrut _ alts -> do
+    scrut' <- rewriteExpr scrut
+    case (scrut', alts) of
+      -- If we already know the int we're matching on, we can skip the case
+      (Box IntBox int, Unbox IntBox n e) -> renaming n int (rewriteExpr e)
+      (Box IntBox int, BindPrim IntBox n e) -> renaming n int (rewriteExpr e)
+      (Box _ _, PolyAlt e) -> rewriteExpr e
+      (Box IntBox (PrimitiveAtom (PrimInt i)), IntAlts branches def) ->
+        lookup i branches
+          |> maybe def Just
+          |> fromMaybe (Error "Incomplete Case Expression")
+          |> rewriteExpr
+      _ -> makeCase scrut' <$> rewriteAlts alts
+  Let bindings e -> rewriteLet bindings e
+  e -> return e
+
+rewriteAlts :: Alts -> StrictnessM Alts
+rewriteAlts = \case
+  IntAlts branches def -> IntAlts <$> mapM (traverse rewriteExpr) branches <*> traverse rewriteExpr def
+  StringAlts branches def -> StringAlts <$> mapM (traverse rewriteExpr) branches <*> traverse rewriteExpr def
+  ConstrAlts branches def ->
+    let rewriteBranch (pat@(_, names), e) = (pat,) <$> binding names (rewriteExpr e)
+     in ConstrAlts <$> mapM rewriteBranch branches <*> traverse rewriteExpr def
+  -- We give primitive names fresh names, to avoid clashes when inlining
+  BindPrim box n e -> do
+    n' <- freshPrim
+    BindPrim box n' <$> renaming n (NameAtom n') (rewriteExpr e)
+  Unbox box n e -> do
+    n' <- freshPrim
+    Unbox box n' <$> renaming n (NameAtom n') (rewriteExpr e)
+  PolyAlt e -> PolyAlt <$> rewriteExpr e
+
+rewriteForm :: LambdaForm -> StrictnessM LambdaForm
+rewriteForm (LambdaForm free u params intParams e) =
+  LambdaForm free u params intParams <$> binding (params <> intParams) (rewriteExpr e)
+
+-- | Rewrite a let expression
+--
+-- The STG stage binds each argument that isn't an atom right before calling
+-- a function. If the function is strict in that argument, we can evaluate
+-- the argument directly instead of allocating a thunk for it.
+rewriteLet :: [Binding] -> Expr -> StrictnessM Expr
+rewriteLet bindings e =
+  binding (bindingNames bindings) <| withUnboxed literals <| do
+    bindings' <- forM bindings (\(Binding name form) -> Binding name <$> rewriteForm form)
+    withUnboxed (knownInts bindings') <| do
+      (inlined, e') <- case e of
+        Apply f atoms -> do
+          atoms' <- mapM rewriteAtom atoms
+          lookupWorker f atoms' >>= \case
+            Just worker -> do
+              let thunks = singleUseThunks worker atoms' bindings'
+              (Map.keysSet thunks,) <$> callWorker thunks worker atoms'
+            Nothing -> (mempty,) <$> rewriteExpr e
+        _ -> (mempty,) <$> rewriteExpr e
+      let remaining = filter (\(Binding name _) -> not (Set.member name inlined)) bindings'
+      return (makeLet remaining e')
+  where
+    knownInts :: [Binding] -> [(ValName, Atom)]
+    knownInts bs = [(name, int) | Binding name (LambdaForm _ _ [] [] (Box IntBox int)) <- bs]
+
+    -- The other bindings can already make use of literals, since these don't depend on anything
+    literals = [known | known@(_, PrimitiveAtom _) <- knownInts bindings]
+
+-- | Find the thunks bound for a call that we can evaluate instead of allocating
+--
+-- These are thunks that we pass as an unboxed argument, which aren't used anywhere else.
+singleUseThunks :: Worker -> [Atom] -> [Binding] -> Map.Map ValName Expr
+singleUseThunks worker atoms bindings =
+  Map.fromList
+    [ (name, body)
+      | Binding name (LambdaForm _ U [] [] body) <- bindings,
+        NameAtom name `elem` unboxedAtoms,
+        length (filter (== NameAtom name) atoms) == 1,
+        not (Set.member name usedByBindings)
+    ]
+  where
+    unboxedAtoms = [atom | (True, atom) <- zip (unboxedArgs worker) atoms]
+    usedByBindings = foldMap (\(Binding _ form) -> freeNames form) bindings
+
+-- | Create the worker for a function
+--
+-- The worker takes the arguments the function evaluates as unboxed ints.
+-- If the body still needs the boxed version of such an argument, we box it up again.
+makeWorker :: Worker -> ([ValName], Expr) -> StrictnessM LambdaForm
+makeWorker (Worker _ unboxedFlags) (params, e) = do
+  let ptrParams = [p | (False, p) <- zip unboxedFlags params]
+      intParams = [p | (True, p) <- zip unboxedFlags params]
+  intNames <- mapM (const freshPrim) intParams
+  let known = zip intParams (map NameAtom intNames)
+  e' <- binding params (withUnboxed known (rewriteExpr e))
+  let reboxed =
+        [ Binding p (LambdaForm [] N [] [] (Box IntBox int))
+          | (p, int) <- known,
+            Set.member p (freeNames e')
+        ]
+  return (LambdaForm [] N ptrParams intNames (makeLet reboxed e'))
+
+-- | Create the wrapper for a function, which just calls its worker
+makeWrapper :: Worker -> [ValName] -> StrictnessM LambdaForm
+makeWrapper worker params =
+  LambdaForm [] N params [] <$> binding params (callWorker mempty worker (map NameAtom params))
+
+-- | Check if an expression only does primitive operations
+--
+-- These are cheap enough that we can inline them, instead of making a call.
+isPrimitive :: Expr -> Bool
+isPrimitive = \case
+  Primitive _ -> True
+  Builtin _ _ -> True
+  Box _ _ -> True
+  Constructor _ [] -> True
+  Case scrut _ alts -> isPrimitive scrut && primitiveAlts alts
+  _ -> False
+  where
+    primitiveAlts = \case
+      IntAlts branches def -> all isPrimitive (map snd branches <> maybeToList def)
+      BindPrim _ _ e -> isPrimitive e
+      Unbox _ _ e -> isPrimitive e
+      _ -> False
+
+-- | Use strictness analysis to avoid allocating thunks for strict arguments
+--
+-- Functions evaluating some of their int arguments get split into a worker taking
+-- these ints unboxed, and a wrapper calling that worker.
+strictness :: STG -> STG
+strictness (STG bindings entry) =
+  runStrictnessM transform (Context allWorkers mempty mempty mempty)
+  where
+    functions = gatherFunctions bindings
+    allWorkers = findWorkers functions
+
+    transform :: StrictnessM STG
+    transform = do
+      -- Workers that end up only doing primitive operations can be inlined at each call
+      firstWorkers <- Map.traverseWithKey (\name worker -> makeWorker worker (functions Map.! name)) allWorkers
+      --
+      -- Since these take no pointers, every argument of the original function is unboxed.
+      let inlineableWorkers =
+            Map.fromList
+              [ (workerName (allWorkers Map.! name), functions Map.! name)
+                | (name, LambdaForm _ _ [] _ body) <- Map.toList firstWorkers,
+                  isPrimitive body
+              ]
+      local (\ctx -> ctx {inlineable = inlineableWorkers}) <| do
+        bindings' <- fmap concat <| forM bindings <| \(Binding name form) ->
+          case Map.lookup name allWorkers of
+            Nothing -> (: []) <<< Binding name <$> rewriteForm form
+            Just worker -> do
+              let (params, e) = functions Map.! name
+              wrapper <- makeWrapper worker params
+              workerForm <- makeWorker worker (params, e)
+              return [Binding name wrapper, Binding (workerName worker) workerForm]
+        entry' <- rewriteForm entry
+        return (finish bindings' entry')
+
+    workerNames = Set.fromList (map workerName (Map.elems allWorkers))
+
+    -- We only keep the workers that some call still uses
+    finish bindings' entry' =
+      let isWorker (Binding name _) = Set.member name workerNames
+          roots = foldMap (\(Binding _ form) -> freeNames form) (filter (not <<< isWorker) bindings') <> freeNames entry'
+          reach names =
+            names <> foldMap (\(Binding name form) -> if Set.member name names then freeNames form else mempty) bindings'
+          live = fixpoint reach roots
+          kept = filter (\b@(Binding name _) -> not (isWorker b) || Set.member name live) bindings'
+          topLevel = Set.fromList (bindingNames kept)
+       in STG
+            (map (\(Binding name form) -> Binding name (refreshForm topLevel form)) kept)
+            (refreshForm topLevel entry')
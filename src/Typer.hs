@@ -1,40 +1,43 @@
 {-# LANGUAGE FlexibleContexts #-}
-{-# LANGUAGE FlexibleInstances #-}
 {-# LANGUAGE GeneralizedNewtypeDeriving #-}
+{-# LANGUAGE LambdaCase #-}
+{-# LANGUAGE RankNTypes #-}
 {-# LANGUAGE TupleSections #-}
 
 module Typer (typer, TypeError) where
 
 import Control.Monad
-  ( foldM,
-    forM,
-    unless,
+  ( forM,
+    forM_,
+    when,
+    zipWithM_,
+    (>=>),
   )
 import Control.Monad.Except
-  ( Except,
+  ( ExceptT,
     MonadError (throwError),
-    liftEither,
     runExcept,
+    runExceptT,
   )
 import Control.Monad.Reader
   ( MonadReader (local),
     ReaderT (..),
     asks,
   )
-import Control.Monad.State
-  ( MonadState (get, put),
-    StateT (runStateT),
-  )
-import Data.List (delete, find, nub)
+import Control.Monad.ST (ST, runST)
+import Control.Monad.Trans (lift)
+import Data.Graph (flattenSCC, stronglyConnComp)
+import qualified Data.IntMap as IntMap
+import Data.List (sortOn)
 import qualified Data.Map as Map
 import qualified Data.Set as Set
+import Data.STRef (STRef, modifySTRef', newSTRef, readSTRef, writeSTRef)
 import Ourlude
 import Simplifier
   ( AST (..),
     Builtin (..),
     ConstructorInfo (..),
     ConstructorMap,
-    ConstructorName,
     Expr (..),
     HasConstructorMap (..),
     Literal (..),
@@ -42,7 +45,6 @@ import Simplifier
     Pattern (..),
     TypeName,
     TypeVar,
-    ValName,
     ValueDefinition (..),
     lookupConstructorOrFail,
   )
@@ -60,157 +62,264 @@ data TypeError
     NotGeneralEnough Scheme Scheme
   deriving (Eq, Show)
 
--- Represents some kind of constraint we generate during our gathering pharse.
+{- Inference Types -}
+
+-- The type we use for type expressions during inference.
 --
--- This provides us with information about how different types are used, and is
--- necessary to be able to infer the correct types later on.
-data Constraint
-  = -- An assertion that two type expressions are equivalent
-    SameType Type Type
-  | -- An assertation that some type explicitly instantiates some scheme
-    ExplicitlyInstantiates Type Scheme
-  | -- An assertion that some type implicitly insntatiates some type, given some bound vars
-    ImplicitlyInstantations Type (Set.Set TypeVar) Type
-  deriving (Eq, Show)
+-- This mirrors Type, except that variables are mutable cells. Instead of building up
+-- and applying substitutions, we unify a variable by pointing its cell at the type
+-- it stands for, which makes that change visible everywhere the variable appears.
+data IType s
+  = IString
+  | IInt
+  | IBool
+  | ICustom TypeName [IType s]
+  | IVar (STRef s (VarState s))
+  | IFunction (IType s) (IType s)
+
+-- The state of a type variable during inference
+data VarState s
+  = -- A variable we don't know anything about yet, with its number and level
+    --
+    -- The level is the number of definitions we're nested inside of, at the point
+    -- where the variable might have been introduced. Once we're done with a definition,
+    -- the variables with a deeper level than ours can't be used anywhere else, so
+    -- they're the ones we can generalize.
+    Unbound Int Int
+  | -- A variable that's been generalized, and gets replaced every time we instantiate
+    Generic Int
+  | -- A variable that's been unified with some type
+    Link (IType s)
+
+-- The name we use for a numbered type variable, once inference is done
+varName :: Int -> TypeVar
+varName i = "#" <> show i
+
+-- Follow the links from a type, until we reach the start of the type it stands for
+--
+-- Along the way, we point each variable straight at the end of its chain, so that
+-- following it again only takes a single step.
+prune :: IType s -> ST s (IType s)
+prune = \case
+  t@(IVar ref) ->
+    readSTRef ref >>= \case
+      Link t' -> do
+        t'' <- prune t'
+        writeSTRef ref (Link t'')
+        return t''
+      _ -> return t
+  t -> return t
+
+-- Convert a type used during inference into a normal type
+zonk :: IType s -> ST s Type
+zonk =
+  prune >=> \case
+    IString -> return StringT
+    IInt -> return IntT
+    IBool -> return BoolT
+    ICustom name ts -> CustomType name <$> mapM zonk ts
+    IFunction t1 t2 -> (:->) <$> zonk t1 <*> zonk t2
+    IVar ref ->
+      readSTRef ref >>= \case
+        Unbound i _ -> return (TVar (varName i))
+        Generic i -> return (TVar (varName i))
+        Link t -> zonk t
+
+-- Convert all of the types annotating an expression
+zonkExpr :: Expr (IType s) -> ST s (Expr Type)
+zonkExpr = \case
+  LetExpr defs e -> LetExpr <$> mapM zonkDefinition defs <*> zonkExpr e
+  CaseExpr e pats -> CaseExpr <$> zonkExpr e <*> mapM (\(pat, e') -> (pat,) <$> zonkExpr e') pats
+  Error err -> return (Error err)
+  LitExpr litt -> return (LitExpr litt)
+  Builtin b -> return (Builtin b)
+  NameExpr n -> return (NameExpr n)
+  ApplyExpr e1 e2 -> ApplyExpr <$> zonkExpr e1 <*> zonkExpr e2
+  LambdaExpr n t e -> LambdaExpr n <$> zonk t <*> zonkExpr e
+
+zonkDefinition :: ValueDefinition (IType s) -> ST s (ValueDefinition Type)
+zonkDefinition (ValueDefinition n declared t e) =
+  ValueDefinition n declared <$> zonk t <*> zonkExpr e
 
--- Represents a substitution of type variables for actual types
-newtype Subst = Subst (Map.Map TypeVar Type) deriving (Eq, Show)
-
--- We can combine multiple substitutions together
-instance Semigroup Subst where
-  (Subst s1) <> (Subst s2) = Subst (Map.map (subst (Subst s1)) s2 <> s1)
-
--- There is a substitution that doesn't do anything
-instance Monoid Subst where
-  mempty = Subst mempty
-
--- Create a substitution from a single mapping
-singleSubst :: TypeName -> Type -> Subst
-singleSubst v t = Subst (Map.singleton v t)
-
--- A class for types where substitutions can be applied
-class Substitutable a where
-  subst :: Subst -> a -> a
-
-instance (Ord a, Substitutable a) => Substitutable (Set.Set a) where
-  subst = subst >>> Set.map
-
-instance Substitutable TypeName where
-  subst (Subst s) a = case Map.findWithDefault (TVar a) a s of
-    TVar tn -> tn
-    _ -> a
-
-instance Substitutable Type where
-  subst sub@(Subst s) t = case t of
-    IntT -> IntT
-    StringT -> StringT
-    BoolT -> BoolT
-    TVar a -> Map.findWithDefault (TVar a) a s
-    t1 :-> t2 -> subst sub t1 :-> subst sub t2
-    CustomType name ts -> CustomType name (map (subst sub) ts)
-
-instance Substitutable Scheme where
-  subst (Subst s) (Scheme vars t) =
-    let s' = Subst (foldr Map.delete s vars)
-     in Scheme vars (subst s' t)
-
-instance Substitutable Constraint where
-  subst s (SameType t1 t2) = SameType (subst s t1) (subst s t2)
-  subst s (ExplicitlyInstantiates t sc) =
-    ExplicitlyInstantiates (subst s t) (subst s sc)
-  subst s (ImplicitlyInstantations t1 vars t2) =
-    ImplicitlyInstantations (subst s t1) (subst s vars) (subst s t2)
-
--- A class for types where we can detect which variables are important.
-class ActiveTypeVars a where
-  atv :: a -> Set.Set TypeName
-
-instance ActiveTypeVars Constraint where
-  atv (SameType t1 t2) = Set.union (ftv t1) (ftv t2)
-  atv (ExplicitlyInstantiates t sc) = Set.union (ftv t) (ftv sc)
-  -- What's different is that the important variables are the ones appearing
-  -- in the first type, or the free variables implicitly bound on the right
-  atv (ImplicitlyInstantations t1 vars t2) =
-    Set.union (ftv t1) (Set.intersection (ftv vars) (ftv t2))
-
-instance ActiveTypeVars a => ActiveTypeVars [a] where
-  atv = foldMap atv
+{- Inference -}
+
+-- The type we have for a name in scope
+data Bound s
+  = -- A name bound by a lambda or a pattern, which can only be used at one type
+    Monomorphic (IType s)
+  | -- A name bound by a definition, whose generic variables get instantiated at each use
+    Polymorphic (IType s)
 
 -- The environment we use when doing type inference.
 --
--- We keep a local environment of bound type names, as well
--- as the information about type synonym resolutions.
-data InferEnv = InferEnv
-  { bound :: Set.Set TypeName,
+-- We keep track of the names in scope, and the level we're at, along with a counter
+-- for fresh type variables, and the information about constructors.
+data InferEnv s = InferEnv
+  { scope :: Map.Map Name (Bound s),
+    currentLevel :: Int,
+    varCounter :: STRef s Int,
     constructorInfo :: ConstructorMap
   }
 
 -- The context in which we perform type inference.
 --
--- We have access to an environment, which we modify locally,
--- as well as a source of fresh type variables, and we can throw errors.
-newtype Infer a = Infer (ReaderT InferEnv (StateT Int (Except TypeError)) a)
-  deriving (Functor, Applicative, Monad, MonadReader InferEnv, MonadState Int, MonadError TypeError)
+-- We have access to an environment, which we modify locally, and we can throw errors.
+-- Our type variables live in ST, which lets us modify them in place.
+newtype Infer s a = Infer (ReaderT (InferEnv s) (ExceptT TypeError (ST s)) a)
+  deriving (Functor, Applicative, Monad, MonadReader (InferEnv s), MonadError TypeError)
 
-instance HasConstructorMap Infer where
+instance HasConstructorMap (Infer s) where
   constructorMap = asks constructorInfo
 
--- Run the inference context, provided we have a resolution map
-runInfer :: Infer a -> ConstructorMap -> Either TypeError a
-runInfer (Infer m) info =
-  runReaderT m (InferEnv Set.empty info)
-    |> (`runStateT` 0)
-    |> runExcept
-    |> fmap fst
-
--- Generate a fresh type name during inference
-fresh :: Infer TypeVar
-fresh =
-  Infer <| do
-    count <- get
-    put (count + 1)
-    return ("#" <> show count)
-
--- Instantiate a scheme by providing a fresh tyep variable for each parameter
-instantiate :: Scheme -> Infer Type
-instantiate (Scheme vars t) = do
-  newVars <- forM vars (const fresh)
-  let sub = foldMap (uncurry singleSubst) (zip vars (map TVar newVars))
-  return (subst sub t)
-
--- Generalize a type into a scheme by closing over all unbound variables
-generalize :: Set.Set TypeVar -> Type -> Scheme
-generalize free t =
-  let as = Set.toList (Set.difference (ftv t) free)
-   in Scheme as t
-
--- Modify inference with access to a bound type variable
-withBound :: TypeVar -> Infer a -> Infer a
-withBound a = local (\r -> r {bound = Set.insert a (bound r)})
-
-withManyBound :: Set.Set TypeVar -> Infer a -> Infer a
-withManyBound vars = local (\r -> r {bound = Set.union (bound r) vars})
-
--- Represents an ordered collection about assumptions we've gathered so far
-newtype Assumptions = Assumptions [(Name, Type)]
-  deriving (Show, Semigroup, Monoid)
-
--- Remove an assumption about a given name
-removeAssumption :: Name -> Assumptions -> Assumptions
-removeAssumption v (Assumptions as) = Assumptions (filter ((/= v) . fst) as)
+-- Unwrap the inference context, to run inside of a specific ST computation
+unInfer :: Infer s a -> ReaderT (InferEnv s) (ExceptT TypeError (ST s)) a
+unInfer (Infer r) = r
 
--- An assumption about a single type
-singleAssumption :: Name -> Type -> Assumptions
-singleAssumption v t = Assumptions [(v, t)]
+-- Run the inference context, provided we have a resolution map
+runInfer :: (forall s. Infer s a) -> ConstructorMap -> Either TypeError a
+runInfer m info =
+  runST
+    ( do
+        counter <- newSTRef 0
+        runExceptT (runReaderT (unInfer m) (InferEnv Map.empty 0 counter info))
+    )
 
--- Lookup all of the assumptions we have about a given name
-lookupAssumptions :: Name -> Assumptions -> [Type]
-lookupAssumptions target (Assumptions as) =
-  [t | (v, t) <- as, v == target]
+-- Run an ST computation, as part of inference
+liftST :: ST s a -> Infer s a
+liftST = lift >>> lift >>> Infer
+
+-- Generate a fresh type variable during inference, at the current level
+fresh :: Infer s (IType s)
+fresh = do
+  counter <- asks varCounter
+  level <- asks currentLevel
+  liftST <| do
+    count <- readSTRef counter
+    writeSTRef counter (count + 1)
+    IVar <$> newSTRef (Unbound count level)
+
+-- Run inference one level deeper, for the body of some definitions
+enterLevel :: Infer s a -> Infer s a
+enterLevel = local (\r -> r {currentLevel = currentLevel r + 1})
+
+-- Modify inference with access to some more names
+withBindings :: [(Name, Bound s)] -> Infer s a -> Infer s a
+withBindings bindings =
+  local (\r -> r {scope = Map.union (Map.fromList bindings) (scope r)})
+
+-- Instantiate a scheme by providing a fresh type variable for each parameter
+instantiate :: Scheme -> Infer s (IType s)
+instantiate (Scheme vars t) = do
+  newVars <- Map.fromList <$> forM vars (\v -> (v,) <$> fresh)
+  let go = \case
+        StringT -> IString
+        IntT -> IInt
+        BoolT -> IBool
+        CustomType name ts -> ICustom name (map go ts)
+        TVar a -> Map.findWithDefault (error ("Unquantified type variable " <> a)) a newVars
+        t1 :-> t2 -> IFunction (go t1) (go t2)
+  return (go t)
+
+-- Instantiate the type of a definition, by replacing each generic variable with a fresh one
+--
+-- The same generic variable gets replaced with the same fresh variable each time it appears.
+instantiateGeneric :: IType s -> Infer s (IType s)
+instantiateGeneric t = do
+  replaced <- liftST (newSTRef IntMap.empty)
+  let go t' =
+        liftST (prune t') >>= \case
+          ICustom name ts -> ICustom name <$> mapM go ts
+          IFunction t1 t2 -> IFunction <$> go t1 <*> go t2
+          v@(IVar ref) ->
+            liftST (readSTRef ref) >>= \case
+              Generic i ->
+                liftST (IntMap.lookup i <$> readSTRef replaced) >>= \case
+                  Just v' -> return v'
+                  Nothing -> do
+                    v' <- fresh
+                    liftST (modifySTRef' replaced (IntMap.insert i v'))
+                    return v'
+              _ -> return v
+          terminal -> return terminal
+  go t
+
+-- Generalize the type of a definition, once we're done inferring it
+--
+-- Every variable introduced deeper than our current level can't be mentioned by the names
+-- in scope, so we can make it generic.
+generalizeType :: IType s -> Infer s ()
+generalizeType t = do
+  level <- asks currentLevel
+  let go =
+        prune >=> \case
+          IVar ref ->
+            readSTRef ref >>= \case
+              Unbound i l | l > level -> writeSTRef ref (Generic i)
+              _ -> return ()
+          ICustom _ ts -> mapM_ go ts
+          IFunction t1 t2 -> go t1 >> go t2
+          _ -> return ()
+  liftST (go t)
+
+-- Try and unify two type expressions together
+unify :: IType s -> IType s -> Infer s ()
+unify t1 t2 = do
+  t1' <- liftST (prune t1)
+  t2' <- liftST (prune t2)
+  case (t1', t2') of
+    (IVar ref1, IVar ref2) | ref1 == ref2 -> return ()
+    (IVar ref, t) -> bind ref t
+    (t, IVar ref) -> bind ref t
+    (IString, IString) -> return ()
+    (IInt, IInt) -> return ()
+    (IBool, IBool) -> return ()
+    (IFunction t3 t4, IFunction t5 t6) -> do
+      unify t3 t5
+      unify t4 t6
+    (ICustom name1 ts1, ICustom name2 ts2)
+      | name1 == name2 && length ts1 == length ts2 -> zipWithM_ unify ts1 ts2
+    _ -> do
+      mismatch <- liftST (TypeMismatch <$> zonk t1' <*> zonk t2')
+      throwError mismatch
 
--- Get the set of all names used inside our assumptions
-assumptionNames :: Assumptions -> Set.Set Name
-assumptionNames (Assumptions as) = Set.fromList (map fst as)
+-- Try and bind a variable to a given type expression
+--
+-- Since the variable might be used anywhere the type ends up being used, we lower
+-- the level of the variables in that type to match, as we check that the variable
+-- doesn't appear inside of it.
+bind :: STRef s (VarState s) -> IType s -> Infer s ()
+bind ref t =
+  liftST (readSTRef ref) >>= \case
+    Unbound i level -> do
+      occurs <- liftST (adjust level t)
+      when occurs <| do
+        t' <- liftST (zonk t)
+        throwError (InfiniteType (varName i) t')
+      liftST (writeSTRef ref (Link t))
+    _ -> error "Only unbound variables can be unified"
+  where
+    adjust level =
+      prune >=> \case
+        IVar ref' | ref' == ref -> return True
+        IVar ref' ->
+          readSTRef ref' >>= \case
+            Unbound j l | l > level -> False <$ writeSTRef ref' (Unbound j level)
+            _ -> return False
+        ICustom _ ts -> or <$> mapM (adjust level) ts
+        IFunction t1 t2 -> (||) <$> adjust level t1 <*> adjust level t2
+        _ -> return False
+
+-- Lookup the type of a name in scope, instantiating it if necessary
+lookupName :: Name -> Infer s (IType s)
+lookupName n =
+  asks (scope >>> Map.lookup n) >>= \case
+    Just (Monomorphic t) -> return t
+    Just (Polymorphic t) -> instantiateGeneric t
+    Nothing -> do
+      constructors <- constructorMap
+      case Map.lookup n constructors of
+        Just info -> instantiate (constructorType info)
+        Nothing -> throwError (UnboundName n)
 
 -- Get the scheme we know a builtin name to conform to
 builtinScheme :: Builtin -> Scheme
@@ -223,6 +332,8 @@ builtinScheme Cash =
     ["a", "b"]
     ( (TVar "a" :-> TVar "b") :-> TVar "a" :-> TVar "b"
     )
+builtinScheme Seq = Scheme ["a", "b"] (TVar "a" :-> TVar "b" :-> TVar "b")
+builtinScheme Par = Scheme ["a", "b"] (TVar "a" :-> TVar "b" :-> TVar "b")
 builtinScheme b =
   Scheme [] <| case b of
     Add -> IntT :-> IntT :-> IntT
@@ -242,182 +353,138 @@ builtinScheme b =
     _ -> error "Already handled"
 
 -- Get the type of a given literal
-littType :: Literal -> Type
-littType (IntLiteral _) = IntT
-littType (StringLiteral _) = StringT
-littType (BoolLiteral _) = BoolT
+littType :: Literal -> IType s
+littType (IntLiteral _) = IInt
+littType (StringLiteral _) = IString
+littType (BoolLiteral _) = IBool
 
--- Run constraint generation over a given expression.
+-- Run inference over a given expression.
 --
--- This returns the assumptions about variables we've encountered,
--- the constraints we've managed to gather, the type of the expression we've inferred,
+-- This returns the type of the expression we've inferred,
 -- and the typed version of that expression tree.
-inferExpr :: Expr () -> Infer (Assumptions, [Constraint], Type, Expr Type)
+inferExpr :: Expr () -> Infer s (IType s, Expr (IType s))
 inferExpr expr = case expr of
   Error err -> do
-    tv <- TVar <$> fresh
-    return (mempty, [], tv, Error err)
-  LitExpr litt ->
-    let t = littType litt
-     in return (mempty, [], t, LitExpr litt)
+    tv <- fresh
+    return (tv, Error err)
+  LitExpr litt -> return (littType litt, LitExpr litt)
   ApplyExpr e1 e2 -> do
-    (as1, cs1, t1, e1') <- inferExpr e1
-    (as2, cs2, t2, e2') <- inferExpr e2
-    tv <- TVar <$> fresh
-    let cs' = [SameType t1 (t2 :-> tv)] <> cs1 <> cs2
-    return (as1 <> as2, cs', tv, ApplyExpr e1' e2')
+    (t1, e1') <- inferExpr e1
+    (t2, e2') <- inferExpr e2
+    tv <- fresh
+    unify t1 (IFunction t2 tv)
+    return (tv, ApplyExpr e1' e2')
   Builtin b -> do
     t <- instantiate (builtinScheme b)
-    return (mempty, [], t, Builtin b)
+    return (t, Builtin b)
   NameExpr n -> do
-    tv <- TVar <$> fresh
-    return (singleAssumption n tv, [], tv, NameExpr n)
+    t <- lookupName n
+    return (t, NameExpr n)
   CaseExpr e pats -> do
-    (as1, cs1, t, e') <- inferExpr e
-    -- We infer assumptions and constraints for each case branch, knowing the scrutinee's type
-    -- We have to push down, because certain branches impose no constraints on the scrutinee,
-    -- like wildcard patterns, for example
-    inferred <- forM pats (inferPatternDef t)
-    let pats' = map (\(_, _, _, p) -> p) inferred
-        (as2, cs2) = foldMap (\(a, c, _, _) -> (a, c)) inferred
-    -- We generate constraints making sure each branch has the same return type,
-    -- and the same scrutinee type
-    ret <- TVar <$> fresh
-    let cs3 = map (\(_, _, branchRet, _) -> SameType ret branchRet) inferred
-    return (as2 <> as1, cs3 <> cs2 <> cs1, ret, CaseExpr e' pats')
+    (t, e') <- inferExpr e
+    -- Each branch needs to have the same return type
+    ret <- fresh
+    pats' <-
+      forM pats <| \(pat, branch) -> do
+        bindings <- inferPattern t pat
+        (branchRet, branch') <- withBindings bindings (inferExpr branch)
+        unify ret branchRet
+        return (pat, branch')
+    return (ret, CaseExpr e' pats')
   LambdaExpr n _ e -> do
-    a <- fresh
-    let tv = TVar a
-    (as, cs, t, e') <- withBound a (inferExpr e)
-    return
-      ( removeAssumption n as,
-        [SameType t' tv | t' <- lookupAssumptions n as] <> cs,
-        tv :-> t,
-        LambdaExpr n tv e'
-      )
+    tv <- fresh
+    (t, e') <- withBindings [(n, Monomorphic tv)] (inferExpr e)
+    return (IFunction tv t, LambdaExpr n tv e')
   LetExpr defs e -> do
-    (as1, cs1, t, e') <- inferExpr e
-    (as2, cs2, defs') <- inferDefs as1 defs
-    return (as2, cs1 <> cs2, t, LetExpr defs' e')
-
--- Run inference over a pattern definition, given the scrutinee's type
-inferPatternDef :: Type -> (Pattern, Expr ()) -> Infer (Assumptions, [Constraint], Type, (Pattern, Expr Type))
-inferPatternDef scrutinee (pat, e) = do
-  tv <- TVar <$> fresh
-  (cs1, valMap, boundSet) <- inspectPattern tv pat
-  (as, cs2, t, e') <- withManyBound boundSet (inferExpr e)
-  return
-    ( adjustValAssumptions valMap as,
-      SameType tv scrutinee : cs1 <> cs2 <> valConstraints valMap as,
-      t,
-      (pat, e')
-    )
+    (defs', (t, e')) <- inferDefs defs (inferExpr e)
+    return (t, LetExpr defs' e')
+
+-- Run inference over a pattern, given the scrutinee's type, returning the names it binds
+inferPattern :: IType s -> Pattern -> Infer s [(Name, Bound s)]
+inferPattern scrutinee = \case
+  Wildcard -> return []
+  LiteralPattern litt -> do
+    unify scrutinee (littType litt)
+    return []
+  ConstructorPattern cstr pats -> do
+    patTypes <- forM pats (const fresh)
+    constructor <- constructorType <$> lookupConstructorOrFail cstr
+    t <- instantiate constructor
+    unify (foldr IFunction scrutinee patTypes) t
+    return (zipWith (\n patType -> (n, Monomorphic patType)) pats patTypes)
+
+-- The names an expression uses, that aren't bound inside of it
+freeNames :: Expr t -> Set.Set Name
+freeNames = \case
+  LetExpr defs e ->
+    let defined = Set.fromList (map (\(ValueDefinition n _ _ _) -> n) defs)
+        used = freeNames e <> foldMap (\(ValueDefinition _ _ _ e') -> freeNames e') defs
+     in Set.difference used defined
+  CaseExpr e pats -> freeNames e <> foldMap (\(pat, e') -> Set.difference (freeNames e') (patternNames pat)) pats
+  Error _ -> Set.empty
+  LitExpr _ -> Set.empty
+  Builtin _ -> Set.empty
+  NameExpr n -> Set.singleton n
+  ApplyExpr e1 e2 -> freeNames e1 <> freeNames e2
+  LambdaExpr n _ e -> Set.delete n (freeNames e)
   where
-    inspectPattern :: Type -> Pattern -> Infer ([Constraint], Map.Map ValName Type, Set.Set TypeVar)
-    inspectPattern scrutinee' pat' = case pat' of
-      Wildcard -> return ([], Map.empty, Set.empty)
-      LiteralPattern litt -> return ([SameType scrutinee (littType litt)], Map.empty, Set.empty)
-      ConstructorPattern cstr pats -> do
-        patVars <- forM pats (const fresh)
-        let patTypes = map TVar patVars
-            patType = foldr (:->) scrutinee' patTypes
-            valMap = zip pats patTypes |> Map.fromList
-        constructor <- constructorType <$> lookupConstructorOrFail cstr
-        return ([ExplicitlyInstantiates patType constructor], valMap, Set.fromList patVars)
-
-    adjustValAssumptions :: Map.Map ValName Type -> Assumptions -> Assumptions
-    adjustValAssumptions mp as = foldr removeAssumption as (Map.keys mp)
-
-    valConstraints :: Map.Map ValName Type -> Assumptions -> [Constraint]
-    valConstraints mp as =
-      foldMap (\(n, t) -> [SameType t t' | t' <- lookupAssumptions n as]) (Map.toList mp)
-
-inferDefs :: Assumptions -> [ValueDefinition ()] -> Infer (Assumptions, [Constraint], [ValueDefinition Type])
-inferDefs usageAs defs = do
-  together <-
-    forM defs <| \(ValueDefinition n declared _ e) -> do
-      (as, cs, t, e') <- inferExpr e
-      let extra = foldMap (\sc -> [ExplicitlyInstantiates t sc]) declared
-      return (as, extra ++ cs, (n, t), ValueDefinition n declared t e')
-  bound' <- asks bound
-  let as = usageAs <> foldMap (\(x, _, _, _) -> x) together
-      cs = foldMap (\(_, x, _, _) -> x) together
-      defs' = map (\(_, _, _, def) -> def) together
-      usages = map (\(_, _, usage, _) -> usage) together
-      process (n, t) (as', cs') =
-        (removeAssumption n as', [ImplicitlyInstantations t' bound' t | t' <- lookupAssumptions n as'] <> cs')
-  let (as', cs') = foldr process (as, cs) usages
-  return (as', cs', defs')
-
-{- Constraint Solving -}
-
--- Solve a list of constraints, by producing a valid substitution of type variables
-solve :: [Constraint] -> Infer Subst
-solve [] = return mempty
-solve constraints = solve' (nextSolvable True constraints)
-  where
-    chooseOne :: Eq a => [a] -> [(a, [a])]
-    chooseOne as = [(a, bs) | a <- as, let bs = delete a as]
-
-    nextSolvable :: Bool -> [Constraint] -> (Constraint, [Constraint])
-    nextSolvable trySorting xs = case find solvable (chooseOne xs) of
-      Just c -> c
-      Nothing | trySorting -> nextSolvable False (nub xs)
-      Nothing -> error ("Couldn't find solvable constraint inside of:\n" ++ show xs)
-      where
-        solvable (SameType _ _, _) = True
-        solvable (ExplicitlyInstantiates _ _, _) = True
-        solvable (ImplicitlyInstantations _ bound' t2, cs) =
-          Set.null (Set.intersection (atv cs) (Set.difference (ftv t2) bound'))
-
-    solve' :: (Constraint, [Constraint]) -> Infer Subst
-    solve' (c, cs) = case c of
-      SameType t1 t2 -> do
-        su1 <- unify t1 t2
-        su2 <- solve (map (subst su1) cs)
-        return (su2 <> su1)
-      ImplicitlyInstantations t1 bound' t2 ->
-        solve (ExplicitlyInstantiates t1 (generalize bound' t2) : cs)
-      ExplicitlyInstantiates t sc -> do
-        sc' <- instantiate sc
-        solve (SameType t sc' : cs)
-
--- Try and unify two type expressions togethe
-unify :: Type -> Type -> Infer Subst
-unify t1 t2 | t1 == t2 = return mempty
-unify (TVar n) t = bind n t
-unify t (TVar n) = bind n t
-unify (t1 :-> t2) (t3 :-> t4) = do
-  su1 <- unify t1 t3
-  su2 <- unify (subst su1 t2) (subst su1 t4)
-  return (su2 <> su1)
-unify (CustomType name1 ts1) (CustomType name2 ts2)
-  | name1 == name2 && length ts1 == length ts2 =
-    let together = zip ts1 ts2
-        go acc (t1, t2) = do
-          su <- unify (subst acc t1) (subst acc t2)
-          return (su <> acc)
-     in foldM go mempty together
-unify t1 t2 = throwError (TypeMismatch t1 t2)
+    patternNames (ConstructorPattern _ pats) = Set.fromList pats
+    patternNames _ = Set.empty
 
--- Try and bind a variable to a given type expression
-bind :: TypeVar -> Type -> Infer Subst
-bind a t
-  | t == TVar a = return mempty
-  | Set.member a (ftv t) = throwError (InfiniteType a t)
-  | otherwise = return (singleSubst a t)
+-- Split definitions into groups, which only depend on each other, and the groups before them
+--
+-- Each definition comes along with its position in the original list.
+bindingGroups :: [ValueDefinition t] -> [[(Int, ValueDefinition t)]]
+bindingGroups defs =
+  let defined = Set.fromList (map (\(ValueDefinition n _ _ _) -> n) defs)
+      node (i, def@(ValueDefinition n _ _ e)) =
+        ((i, def), n, Set.toList (Set.intersection (freeNames e) defined))
+   in zip [0 ..] defs |> map node |> stronglyConnComp |> map flattenSCC
+
+-- Infer the types of a group of definitions, and then run some inference with them in scope
+--
+-- Each binding group gets inferred once, in order, and then generalized, so that the
+-- groups using it can instantiate its type. Inside of a group, the definitions
+-- can only use each other at a single type.
+inferDefs :: [ValueDefinition ()] -> Infer s a -> Infer s ([ValueDefinition (IType s)], a)
+inferDefs defs inner = go (bindingGroups defs) []
+  where
+    go [] acc = do
+      a <- inner
+      return (acc |> sortOn fst |> map snd, a)
+    go (group : groups) acc = do
+      (typed, bindings) <- inferGroup group
+      withBindings bindings (go groups (typed <> acc))
+
+    inferGroup group = do
+      typed <-
+        enterLevel <| do
+          tvs <- forM group (const fresh)
+          let monomorphic = zipWith (\(_, ValueDefinition n _ _ _) tv -> (n, Monomorphic tv)) group tvs
+          withBindings monomorphic <| forM (zip group tvs) <| \((i, ValueDefinition n declared _ e), tv) -> do
+            (t, e') <- inferExpr e
+            unify tv t
+            forM_ declared (instantiate >=> unify t)
+            return (i, ValueDefinition n declared t e')
+      forM_ typed (\(_, ValueDefinition _ _ t _) -> generalizeType t)
+      let bindings = map (\(_, ValueDefinition n _ t _) -> (n, Polymorphic t)) typed
+      return (typed, bindings)
 
 {- Type Annotation -}
 
+-- Generalize a type into a scheme by closing over all unbound variables
+generalize :: Set.Set TypeVar -> Type -> Scheme
+generalize free t =
+  let as = Set.toList (Set.difference (ftv t) free)
+   in Scheme as t
+
 -- Represents the contextual information we have while typing our syntax tree
 --
 -- We introduce locally scoped context as we traverse the tree, introducing
 -- lexically scoped type variables.
-data TyperInfo = TyperInfo
+newtype TyperInfo = TyperInfo
   { -- The type variables we know to be bound in this ocntext
-    typerVars :: Set.Set TypeVar,
-    -- The substitution we have access to
-    typerSub :: Subst
+    typerVars :: Set.Set TypeVar
   }
 
 -- The context we have while assigning types to our syntax tree
@@ -428,9 +495,9 @@ data TyperInfo = TyperInfo
 newtype Typer a = Typer (ReaderT TyperInfo (Except TypeError) a)
   deriving (Functor, Applicative, Monad, MonadReader TyperInfo, MonadError TypeError)
 
--- Run a typer computation, given a substitution
-runTyper :: Typer a -> Subst -> Either TypeError a
-runTyper (Typer r) sub = runReaderT r (TyperInfo Set.empty sub) |> runExcept
+-- Run a typer computation
+runTyper :: Typer a -> Either TypeError a
+runTyper (Typer r) = runReaderT r (TyperInfo Set.empty) |> runExcept
 
 -- Introduce new type variables to run a typer computation
 withTyperNames :: [TypeVar] -> Typer a -> Typer a
@@ -442,8 +509,7 @@ withTyperNames vars =
 schemeFor :: Type -> Typer Scheme
 schemeFor t = do
   typerVars' <- asks typerVars
-  typerSub' <- asks typerSub
-  return (generalize typerVars' (subst typerSub' t))
+  return (generalize typerVars' t)
 
 -- Assign types to a given expression
 typeExpr :: Expr Type -> Typer (Expr Scheme)
@@ -475,20 +541,14 @@ typeDefinitions defs =
       _ -> return ()
     return (ValueDefinition name ann sc e')
 
--- Infer and check the types for a series of value definitions
-inferTypes :: [ValueDefinition ()] -> Infer [ValueDefinition Scheme]
+-- Infer the types for a series of value definitions
+inferTypes :: [ValueDefinition ()] -> Infer s [ValueDefinition Type]
 inferTypes defs = do
-  constructors <- allConstructors
-  (as, cs, defs') <- inferDefs mempty defs
-  let unbound = Set.difference (assumptionNames as) (Map.keysSet constructors)
-  unless (Set.null unbound) (throwError (UnboundName (Set.elemAt 0 unbound)))
-  let cs' = [ExplicitlyInstantiates t s | (x, s) <- Map.toList constructors, t <- lookupAssumptions x as]
-  sub <- solve (cs' <> cs)
-  liftEither <| runTyper (typeDefinitions defs') sub
-  where
-    allConstructors :: Infer (Map.Map ConstructorName Scheme)
-    allConstructors = Map.map constructorType <$> constructorMap
+  (defs', _) <- inferDefs defs (return ())
+  liftST (mapM zonkDefinition defs')
 
 -- Run the type checker on a given AST, producing just the value definitions, annotated
 typer :: AST () -> Either TypeError (AST Scheme)
-typer (AST info defs) = AST info <$> runInfer (inferTypes defs) info
+typer (AST info defs) = do
+  defs' <- runInfer (inferTypes defs) info
+  AST info <$> runTyper (typeDefinitions defs')
@@ -0,0 +1,198 @@
+{-# LANGUAGE LambdaCase #-}
+
+-- | This module contains a usage analysis over STG, finding the thunks that only get entered once
+--
+-- When an updateable thunk gets entered, it pushes an update frame, so that once
+-- it's done, it can be overwritten with its value. This is what makes sure the work
+-- only ever happens once, but if nothing enters that thunk again, the frame and
+-- the update are wasted. This is often the case for the intermediate results
+-- flowing from one function to the next.
+--
+-- We count how many times each thunk bound in a let might get entered, and make
+-- the ones entered at most once non-updateable. Top level functions get a signature,
+-- saying which of their arguments they enter at most once per call, so that we know
+-- which thunks we can pass them.
+module Usage (usage) where
+
+import qualified Data.Map.Strict as Map
+import Data.Maybe (maybeToList)
+import qualified Data.Set as Set
+import Ourlude
+import STG
+
+{- Usages -}
+
+-- | How many times something gets entered
+data Usage = Unused | Once | Many deriving (Eq, Ord, Show)
+
+-- | The usage of each name an expression enters
+newtype Usages = Usages (Map.Map ValName Usage) deriving (Eq, Show)
+
+-- | Adding usages together counts the uses on both sides
+instance Semigroup Usages where
+  Usages a <> Usages b = Usages (Map.unionWith add a b)
+    where
+      add Unused u = u
+      add u Unused = u
+      add _ _ = Many
+
+instance Monoid Usages where
+  mempty = Usages mempty
+
+-- | Combine the usages of branches, only one of which will happen
+oneOf :: [Usages] -> Usages
+oneOf = foldr (\(Usages a) (Usages b) -> Usages (Map.unionWith max a b)) mempty
+
+-- | Some name being used a certain number of times
+used :: Usage -> ValName -> Usages
+used u name = Usages (Map.singleton name u)
+
+usageOf :: ValName -> Usages -> Usage
+usageOf name (Usages mp) = Map.findWithDefault Unused name mp
+
+-- | Use everything many times, because it happens as often as something else gets called
+many :: Usages -> Usages
+many (Usages mp) = Usages (Map.map (const Many) mp)
+
+-- | Forget about some names, once they're no longer in scope
+forget :: [ValName] -> Usages -> Usages
+forget names (Usages mp) = Usages (Map.withoutKeys mp (Set.fromList names))
+
+{- Analysis -}
+
+-- | How many times the top level functions use each of their arguments
+--
+-- Only calls passing every argument get to make use of this, since partial
+-- applications can be called any number of times.
+type Signatures = Map.Map ValName [Usage]
+
+-- | The top level functions we analyze, along with their parameters and bodies
+--
+-- The int parameters of workers never hold thunks, but we need them to know when
+-- a call passes every argument.
+type Functions = Map.Map ValName ([ValName], [ValName], Expr)
+
+gatherFunctions :: [Binding] -> Functions
+gatherFunctions bindings =
+  Map.fromList
+    [ (name, (params, intParams, e))
+      | Binding name (LambdaForm _ _ params intParams e) <- bindings,
+        not (null params && null intParams)
+    ]
+
+-- | Remove the information about some names, since they're now shadowed
+without :: [ValName] -> Map.Map ValName a -> Map.Map ValName a
+without names mp = Map.withoutKeys mp (Set.fromList names)
+
+bindingNames :: [Binding] -> [ValName]
+bindingNames = map (\(Binding name _) -> name)
+
+-- | Iterate a function until we reach a fixed point
+fixpoint :: Eq a => (a -> a) -> a -> a
+fixpoint f a =
+  let a' = f a
+   in if a' == a then a else fixpoint f a'
+
+-- | The usage of an atom, when it gets used a certain number of times
+atomUsage :: Usage -> Atom -> Usages
+atomUsage u = \case
+  NameAtom name -> used u name
+  PrimitiveAtom _ -> mempty
+
+-- | Figure out how many times an expression enters each name
+--
+-- A name passed anywhere but to a function whose signature we know might end up
+-- getting entered any number of times, so we count that as many uses.
+uses :: Signatures -> Expr -> Usages
+uses sigs = \case
+  Apply f atoms ->
+    let argUsages = case Map.lookup f sigs of
+          Just sig | length atoms >= length sig -> sig <> repeat Many
+          _ -> repeat Many
+     in used Once f <> mconcat (zipWith atomUsage argUsages atoms)
+  Constructor _ atoms -> foldMap (atomUsage Many) atoms
+  Builtin _ atoms -> foldMap (atomUsage Many) atoms
+  Box _ atom -> atomUsage Many atom
+  Case scrut _ alts -> uses sigs scrut <> altsUses sigs alts
+  Let bindings e ->
+    let names = bindingNames bindings
+        sigs' = without names sigs
+     in forget names (uses sigs' e <> foldMap (\(Binding _ form) -> formUses sigs' form) bindings)
+  Primitive _ -> mempty
+  Error _ -> mempty
+
+-- | Figure out how many times the body of a lambda form enters each name
+--
+-- An updateable thunk only ever runs its body once, but anything else can run
+-- its body every time it gets entered.
+formUses :: Signatures -> LambdaForm -> Usages
+formUses sigs (LambdaForm _ u params intParams e) =
+  let names = params <> intParams
+      inBody = forget names (uses (without names sigs) e)
+   in if u == U && null names then inBody else many inBody
+
+altsUses :: Signatures -> Alts -> Usages
+altsUses sigs = \case
+  IntAlts branches def -> oneOf (map (snd >>> uses sigs) branches <> map (uses sigs) (maybeToList def))
+  StringAlts branches def -> oneOf (map (snd >>> uses sigs) branches <> map (uses sigs) (maybeToList def))
+  ConstrAlts branches def ->
+    let inBranch ((_, names), e) = forget names (uses (without names sigs) e)
+     in oneOf (map inBranch branches <> map (uses sigs) (maybeToList def))
+  BindPrim _ n e -> forget [n] (uses (without [n] sigs) e)
+  Unbox _ n e -> forget [n] (uses (without [n] sigs) e)
+  PolyAlt e -> uses sigs e
+
+-- | Find the signatures of all of the top level functions
+--
+-- We start off assuming that no function uses its arguments, and keep
+-- counting the uses in each body, until nothing changes.
+findSignatures :: Functions -> Signatures
+findSignatures functions = fixpoint step (Map.map unused functions)
+  where
+    unused (params, intParams, _) = map (const Unused) (params <> intParams)
+
+    step sigs = Map.map (signature sigs) functions
+
+    signature sigs (params, intParams, e) =
+      let inBody = uses (without (params <> intParams) sigs) e
+       in map (`usageOf` inBody) params <> map (const Unused) intParams
+
+{- Transformation -}
+
+-- | Make the thunks entered at most once inside of an expression non-updateable
+rewriteExpr :: Signatures -> Expr -> Expr
+rewriteExpr sigs = \case
+  Case scrut bound alts -> Case (rewriteExpr sigs scrut) bound (rewriteAlts sigs alts)
+  Let bindings e ->
+    let names = bindingNames bindings
+        sigs' = without names sigs
+        total = uses sigs' e <> foldMap (\(Binding _ form) -> formUses sigs' form) bindings
+        rewriteBinding (Binding name form) =
+          let form'@(LambdaForm free u params intParams body) = rewriteForm sigs' form
+           in case (u, params, intParams) of
+                (U, [], []) | usageOf name total <= Once -> Binding name (LambdaForm free N [] [] body)
+                _ -> Binding name form'
+     in Let (map rewriteBinding bindings) (rewriteExpr sigs' e)
+  e -> e
+
+rewriteForm :: Signatures -> LambdaForm -> LambdaForm
+rewriteForm sigs (LambdaForm free u params intParams e) =
+  LambdaForm free u params intParams (rewriteExpr (without (params <> intParams) sigs) e)
+
+rewriteAlts :: Signatures -> Alts -> Alts
+rewriteAlts sigs = \case
+  IntAlts branches def -> IntAlts (map (fmap (rewriteExpr sigs)) branches) (fmap (rewriteExpr sigs) def)
+  StringAlts branches def -> StringAlts (map (fmap (rewriteExpr sigs)) branches) (fmap (rewriteExpr sigs) def)
+  ConstrAlts branches def ->
+    let branch ((tag, names), e) = ((tag, names), rewriteExpr (without names sigs) e)
+     in ConstrAlts (map branch branches) (fmap (rewriteExpr sigs) def)
+  BindPrim box n e -> BindPrim box n (rewriteExpr (without [n] sigs) e)
+  Unbox box n e -> Unbox box n (rewriteExpr (without [n] sigs) e)
+  PolyAlt e -> PolyAlt (rewriteExpr sigs e)
+
+-- | Use usage analysis to avoid pushing update frames for thunks only entered once
+usage :: STG -> STG
+usage (STG bindings entry) =
+  STG (map (\(Binding name form) -> Binding name (rewriteForm sigs form)) bindings) (rewriteForm sigs entry)
+  where
+    sigs = findSignatures (gatherFunctions bindings)
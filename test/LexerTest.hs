@@ -1,12 +1,13 @@
 module LexerTest (tests) where
 
+import qualified Data.Text as Text
 import Lexer (Token (..), lexer)
 import Ourlude
 import Test.Tasty
 import Test.Tasty.HUnit
 
 shouldLex :: String -> [Token] -> Assertion
-shouldLex str as = Right as @=? lexer str
+shouldLex str as = Right as @=? lexer (Text.pack str)
 
 tests :: TestTree
 tests =
@@ -55,7 +56,8 @@ layoutTests =
   testGroup
     "Layout Tests"
     [ testCase "basic layouts" (shouldLex prog1 [OpenBrace, If, Equal, Let, OpenBrace, If, Semicolon, If, CloseBrace, In, CloseBrace]),
-      testCase "nested layouts" (shouldLex prog2 [OpenBrace, If, Equal, Let, OpenBrace, If, Equal, Let, OpenBrace, If, CloseBrace, In, Semicolon, If, CloseBrace, In, CloseBrace])
+      testCase "nested layouts" (shouldLex prog2 [OpenBrace, If, Equal, Let, OpenBrace, If, Equal, Let, OpenBrace, If, CloseBrace, In, Semicolon, If, CloseBrace, In, CloseBrace]),
+      testCase "layouts after string literals" (shouldLex prog3 [OpenBrace, If, Equal, Let, OpenBrace, StringLit "foo", Semicolon, If, CloseBrace, In, CloseBrace])
     ]
   where
     prog1 =
@@ -73,3 +75,9 @@ layoutTests =
       \      in\n\
       \    if\n\
       \  in"
+    prog3 =
+      "if =\n\
+      \  let\n\
+      \    \"foo\"\n\
+      \    if\n\
+      \  in"
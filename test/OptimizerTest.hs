@@ -0,0 +1,128 @@
+{-# LANGUAGE LambdaCase #-}
+
+module OptimizerTest (tests) where
+
+import Data.Maybe (maybeToList)
+import qualified Data.Text as Text
+import Lexer (lexer)
+import Optimizer (OptLevel (..), optimize)
+import Ourlude
+import Parser (parser)
+import STG (Alts (..), Binding (..), Expr (..), LambdaForm (..), STG (..), ValName, stg)
+import Simplifier (simplifier)
+import Test.Tasty
+import Test.Tasty.HUnit
+import Typer (typer)
+
+-- Compile some code down to STG
+toSTG :: String -> Maybe STG
+toSTG str = do
+  let eitherToMaybe = either (const Nothing) Just
+  tokens <- eitherToMaybe (lexer (Text.pack str))
+  raw <- eitherToMaybe (parser tokens)
+  simple <- eitherToMaybe (simplifier raw)
+  typed <- eitherToMaybe (typer simple)
+  eitherToMaybe (stg typed)
+
+topLevelNames :: STG -> [ValName]
+topLevelNames (STG bindings _) = map (\(Binding name _) -> name) bindings
+
+-- Check whether a program still matches on the tag of some constructor
+matchesConstructors :: STG -> Bool
+matchesConstructors (STG bindings entry) = any inBinding bindings || inForm entry
+  where
+    inBinding (Binding _ form) = inForm form
+
+    inForm (LambdaForm _ _ _ _ e) = inExpr e
+
+    inExpr = \case
+      Case scrut _ alts -> inExpr scrut || inAlts alts
+      Let bindings' e -> any inBinding bindings' || inExpr e
+      _ -> False
+
+    inAlts = \case
+      ConstrAlts _ _ -> True
+      IntAlts branches def -> any (snd >>> inExpr) branches || any inExpr def
+      StringAlts branches def -> any (snd >>> inExpr) branches || any inExpr def
+      BindPrim _ _ e -> inExpr e
+      Unbox _ _ e -> inExpr e
+      PolyAlt e -> inExpr e
+
+-- Get the lambda form of some top level binding
+formOf :: ValName -> STG -> Maybe LambdaForm
+formOf name (STG bindings _) = lookup name [(n, form) | Binding n form <- bindings]
+
+-- Every expression inside of a lambda form, including the form's body
+formExprs :: LambdaForm -> [Expr]
+formExprs (LambdaForm _ _ _ _ e) = exprs e
+  where
+    exprs e' =
+      e' : case e' of
+        Case scrut _ alts -> exprs scrut <> concatMap exprs (altExprs alts)
+        Let bindings body -> concatMap (\(Binding _ form) -> formExprs form) bindings <> exprs body
+        _ -> []
+
+    altExprs = \case
+      IntAlts branches def -> map snd branches <> maybeToList def
+      StringAlts branches def -> map snd branches <> maybeToList def
+      ConstrAlts branches def -> map snd branches <> maybeToList def
+      BindPrim _ _ e' -> [e']
+      Unbox _ _ e' -> [e']
+      PolyAlt e' -> [e']
+
+-- Every expression in a program
+programExprs :: STG -> [Expr]
+programExprs (STG bindings entry) = concatMap formExprs (entry : [form | Binding _ form <- bindings])
+
+-- The names bound by the lets inside some expressions
+letNames :: [Expr] -> [ValName]
+letNames es = [name | Let bindings _ <- es, Binding name _ <- bindings]
+
+-- The names bound by the lets a lambda form starts with, before doing anything else
+outermostLets :: LambdaForm -> [ValName]
+outermostLets (LambdaForm _ _ _ _ e) = go e
+  where
+    go = \case
+      Let bindings body -> [name | Binding name _ <- bindings] <> go body
+      _ -> []
+
+-- How many times some expressions match on the tag of a constructor
+constructorMatches :: [Expr] -> Int
+constructorMatches es = length [() | Case _ _ (ConstrAlts _ _) <- es]
+
+-- Look at a program before, and after optimizing it
+beforeAndAfter :: OptLevel -> (STG -> a) -> String -> Maybe (a, a)
+beforeAndAfter level f s = fmap (\program -> (f program, f (optimize level program))) (toSTG s)
+
+shouldInline :: ValName -> String -> Assertion
+shouldInline name s = Just False @=? fmap (optimize O1 >>> topLevelNames >>> elem name) (toSTG s)
+
+shouldNotInline :: ValName -> String -> Assertion
+shouldNotInline name s = Just True @=? fmap (optimize O1 >>> topLevelNames >>> elem name) (toSTG s)
+
+shouldNotMatch :: String -> Assertion
+shouldNotMatch s = Just False @=? fmap (optimize O1 >>> matchesConstructors) (toSTG s)
+
+tests :: TestTree
+tests =
+  testGroup
+    "Optimizer Tests"
+    [ testCase "small functions get inlined" (shouldInline "f" "{ f :: Int -> Int; f x = x + 1; main :: Int; main = f 3 }"),
+      testCase "recursive functions stay" (shouldNotInline "f" "{ f :: Int -> Int; f 0 = 0; f n = f (n - 1); main :: Int; main = f 3 }"),
+      testCase "case of known constructor" (shouldNotMatch "{ data M = N | J Int; main :: Int; main = case J 3 of { J x -> x; N -> 0 } }"),
+      testCase "unused bindings get removed" <| do
+        let program = "{ f :: Int -> Int; f x = let { y = x + 1 } in x; main :: Int; main = f 3 }"
+        Just (True, False) @=? beforeAndAfter O1 (programExprs >>> letNames >>> elem "y") program,
+      testCase "bindings get sunk into the only branch using them" <| do
+        let program = "{ f :: Bool -> Int -> Int; f b x = let { y = x + 1 } in if b then y + y else f True x; main :: Int; main = f False 3 }"
+            placement stg' = case formOf "f" stg' of
+              Just form -> (elem "y" (outermostLets form), elem "y" (letNames (formExprs form)))
+              Nothing -> (False, False)
+        Just ((True, True), (False, True)) @=? beforeAndAfter O1 placement program,
+      testCase "cases get pushed into the branches of other cases" <| do
+        let program = "{ data M = N | J Int; f :: Bool -> Int; f b = case (if b then J 1 else N) of { J x -> x; N -> f True }; main :: Int; main = f False }"
+        Just (2, 1) @=? beforeAndAfter O2 (formOf "f" >>> foldMap formExprs >>> constructorMatches) program,
+      testCase "-O0 does nothing" <| do
+        let program = toSTG "{ f :: Int -> Int; f x = x + 1; main :: Int; main = f 3 }"
+        program @=? fmap (optimize O0) program
+    ]
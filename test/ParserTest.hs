@@ -1,5 +1,6 @@
 module ParserTest (tests) where
 
+import qualified Data.Text as Text
 import Lexer (lexer)
 import Ourlude
 import Parser
@@ -10,7 +11,7 @@ import Test.Tasty.HUnit
 shouldParse :: String -> AST -> Assertion
 shouldParse str ast =
   let eitherToMaybe = either (const Nothing) Just
-      tokens = lexer str
+      tokens = lexer (Text.pack str)
       result =
         eitherToMaybe tokens >>= \toks ->
           let parsed = parser toks
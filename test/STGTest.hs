@@ -1,5 +1,6 @@
 module STGTest (tests) where
 
+import qualified Data.Text as Text
 import Lexer (lexer)
 import Ourlude
 import Parser (parser)
@@ -12,7 +13,7 @@ import Typer (typer)
 doesCompile :: String -> Maybe Bool
 doesCompile str = do
   let eitherToMaybe = either (const Nothing) Just
-  tokens <- eitherToMaybe (lexer str)
+  tokens <- eitherToMaybe (lexer (Text.pack str))
   raw <- eitherToMaybe (parser tokens)
   simple <- eitherToMaybe (simplifier raw)
   typed <- eitherToMaybe (typer simple)
@@ -1,5 +1,8 @@
+{-# LANGUAGE LambdaCase #-}
+
 module SimplifierTest (tests) where
 
+import qualified Data.Text as Text
 import Lexer (lexer)
 import Ourlude
 import Parser (parser)
@@ -11,12 +14,36 @@ shouldSimplify :: String -> Assertion
 shouldSimplify str =
   let eitherToMaybe = either (const Nothing) Just
       result = do
-        tokens <- eitherToMaybe (lexer str)
+        tokens <- eitherToMaybe (lexer (Text.pack str))
         raw <- eitherToMaybe (parser tokens)
         eitherToMaybe (simplifier raw)
         Just True
    in Just True @=? result
 
+-- | Gather the builtins used in the definitions of a program
+builtinsIn :: AST t -> [Builtin]
+builtinsIn (AST _ defs) = foldMap inDefinition defs
+  where
+    inDefinition (ValueDefinition _ _ _ e) = inExpr e
+
+    inExpr = \case
+      LetExpr defs' e -> foldMap inDefinition defs' <> inExpr e
+      CaseExpr e branches -> inExpr e <> foldMap (snd >>> inExpr) branches
+      Builtin b -> [b]
+      ApplyExpr f e -> inExpr f <> inExpr e
+      LambdaExpr _ _ e -> inExpr e
+      _ -> []
+
+-- | Check whether or not simplifying a program uses some builtin
+shouldUseBuiltin :: Bool -> Builtin -> String -> Assertion
+shouldUseBuiltin expected b str =
+  let result = do
+        tokens <- either (const Nothing) Just (lexer (Text.pack str))
+        raw <- either (const Nothing) Just (parser tokens)
+        ast <- either (const Nothing) Just (simplifier raw)
+        Just (b `elem` builtinsIn ast)
+   in Just expected @=? result
+
 tests :: TestTree
 tests =
   testGroup
@@ -50,5 +77,21 @@ tests =
         "catch all definitions"
         ( shouldSimplify
             "{ f 3 = 3; f _ = 3 }"
+        ),
+      testCase
+        "seq and par refer to the builtins"
+        ( do
+            shouldUseBuiltin True Seq "f x = seq x 1"
+            shouldUseBuiltin True Par "f x = par x 1"
+        ),
+      testCase
+        "bindings can shadow seq and par"
+        ( do
+            shouldUseBuiltin False Seq "x = let { seq = 3 } in seq"
+            shouldUseBuiltin False Par "f par = par + 1"
+            shouldUseBuiltin False Seq "f x = (\\seq -> seq) x"
+            shouldUseBuiltin False Seq "f x = case x of { seq -> seq }"
+            shouldUseBuiltin False Seq "{ seq = 3; x = seq }"
+            shouldUseBuiltin True Seq "f x = let { y = \\seq -> seq } in seq x y"
         )
     ]
\ No newline at end of file
@@ -0,0 +1,99 @@
+{-# LANGUAGE LambdaCase #-}
+
+module StrictnessTest (tests) where
+
+import qualified Data.Text as Text
+import Lexer (lexer)
+import Ourlude
+import Parser (parser)
+import STG (Alts (..), Atom (..), Binding (..), Expr (..), LambdaForm (..), STG (..), ValName, stg)
+import Simplifier (simplifier)
+import Strictness (strictness)
+import Test.Tasty
+import Test.Tasty.HUnit
+import Typer (typer)
+
+-- Get the top level bindings, after strictness analysis
+topLevelBindings :: String -> Maybe [Binding]
+topLevelBindings str = do
+  let eitherToMaybe = either (const Nothing) Just
+  tokens <- eitherToMaybe (lexer (Text.pack str))
+  raw <- eitherToMaybe (parser tokens)
+  simple <- eitherToMaybe (simplifier raw)
+  typed <- eitherToMaybe (typer simple)
+  STG bindings _ <- strictness <$> eitherToMaybe (stg typed)
+  return bindings
+
+-- Get the names of the top level bindings, after strictness analysis
+topLevelNames :: String -> Maybe [ValName]
+topLevelNames = topLevelBindings >>> fmap (map (\(Binding name _) -> name))
+
+-- Get the lambda form of some top level binding, after strictness analysis
+topLevelForm :: ValName -> String -> Maybe LambdaForm
+topLevelForm name str = do
+  bindings <- topLevelBindings str
+  lookup name [(n, form) | Binding n form <- bindings]
+
+-- Gather the calls an expression makes, along with the names it allocates closures for
+callsAndAllocations :: Expr -> ([(ValName, [Atom])], [ValName])
+callsAndAllocations = \case
+  Apply f atoms -> ([(f, atoms)], [])
+  Case scrut _ alts -> callsAndAllocations scrut <> inAlts alts
+  Let bindings e ->
+    foldMap (\(Binding name (LambdaForm _ _ _ _ body)) -> ([], [name]) <> callsAndAllocations body) bindings
+      <> callsAndAllocations e
+  _ -> mempty
+  where
+    inAlts = \case
+      IntAlts branches def -> foldMap (snd >>> callsAndAllocations) branches <> foldMap callsAndAllocations def
+      StringAlts branches def -> foldMap (snd >>> callsAndAllocations) branches <> foldMap callsAndAllocations def
+      ConstrAlts branches def -> foldMap (snd >>> callsAndAllocations) branches <> foldMap callsAndAllocations def
+      BindPrim _ _ e -> callsAndAllocations e
+      Unbox _ _ e -> callsAndAllocations e
+      PolyAlt e -> callsAndAllocations e
+
+-- The arguments a function passes in each of its calls to some other function
+callsTo :: ValName -> LambdaForm -> [[Atom]]
+callsTo f (LambdaForm _ _ _ _ e) = [atoms | (g, atoms) <- fst (callsAndAllocations e), g == f]
+
+shouldHaveWorker :: ValName -> String -> Assertion
+shouldHaveWorker name s = Just True @=? fmap ((name <> "$w") `elem`) (topLevelNames s)
+
+-- Check that the worker for a function takes some number of pointers, and of unboxed ints
+shouldTakeUnboxed :: ValName -> Int -> Int -> String -> Assertion
+shouldTakeUnboxed name ptrs ints s =
+  let shape (LambdaForm _ _ params intParams _) = (length params, length intParams)
+   in Just (ptrs, ints) @=? fmap shape (topLevelForm (name <> "$w") s)
+
+-- Check that the wrapper for a function calls its worker, with all of its arguments
+shouldCallWorker :: ValName -> Int -> String -> Assertion
+shouldCallWorker name args s =
+  Just [args] @=? fmap (callsTo (name <> "$w") >>> map length) (topLevelForm name s)
+
+-- Check that the worker for a function calls itself, without allocating thunks for the arguments
+shouldRecurseWithoutThunks :: ValName -> String -> Assertion
+shouldRecurseWithoutThunks name s =
+  let worker = name <> "$w"
+      check form@(LambdaForm _ _ _ _ e) =
+        let allocated = snd (callsAndAllocations e)
+            calls = callsTo worker form
+         in not (null calls) && and [NameAtom n `notElem` atoms | atoms <- calls, n <- allocated]
+   in Just True @=? fmap check (topLevelForm worker s)
+
+shouldNotHaveWorker :: ValName -> String -> Assertion
+shouldNotHaveWorker name s = Just False @=? fmap ((name <> "$w") `elem`) (topLevelNames s)
+
+tests :: TestTree
+tests =
+  testGroup
+    "Strictness Tests"
+    [ testCase "strict int arguments" (shouldHaveWorker "f" countdown),
+      testCase "workers take strict ints unboxed" (shouldTakeUnboxed "f" 0 1 countdown),
+      testCase "wrappers call their worker" (shouldCallWorker "f" 1 countdown),
+      testCase "recursive calls don't allocate thunks" (shouldRecurseWithoutThunks "f" countdown),
+      testCase "strictness through calls" (shouldHaveWorker "g" "{ f :: Int -> Int; f n = n + 1; g :: Int -> Int -> Int; g x y = f x; main :: Int; main = g 1 2 }"),
+      testCase "lazy int arguments" (shouldNotHaveWorker "h" "{ h :: Bool -> Int -> Int; h b n = if b then n + 1 else 0; main :: Int; main = h True 2 }"),
+      testCase "strict arguments that aren't ints" (shouldNotHaveWorker "k" "{ k :: Bool -> Int; k b = if b then 1 else 0; main :: Int; main = k True }")
+    ]
+  where
+    countdown = "{ f :: Int -> Int; f 0 = 0; f n = f (n - 1); main :: Int; main = f 3 }"
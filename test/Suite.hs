@@ -1,10 +1,13 @@
 import qualified LexerTest
+import qualified OptimizerTest
 import Ourlude
 import qualified ParserTest
 import qualified STGTest
 import qualified SimplifierTest
+import qualified StrictnessTest
 import Test.Tasty
 import qualified TyperTest
+import qualified UsageTest
 
 main :: IO ()
 main = defaultMain tests
@@ -17,5 +20,8 @@ tests =
       ParserTest.tests,
       SimplifierTest.tests,
       TyperTest.tests,
-      STGTest.tests
+      STGTest.tests,
+      OptimizerTest.tests,
+      StrictnessTest.tests,
+      UsageTest.tests
     ]
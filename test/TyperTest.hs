@@ -1,5 +1,6 @@
 module TyperTest (tests) where
 
+import qualified Data.Text as Text
 import Lexer (lexer)
 import Ourlude
 import Parser (parser)
@@ -11,7 +12,7 @@ import Typer (typer)
 doesType :: String -> Maybe Bool
 doesType str = do
   let eitherToMaybe = either (const Nothing) Just
-  tokens <- eitherToMaybe (lexer str)
+  tokens <- eitherToMaybe (lexer (Text.pack str))
   raw <- eitherToMaybe (parser tokens)
   simple <- eitherToMaybe (simplifier raw)
   return <| case typer simple of
@@ -47,5 +48,8 @@ tests =
       testCase "basic constructor matching" (shouldType "{ data A = A Int; inc (A x) = x }"),
       testCase "basic constructor matching 2" (shouldType "{ data A = A Int; inc (A x) = x + 1 }"),
       testCase "weakening declarations" (shouldNotType "{ f :: a -> Int; f x = x }"),
-      testCase "stuck solver" (shouldType "{ data L a = C a (L a) | CI Int (L a) | N; f N = 0; f (C _ xs) = f xs; f (CI i xs) = i + f xs }")
+      testCase "stuck solver" (shouldType "{ data L a = C a (L a) | CI Int (L a) | N; f N = 0; f (C _ xs) = f xs; f (CI i xs) = i + f xs }"),
+      testCase "polymorphic definitions" (shouldType "{ x = i 3; i y = y; z = i \"foo\" ++ \"bar\" }"),
+      testCase "monomorphic lambdas" (shouldNotType "{ f g = g 3 ++ g \"foo\" }"),
+      testCase "infinite types" (shouldNotType "{ f x = x x }")
     ]
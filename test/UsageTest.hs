@@ -0,0 +1,76 @@
+{-# LANGUAGE LambdaCase #-}
+
+module UsageTest (tests) where
+
+import qualified Data.Text as Text
+import Lexer (lexer)
+import Ourlude
+import Parser (parser)
+import STG (Alts (..), Binding (..), Expr (..), LambdaForm (..), STG (..), Updateable (..), ValName, stg)
+import Simplifier (simplifier)
+import Test.Tasty
+import Test.Tasty.HUnit
+import Typer (typer)
+import Usage (usage)
+
+-- Compile some code down to STG, and then run usage analysis
+toSTG :: String -> Maybe STG
+toSTG str = do
+  let eitherToMaybe = either (const Nothing) Just
+  tokens <- eitherToMaybe (lexer (Text.pack str))
+  raw <- eitherToMaybe (parser tokens)
+  simple <- eitherToMaybe (simplifier raw)
+  typed <- eitherToMaybe (typer simple)
+  usage <$> eitherToMaybe (stg typed)
+
+-- The update flags of the thunks main binds to calls of some function
+callFlags :: ValName -> STG -> [Updateable]
+callFlags name (STG bindings _) = foldMap inBinding [b | b@(Binding "main" _) <- bindings]
+  where
+    inBinding (Binding _ form) = inForm form
+
+    inForm (LambdaForm _ _ _ _ e) = inExpr e
+
+    inExpr = \case
+      Case scrut _ alts -> inExpr scrut <> inAlts alts
+      Let bindings' e -> foldMap inLetBinding bindings' <> inExpr e
+      _ -> []
+
+    inLetBinding b@(Binding _ (LambdaForm _ u [] [] e)) | calls e = u : inBinding b
+    inLetBinding b = inBinding b
+
+    calls = \case
+      Apply f _ -> f == name
+      Let _ e -> calls e
+      _ -> False
+
+    inAlts = \case
+      ConstrAlts branches def -> foldMap (snd >>> inExpr) branches <> foldMap inExpr def
+      IntAlts branches def -> foldMap (snd >>> inExpr) branches <> foldMap inExpr def
+      StringAlts branches def -> foldMap (snd >>> inExpr) branches <> foldMap inExpr def
+      BindPrim _ _ e -> inExpr e
+      Unbox _ _ e -> inExpr e
+      PolyAlt e -> inExpr e
+
+shouldNotUpdate :: ValName -> String -> Assertion
+shouldNotUpdate name s = case fmap (callFlags name) (toSTG s) of
+  Just flags@(_ : _) -> all (== N) flags @? ("thunks calling " <> name <> " are still updated: " <> show flags)
+  other -> assertFailure ("no thunks calling " <> name <> ": " <> show other)
+
+shouldUpdate :: ValName -> String -> Assertion
+shouldUpdate name s = case fmap (callFlags name) (toSTG s) of
+  Just flags@(_ : _) -> all (== U) flags @? ("thunks calling " <> name <> " are no longer updated: " <> show flags)
+  other -> assertFailure ("no thunks calling " <> name <> ": " <> show other)
+
+lists :: String
+lists = "data List a = Cons a (List a) | Nil; length :: List a -> Int; length Nil = 0; length (Cons _ xs) = 1 + length xs; upTo :: Int -> List Int; upTo 0 = Nil; upTo n = Cons n (upTo (n - 1));"
+
+tests :: TestTree
+tests =
+  testGroup
+    "Usage Tests"
+    [ testCase "thunks passed to a function entering them once" (shouldNotUpdate "upTo" ("{ " <> lists <> " main :: Int; main = length (upTo 10) }")),
+      testCase "thunks entered twice" (shouldUpdate "f" "{ f :: Int -> Int; f x = x; main :: Int; main = let { y = f 3 } in y + y }"),
+      testCase "thunks stored in constructors" (shouldUpdate "upTo" ("{ " <> lists <> " main :: Int; main = length (Cons 1 (upTo 10)) }")),
+      testCase "thunks passed to partial applications" (shouldUpdate "f" "{ f :: Int -> Int; f x = x; g :: Int -> Int -> Int; g x y = x + y; main :: Int; main = let { h = g (f 3) } in h 1 + h 2 }")
+    ]